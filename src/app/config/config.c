@@ -72,6 +72,7 @@
 #include "core/or/circuitbuild.h"
 #include "core/or/circuitlist.h"
 #include "core/or/circuitmux.h"
+#include "core/or/circuitmux_class.h"
 #include "core/or/circuitmux_ewma.h"
 #include "core/or/circuitstats.h"
 #include "core/or/connection_edge.h"
@@ -284,6 +285,7 @@ DUMMY_TYPECHECK_INSTANCE(or_options_t);
  */
 static config_var_t option_vars_[] = {
   V(AccountingMax,               MEMUNIT,  "0 bytes"),
+  V(AccountingPacing,            BOOL,     "0"),
   VAR("AccountingRule",          STRING,   AccountingRule_option,  "max"),
   V(AccountingStart,             STRING,   NULL),
   V(Address,                     STRING,   NULL),
@@ -512,6 +514,7 @@ static config_var_t option_vars_[] = {
   OBSOLETE("MaxOnionsPending"),
   V(MaxOnionQueueDelay,          MSEC_INTERVAL, "1750 msec"),
   V(MaxUnparseableDescSizeToLog, MEMUNIT, "10 MB"),
+  V(MicrodescCacheSnapshot,      BOOL,     "0"),
   V(MinMeasuredBWsForAuthToIgnoreAdvertised, INT, "500"),
   VAR("MyFamily",                LINELIST, MyFamily_lines,       NULL),
   V(NewCircuitPeriod,            INTERVAL, "30 seconds"),
@@ -606,6 +609,7 @@ static config_var_t option_vars_[] = {
   V(KISTSchedRunInterval,        MSEC_INTERVAL, "0 msec"),
   V(KISTSockBufSizeFactor,       DOUBLE,   "1.0"),
   V(Schedulers,                  CSV,      "KIST,KISTLite,Vanilla"),
+  V(SharedConsensusCacheDirectory, FILENAME, NULL),
   V(ShutdownWaitLength,          INTERVAL, "30 seconds"),
   OBSOLETE("SocksListenAddress"),
   V(SocksPolicy,                 LINELIST, NULL),
@@ -2103,8 +2107,9 @@ options_act(const or_options_t *old_options)
   if (accounting_is_enabled(options))
     configure_accounting(time(NULL));
 
-  /* Change the cell EWMA settings */
+  /* Change the cell EWMA and circuit class settings */
   cmux_ewma_set_options(options, networkstatus_get_latest_consensus());
+  cmux_class_set_options(networkstatus_get_latest_consensus());
 
   /* Update the BridgePassword's hashed version as needed.  We store this as a
    * digest so that we can do side-channel-proof comparisons on it.
@@ -2268,7 +2273,9 @@ options_act(const or_options_t *old_options)
     if (options->BandwidthRate != old_options->BandwidthRate ||
         options->BandwidthBurst != old_options->BandwidthBurst ||
         options->RelayBandwidthRate != old_options->RelayBandwidthRate ||
-        options->RelayBandwidthBurst != old_options->RelayBandwidthBurst)
+        options->RelayBandwidthBurst != old_options->RelayBandwidthBurst ||
+        options->AccountingMax != old_options->AccountingMax ||
+        options->AccountingPacing != old_options->AccountingPacing)
       connection_bucket_adjust(options);
 
     if (options->MainloopStats != old_options->MainloopStats) {
@@ -4713,6 +4720,7 @@ options_transition_allowed(const or_options_t *old,
   NO_CHANGE_STRING(DataDirectory);
   NO_CHANGE_STRING(KeyDirectory);
   NO_CHANGE_STRING(CacheDirectory);
+  NO_CHANGE_STRING(SharedConsensusCacheDirectory);
   NO_CHANGE_STRING(User);
   NO_CHANGE_BOOL(KeepBindCapabilities);
   NO_CHANGE_STRING(SyslogIdentityTag);
@@ -482,6 +482,9 @@ struct or_options_t {
    * "out" for when out reaches AccountingMax */
   char *AccountingRule_option;
   enum { ACCT_MAX, ACCT_SUM, ACCT_IN, ACCT_OUT } AccountingRule;
+  /** If true, limit our bandwidth so that our AccountingMax lasts for the
+   * whole accounting interval, instead of hibernating once it runs out. */
+  int AccountingPacing;
 
   /** Base64-encoded hash of accepted passwords for the control system. */
   struct config_line_t *HashedControlPassword;
@@ -991,6 +994,11 @@ struct or_options_t {
    */
   uint64_t MaxUnparseableDescSizeToLog;
 
+  /** If true, save a snapshot of our parsed microdescriptor cache when we
+   * exit cleanly, and load it instead of parsing the cache at startup. The
+   * consensus and the rest of our directory state aren't snapshotted. */
+  int MicrodescCacheSnapshot;
+
   /** Bool (default: 1): Switch for the shared random protocol. Only
    * relevant to a directory authority. If off, the authority won't
    * participate in the protocol. If on (default), a flag is added to the
@@ -1017,6 +1025,10 @@ struct or_options_t {
    * use the default. */
   int MaxConsensusAgeForDiffs;
 
+  /** If set, a directory where we keep our consensus diff cache, shared
+   * with other Tor processes on this host. */
+  char *SharedConsensusCacheDirectory;
+
   /** Bool (default: 0). Tells Tor to never try to exec another program.
    */
   int NoExec;
@@ -33,6 +33,7 @@
 #include "core/or/relay.h"
 #include "core/or/scheduler.h"
 #include "core/or/status.h"
+#include "core/or/versions.h"
 #include "feature/api/tor_api.h"
 #include "feature/api/tor_api_internal.h"
 #include "feature/client/addressmap.h"
@@ -771,6 +772,7 @@ tor_free_all(int postfork)
   dns_free_all();
   clear_pending_onions();
   circuit_free_all();
+  relay_free_all();
   entry_guards_free_all();
   pt_free_all();
   channel_tls_free_all();
@@ -785,6 +787,7 @@ tor_free_all(int postfork)
   control_free_all();
   tor_free_getaddrinfo_cache();
   protover_free_all();
+  protover_summary_cache_free_all();
   bridges_free_all();
   consdiffmgr_free_all();
   hs_free_all();
@@ -869,6 +872,7 @@ tor_cleanup(void)
     if (authdir_mode_tests_reachability(options))
       rep_hist_record_mtbf_data(now, 0);
     keypin_close_journal();
+    microdesc_cache_save_snapshot();
   }
 
   timers_shutdown();
@@ -1029,6 +1033,7 @@ sandbox_init_filter(void)
   OPEN_CACHEDIR_SUFFIX("cached-microdesc-consensus", ".tmp");
   OPEN_CACHEDIR_SUFFIX("cached-microdescs", ".tmp");
   OPEN_CACHEDIR_SUFFIX("cached-microdescs.new", ".tmp");
+  OPEN_CACHEDIR_SUFFIX("cached-microdescs.snapshot", ".tmp");
   OPEN_CACHEDIR_SUFFIX("cached-descriptors", ".tmp");
   OPEN_CACHEDIR_SUFFIX("cached-descriptors.new", ".tmp");
   OPEN_CACHEDIR("cached-descriptors.tmp.tmp");
@@ -1097,6 +1102,7 @@ sandbox_init_filter(void)
   RENAME_CACHEDIR_SUFFIX("cached-microdescs", ".tmp");
   RENAME_CACHEDIR_SUFFIX("cached-microdescs", ".new");
   RENAME_CACHEDIR_SUFFIX("cached-microdescs.new", ".tmp");
+  RENAME_CACHEDIR_SUFFIX("cached-microdescs.snapshot", ".tmp");
   RENAME_CACHEDIR_SUFFIX("cached-descriptors", ".tmp");
   RENAME_CACHEDIR_SUFFIX("cached-descriptors", ".new");
   RENAME_CACHEDIR_SUFFIX("cached-descriptors.new", ".tmp");
@@ -1320,17 +1326,31 @@ run_tor_main_loop(void)
     tor_free(fname);
   }
 
+  /* Keep track of how long it takes to load our cached directory
+   * information, since it can dominate our startup time. */
+  monotime_t load_start, certs_loaded, consensus_loaded, routers_loaded;
+  monotime_get(&load_start);
   if (trusted_dirs_reload_certs()) {
     log_warn(LD_DIR,
              "Couldn't load all cached v3 certificates. Starting anyway.");
   }
+  monotime_get(&certs_loaded);
   if (router_reload_consensus_networkstatus()) {
     return -1;
   }
+  monotime_get(&consensus_loaded);
   /* load the routers file, or assign the defaults. */
   if (router_reload_router_list()) {
     return -1;
   }
+  monotime_get(&routers_loaded);
+  log_notice(LD_DIR, "Loaded cached directory information in %d msec "
+             "(certificates: %d msec; consensuses and microdescriptors: "
+             "%d msec; router descriptors: %d msec).",
+             (int) monotime_diff_msec(&load_start, &routers_loaded),
+             (int) monotime_diff_msec(&load_start, &certs_loaded),
+             (int) monotime_diff_msec(&certs_loaded, &consensus_loaded),
+             (int) monotime_diff_msec(&consensus_loaded, &routers_loaded));
   /* load the networkstatuses. (This launches a download for new routers as
    * appropriate.)
    */
@@ -715,6 +715,13 @@ connection_free_minimal(connection_t *conn)
     tor_free(dir_conn->requested_resource);
 
     tor_compress_free(dir_conn->compress_state);
+    tor_free(dir_conn->response_headers);
+    buf_free(dir_conn->response_body);
+    tor_compress_free(dir_conn->response_decompress);
+    if (dir_conn->microdescs_wanted) {
+      SMARTLIST_FOREACH(dir_conn->microdescs_wanted, char *, cp, tor_free(cp));
+      smartlist_free(dir_conn->microdescs_wanted);
+    }
     if (dir_conn->spool) {
       SMARTLIST_FOREACH(dir_conn->spool, spooled_resource_t *, spooled,
                         spooled_resource_free(spooled));
@@ -3369,6 +3376,17 @@ connection_consider_empty_write_buckets(connection_t *conn)
   connection_write_bw_exhausted(conn, is_global);
 }
 
+/** Return the rate for a global bucket configured to <b>rate</b> bytes per
+ * second, after limiting it to fit our accounting quota if we're pacing. */
+static int32_t
+global_bucket_rate(uint64_t rate)
+{
+  uint32_t paced = accounting_get_pacing_rate();
+  if (paced && paced < rate)
+    return (int32_t)paced;
+  return (int32_t)rate;
+}
+
 /** Initialize the global buckets to the values configured in the
  * options */
 void
@@ -3377,17 +3395,17 @@ connection_bucket_init(void)
   const or_options_t *options = get_options();
   const uint32_t now_ts = monotime_coarse_get_stamp();
   token_bucket_rw_init(&global_bucket,
-                    (int32_t)options->BandwidthRate,
+                    global_bucket_rate(options->BandwidthRate),
                     (int32_t)options->BandwidthBurst,
                     now_ts);
   if (options->RelayBandwidthRate) {
     token_bucket_rw_init(&global_relayed_bucket,
-                      (int32_t)options->RelayBandwidthRate,
+                      global_bucket_rate(options->RelayBandwidthRate),
                       (int32_t)options->RelayBandwidthBurst,
                       now_ts);
   } else {
     token_bucket_rw_init(&global_relayed_bucket,
-                      (int32_t)options->BandwidthRate,
+                      global_bucket_rate(options->BandwidthRate),
                       (int32_t)options->BandwidthBurst,
                       now_ts);
   }
@@ -3400,15 +3418,15 @@ void
 connection_bucket_adjust(const or_options_t *options)
 {
   token_bucket_rw_adjust(&global_bucket,
-                      (int32_t)options->BandwidthRate,
+                      global_bucket_rate(options->BandwidthRate),
                       (int32_t)options->BandwidthBurst);
   if (options->RelayBandwidthRate) {
     token_bucket_rw_adjust(&global_relayed_bucket,
-                        (int32_t)options->RelayBandwidthRate,
+                        global_bucket_rate(options->RelayBandwidthRate),
                         (int32_t)options->RelayBandwidthBurst);
   } else {
     token_bucket_rw_adjust(&global_relayed_bucket,
-                        (int32_t)options->BandwidthRate,
+                        global_bucket_rate(options->BandwidthRate),
                         (int32_t)options->BandwidthBurst);
   }
 }
@@ -8,46 +8,230 @@
  * This module was first written on a semi-emergency basis to improve the
  * robustness of the anti-DoS module.  As such, it's written in a pretty
  * conservative way, and should be susceptible to improvement later on.
+ *
+ * The set is two structures kept in step: a counting Bloom filter, which
+ * answers most queries for addresses that aren't in the set after one hash
+ * and a few memory reads, and a hash table of the addresses themselves,
+ * which settles whatever the filter lets through.  Because the filter
+ * counts rather than just marking, and the table knows what's in it, we can
+ * remove addresses as well as add them.
  **/
 
 #include "orconfig.h"
 #include "core/or/address_set.h"
 #include "lib/net/address.h"
-#include "lib/container/bloomfilt.h"
+#include "lib/intmath/bits.h"
+#include "lib/intmath/cmp.h"
+#include "lib/malloc/malloc.h"
 #include "lib/crypt_ops/crypto_rand.h"
+#include "lib/crypt_ops/crypto_util.h"
 #include "siphash.h"
 
-/* Wrap our hash function to have the signature that the bloom filter
- * needs. */
-static uint64_t
-bloomfilt_addr_hash(const struct sipkey *key,
-                    const void *item)
+#include <string.h>
+
+#include "ht.h"
+
+/** How many filter counters we set per address. */
+#define ADDRESS_SET_N_HASHES 4
+/** How many filter counters we have per address at most; we have at least
+ * half as many. */
+#define ADDRESS_SET_COUNTERS_PER_ADDR_LOG2 4
+/** A counter that reaches this value stays there: we don't know how many
+ * addresses it counts any more. */
+#define ADDRESS_SET_COUNTER_MAX UINT8_MAX
+
+/** One address in the set. */
+typedef struct address_set_entry_t {
+  HT_ENTRY(address_set_entry_t) node;
+  /** The address itself. */
+  tor_addr_t addr;
+  /** Its keyed hash, which picks its filter counters too. */
+  uint64_t hash;
+  /** How many times it has been added without being removed. */
+  unsigned int refcount;
+} address_set_entry_t;
+
+struct address_set_t {
+  /** siphash key for hashing addresses. */
+  struct sipkey key;
+  /** The counting Bloom filter. */
+  uint8_t *counters;
+  /** One less than the number of counters; always one less than a power of
+   * two. */
+  uint32_t mask;
+  /** The addresses in the set. */
+  HT_HEAD(address_set_map, address_set_entry_t) map;
+  /** How many distinct addresses are in the set. */
+  int n_addrs;
+};
+
+static inline unsigned int
+address_set_entry_hash(const address_set_entry_t *ent)
+{
+  return (unsigned int) ent->hash;
+}
+
+static inline int
+address_set_entries_eq(const address_set_entry_t *a,
+                       const address_set_entry_t *b)
+{
+  return a->hash == b->hash && tor_addr_eq(&a->addr, &b->addr);
+}
+
+HT_PROTOTYPE(address_set_map, address_set_entry_t, node,
+             address_set_entry_hash, address_set_entries_eq)
+HT_GENERATE2(address_set_map, address_set_entry_t, node,
+             address_set_entry_hash, address_set_entries_eq,
+             0.6, tor_reallocarray_, tor_free_)
+
+/** Return the index of the <b>i</b>th filter counter of <b>set</b> for an
+ * address whose hash is <b>hash</b>. */
+static inline uint32_t
+address_set_counter_idx(const address_set_t *set, uint64_t hash, int i)
+{
+  /* Two 32-bit halves of one siphash make as many indices as we need. */
+  const uint32_t h1 = (uint32_t) hash;
+  const uint32_t h2 = (uint32_t) (hash >> 32) | 1;
+  return (h1 + (uint32_t) i * h2) & set->mask;
+}
+
+/** Count an address whose hash is <b>hash</b> in the filter of <b>set</b>.
+ */
+static void
+address_set_filter_add(address_set_t *set, uint64_t hash)
+{
+  int i;
+  for (i = 0; i < ADDRESS_SET_N_HASHES; ++i) {
+    uint8_t *c = &set->counters[address_set_counter_idx(set, hash, i)];
+    if (*c < ADDRESS_SET_COUNTER_MAX)
+      ++*c;
+  }
+}
+
+/** Stop counting an address whose hash is <b>hash</b> in the filter of
+ * <b>set</b>. */
+static void
+address_set_filter_remove(address_set_t *set, uint64_t hash)
+{
+  int i;
+  for (i = 0; i < ADDRESS_SET_N_HASHES; ++i) {
+    uint8_t *c = &set->counters[address_set_counter_idx(set, hash, i)];
+    if (*c < ADDRESS_SET_COUNTER_MAX)
+      --*c;
+  }
+}
+
+/** Return true iff the filter of <b>set</b> might count an address whose
+ * hash is <b>hash</b>. */
+static inline int
+address_set_filter_might_contain(const address_set_t *set, uint64_t hash)
+{
+  int i;
+  for (i = 0; i < ADDRESS_SET_N_HASHES; ++i) {
+    if (set->counters[address_set_counter_idx(set, hash, i)] == 0)
+      return 0;
+  }
+  return 1;
+}
+
+/** Give <b>set</b> a new filter, big enough for <b>n_addrs</b> addresses,
+ * counting everything in the set. */
+static void
+address_set_resize_filter(address_set_t *set, int n_addrs)
+{
+  address_set_entry_t **ent;
+  const uint32_t n_counters =
+    UINT32_C(1) << (tor_log2(MAX(n_addrs, 4)) +
+                    ADDRESS_SET_COUNTERS_PER_ADDR_LOG2);
+
+  tor_free(set->counters);
+  set->counters = tor_malloc_zero(n_counters);
+  set->mask = n_counters - 1;
+  HT_FOREACH(ent, address_set_map, &set->map) {
+    address_set_filter_add(set, (*ent)->hash);
+  }
+}
+
+/** Return the entry for <b>addr</b>, whose hash is <b>hash</b>, in
+ * <b>set</b>, or NULL if there isn't one. */
+static address_set_entry_t *
+address_set_find(const address_set_t *set, const tor_addr_t *addr,
+                 uint64_t hash)
 {
-  return tor_addr_keyed_hash(key, item);
+  address_set_entry_t search;
+  tor_addr_copy(&search.addr, addr);
+  search.hash = hash;
+  return HT_FIND(address_set_map, &((address_set_t *) set)->map, &search);
 }
 
 /**
  * Allocate and return an address_set, suitable for holding up to
- * <b>max_address_guess</b> distinct values.
+ * <b>max_address_guess</b> distinct values.  It can hold more, but it
+ * will grow to do so.
  */
 address_set_t *
 address_set_new(int max_addresses_guess)
 {
-  uint8_t k[BLOOMFILT_KEY_LEN];
-  crypto_rand((void*)k, sizeof(k));
-  return bloomfilt_new(max_addresses_guess, bloomfilt_addr_hash, k);
+  address_set_t *set = tor_malloc_zero(sizeof(*set));
+  crypto_rand((void*) &set->key, sizeof(set->key));
+  HT_INIT(address_set_map, &set->map);
+  address_set_resize_filter(set, max_addresses_guess);
+  return set;
+}
+
+/** Release all storage held by <b>set</b>. */
+void
+address_set_free_(address_set_t *set)
+{
+  address_set_entry_t **ent, **next, *this;
+
+  if (!set)
+    return;
+
+  for (ent = HT_START(address_set_map, &set->map); ent != NULL;
+       ent = next) {
+    this = *ent;
+    next = HT_NEXT_RMV(address_set_map, &set->map, ent);
+    tor_free(this);
+  }
+  HT_CLEAR(address_set_map, &set->map);
+  tor_free(set->counters);
+  memwipe(&set->key, 0, sizeof(set->key));
+  tor_free(set);
 }
 
 /**
  * Add <b>addr</b> to <b>set</b>.
  *
- * All future queries for <b>addr</b> in set will return true. Removing
- * items is not possible.
+ * All future queries for <b>addr</b> in set will return true, until it has
+ * been removed as many times as it was added.
  */
 void
 address_set_add(address_set_t *set, const struct tor_addr_t *addr)
 {
-  bloomfilt_add(set, addr);
+  const uint64_t hash = tor_addr_keyed_hash(&set->key, addr);
+  address_set_entry_t *ent = address_set_find(set, addr, hash);
+
+  if (ent) {
+    ++ent->refcount;
+    return;
+  }
+
+  ent = tor_malloc_zero(sizeof(*ent));
+  tor_addr_copy(&ent->addr, addr);
+  ent->hash = hash;
+  ent->refcount = 1;
+  HT_INSERT(address_set_map, &set->map, ent);
+  ++set->n_addrs;
+
+  /* Past this many addresses per counter, too many queries would get past
+   * the filter: make it bigger. */
+  if ((uint32_t) set->n_addrs >
+      (set->mask + 1) >> (ADDRESS_SET_COUNTERS_PER_ADDR_LOG2 - 1)) {
+    address_set_resize_filter(set, set->n_addrs);
+  } else {
+    address_set_filter_add(set, hash);
+  }
 }
 
 /** As address_set_add(), but take an ipv4 address in host order. */
@@ -60,12 +244,53 @@ address_set_add_ipv4h(address_set_t *set, uint32_t addr)
 }
 
 /**
- * Return true if <b>addr</b> is a member of <b>set</b>.  (And probably,
- * return false if <b>addr</b> is not a member of set.)
+ * Undo one address_set_add() of <b>addr</b> to <b>set</b>.  Once every add
+ * has been undone, queries for <b>addr</b> return false.  Removing an
+ * address that isn't in the set does nothing.
+ */
+void
+address_set_remove(address_set_t *set, const struct tor_addr_t *addr)
+{
+  const uint64_t hash = tor_addr_keyed_hash(&set->key, addr);
+  address_set_entry_t *ent = address_set_find(set, addr, hash);
+
+  if (!ent || --ent->refcount > 0)
+    return;
+
+  HT_REMOVE(address_set_map, &set->map, ent);
+  address_set_filter_remove(set, hash);
+  --set->n_addrs;
+  tor_free(ent);
+}
+
+/** As address_set_remove(), but take an ipv4 address in host order. */
+void
+address_set_remove_ipv4h(address_set_t *set, uint32_t addr)
+{
+  tor_addr_t a;
+  tor_addr_from_ipv4h(&a, addr);
+  address_set_remove(set, &a);
+}
+
+/**
+ * Return true if <b>addr</b> is a member of <b>set</b>, and false if it
+ * isn't.  (The name is from when the set was only a Bloom filter, and could
+ * only say "probably".)
  */
 int
 address_set_probably_contains(const address_set_t *set,
                               const struct tor_addr_t *addr)
 {
-  return bloomfilt_probably_contains(set, addr);
+  const uint64_t hash = tor_addr_keyed_hash(&set->key, addr);
+
+  if (!address_set_filter_might_contain(set, hash))
+    return 0;
+  return address_set_find(set, addr, hash) != NULL;
+}
+
+/** Return the number of distinct addresses in <b>set</b>. */
+int
+address_set_size(const address_set_t *set)
+{
+  return set->n_addrs;
 }
@@ -11,21 +11,27 @@
 
 #include "orconfig.h"
 #include "lib/cc/torint.h"
-#include "lib/container/bloomfilt.h"
+#include "lib/malloc/malloc.h"
 
 /**
- * An address_set_t represents a set of tor_addr_t values. The implementation
- * is probabilistic: false negatives cannot occur but false positives are
- * possible.
+ * An address_set_t represents a multiset of tor_addr_t values: each address
+ * stays in it until it has been removed as often as it was added. Queries
+ * are exact, but most of those for addresses that aren't in the set are
+ * answered by a counting Bloom filter without looking further.
  */
-typedef struct bloomfilt_t address_set_t;
+typedef struct address_set_t address_set_t;
 struct tor_addr_t;
 
 address_set_t *address_set_new(int max_addresses_guess);
-#define address_set_free(set) bloomfilt_free(set)
+void address_set_free_(address_set_t *set);
+#define address_set_free(set) \
+  FREE_AND_NULL(address_set_t, address_set_free_, (set))
 void address_set_add(address_set_t *set, const struct tor_addr_t *addr);
 void address_set_add_ipv4h(address_set_t *set, uint32_t addr);
+void address_set_remove(address_set_t *set, const struct tor_addr_t *addr);
+void address_set_remove_ipv4h(address_set_t *set, uint32_t addr);
 int address_set_probably_contains(const address_set_t *set,
                                   const struct tor_addr_t *addr);
+int address_set_size(const address_set_t *set);
 
 #endif
@@ -24,6 +24,16 @@ struct cell_queue_t {
   /** Linked list of packed_cell_t*/
   TOR_SIMPLEQ_HEAD(cell_simpleq, packed_cell_t) head;
   int n; /**< The number of cells in the queue. */
+  /** Active queue management: if <b>aqm_above_target</b> is set, the coarse
+   * timestamp at which cells leaving this queue started to have waited
+   * longer than the target delay. */
+  uint32_t aqm_above_target_since;
+  /** True iff every cell to leave this queue since aqm_above_target_since
+   * has waited longer than the target delay. */
+  unsigned int aqm_above_target : 1;
+  /** True iff cells have waited longer than the target delay for at least
+   * a whole interval, and we've asked the edges to stop reading. */
+  unsigned int aqm_congested : 1;
 };
 
 #endif
@@ -42,7 +42,7 @@
 #include "core/or/channel.h"
 #include "core/or/channeltls.h"
 #include "core/or/circuitmux.h"
-#include "core/or/circuitmux_ewma.h"
+#include "core/or/circuitmux_class.h"
 #include "core/or/command.h"
 #include "app/config/config.h"
 #include "core/mainloop/connection.h"
@@ -173,8 +173,7 @@ channel_tls_common_init(channel_tls_t *tlschan)
   chan->write_var_cell = channel_tls_write_var_cell_method;
 
   chan->cmux = circuitmux_alloc();
-  /* We only have one policy for now so always set it to EWMA. */
-  circuitmux_set_policy(chan->cmux, &ewma_policy);
+  circuitmux_set_policy(chan->cmux, cmux_get_default_policy());
 }
 
 /**
@@ -1142,6 +1141,38 @@ channel_tls_handle_cell(cell_t *cell, or_connection_t *conn)
   }
 }
 
+/**
+ * Handle a batch of incoming cells on a channel_tls_t.
+ *
+ * This is called from connection_or.c with the <b>n_cells</b> fixed-length
+ * cells in <b>cells</b>, which arrived on <b>conn</b> in that order.  While
+ * the connection is handshaking, we handle them one at a time, in order.
+ * Once it is open, we handle each circuit's cells together, and tell the
+ * circuitmuxes about the cells we relay once for the whole batch.
+ */
+void
+channel_tls_handle_cells(cell_t *cells, int n_cells, or_connection_t *conn)
+{
+  int order[COMMAND_CELL_BATCH_MAX];
+  int i;
+
+  tor_assert(cells);
+  tor_assert(conn);
+  tor_assert(n_cells <= COMMAND_CELL_BATCH_MAX);
+
+  if (n_cells == 1 || TO_CONN(conn)->state != OR_CONN_STATE_OPEN) {
+    for (i = 0; i < n_cells; ++i)
+      channel_tls_handle_cell(&cells[i], conn);
+    return;
+  }
+
+  command_order_cell_batch(cells, n_cells, order);
+  relay_cell_batch_begin();
+  for (i = 0; i < n_cells; ++i)
+    channel_tls_handle_cell(&cells[order[i]], conn);
+  relay_cell_batch_end();
+}
+
 /**
  * Handle an incoming variable-length cell on a channel_tls_t.
  *
@@ -47,6 +47,8 @@ channel_tls_t * channel_tls_from_base(channel_t *chan);
 
 /* Things for connection_or.c to call back into */
 void channel_tls_handle_cell(cell_t *cell, or_connection_t *conn);
+void channel_tls_handle_cells(cell_t *cells, int n_cells,
+                              or_connection_t *conn);
 void channel_tls_handle_state_change_on_orconn(channel_tls_t *chan,
                                                or_connection_t *conn,
                                                uint8_t old_state,
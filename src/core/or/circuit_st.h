@@ -93,6 +93,13 @@ struct circuit_t {
   /** True iff this circuit has received a DESTROY cell in either direction */
   unsigned int received_destroy : 1;
 
+  /** True iff we have added cells to n_chan_cells during a batch of inbound
+   * cells, but not yet told the circuitmux and scheduler about them. */
+  unsigned int n_cmux_update_deferred : 1;
+  /** True iff we have added cells to p_chan_cells during a batch of inbound
+   * cells, but not yet told the circuitmux and scheduler about them. */
+  unsigned int p_cmux_update_deferred : 1;
+
   uint8_t state; /**< Current status of this circuit. */
   uint8_t purpose; /**< Why are we creating this circuit? */
 
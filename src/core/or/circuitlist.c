@@ -1068,6 +1068,10 @@ circuit_free_(circuit_t *circ)
 
   circuit_clear_testing_cell_stats(circ);
 
+  /* Don't leave the circuit in a batch of pending cmux updates. */
+  if (circ->n_cmux_update_deferred || circ->p_cmux_update_deferred)
+    relay_cell_batch_forget_circuit(circ);
+
   /* Cleanup circuit from anything HS v3 related. We also do this when the
    * circuit is closed. This is to avoid any code path that free registered
    * circuits without closing them before. This needs to be done before the
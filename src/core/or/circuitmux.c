@@ -73,6 +73,8 @@
 #include "core/or/channel.h"
 #include "core/or/circuitlist.h"
 #include "core/or/circuitmux.h"
+#include "core/or/circuitmux_class.h"
+#include "core/or/circuitmux_ewma.h"
 #include "core/or/relay.h"
 
 #include "core/or/cell_queue_st.h"
@@ -1353,7 +1355,14 @@ circuitmux_compare_muxes, (circuitmux_t *cmux_1, circuitmux_t *cmux_2))
         return 0;
       }
     } else {
-      /* Equivalent because they have different policies */
+      /* Different policies.  If both use EWMA to pick circuits, compare the
+       * circuits they'd send next; otherwise they're equivalent. */
+      circuitmux_policy_data_t *ewma_1 =
+        cmux_class_get_ewma_data(cmux_1->policy, cmux_1->policy_data);
+      circuitmux_policy_data_t *ewma_2 =
+        cmux_class_get_ewma_data(cmux_2->policy, cmux_2->policy_data);
+      if (ewma_1 && ewma_2)
+        return ewma_policy.cmp_cmux(cmux_1, ewma_1, cmux_2, ewma_2);
       return 0;
     }
   } else {
@@ -0,0 +1,509 @@
+/* Copyright (c) 2018, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * \file circuitmux_class.c
+ * \brief Weighted scheduling between classes of circuits, as a circuitmux_t
+ * policy
+ *
+ * The EWMA policy favors circuits that have been quiet recently, but it has
+ * no idea what the circuits are for: a burst of directory fetches or a busy
+ * onion service competes on equal terms with every bulk exit circuit on the
+ * channel.  This policy sorts circuits into a few classes, based on their
+ * purpose and on whether they carry tunneled directory requests, and gives
+ * each class a weighted share of the channel when several classes have cells
+ * waiting.  Within each class, circuits are chosen by EWMA as usual: we keep
+ * an EWMA policy instance per class and delegate to it.
+ *
+ * Between classes we use stride scheduling.  Each class has a "pass" value
+ * that grows by the class's stride -- inversely proportional to its weight --
+ * for every cell it sends, and we always serve the active class with the
+ * lowest pass.  A class that has been idle restarts from the current pass, so
+ * it can't save up credit while it has nothing to send.
+ *
+ * The weights only share out each channel among its own classes.  When the
+ * scheduler asks which of two channels should go first, we compare the
+ * circuits they would send next by EWMA, just as the EWMA policy does.
+ *
+ * A circuit's class is worked out again whenever it becomes active, since
+ * (for example) a directory request may arrive on a circuit after it was
+ * attached.
+ *
+ * This module should be used through the interfaces in circuitmux.c, which it
+ * implements.
+ **/
+
+#define CIRCUITMUX_CLASS_PRIVATE
+
+#include "core/or/or.h"
+#include "core/or/circuitlist.h"
+#include "core/or/circuitmux.h"
+#include "core/or/circuitmux_class.h"
+#include "core/or/circuitmux_ewma.h"
+#include "core/or/circuituse.h"
+#include "feature/nodelist/networkstatus.h"
+
+#include "core/or/circuit_st.h"
+#include "core/or/cpath_build_state_st.h"
+#include "core/or/origin_circuit_st.h"
+
+/*** Class policy parameter #defines ***/
+
+/** Default relative weights of the classes, if they haven't been overridden
+ * by the consensus. */
+#define CMUX_CLASS_WEIGHT_GENERAL_DEFAULT 7
+#define CMUX_CLASS_WEIGHT_ONION_SERVICE_DEFAULT 2
+#define CMUX_CLASS_WEIGHT_DIRECTORY_DEFAULT 1
+/** Minimum and maximum for the class weight consensus parameters. */
+#define CMUX_CLASS_WEIGHT_MIN 1
+#define CMUX_CLASS_WEIGHT_MAX 1000
+
+/** The stride of a class with weight 1.  Strides of other classes are this
+ * divided by their weight. */
+#define CMUX_CLASS_STRIDE1 (1u<<20)
+
+/*** Class policy structures ***/
+
+typedef struct class_policy_data_s class_policy_data_t;
+typedef struct class_policy_circ_data_s class_policy_circ_data_t;
+
+struct class_policy_data_s {
+  circuitmux_policy_data_t base_;
+
+  /** The EWMA policy data that chooses between the circuits of each
+   * class. */
+  circuitmux_policy_data_t *ewma[CMUX_CLASS_MAX_+1];
+  /** How many active circuits are there in each class? */
+  int n_active[CMUX_CLASS_MAX_+1];
+  /** Stride-scheduling pass value of each class: the class with the lowest
+   * pass goes next. */
+  uint64_t pass[CMUX_CLASS_MAX_+1];
+  /** The pass value of the class we served most recently. */
+  uint64_t global_pass;
+};
+
+struct class_policy_circ_data_s {
+  circuitmux_policy_circ_data_t base_;
+
+  /** The class this circuit was in when it last became active. */
+  cmux_class_t cls;
+  /** The EWMA policy's data for this circuit. */
+  circuitmux_policy_circ_data_t *ewma;
+};
+
+#define CLASS_POL_DATA_MAGIC 0x5d3c2a71U
+#define CLASS_POL_CIRC_DATA_MAGIC 0x19e4b6c3U
+
+/*** Downcasts for the above types ***/
+
+/**
+ * Downcast a circuitmux_policy_data_t to a class_policy_data_t and assert
+ * if the cast is impossible.
+ */
+
+static inline class_policy_data_t *
+TO_CLASS_POL_DATA(circuitmux_policy_data_t *pol)
+{
+  if (!pol) return NULL;
+  else {
+    tor_assert(pol->magic == CLASS_POL_DATA_MAGIC);
+    return DOWNCAST(class_policy_data_t, pol);
+  }
+}
+
+/**
+ * Downcast a circuitmux_policy_circ_data_t to a class_policy_circ_data_t
+ * and assert if the cast is impossible.
+ */
+
+static inline class_policy_circ_data_t *
+TO_CLASS_POL_CIRC_DATA(circuitmux_policy_circ_data_t *pol)
+{
+  if (!pol) return NULL;
+  else {
+    tor_assert(pol->magic == CLASS_POL_CIRC_DATA_MAGIC);
+    return DOWNCAST(class_policy_circ_data_t, pol);
+  }
+}
+
+/*** Class policy global variables ***/
+
+/** Are we using the class policy for new channels? */
+static int cmux_class_enabled = 0;
+
+/** The relative weight of each class. */
+static uint32_t cmux_class_weight[CMUX_CLASS_MAX_+1] = {
+  CMUX_CLASS_WEIGHT_GENERAL_DEFAULT,
+  CMUX_CLASS_WEIGHT_ONION_SERVICE_DEFAULT,
+  CMUX_CLASS_WEIGHT_DIRECTORY_DEFAULT,
+};
+
+/*** Helpers ***/
+
+/** Return the class that <b>circ</b> belongs in. */
+STATIC cmux_class_t
+cmux_class_of_circuit(const circuit_t *circ)
+{
+  /* Set on relays when a BEGIN_DIR arrives on the circuit. */
+  if (circ->dirreq_id)
+    return CMUX_CLASS_DIRECTORY;
+
+  if (CIRCUIT_IS_ORIGIN(circ)) {
+    const origin_circuit_t *ocirc = CONST_TO_ORIGIN_CIRCUIT(circ);
+    if (ocirc->build_state && ocirc->build_state->onehop_tunnel)
+      return CMUX_CLASS_DIRECTORY;
+    if (circuit_purpose_is_hidden_service(circ->purpose))
+      return CMUX_CLASS_ONION_SERVICE;
+    return CMUX_CLASS_GENERAL;
+  }
+
+  switch (circ->purpose) {
+    case CIRCUIT_PURPOSE_INTRO_POINT:
+    case CIRCUIT_PURPOSE_REND_POINT_WAITING:
+    case CIRCUIT_PURPOSE_REND_ESTABLISHED:
+      return CMUX_CLASS_ONION_SERVICE;
+    default:
+      return CMUX_CLASS_GENERAL;
+  }
+}
+
+/** Return the relative weight of class <b>cls</b>. */
+STATIC uint32_t
+cmux_class_get_weight(cmux_class_t cls)
+{
+  tor_assert(cls <= CMUX_CLASS_MAX_);
+  return cmux_class_weight[cls];
+}
+
+/** Return the class in <b>pol</b> that should send next, or -1 if no class
+ * has an active circuit. */
+static int
+class_pick(const class_policy_data_t *pol)
+{
+  int cls, best = -1;
+  for (cls = 0; cls <= CMUX_CLASS_MAX_; ++cls) {
+    if (!pol->n_active[cls])
+      continue;
+    if (best < 0 || pol->pass[cls] < pol->pass[best])
+      best = cls;
+  }
+  return best;
+}
+
+/*** Circuitmux policy methods ***/
+
+/**
+ * Allocate a class_policy_data_t and upcast it to a circuitmux_policy_data_t;
+ * this is called when setting the policy on a circuitmux_t to class_policy.
+ */
+
+static circuitmux_policy_data_t *
+class_alloc_cmux_data(circuitmux_t *cmux)
+{
+  class_policy_data_t *pol = NULL;
+  int cls;
+
+  tor_assert(cmux);
+
+  pol = tor_malloc_zero(sizeof(*pol));
+  pol->base_.magic = CLASS_POL_DATA_MAGIC;
+  for (cls = 0; cls <= CMUX_CLASS_MAX_; ++cls)
+    pol->ewma[cls] = ewma_policy.alloc_cmux_data(cmux);
+
+  return TO_CMUX_POL_DATA(pol);
+}
+
+/**
+ * Free a class_policy_data_t allocated with class_alloc_cmux_data()
+ */
+
+static void
+class_free_cmux_data(circuitmux_t *cmux,
+                     circuitmux_policy_data_t *pol_data)
+{
+  class_policy_data_t *pol = NULL;
+  int cls;
+
+  tor_assert(cmux);
+  if (!pol_data) return;
+
+  pol = TO_CLASS_POL_DATA(pol_data);
+
+  for (cls = 0; cls <= CMUX_CLASS_MAX_; ++cls)
+    ewma_policy.free_cmux_data(cmux, pol->ewma[cls]);
+  tor_free(pol);
+}
+
+/**
+ * Allocate a class_policy_circ_data_t and upcast it to a
+ * circuitmux_policy_circ_data_t; this is called when attaching a circuit to
+ * a circuitmux_t with class_policy.
+ */
+
+static circuitmux_policy_circ_data_t *
+class_alloc_circ_data(circuitmux_t *cmux,
+                      circuitmux_policy_data_t *pol_data,
+                      circuit_t *circ,
+                      cell_direction_t direction,
+                      unsigned int cell_count)
+{
+  class_policy_data_t *pol = NULL;
+  class_policy_circ_data_t *cdata = NULL;
+
+  tor_assert(cmux);
+  tor_assert(pol_data);
+  tor_assert(circ);
+
+  pol = TO_CLASS_POL_DATA(pol_data);
+
+  cdata = tor_malloc_zero(sizeof(*cdata));
+  cdata->base_.magic = CLASS_POL_CIRC_DATA_MAGIC;
+  cdata->cls = cmux_class_of_circuit(circ);
+  cdata->ewma = ewma_policy.alloc_circ_data(cmux, pol->ewma[cdata->cls],
+                                            circ, direction, cell_count);
+
+  return TO_CMUX_POL_CIRC_DATA(cdata);
+}
+
+/**
+ * Free a class_policy_circ_data_t allocated with class_alloc_circ_data()
+ */
+
+static void
+class_free_circ_data(circuitmux_t *cmux,
+                     circuitmux_policy_data_t *pol_data,
+                     circuit_t *circ,
+                     circuitmux_policy_circ_data_t *pol_circ_data)
+{
+  class_policy_data_t *pol = NULL;
+  class_policy_circ_data_t *cdata = NULL;
+
+  tor_assert(cmux);
+  tor_assert(circ);
+  tor_assert(pol_data);
+
+  if (!pol_circ_data) return;
+
+  pol = TO_CLASS_POL_DATA(pol_data);
+  cdata = TO_CLASS_POL_CIRC_DATA(pol_circ_data);
+
+  ewma_policy.free_circ_data(cmux, pol->ewma[cdata->cls], circ, cdata->ewma);
+  tor_free(cdata);
+}
+
+/**
+ * Handle circuit activation: work out the circuit's class again, and add
+ * it to that class's EWMA queue.
+ */
+
+static void
+class_notify_circ_active(circuitmux_t *cmux,
+                         circuitmux_policy_data_t *pol_data,
+                         circuit_t *circ,
+                         circuitmux_policy_circ_data_t *pol_circ_data)
+{
+  class_policy_data_t *pol = NULL;
+  class_policy_circ_data_t *cdata = NULL;
+
+  tor_assert(cmux);
+  tor_assert(pol_data);
+  tor_assert(circ);
+  tor_assert(pol_circ_data);
+
+  pol = TO_CLASS_POL_DATA(pol_data);
+  cdata = TO_CLASS_POL_CIRC_DATA(pol_circ_data);
+
+  /* An inactive circuit isn't in any EWMA queue, so it can change class
+   * freely. */
+  cdata->cls = cmux_class_of_circuit(circ);
+
+  ewma_policy.notify_circ_active(cmux, pol->ewma[cdata->cls], circ,
+                                 cdata->ewma);
+  if (pol->n_active[cdata->cls]++ == 0) {
+    /* Don't let a class that has been idle catch up on its share. */
+    pol->pass[cdata->cls] = MAX(pol->pass[cdata->cls], pol->global_pass);
+  }
+}
+
+/**
+ * Handle circuit deactivation: remove the circuit from its class's EWMA
+ * queue.
+ */
+
+static void
+class_notify_circ_inactive(circuitmux_t *cmux,
+                           circuitmux_policy_data_t *pol_data,
+                           circuit_t *circ,
+                           circuitmux_policy_circ_data_t *pol_circ_data)
+{
+  class_policy_data_t *pol = NULL;
+  class_policy_circ_data_t *cdata = NULL;
+
+  tor_assert(cmux);
+  tor_assert(pol_data);
+  tor_assert(circ);
+  tor_assert(pol_circ_data);
+
+  pol = TO_CLASS_POL_DATA(pol_data);
+  cdata = TO_CLASS_POL_CIRC_DATA(pol_circ_data);
+
+  ewma_policy.notify_circ_inactive(cmux, pol->ewma[cdata->cls], circ,
+                                   cdata->ewma);
+  tor_assert(pol->n_active[cdata->cls] > 0);
+  --pol->n_active[cdata->cls];
+}
+
+/**
+ * Update the circuit's EWMA and its class's pass value after we've sent
+ * some cells.
+ */
+
+static void
+class_notify_xmit_cells(circuitmux_t *cmux,
+                        circuitmux_policy_data_t *pol_data,
+                        circuit_t *circ,
+                        circuitmux_policy_circ_data_t *pol_circ_data,
+                        unsigned int n_cells)
+{
+  class_policy_data_t *pol = NULL;
+  class_policy_circ_data_t *cdata = NULL;
+
+  tor_assert(cmux);
+  tor_assert(pol_data);
+  tor_assert(circ);
+  tor_assert(pol_circ_data);
+
+  pol = TO_CLASS_POL_DATA(pol_data);
+  cdata = TO_CLASS_POL_CIRC_DATA(pol_circ_data);
+
+  ewma_policy.notify_xmit_cells(cmux, pol->ewma[cdata->cls], circ,
+                                cdata->ewma, n_cells);
+  pol->pass[cdata->cls] +=
+    (uint64_t)(CMUX_CLASS_STRIDE1 / cmux_class_get_weight(cdata->cls)) *
+    n_cells;
+}
+
+/**
+ * Pick the preferred circuit to send from: the EWMA policy's choice from the
+ * class with the lowest pass value.
+ */
+
+static circuit_t *
+class_pick_active_circuit(circuitmux_t *cmux,
+                          circuitmux_policy_data_t *pol_data)
+{
+  class_policy_data_t *pol = NULL;
+  int cls;
+
+  tor_assert(cmux);
+  tor_assert(pol_data);
+
+  pol = TO_CLASS_POL_DATA(pol_data);
+
+  cls = class_pick(pol);
+  if (cls < 0)
+    return NULL;
+
+  pol->global_pass = pol->pass[cls];
+  return ewma_policy.pick_active_circuit(cmux, pol->ewma[cls]);
+}
+
+/** Return the EWMA policy data for the class in <b>pol</b> that should send
+ * next.  If no class has an active circuit, return an empty one. */
+static circuitmux_policy_data_t *
+class_next_ewma(const class_policy_data_t *pol)
+{
+  int cls = class_pick(pol);
+  return pol->ewma[cls < 0 ? CMUX_CLASS_GENERAL : cls];
+}
+
+/**
+ * Compare two class-policy cmuxes, and return -1, 0 or 1 to indicate which
+ * should be more preferred - see circuitmux_compare_muxes() of circuitmux.c.
+ *
+ * The class weights only divide up each channel among its own classes;
+ * they say nothing about how busy one channel's circuits are compared to
+ * another's.  So we compare the circuits that each cmux would send next by
+ * EWMA, as the EWMA policy does.  A quiet directory or onion service
+ * circuit thus still goes ahead of a bulk circuit on another channel.
+ */
+
+static int
+class_cmp_cmux(circuitmux_t *cmux_1, circuitmux_policy_data_t *pol_data_1,
+               circuitmux_t *cmux_2, circuitmux_policy_data_t *pol_data_2)
+{
+  class_policy_data_t *p1 = NULL, *p2 = NULL;
+
+  tor_assert(cmux_1);
+  tor_assert(pol_data_1);
+  tor_assert(cmux_2);
+  tor_assert(pol_data_2);
+
+  p1 = TO_CLASS_POL_DATA(pol_data_1);
+  p2 = TO_CLASS_POL_DATA(pol_data_2);
+
+  if (p1 == p2)
+    return 0;
+
+  return ewma_policy.cmp_cmux(cmux_1, class_next_ewma(p1),
+                              cmux_2, class_next_ewma(p2));
+}
+
+/*** Class circuitmux_policy_t method table ***/
+
+circuitmux_policy_t class_policy = {
+  /*.alloc_cmux_data =*/ class_alloc_cmux_data,
+  /*.free_cmux_data =*/ class_free_cmux_data,
+  /*.alloc_circ_data =*/ class_alloc_circ_data,
+  /*.free_circ_data =*/ class_free_circ_data,
+  /*.notify_circ_active =*/ class_notify_circ_active,
+  /*.notify_circ_inactive =*/ class_notify_circ_inactive,
+  /*.notify_set_n_cells =*/ NULL, /* Neither we nor EWMA need this */
+  /*.notify_xmit_cells =*/ class_notify_xmit_cells,
+  /*.pick_active_circuit =*/ class_pick_active_circuit,
+  /*.cmp_cmux =*/ class_cmp_cmux
+};
+
+/** Update the class policy's parameters from <b>consensus</b>, which may be
+ * NULL. */
+void
+cmux_class_set_options(const networkstatus_t *consensus)
+{
+  cmux_class_enabled =
+    networkstatus_get_param(consensus, "CircuitPriorityClasses", 0, 0, 1);
+  cmux_class_weight[CMUX_CLASS_GENERAL] =
+    networkstatus_get_param(consensus, "CircuitPriorityWeightGeneral",
+                            CMUX_CLASS_WEIGHT_GENERAL_DEFAULT,
+                            CMUX_CLASS_WEIGHT_MIN, CMUX_CLASS_WEIGHT_MAX);
+  cmux_class_weight[CMUX_CLASS_ONION_SERVICE] =
+    networkstatus_get_param(consensus, "CircuitPriorityWeightOnionService",
+                            CMUX_CLASS_WEIGHT_ONION_SERVICE_DEFAULT,
+                            CMUX_CLASS_WEIGHT_MIN, CMUX_CLASS_WEIGHT_MAX);
+  cmux_class_weight[CMUX_CLASS_DIRECTORY] =
+    networkstatus_get_param(consensus, "CircuitPriorityWeightDirectory",
+                            CMUX_CLASS_WEIGHT_DIRECTORY_DEFAULT,
+                            CMUX_CLASS_WEIGHT_MIN, CMUX_CLASS_WEIGHT_MAX);
+}
+
+/** If <b>policy</b> is the EWMA policy or the class policy, return the EWMA
+ * policy data that chooses the next circuit to send from <b>pol_data</b>.
+ * Otherwise return NULL.  This lets us compare channels by EWMA while the
+ * class policy is being switched on or off, and channels are using
+ * both. */
+circuitmux_policy_data_t *
+cmux_class_get_ewma_data(const circuitmux_policy_t *policy,
+                         circuitmux_policy_data_t *pol_data)
+{
+  if (policy == &ewma_policy)
+    return pol_data;
+  if (policy == &class_policy)
+    return class_next_ewma(TO_CLASS_POL_DATA(pol_data));
+  return NULL;
+}
+
+/** Return the circuitmux policy that new channels should use. */
+const circuitmux_policy_t *
+cmux_get_default_policy(void)
+{
+  return cmux_class_enabled ? &class_policy : &ewma_policy;
+}
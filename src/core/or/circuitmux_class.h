@@ -0,0 +1,42 @@
+/* Copyright (c) 2018, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * \file circuitmux_class.h
+ * \brief Header file for circuitmux_class.c
+ **/
+
+#ifndef TOR_CIRCUITMUX_CLASS_H
+#define TOR_CIRCUITMUX_CLASS_H
+
+#include "core/or/or.h"
+#include "core/or/circuitmux.h"
+
+/** The traffic classes that the class policy schedules between. */
+typedef enum {
+  /** Everything else: mostly exit and client traffic. */
+  CMUX_CLASS_GENERAL = 0,
+  /** Circuits for onion services, at either end or at an intro or rendezvous
+   * point. */
+  CMUX_CLASS_ONION_SERVICE = 1,
+  /** Circuits carrying tunneled directory requests. */
+  CMUX_CLASS_DIRECTORY = 2,
+} cmux_class_t;
+#define CMUX_CLASS_MAX_ CMUX_CLASS_DIRECTORY
+
+/* The public class policy callbacks object. */
+extern circuitmux_policy_t class_policy;
+
+/* Externally visible class policy functions */
+void cmux_class_set_options(const networkstatus_t *consensus);
+const circuitmux_policy_t *cmux_get_default_policy(void);
+circuitmux_policy_data_t *cmux_class_get_ewma_data(
+                                     const circuitmux_policy_t *policy,
+                                     circuitmux_policy_data_t *pol_data);
+
+#ifdef CIRCUITMUX_CLASS_PRIVATE
+STATIC cmux_class_t cmux_class_of_circuit(const circuit_t *circ);
+STATIC uint32_t cmux_class_get_weight(cmux_class_t cls);
+#endif
+
+#endif /* !defined(TOR_CIRCUITMUX_CLASS_H) */
@@ -527,7 +527,20 @@ ewma_cmp_cmux(circuitmux_t *cmux_1, circuitmux_policy_data_t *pol_data_1,
 
     /* Got both of them? */
     if (ce1 != NULL && ce2 != NULL) {
-      /* Pick whichever one has the better best circuit */
+      /* Pick whichever one has the better best circuit. The two queues may
+       * not have been recalibrated on the same tick, so put both counts on
+       * the same scale first: the scheduler relies on this to find the
+       * quietest circuit across all channels. */
+      if (ce1->last_adjusted_tick != ce2->last_adjusted_tick) {
+        double count1 = ce1->cell_count *
+          get_scale_factor(ce1->last_adjusted_tick, ce2->last_adjusted_tick);
+        if (count1 < ce2->cell_count)
+          return -1;
+        else if (count1 > ce2->cell_count)
+          return 1;
+        else
+          return 0;
+      }
       return compare_cell_ewma_counts(ce1, ce2);
     } else {
       if (ce1 != NULL ) {
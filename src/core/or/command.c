@@ -217,6 +217,37 @@ command_process_cell(channel_t *chan, cell_t *cell)
   }
 }
 
+/** Fill <b>order_out</b> with the indices of the <b>n_cells</b> cells in
+ * <b>cells</b>, in the order that we should process them: grouped by
+ * circuit ID, with the circuits in the order their first cells arrived, and
+ * each circuit's cells in the order they arrived.
+ *
+ * Nothing orders cells on different circuits with respect to each other, but
+ * processing a circuit's cells together is cheaper: after the first cell,
+ * looking up the circuit hits the circuit map's cache, and the cells we
+ * relay onwards join the next hop's queue together. */
+void
+command_order_cell_batch(const cell_t *cells, int n_cells, int *order_out)
+{
+  char placed[COMMAND_CELL_BATCH_MAX];
+  int i, j, n_placed = 0;
+
+  tor_assert(n_cells <= COMMAND_CELL_BATCH_MAX);
+  memset(placed, 0, sizeof(placed));
+
+  for (i = 0; i < n_cells; ++i) {
+    if (placed[i])
+      continue;
+    for (j = i; j < n_cells; ++j) {
+      if (!placed[j] && cells[j].circ_id == cells[i].circ_id) {
+        placed[j] = 1;
+        order_out[n_placed++] = j;
+      }
+    }
+  }
+  tor_assert(n_placed == n_cells);
+}
+
 /** Process an incoming var_cell from a channel; in the current protocol all
  * the var_cells are handshake-related and handled below the channel layer,
  * so this just logs a warning and drops the cell.
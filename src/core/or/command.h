@@ -14,7 +14,13 @@
 
 #include "core/or/channel.h"
 
+/** The largest number of fixed-length cells that we read from a connection
+ * and process as one batch. */
+#define COMMAND_CELL_BATCH_MAX 16
+
 void command_process_cell(channel_t *chan, cell_t *cell);
+void command_order_cell_batch(const cell_t *cells, int n_cells,
+                              int *order_out);
 void command_process_var_cell(channel_t *chan, var_cell_t *cell);
 void command_setup_channel(channel_t *chan);
 void command_setup_listener(channel_listener_t *chan_l);
@@ -460,23 +460,6 @@ cell_pack(packed_cell_t *dst, const cell_t *src, int wide_circ_ids)
   memcpy(dest+1, src->payload, CELL_PAYLOAD_SIZE);
 }
 
-/** Unpack the network-order buffer <b>src</b> into a host-order
- * cell_t structure <b>dest</b>.
- */
-static void
-cell_unpack(cell_t *dest, const char *src, int wide_circ_ids)
-{
-  if (wide_circ_ids) {
-    dest->circ_id = ntohl(get_uint32(src));
-    src += 4;
-  } else {
-    dest->circ_id = ntohs(get_uint16(src));
-    src += 2;
-  }
-  dest->command = get_uint8(src);
-  memcpy(dest->payload, src+1, CELL_PAYLOAD_SIZE);
-}
-
 /** Write the header of <b>cell</b> into the first VAR_CELL_MAX_HEADER_SIZE
  * bytes of <b>hdr_out</b>. Returns number of bytes used. */
 int
@@ -2306,6 +2289,25 @@ connection_fetch_var_cell_from_buf(or_connection_t *or_conn, var_cell_t **out)
   return fetch_var_cell_from_buf(conn->inbuf, out, or_conn->link_proto);
 }
 
+/** Helper for connection_or_process_cells_from_inbuf(): hand the
+ * *<b>n_cells</b> cells in <b>cells</b>, which we just took from
+ * <b>conn</b>'s inbuf, to the channel, and empty the batch. */
+static void
+connection_or_handle_cell_batch(or_connection_t *conn, cell_t *cells,
+                                int *n_cells)
+{
+  if (*n_cells == 0)
+    return;
+
+  /* Touch the channel's active timestamp if there is one */
+  if (conn->chan)
+    channel_timestamp_active(TLS_CHAN_TO_BASE(conn->chan));
+
+  circuit_build_times_network_is_live(get_circuit_build_times_mutable());
+  channel_tls_handle_cells(cells, *n_cells, conn);
+  *n_cells = 0;
+}
+
 /** Process cells from <b>conn</b>'s inbuf.
  *
  * Loop: while inbuf contains a cell, pull it off the inbuf, unpack it,
@@ -2331,6 +2333,11 @@ connection_or_process_cells_from_inbuf(or_connection_t *conn)
    * buffer and copy the cell.
    */
 
+  /* We take fixed-length cells off the inbuf a batch at a time, so that
+   * channeltls.c can handle each circuit's cells in a batch together. */
+  cell_t cells[COMMAND_CELL_BATCH_MAX];
+  int n_cells = 0;
+
   while (1) {
     log_debug(LD_OR,
               TOR_SOCKET_T_FORMAT": starting, inbuf_datalen %d "
@@ -2338,6 +2345,8 @@ connection_or_process_cells_from_inbuf(or_connection_t *conn)
               conn->base_.s,(int)connection_get_inbuf_len(TO_CONN(conn)),
               tor_tls_get_pending_bytes(conn->tls));
     if (connection_fetch_var_cell_from_buf(conn, &var_cell)) {
+      /* Handle the cells before this one first. */
+      connection_or_handle_cell_batch(conn, cells, &n_cells);
       if (!var_cell)
         return 0; /* not yet. */
 
@@ -2349,26 +2358,16 @@ connection_or_process_cells_from_inbuf(or_connection_t *conn)
       channel_tls_handle_var_cell(var_cell, conn);
       var_cell_free(var_cell);
     } else {
-      const int wide_circ_ids = conn->wide_circ_ids;
-      size_t cell_network_size = get_cell_network_size(conn->wide_circ_ids);
-      char buf[CELL_MAX_NETWORK_SIZE];
-      cell_t cell;
-      if (connection_get_inbuf_len(TO_CONN(conn))
-          < cell_network_size) /* whole response available? */
+      /* retrieve cell info from the inbuf (create the host-order struct from
+       * the network-order string) */
+      if (! fetch_cell_from_buf(conn->base_.inbuf, &cells[n_cells],
+                                conn->wide_circ_ids)) {
+        connection_or_handle_cell_batch(conn, cells, &n_cells);
         return 0; /* not yet */
+      }
 
-      /* Touch the channel's active timestamp if there is one */
-      if (conn->chan)
-        channel_timestamp_active(TLS_CHAN_TO_BASE(conn->chan));
-
-      circuit_build_times_network_is_live(get_circuit_build_times_mutable());
-      connection_buf_get_bytes(buf, cell_network_size, TO_CONN(conn));
-
-      /* retrieve cell info from buf (create the host-order struct from the
-       * network-order string) */
-      cell_unpack(&cell, buf, wide_circ_ids);
-
-      channel_tls_handle_cell(&cell, conn);
+      if (++n_cells == COMMAND_CELL_BATCH_MAX)
+        connection_or_handle_cell_batch(conn, cells, &n_cells);
     }
   }
 }
@@ -34,6 +34,10 @@ static const smartlist_t *get_supported_protocol_list(void);
 static int protocol_list_contains(const smartlist_t *protos,
                                   protocol_type_t pr, uint32_t ver);
 
+/** For each protocol_type_t, the set of its versions that we support.
+ * Filled in along with supported_protocol_list. */
+static uint64_t supported_protocol_bitsets[PRT_CONS + 1];
+
 /** Mapping between protocol type string and protocol type. */
 /// C_RUST_COUPLED: src/rust/protover/protover.rs `PROTOCOL_NAMES`
 static const struct {
@@ -115,6 +119,38 @@ proto_entry_free_(proto_entry_t *entry)
 /** The largest possible protocol version. */
 #define MAX_PROTOCOL_VERSION (UINT32_MAX-1)
 
+/** Return the set of versions from <b>low</b> through <b>high</b> that fit
+ * in a protocol version bitset. */
+STATIC uint64_t
+proto_range_to_bitset(uint32_t low, uint32_t high)
+{
+  if (low > high || low > PROTOVER_BITSET_MAX_VERSION)
+    return 0;
+  if (high > PROTOVER_BITSET_MAX_VERSION)
+    high = PROTOVER_BITSET_MAX_VERSION;
+  return (UINT64_MAX >> (PROTOVER_BITSET_MAX_VERSION - high)) &
+    (UINT64_MAX << low);
+}
+
+/** Append to <b>ranges</b> a newly allocated proto_range_t for each run of
+ * consecutive versions in the protocol version bitset <b>bits</b>. */
+static void
+proto_bitset_add_ranges(smartlist_t *ranges, uint64_t bits)
+{
+  uint32_t v = 0;
+
+  while (bits) {
+    proto_range_t *range = tor_malloc_zero(sizeof(proto_range_t));
+    for (; !(bits & 1); bits >>= 1)
+      ++v;
+    range->low = v;
+    for (; bits & 1; bits >>= 1)
+      ++v;
+    range->high = v - 1;
+    smartlist_add(ranges, range);
+  }
+}
+
 /**
  * Given a string <b>s</b> and optional end-of-string pointer
  * <b>end_of_range</b>, parse the protocol range and store it in
@@ -314,8 +350,12 @@ protover_contains_long_protocol_names(const char *s)
 int
 protover_is_supported_here(protocol_type_t pr, uint32_t ver)
 {
-  const smartlist_t *ours = get_supported_protocol_list();
-  return protocol_list_contains(ours, pr, ver);
+  get_supported_protocol_list();
+  if (BUG((unsigned)pr > PRT_CONS))
+    return 0; // LCOV_EXCL_LINE
+  /* We don't support any version too large for a bitset. */
+  return ver <= PROTOVER_BITSET_MAX_VERSION &&
+    (supported_protocol_bitsets[pr] >> ver) & 1;
 }
 
 /**
@@ -326,8 +366,10 @@ int
 protocol_list_supports_protocol(const char *list, protocol_type_t tp,
                                 uint32_t version)
 {
-  /* NOTE: This is a pretty inefficient implementation. If it ever shows
-   * up in profiles, we should memoize it.
+  /* We answer a single question per parse here, so checking the parsed
+   * ranges is as cheap as building a bitset from them would be. The caller
+   * that matters, memoize_protover_summary(), only gets here once per
+   * distinct list.
    */
   smartlist_t *protocols = parse_protocol_list(list);
   if (!protocols) {
@@ -412,6 +454,17 @@ get_supported_protocol_list(void)
   if (PREDICT_UNLIKELY(supported_protocol_list == NULL)) {
     supported_protocol_list =
       parse_protocol_list(protover_get_supported_protocols());
+    memset(supported_protocol_bitsets, 0,
+           sizeof(supported_protocol_bitsets));
+    SMARTLIST_FOREACH_BEGIN(supported_protocol_list,
+                            const proto_entry_t *, ent) {
+      protocol_type_t tp;
+      if (BUG(str_to_protocol_type(ent->name, &tp) < 0))
+        continue; // LCOV_EXCL_LINE
+      SMARTLIST_FOREACH(ent->ranges, const proto_range_t *, range,
+        supported_protocol_bitsets[tp] |=
+          proto_range_to_bitset(range->low, range->high));
+    } SMARTLIST_FOREACH_END(ent);
   }
   return supported_protocol_list;
 }
@@ -470,52 +523,6 @@ encode_protocol_list(const smartlist_t *sl)
 ///                 `MAX_PROTOCOLS_TO_EXPAND`
 static const int MAX_PROTOCOLS_TO_EXPAND = (1<<16);
 
-/** Voting helper: Given a list of proto_entry_t, return a newly allocated
- * smartlist of newly allocated strings, one for each included protocol
- * version. (So 'Foo=3,5-7' expands to a list of 'Foo=3', 'Foo=5', 'Foo=6',
- * 'Foo=7'.)
- *
- * Do not list any protocol version more than once.
- *
- * Return NULL if the list would be too big.
- */
-static smartlist_t *
-expand_protocol_list(const smartlist_t *protos)
-{
-  smartlist_t *expanded = smartlist_new();
-  if (!protos)
-    return expanded;
-
-  SMARTLIST_FOREACH_BEGIN(protos, const proto_entry_t *, ent) {
-    const char *name = ent->name;
-    if (strlen(name) > MAX_PROTOCOL_NAME_LENGTH) {
-      log_warn(LD_NET, "When expanding a protocol entry, I got a very large "
-               "protocol name. This is possibly an attack or a bug, unless "
-               "the Tor network truly supports protocol names larger than "
-               "%ud characters. The offending string was: %s",
-               MAX_PROTOCOL_NAME_LENGTH, escaped(name));
-      continue;
-    }
-    SMARTLIST_FOREACH_BEGIN(ent->ranges, const proto_range_t *, range) {
-      uint32_t u;
-      for (u = range->low; u <= range->high; ++u) {
-        smartlist_add_asprintf(expanded, "%s=%lu", name, (unsigned long)u);
-        if (smartlist_len(expanded) > MAX_PROTOCOLS_TO_EXPAND)
-          goto too_many;
-      }
-    } SMARTLIST_FOREACH_END(range);
-  } SMARTLIST_FOREACH_END(ent);
-
-  smartlist_sort_strings(expanded);
-  smartlist_uniq_strings(expanded); // This makes voting work. do not remove
-  return expanded;
-
- too_many:
-  SMARTLIST_FOREACH(expanded, char *, cp, tor_free(cp));
-  smartlist_free(expanded);
-  return NULL;
-}
-
 /** Voting helper: compare two singleton proto_entry_t items by version
  * alone. (A singleton item is one with a single range entry where
  * low==high.) */
@@ -650,6 +657,81 @@ contract_protocol_list(const smartlist_t *proto_strings)
   return result;
 }
 
+/** Voting helper: a count of how many votes list each version of a single
+ * protocol. */
+typedef struct proto_vote_tally_t {
+  /** The versions listed by the vote we're counting now. */
+  uint64_t this_vote;
+  /** For each version up to PROTOVER_BITSET_MAX_VERSION, how many votes
+   * have listed it. */
+  int n_votes[PROTOVER_BITSET_MAX_VERSION + 1];
+} proto_vote_tally_t;
+
+/** Voting helper: add the protocol versions in <b>vote</b> to the tallies
+ * in <b>tallies</b>, a map from protocol name to proto_vote_tally_t.
+ * Versions too large for a bitset are rare, so expand those to singleton
+ * strings at the end of <b>large_entries</b> the old-fashioned way.
+ *
+ * Return 0 on success, or -1 if the vote lists too many versions, in which
+ * case we don't count any of them. */
+static int
+proto_vote_tally_add(strmap_t *tallies, smartlist_t *large_entries,
+                     const smartlist_t *vote)
+{
+  smartlist_t *touched = smartlist_new();
+  smartlist_t *large = smartlist_new();
+  uint64_t n_versions = 0;
+
+  SMARTLIST_FOREACH_BEGIN(vote, const proto_entry_t *, ent) {
+    SMARTLIST_FOREACH_BEGIN(ent->ranges, const proto_range_t *, range) {
+      n_versions += (uint64_t)range->high - range->low + 1;
+      if (n_versions > (uint64_t)MAX_PROTOCOLS_TO_EXPAND)
+        goto too_many;
+    } SMARTLIST_FOREACH_END(range);
+  } SMARTLIST_FOREACH_END(ent);
+
+  SMARTLIST_FOREACH_BEGIN(vote, const proto_entry_t *, ent) {
+    proto_vote_tally_t *tally = strmap_get(tallies, ent->name);
+    if (!tally) {
+      tally = tor_malloc_zero(sizeof(proto_vote_tally_t));
+      strmap_set(tallies, ent->name, tally);
+    }
+    SMARTLIST_FOREACH_BEGIN(ent->ranges, const proto_range_t *, range) {
+      uint32_t u;
+      if (!tally->this_vote)
+        smartlist_add(touched, tally);
+      tally->this_vote |= proto_range_to_bitset(range->low, range->high);
+      for (u = MAX(range->low, PROTOVER_BITSET_MAX_VERSION + 1);
+           u <= range->high; ++u) {
+        smartlist_add_asprintf(large, "%s=%lu", ent->name, (unsigned long)u);
+      }
+    } SMARTLIST_FOREACH_END(range);
+  } SMARTLIST_FOREACH_END(ent);
+
+  /* Count each version at most once per vote. */
+  SMARTLIST_FOREACH_BEGIN(touched, proto_vote_tally_t *, tally) {
+    uint64_t versions = tally->this_vote;
+    int v;
+    for (v = 0; versions; ++v, versions >>= 1) {
+      if (versions & 1)
+        ++tally->n_votes[v];
+    }
+    tally->this_vote = 0;
+  } SMARTLIST_FOREACH_END(tally);
+  smartlist_sort_strings(large);
+  smartlist_uniq_strings(large);
+  smartlist_add_all(large_entries, large);
+
+  smartlist_free(touched);
+  smartlist_free(large);
+  return 0;
+
+ too_many:
+  smartlist_free(touched);
+  smartlist_free(large);
+  return -1;
+}
+
 /**
  * Protocol voting implementation.
  *
@@ -668,9 +750,10 @@ protover_compute_vote(const smartlist_t *list_of_proto_strings,
     return tor_strdup("");
   }
 
-  smartlist_t *all_entries = smartlist_new();
+  strmap_t *tallies = strmap_new();
+  smartlist_t *large_entries = smartlist_new();
 
-  // First, parse the inputs and break them into singleton entries.
+  // First, parse the inputs and count the versions in each.
   SMARTLIST_FOREACH_BEGIN(list_of_proto_strings, const char *, vote) {
     smartlist_t *unexpanded = parse_protocol_list(vote);
     if (! unexpanded) {
@@ -679,52 +762,52 @@ protover_compute_vote(const smartlist_t *list_of_proto_strings,
                escaped(vote));
       continue;
     }
-    smartlist_t *this_vote = expand_protocol_list(unexpanded);
-    if (this_vote == NULL) {
+    if (proto_vote_tally_add(tallies, large_entries, unexpanded) < 0) {
       log_warn(LD_NET, "When expanding a protocol list from an authority, I "
                "got too many protocols. This is possibly an attack or a bug, "
                "unless the Tor network truly has expanded to support over %d "
                "different subprotocol versions. The offending string was: %s",
                MAX_PROTOCOLS_TO_EXPAND, escaped(vote));
-    } else {
-      smartlist_add_all(all_entries, this_vote);
-      smartlist_free(this_vote);
     }
     SMARTLIST_FOREACH(unexpanded, proto_entry_t *, e, proto_entry_free(e));
     smartlist_free(unexpanded);
   } SMARTLIST_FOREACH_END(vote);
 
-  if (smartlist_len(all_entries) == 0) {
-    smartlist_free(all_entries);
-    return tor_strdup("");
-  }
-
-  // Now sort the singleton entries
-  smartlist_sort_strings(all_entries);
-
-  // Now find all the strings that appear at least 'threshold' times.
+  // Now find all the versions that appear at least 'threshold' times.
   smartlist_t *include_entries = smartlist_new();
-  const char *cur_entry = smartlist_get(all_entries, 0);
-  int n_times = 0;
-  SMARTLIST_FOREACH_BEGIN(all_entries, const char *, ent) {
-    if (!strcmp(ent, cur_entry)) {
-      n_times++;
-    } else {
-      if (n_times >= threshold && cur_entry)
-        smartlist_add(include_entries, (void*)cur_entry);
-      cur_entry = ent;
-      n_times = 1 ;
+  STRMAP_FOREACH(tallies, name, const proto_vote_tally_t *, tally) {
+    int v;
+    for (v = 0; v <= PROTOVER_BITSET_MAX_VERSION; ++v) {
+      if (tally->n_votes[v] >= threshold && tally->n_votes[v] > 0)
+        smartlist_add_asprintf(include_entries, "%s=%d", name, v);
     }
-  } SMARTLIST_FOREACH_END(ent);
-
-  if (n_times >= threshold && cur_entry)
-    smartlist_add(include_entries, (void*)cur_entry);
+  } STRMAP_FOREACH_END;
+
+  if (smartlist_len(large_entries)) {
+    smartlist_sort_strings(large_entries);
+    const char *cur_entry = smartlist_get(large_entries, 0);
+    int n_times = 0;
+    SMARTLIST_FOREACH_BEGIN(large_entries, const char *, ent) {
+      if (!strcmp(ent, cur_entry)) {
+        n_times++;
+      } else {
+        if (n_times >= threshold)
+          smartlist_add_strdup(include_entries, cur_entry);
+        cur_entry = ent;
+        n_times = 1;
+      }
+    } SMARTLIST_FOREACH_END(ent);
+    if (n_times >= threshold)
+      smartlist_add_strdup(include_entries, cur_entry);
+  }
 
   // Finally, compress that list.
   char *result = contract_protocol_list(include_entries);
+  SMARTLIST_FOREACH(include_entries, char *, cp, tor_free(cp));
   smartlist_free(include_entries);
-  SMARTLIST_FOREACH(all_entries, char *, cp, tor_free(cp));
-  smartlist_free(all_entries);
+  SMARTLIST_FOREACH(large_entries, char *, cp, tor_free(cp));
+  smartlist_free(large_entries);
+  strmap_free(tallies, tor_free_);
 
   return result;
 }
@@ -733,9 +816,9 @@ protover_compute_vote(const smartlist_t *list_of_proto_strings,
  * one that we support, and false otherwise.  If <b>missing_out</b> is
  * provided, set it to the list of protocols we do not support.
  *
- * NOTE: This is quadratic, but we don't do it much: only a few times per
- * consensus. Checking signatures should be way more expensive than this
- * ever would be.
+ * Versions that fit in a bitset are checked against our own supported
+ * bitsets a whole range at a time, so a huge range costs no more than a
+ * small one.
  **/
 int
 protover_all_supported(const char *s, char **missing_out)
@@ -758,6 +841,7 @@ protover_all_supported(const char *s, char **missing_out)
 
   missing_some = smartlist_new();
   missing_completely = smartlist_new();
+  get_supported_protocol_list();
 
   SMARTLIST_FOREACH_BEGIN(entries, const proto_entry_t *, ent) {
     protocol_type_t tp;
@@ -768,65 +852,40 @@ protover_all_supported(const char *s, char **missing_out)
       continue;
     }
 
+    proto_entry_t *unsupported = tor_malloc_zero(sizeof(proto_entry_t));
+    unsupported->name = tor_strdup(ent->name);
+    unsupported->ranges = smartlist_new();
+
     SMARTLIST_FOREACH_BEGIN(ent->ranges, const proto_range_t *, range) {
-      proto_entry_t *unsupported = tor_malloc_zero(sizeof(proto_entry_t));
-      proto_range_t *versions = tor_malloc_zero(sizeof(proto_range_t));
-      uint32_t i;
-
-      unsupported->name = tor_strdup(ent->name);
-      unsupported->ranges = smartlist_new();
-
-      for (i = range->low; i <= range->high; ++i) {
-        if (!protover_is_supported_here(tp, i)) {
-          if (versions->low == 0 && versions->high == 0) {
-            versions->low = i;
-            /* Pre-emptively add the high now, just in case we're in a single
-             * version range (e.g. "Link=999"). */
-            versions->high = i;
-          }
-          /* If the last one to be unsupported is one less than the current
-           * one, we're in a continuous range, so set the high field. */
-          if ((versions->high && versions->high == i - 1) ||
-              /* Similarly, if the last high wasn't set and we're currently
-               * one higher than the low, add current index as the highest
-               * known high. */
-              (!versions->high && versions->low == i - 1)) {
-            versions->high = i;
-            continue;
-          }
+      const uint64_t missing =
+        proto_range_to_bitset(range->low, range->high) &
+        ~supported_protocol_bitsets[tp];
+      proto_bitset_add_ranges(unsupported->ranges, missing);
+
+      /* Anything too large for a bitset is one we don't support. */
+      if (range->high > PROTOVER_BITSET_MAX_VERSION) {
+        const uint32_t low = MAX(range->low, PROTOVER_BITSET_MAX_VERSION + 1);
+        proto_range_t *last = smartlist_len(unsupported->ranges) ?
+          smartlist_get(unsupported->ranges,
+                        smartlist_len(unsupported->ranges) - 1) : NULL;
+        if (last && last->high == low - 1) {
+          last->high = range->high;
         } else {
-          /* If we hit a supported version, and we previously had a range,
-           * we've hit a non-continuity. Copy the previous range and add it to
-           * the unsupported->ranges list and zero-out the previous range for
-           * the next iteration. */
-          if (versions->low != 0 && versions->high != 0) {
-            proto_range_t *versions_to_add = tor_malloc(sizeof(proto_range_t));
-
-            versions_to_add->low = versions->low;
-            versions_to_add->high = versions->high;
-            smartlist_add(unsupported->ranges, versions_to_add);
-
-            versions->low = 0;
-            versions->high = 0;
-          }
+          proto_range_t *versions = tor_malloc_zero(sizeof(proto_range_t));
+          versions->low = low;
+          versions->high = range->high;
+          smartlist_add(unsupported->ranges, versions);
         }
       }
-      /* Once we've run out of versions to check, see if we had any unsupported
-       * ones and, if so, add them to unsupported->ranges. */
-      if (versions->low != 0 && versions->high != 0) {
-        smartlist_add(unsupported->ranges, versions);
-      }
-      /* Finally, if we had something unsupported, add it to the list of
-       * missing_some things and mark that there was something missing. */
-      if (smartlist_len(unsupported->ranges) != 0) {
-        smartlist_add(missing_some, (void*) unsupported);
-        all_supported = 0;
-      } else {
-        proto_entry_free(unsupported);
-        tor_free(versions);
-      }
     } SMARTLIST_FOREACH_END(range);
 
+    if (smartlist_len(unsupported->ranges) != 0) {
+      smartlist_add(missing_some, unsupported);
+      all_supported = 0;
+    } else {
+      proto_entry_free(unsupported);
+    }
+
     continue;
 
   unsupported:
@@ -81,7 +81,12 @@ typedef struct proto_entry_t {
   struct smartlist_t *ranges;
 } proto_entry_t;
 
+/** The largest protocol version that we can store in a bitset.  Every
+ * protocol version in use today is much smaller than this. */
+#define PROTOVER_BITSET_MAX_VERSION 63
+
 #if !defined(HAVE_RUST) && defined(TOR_UNIT_TESTS)
+STATIC uint64_t proto_range_to_bitset(uint32_t low, uint32_t high);
 STATIC struct smartlist_t *parse_protocol_list(const char *s);
 STATIC char *encode_protocol_list(const struct smartlist_t *sl);
 STATIC const char *protocol_type_to_str(protocol_type_t pr);
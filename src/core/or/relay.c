@@ -133,6 +133,12 @@ uint64_t stats_n_relay_cells_delivered = 0;
 /** Stats: how many circuits have we closed due to the cell queue limit being
  * reached (see append_cell_to_circuit_queue()) */
 uint64_t stats_n_circ_max_cell_reached = 0;
+/** Stats: how many times has a circuit queue's delay stayed above the AQM
+ * target for long enough that we pushed back on its edges? */
+uint64_t stats_n_circ_aqm_congested = 0;
+/** Stats: how many circuits have we closed because their cells waited too
+ * long for too long (see cell_queue_aqm_note_sojourn()) */
+uint64_t stats_n_circ_aqm_closed = 0;
 
 /** Used to tell which stream to read from first on a circuit. */
 static tor_weak_rng_t stream_choice_rng = TOR_WEAK_RNG_INIT;
@@ -2787,6 +2793,84 @@ packed_cell_get_circid(const packed_cell_t *cell, int wide_circ_ids)
   }
 }
 
+/* How many cells to send from a circuit before picking a circuit again. */
+#define CIRC_FLUSH_BATCH_DEFAULT 1
+#define CIRC_FLUSH_BATCH_MIN 1
+#define CIRC_FLUSH_BATCH_MAX 64
+static int circ_flush_batch = CIRC_FLUSH_BATCH_DEFAULT;
+
+/** Return the largest number of cells that we send from one circuit before
+ * letting the cmux pick a circuit again. */
+int
+relay_get_circ_flush_batch(void)
+{
+  return circ_flush_batch;
+}
+
+/* Active queue management on circuit queues. Cell counts alone don't tell us
+ * whether a circuit's queue is a problem: a few cells waiting on a slow
+ * channel can be worse than many on a fast one. So, in the manner of CoDel,
+ * we look at how long each cell has waited when it leaves its queue. If
+ * every cell for a whole interval has waited longer than the target delay,
+ * we stop reading from the circuit's edge streams until the delay drops; if
+ * that goes on for far longer, we close the circuit.
+ *
+ * A target of 0 turns all of this off, which is the default. */
+#define CIRC_AQM_TARGET_MSEC_DEFAULT 0
+#define CIRC_AQM_TARGET_MSEC_MIN 0
+#define CIRC_AQM_TARGET_MSEC_MAX 60000
+#define CIRC_AQM_INTERVAL_MSEC_DEFAULT 1000
+#define CIRC_AQM_INTERVAL_MSEC_MIN 10
+#define CIRC_AQM_INTERVAL_MSEC_MAX 600000
+/* How long cells must have waited too long before we close the circuit. 0
+ * means never. */
+#define CIRC_AQM_KILL_SEC_DEFAULT 0
+#define CIRC_AQM_KILL_SEC_MIN 0
+#define CIRC_AQM_KILL_SEC_MAX 3600
+
+/* The AQM parameters, from the consensus, in msec. */
+static uint32_t circ_aqm_target_msec = CIRC_AQM_TARGET_MSEC_DEFAULT;
+static uint32_t circ_aqm_interval_msec = CIRC_AQM_INTERVAL_MSEC_DEFAULT;
+static uint32_t circ_aqm_kill_msec = CIRC_AQM_KILL_SEC_DEFAULT * 1000;
+
+/** Note that a cell which waited <b>msec_waiting</b> msec has just left
+ * <b>queue</b>, at coarse timestamp <b>now_ts</b>, and update the queue's
+ * AQM state.  Return CELL_QUEUE_AQM_OK if the queue is fine,
+ * CELL_QUEUE_AQM_CONGESTED if cells have been waiting too long for at least
+ * an interval, or CELL_QUEUE_AQM_RUNAWAY if they have been for so long that
+ * the circuit should be closed. */
+STATIC int
+cell_queue_aqm_note_sojourn(cell_queue_t *queue, uint32_t now_ts,
+                            uint32_t msec_waiting)
+{
+  uint64_t msec_above;
+
+  /* An empty queue can't be congested, however long its last cell waited. */
+  if (!circ_aqm_target_msec || msec_waiting <= circ_aqm_target_msec ||
+      queue->n == 0) {
+    queue->aqm_above_target = 0;
+    queue->aqm_congested = 0;
+    return CELL_QUEUE_AQM_OK;
+  }
+
+  if (!queue->aqm_above_target) {
+    queue->aqm_above_target = 1;
+    queue->aqm_above_target_since = now_ts;
+    return CELL_QUEUE_AQM_OK;
+  }
+
+  msec_above = monotime_coarse_stamp_units_to_approx_msec(
+                                   now_ts - queue->aqm_above_target_since);
+  if (msec_above < circ_aqm_interval_msec)
+    return CELL_QUEUE_AQM_OK;
+  if (circ_aqm_kill_msec && msec_above >= circ_aqm_kill_msec)
+    return CELL_QUEUE_AQM_RUNAWAY;
+  if (queue->aqm_congested)
+    return CELL_QUEUE_AQM_OK; /* We already told the caller. */
+  queue->aqm_congested = 1;
+  return CELL_QUEUE_AQM_CONGESTED;
+}
+
 /** Pull as many cells as possible (but no more than <b>max</b>) from the
  * queue of the first active circuit on <b>chan</b>, and write them to
  * <b>chan</b>-&gt;outbuf.  Return the number of cells written.  Advance
@@ -2801,7 +2885,10 @@ channel_flush_from_first_active_circuit, (channel_t *chan, int max))
   circuit_t *circ;
   or_circuit_t *or_circ;
   int streams_blocked;
+  int aqm_verdict;
+  int n_batch, n_sent, write_failed = 0;
   packed_cell_t *cell;
+  const or_options_t *options = get_options();
 
   /* Get the cmux */
   tor_assert(chan);
@@ -2861,79 +2948,130 @@ channel_flush_from_first_active_circuit, (channel_t *chan, int max))
     tor_assert(queue->n > 0);
 
     /*
-     * Get just one cell here; once we've sent it, that can change the circuit
-     * selection, so we have to loop around for another even if this circuit
-     * has more than one.
+     * Send up to circ_flush_batch cells from this circuit before we pick a
+     * circuit again. Each cell we send can change the circuit selection, so
+     * by default that is just one; but picking a circuit and updating the
+     * cmux costs more than sending a cell, and the cmux accounts for a batch
+     * just as it would for the same cells sent one at a time.
      */
-    cell = cell_queue_pop(queue);
-
-    /* Calculate the exact time that this cell has spent in the queue. */
-    if (get_options()->CellStatistics ||
-        get_options()->TestingEnableCellStatsEvent) {
-      uint32_t timestamp_now = monotime_coarse_get_stamp();
-      uint32_t msec_waiting =
-        (uint32_t) monotime_coarse_stamp_units_to_approx_msec(
-                         timestamp_now - cell->inserted_timestamp);
-
-      if (get_options()->CellStatistics && !CIRCUIT_IS_ORIGIN(circ)) {
-        or_circ = TO_OR_CIRCUIT(circ);
-        or_circ->total_cell_waiting_time += msec_waiting;
-        or_circ->processed_cells++;
+    n_batch = MIN(max - n_flushed, circ_flush_batch);
+    if (n_batch > queue->n)
+      n_batch = queue->n;
+    n_sent = 0;
+    aqm_verdict = CELL_QUEUE_AQM_OK;
+    while (n_sent < n_batch) {
+      int verdict = CELL_QUEUE_AQM_OK;
+      cell = cell_queue_pop(queue);
+
+      /* Calculate the exact time that this cell has spent in the queue. */
+      if (options->CellStatistics ||
+          options->TestingEnableCellStatsEvent ||
+          circ_aqm_target_msec) {
+        uint32_t timestamp_now = monotime_coarse_get_stamp();
+        uint32_t msec_waiting =
+          (uint32_t) monotime_coarse_stamp_units_to_approx_msec(
+                           timestamp_now - cell->inserted_timestamp);
+
+        if (circ_aqm_target_msec)
+          verdict = cell_queue_aqm_note_sojourn(queue, timestamp_now,
+                                                msec_waiting);
+
+        if (options->CellStatistics && !CIRCUIT_IS_ORIGIN(circ)) {
+          or_circ = TO_OR_CIRCUIT(circ);
+          or_circ->total_cell_waiting_time += msec_waiting;
+          or_circ->processed_cells++;
+        }
+
+        if (options->TestingEnableCellStatsEvent) {
+          uint8_t command = packed_cell_get_command(cell,
+                                                    chan->wide_circ_ids);
+
+          testing_cell_stats_entry_t *ent =
+            tor_malloc_zero(sizeof(testing_cell_stats_entry_t));
+          ent->command = command;
+          ent->waiting_time = msec_waiting / 10;
+          ent->removed = 1;
+          if (circ->n_chan == chan)
+            ent->exitward = 1;
+          if (!circ->testing_cell_stats)
+            circ->testing_cell_stats = smartlist_new();
+          smartlist_add(circ->testing_cell_stats, ent);
+        }
       }
 
-      if (get_options()->TestingEnableCellStatsEvent) {
-        uint8_t command = packed_cell_get_command(cell, chan->wide_circ_ids);
-
-        testing_cell_stats_entry_t *ent =
-          tor_malloc_zero(sizeof(testing_cell_stats_entry_t));
-        ent->command = command;
-        ent->waiting_time = msec_waiting / 10;
-        ent->removed = 1;
-        if (circ->n_chan == chan)
-          ent->exitward = 1;
-        if (!circ->testing_cell_stats)
-          circ->testing_cell_stats = smartlist_new();
-        smartlist_add(circ->testing_cell_stats, ent);
+      /* If we just flushed our queue and this circuit is used for a
+       * tunneled directory request, possibly advance its state. */
+      if (queue->n == 0 && chan->dirreq_id)
+        geoip_change_dirreq_state(chan->dirreq_id,
+                                  DIRREQ_TUNNELED,
+                                  DIRREQ_CIRC_QUEUE_FLUSHED);
+
+      /* Now send the cell. It is very unlikely that this fails but just in
+       * case, get rid of the channel. */
+      if (channel_write_packed_cell(chan, cell) < 0) {
+        /* The cell has been freed at this point. */
+        channel_mark_for_close(chan);
+        write_failed = 1;
+        break;
       }
-    }
+      cell = NULL;
 
-    /* If we just flushed our queue and this circuit is used for a
-     * tunneled directory request, possibly advance its state. */
-    if (queue->n == 0 && chan->dirreq_id)
-      geoip_change_dirreq_state(chan->dirreq_id,
-                                DIRREQ_TUNNELED,
-                                DIRREQ_CIRC_QUEUE_FLUSHED);
-
-    /* Now send the cell. It is very unlikely that this fails but just in
-     * case, get rid of the channel. */
-    if (channel_write_packed_cell(chan, cell) < 0) {
-      /* The cell has been freed at this point. */
-      channel_mark_for_close(chan);
-      continue;
-    }
-    cell = NULL;
+      /*
+       * Don't packed_cell_free_unchecked(cell) here because the channel will
+       * do so when it gets out of the channel queue (probably already did, in
+       * which case that was an immediate double-free bug).
+       */
 
-    /*
-     * Don't packed_cell_free_unchecked(cell) here because the channel will
-     * do so when it gets out of the channel queue (probably already did, in
-     * which case that was an immediate double-free bug).
-     */
+      ++n_sent;
+      if (verdict > aqm_verdict)
+        aqm_verdict = verdict;
+      /* We're about to throw the rest of the queue away. */
+      if (PREDICT_UNLIKELY(aqm_verdict == CELL_QUEUE_AQM_RUNAWAY))
+        break;
+    }
 
     /* Update the counter */
-    ++n_flushed;
+    n_flushed += n_sent;
 
     /*
-     * Now update the cmux; tell it we've just sent a cell, and how many
-     * we have left.
+     * Now update the cmux; tell it how many cells we've just sent, and how
+     * many we have left.
      */
-    circuitmux_notify_xmit_cells(cmux, circ, 1);
+    if (n_sent)
+      circuitmux_notify_xmit_cells(cmux, circ, n_sent);
     circuitmux_set_num_cells(cmux, circ, queue->n);
     if (queue->n == 0)
       log_debug(LD_GENERAL, "Made a circuit inactive.");
 
-    /* Is the cell queue low enough to unblock all the streams that are waiting
-     * to write to this circuit? */
-    if (streams_blocked && queue->n <= CELL_QUEUE_LOWWATER_SIZE)
+    if (PREDICT_UNLIKELY(write_failed)) {
+      write_failed = 0;
+      continue;
+    }
+
+    if (PREDICT_UNLIKELY(aqm_verdict == CELL_QUEUE_AQM_RUNAWAY)) {
+      log_info(LD_CIRC, "Cells on a circuit have waited over %u msec for "
+               "%u sec. Closing it.", circ_aqm_target_msec,
+               circ_aqm_kill_msec / 1000);
+      ++stats_n_circ_aqm_closed;
+      circuit_clear_cell_queue(circ, chan);
+      if (! circ->marked_for_close)
+        circuit_mark_for_close(circ, END_CIRC_REASON_RESOURCELIMIT);
+      continue;
+    }
+
+    /* Have cells been waiting so long that the edges should stop reading
+     * for a while, even though the queue isn't long? */
+    if (PREDICT_UNLIKELY(aqm_verdict == CELL_QUEUE_AQM_CONGESTED) &&
+        !streams_blocked) {
+      ++stats_n_circ_aqm_congested;
+      set_streams_blocked_on_circ(circ, chan, 1, 0); /* block streams */
+      streams_blocked = 1;
+    }
+
+    /* Is the cell queue low enough, and draining promptly enough, to unblock
+     * all the streams that are waiting to write to this circuit? */
+    if (streams_blocked && queue->n <= CELL_QUEUE_LOWWATER_SIZE &&
+        !queue->aqm_congested)
       set_streams_blocked_on_circ(circ, chan, 0, 0); /* unblock streams */
 
     /* If n_flushed < max still, loop around and pick another circuit */
@@ -2995,6 +3133,118 @@ relay_consensus_has_changed(const networkstatus_t *ns)
                             RELAY_CIRC_CELL_QUEUE_SIZE_DEFAULT,
                             RELAY_CIRC_CELL_QUEUE_SIZE_MIN,
                             RELAY_CIRC_CELL_QUEUE_SIZE_MAX);
+
+  /* Update the flush batch size from the consensus. */
+  circ_flush_batch =
+    networkstatus_get_param(ns, "circ_flush_batch",
+                            CIRC_FLUSH_BATCH_DEFAULT,
+                            CIRC_FLUSH_BATCH_MIN,
+                            CIRC_FLUSH_BATCH_MAX);
+
+  /* Update the circuit queue AQM parameters from the consensus. */
+  circ_aqm_target_msec =
+    networkstatus_get_param(ns, "circ_aqm_target_ms",
+                            CIRC_AQM_TARGET_MSEC_DEFAULT,
+                            CIRC_AQM_TARGET_MSEC_MIN,
+                            CIRC_AQM_TARGET_MSEC_MAX);
+  circ_aqm_interval_msec =
+    networkstatus_get_param(ns, "circ_aqm_interval_ms",
+                            CIRC_AQM_INTERVAL_MSEC_DEFAULT,
+                            CIRC_AQM_INTERVAL_MSEC_MIN,
+                            CIRC_AQM_INTERVAL_MSEC_MAX);
+  circ_aqm_kill_msec = 1000 *
+    networkstatus_get_param(ns, "circ_aqm_kill_sec",
+                            CIRC_AQM_KILL_SEC_DEFAULT,
+                            CIRC_AQM_KILL_SEC_MIN,
+                            CIRC_AQM_KILL_SEC_MAX);
+}
+
+/** How many nested batches of inbound cells we are processing. */
+static int cell_batch_depth = 0;
+/** The circuits whose cell queues have grown during the current batch of
+ * inbound cells, and whose cmux we haven't updated yet. */
+static smartlist_t *cell_batch_circuits = NULL;
+
+/** Start processing a batch of inbound cells.  Until the matching
+ * relay_cell_batch_end(), cells that we queue on circuits don't update the
+ * circuitmux or the scheduler one at a time: relay_cell_batch_end() does it
+ * once for each circuit.  Batches may nest. */
+void
+relay_cell_batch_begin(void)
+{
+  if (!cell_batch_circuits)
+    cell_batch_circuits = smartlist_new();
+  ++cell_batch_depth;
+}
+
+/** Note that we have queued cells on <b>circ</b> in <b>direction</b> during
+ * a batch of inbound cells. */
+static void
+relay_cell_batch_defer_circuit(circuit_t *circ, cell_direction_t direction)
+{
+  if (!circ->n_cmux_update_deferred && !circ->p_cmux_update_deferred)
+    smartlist_add(cell_batch_circuits, circ);
+  if (direction == CELL_DIRECTION_OUT)
+    circ->n_cmux_update_deferred = 1;
+  else
+    circ->p_cmux_update_deferred = 1;
+}
+
+/** Tell the cmux of <b>chan</b> how many cells <b>circ</b> has queued in
+ * <b>direction</b>, and the scheduler that <b>chan</b> has cells, as
+ * append_cell_to_circuit_queue() would have done for each cell. */
+static void
+relay_cell_batch_update_circuit(circuit_t *circ, channel_t *chan,
+                                cell_direction_t direction)
+{
+  /* The circuit may have lost its channel since we queued cells on it. */
+  if (!chan || !circuitmux_is_circuit_attached(chan->cmux, circ))
+    return;
+  update_circuit_on_cmux(circ, direction);
+  scheduler_channel_has_waiting_cells(chan);
+}
+
+/** Finish processing a batch of inbound cells, and tell the circuitmuxes and
+ * the scheduler about all the cells we queued during it. */
+void
+relay_cell_batch_end(void)
+{
+  if (BUG(cell_batch_depth <= 0))
+    return;
+  if (--cell_batch_depth)
+    return;
+
+  SMARTLIST_FOREACH_BEGIN(cell_batch_circuits, circuit_t *, circ) {
+    if (circ->n_cmux_update_deferred) {
+      circ->n_cmux_update_deferred = 0;
+      relay_cell_batch_update_circuit(circ, circ->n_chan,
+                                      CELL_DIRECTION_OUT);
+    }
+    if (circ->p_cmux_update_deferred) {
+      circ->p_cmux_update_deferred = 0;
+      relay_cell_batch_update_circuit(circ, TO_OR_CIRCUIT(circ)->p_chan,
+                                      CELL_DIRECTION_IN);
+    }
+  } SMARTLIST_FOREACH_END(circ);
+  smartlist_clear(cell_batch_circuits);
+}
+
+/** Release all storage held by the relay cell code. */
+void
+relay_free_all(void)
+{
+  smartlist_free(cell_batch_circuits);
+  cell_batch_depth = 0;
+}
+
+/** <b>circ</b> is about to be freed: forget about any cmux updates we were
+ * saving for it until the end of the current batch of cells. */
+void
+relay_cell_batch_forget_circuit(circuit_t *circ)
+{
+  if (cell_batch_circuits)
+    smartlist_remove(cell_batch_circuits, circ);
+  circ->n_cmux_update_deferred = circ->p_cmux_update_deferred = 0;
 }
 
 /** Add <b>cell</b> to the queue of <b>circ</b> writing to <b>chan</b>
@@ -3059,6 +3309,13 @@ append_cell_to_circuit_queue(circuit_t *circ, channel_t *chan,
     set_streams_blocked_on_circ(circ, chan, 1, fromstream);
   }
 
+  /* If we're in the middle of a batch of inbound cells, tell the cmux and
+   * the scheduler about this circuit's new cells once, at the end. */
+  if (cell_batch_depth) {
+    relay_cell_batch_defer_circuit(circ, direction);
+    return;
+  }
+
   update_circuit_on_cmux(circ, direction);
   if (queue->n == 1) {
     /* This was the first cell added to the queue.  We just made this
@@ -15,8 +15,15 @@
 extern uint64_t stats_n_relay_cells_relayed;
 extern uint64_t stats_n_relay_cells_delivered;
 extern uint64_t stats_n_circ_max_cell_reached;
+extern uint64_t stats_n_circ_aqm_congested;
+extern uint64_t stats_n_circ_aqm_closed;
 
 void relay_consensus_has_changed(const networkstatus_t *ns);
+int relay_get_circ_flush_batch(void);
+void relay_cell_batch_begin(void);
+void relay_cell_batch_end(void);
+void relay_cell_batch_forget_circuit(circuit_t *circ);
+void relay_free_all(void);
 int circuit_receive_relay_cell(cell_t *cell, circuit_t *circ,
                                cell_direction_t cell_direction);
 size_t cell_queues_get_total_allocation(void);
@@ -114,6 +121,17 @@ STATIC packed_cell_t *packed_cell_new(void);
 STATIC packed_cell_t *cell_queue_pop(cell_queue_t *queue);
 STATIC destroy_cell_t *destroy_cell_queue_pop(destroy_cell_queue_t *queue);
 STATIC int cell_queues_check_size(void);
+/* Possible results of cell_queue_aqm_note_sojourn(). */
+/** Cells are leaving the queue promptly enough. */
+#define CELL_QUEUE_AQM_OK 0
+/** Cells have waited too long for a whole interval: push back on the
+ * edges. */
+#define CELL_QUEUE_AQM_CONGESTED 1
+/** Cells have waited too long for so long that we should give up on the
+ * circuit. */
+#define CELL_QUEUE_AQM_RUNAWAY 2
+STATIC int cell_queue_aqm_note_sojourn(cell_queue_t *queue, uint32_t now_ts,
+                                       uint32_t msec_waiting);
 STATIC int connection_edge_process_relay_cell(cell_t *cell, circuit_t *circ,
                                    edge_connection_t *conn,
                                    crypt_path_t *layer_hint);
@@ -120,6 +120,7 @@ void scheduler_free_all(void);
 void scheduler_conf_changed(void);
 void scheduler_notify_networkstatus_changed(void);
 MOCK_DECL(void, scheduler_release_channel, (channel_t *chan));
+void scheduler_kist_log_heartbeat(void);
 
 /*
  * Ways for a channel to interact with the scheduling system. A channel only
@@ -180,11 +181,20 @@ typedef struct socket_table_ent_s {
   uint64_t written;
   /* Amount that can be written this scheduling run */
   uint64_t limit;
+  /* Amount written in the previous scheduling run */
+  uint64_t last_written;
   /* TCP info from the kernel */
   uint32_t cwnd;
   uint32_t unacked;
   uint32_t mss;
   uint32_t notsent;
+  /* Number of the scheduling run in which we last asked the kernel for this
+   * socket's TCP info, and in which we last used it. */
+  uint64_t sampled_run;
+  uint64_t last_run;
+  /* Inode number of the socket, used to find it in a netlink dump. 0 if we
+   * don't know it yet. */
+  uint64_t inode;
 } socket_table_ent_t;
 
 typedef HT_HEAD(outbuf_table_s, outbuf_table_ent_s) outbuf_table_t;
@@ -202,8 +212,31 @@ int kist_scheduler_run_interval(void);
 
 #ifdef TOR_UNIT_TESTS
 extern int32_t sched_run_interval;
+extern uint64_t kist_netlink_dump_n_sockets;
+extern uint64_t kist_netlink_dump_run;
+STATIC int kist_netlink_dump_is_cheaper(int n_sockets);
 #endif /* TOR_UNIT_TESTS */
 
+/*********************************
+ * Defined in scheduler_kist_netlink.c
+ *********************************/
+
+/* TCP info for one socket, as reported by a netlink dump. */
+typedef struct kist_tcp_info_t {
+  uint64_t inode;
+  uint32_t cwnd;
+  uint32_t unacked;
+  uint32_t mss;
+  uint32_t notsent;
+} kist_tcp_info_t;
+
+/* Called by kist_netlink_dump() for every established TCP socket. */
+typedef void (*kist_netlink_cb_t)(const kist_tcp_info_t *info, void *arg);
+
+tor_socket_t kist_netlink_open(void);
+int kist_netlink_dump(tor_socket_t nl_sock, kist_netlink_cb_t cb, void *arg,
+                      uint64_t *n_syscalls);
+
 #endif /* defined(SCHEDULER_KIST_PRIVATE) */
 
 /*********************************
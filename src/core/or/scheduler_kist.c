@@ -11,6 +11,7 @@
 #define TOR_CHANNEL_INTERNAL_
 #include "core/or/channel.h"
 #include "core/or/channeltls.h"
+#include "core/or/relay.h"
 #define SCHEDULER_PRIVATE_
 #include "core/or/scheduler.h"
 #include "lib/math/fp.h"
@@ -20,6 +21,9 @@
 #ifdef HAVE_SYS_IOCTL_H
 #include <sys/ioctl.h>
 #endif
+#ifdef HAVE_SYS_STAT_H
+#include <sys/stat.h>
+#endif
 
 #ifdef HAVE_KIST_SUPPORT
 /* Kernel interface needed for KIST. */
@@ -108,6 +112,45 @@ static unsigned int kist_no_kernel_support = 0;
 static unsigned int kist_lite_mode = 1;
 #endif /* defined(HAVE_KIST_SUPPORT) */
 
+/* Number of scheduling runs so far. Socket table entries use this to tell
+ * how old their TCP info is. */
+static uint64_t kist_run_count = 0;
+
+/* We reuse a socket's TCP info from an earlier run, rather than asking the
+ * kernel again, only if that info is at most this many runs old... */
+#define KIST_SOCKET_INFO_MAX_AGE 4
+/* ...and only if the socket used no more than 1/KIST_SOCKET_INFO_REUSE_SHARE
+ * of its limit in the previous run. */
+#define KIST_SOCKET_INFO_REUSE_SHARE 4
+
+/* A netlink sock_diag dump returns roughly this many sockets per system
+ * call. We use it to guess whether a dump is cheaper than asking about each
+ * socket on its own. */
+#define KIST_NETLINK_SOCKETS_PER_SYSCALL 100
+/* Never bother with a netlink dump for fewer sockets than this. */
+#define KIST_NETLINK_MIN_SOCKETS 16
+/* How many scheduling runs we trust the size of the last netlink dump for.
+ * After that, we try a dump again even if the last one was big, in case the
+ * host has closed some connections since. */
+#define KIST_NETLINK_DUMP_SIZE_MAX_AGE 1000
+/* Netlink socket for sock_diag dumps, if we have opened one. */
+static tor_socket_t kist_netlink_sock = TOR_INVALID_SOCKET;
+/* Set if sock_diag dumps failed, so that we stop trying them. */
+static unsigned int kist_netlink_disabled = 0;
+/* How many sockets, ours or not, the last netlink dump reported, and the
+ * scheduling run in which we did it. */
+STATIC uint64_t kist_netlink_dump_n_sockets = 0;
+STATIC uint64_t kist_netlink_dump_run = 0;
+
+/* Statistics for the heartbeat: scheduling runs, sockets whose TCP info we
+ * asked the kernel for, sockets whose earlier TCP info we reused, netlink
+ * dumps, and the system calls all of that took. */
+static uint64_t kist_stats_n_runs = 0;
+static uint64_t kist_stats_n_sampled = 0;
+static uint64_t kist_stats_n_reused = 0;
+static uint64_t kist_stats_n_dumps = 0;
+static uint64_t kist_stats_n_syscalls = 0;
+
 /*****************************************************************************
  * Internally called function implementations
  *****************************************************************************/
@@ -163,6 +206,10 @@ free_all_socket_info(void)
 {
   HT_FOREACH_FN(socket_table_s, &socket_table, free_socket_info_by_ent, NULL);
   HT_CLEAR(socket_table_s, &socket_table);
+  if (SOCKET_OK(kist_netlink_sock)) {
+    tor_close_socket(kist_netlink_sock);
+    kist_netlink_sock = TOR_INVALID_SOCKET;
+  }
 }
 
 static socket_table_ent_t *
@@ -188,13 +235,14 @@ free_socket_info_by_chan(socket_table_t *table, const channel_t *chan)
   free_socket_info_by_ent(ent, NULL);
 }
 
+static void socket_info_set_limit(socket_table_ent_t *ent);
+
 /* Perform system calls for the given socket in order to calculate kist's
  * per-socket limit as documented in the function body. */
 MOCK_IMPL(void,
 update_socket_info_impl, (socket_table_ent_t *ent))
 {
 #ifdef HAVE_KIST_SUPPORT
-  int64_t tcp_space, extra_space;
   tor_assert(ent);
   tor_assert(ent->chan);
   const tor_socket_t sock =
@@ -207,6 +255,7 @@ update_socket_info_impl, (socket_table_ent_t *ent))
   }
 
   /* Gather information */
+  ++kist_stats_n_syscalls;
   if (getsockopt(sock, SOL_TCP, TCP_INFO, (void *)&(tcp), &tcp_info_len) < 0) {
     if (errno == EINVAL) {
       /* Oops, this option is not provided by the kernel, we'll have to
@@ -221,6 +270,7 @@ update_socket_info_impl, (socket_table_ent_t *ent))
     }
     goto fallback;
   }
+  ++kist_stats_n_syscalls;
   if (ioctl(sock, SIOCOUTQNSD, &(ent->notsent)) < 0) {
     if (errno == EINVAL) {
       log_notice(LD_SCHED, "Looks like our kernel doesn't have the support "
@@ -235,6 +285,35 @@ update_socket_info_impl, (socket_table_ent_t *ent))
   ent->cwnd = tcp.tcpi_snd_cwnd;
   ent->unacked = tcp.tcpi_unacked;
   ent->mss = tcp.tcpi_snd_mss;
+  socket_info_set_limit(ent);
+  return;
+
+#else /* !(defined(HAVE_KIST_SUPPORT)) */
+  goto fallback;
+#endif /* defined(HAVE_KIST_SUPPORT) */
+
+ fallback:
+  /* If all of a sudden we don't have kist support, we just zero out all the
+   * variables for this socket since we don't know what they should be. We
+   * also allow the socket to write as much as it can from the estimated
+   * number of cells the lower layer can accept, effectively returning it to
+   * Vanilla scheduler behavior. */
+  ent->cwnd = ent->unacked = ent->mss = ent->notsent = 0;
+  /* This function calls the specialized channel object (currently channeltls)
+   * and ask how many cells it can write on the outbuf which we then multiply
+   * by the size of the cells for this channel. The cast is because this
+   * function requires a non-const channel object, meh. */
+  ent->limit = channel_num_cells_writeable((channel_t *) ent->chan) *
+               (get_cell_network_size(ent->chan->wide_circ_ids) +
+                TLS_PER_CELL_OVERHEAD);
+}
+
+/* Given the TCP info from the kernel in <b>ent</b>, calculate kist's
+ * per-socket limit as documented in the function body. */
+static void
+socket_info_set_limit(socket_table_ent_t *ent)
+{
+  int64_t tcp_space, extra_space;
 
   /* In order to reduce outbound kernel queuing delays and thus improve Tor's
    * ability to prioritize circuits, KIST wants to set a socket write limit
@@ -296,26 +375,6 @@ update_socket_info_impl, (socket_table_ent_t *ent))
      * And we know this will always be positive, since we checked above. */
     ent->limit = (uint64_t)tcp_space + (uint64_t)extra_space;
   }
-  return;
-
-#else /* !(defined(HAVE_KIST_SUPPORT)) */
-  goto fallback;
-#endif /* defined(HAVE_KIST_SUPPORT) */
-
- fallback:
-  /* If all of a sudden we don't have kist support, we just zero out all the
-   * variables for this socket since we don't know what they should be. We
-   * also allow the socket to write as much as it can from the estimated
-   * number of cells the lower layer can accept, effectively returning it to
-   * Vanilla scheduler behavior. */
-  ent->cwnd = ent->unacked = ent->mss = ent->notsent = 0;
-  /* This function calls the specialized channel object (currently channeltls)
-   * and ask how many cells it can write on the outbuf which we then multiply
-   * by the size of the cells for this channel. The cast is because this
-   * function requires a non-const channel object, meh. */
-  ent->limit = channel_num_cells_writeable((channel_t *) ent->chan) *
-               (get_cell_network_size(ent->chan->wide_circ_ids) +
-                TLS_PER_CELL_OVERHEAD);
 }
 
 /* Given a socket that isn't in the table, add it.
@@ -334,6 +393,7 @@ init_socket_info(socket_table_t *table, const channel_t *chan)
     ent->chan = chan;
     HT_INSERT(socket_table_s, table, ent);
   }
+  ent->last_written = ent->written;
   ent->written = 0;
 }
 
@@ -379,9 +439,10 @@ set_scheduler_run_interval(void)
   }
 }
 
-/* Return true iff the channel hasn't hit its kist-imposed write limit yet */
-static int
-socket_can_write(socket_table_t *table, const channel_t *chan)
+/* Return how many more cells the channel may write before it hits its
+ * kist-imposed write limit. */
+static int64_t
+socket_cells_can_write(socket_table_t *table, const channel_t *chan)
 {
   socket_table_ent_t *ent = NULL;
   ent = socket_table_search(table, chan);
@@ -391,12 +452,37 @@ socket_can_write(socket_table_t *table, const channel_t *chan)
 
   /* We previously calculated a write limit for this socket. In the below
    * calculation, first determine how much room is left in bytes. Then divide
-   * that by the amount of space a cell takes. If there's room for at least 1
-   * cell, then KIST will allow the socket to write. */
+   * that by the amount of space a cell takes. */
   int64_t kist_limit_space =
     (int64_t) (ent->limit - ent->written) /
     (CELL_MAX_NETWORK_SIZE + TLS_PER_CELL_OVERHEAD);
-  return kist_limit_space > 0;
+  return MAX(kist_limit_space, 0);
+}
+
+/* Return true iff the channel hasn't hit its kist-imposed write limit yet:
+ * that is, if there's room for at least 1 cell. */
+static int
+socket_can_write(socket_table_t *table, const channel_t *chan)
+{
+  return socket_cells_can_write(table, chan) > 0;
+}
+
+/* Return true iff the TCP info in <b>ent</b> is recent enough, and the
+ * socket was far enough from its limit in the previous run, that we can keep
+ * using that info for this run instead of asking the kernel again. */
+static int
+socket_info_can_be_reused(const socket_table_ent_t *ent)
+{
+  /* We have no TCP info at all: either we never asked, or we fell back to
+   * the naive limit, which is cheap to recompute anyway. */
+  if (ent->cwnd == 0 || ent->mss == 0)
+    return 0;
+  /* The info is too old, or last_written doesn't describe the previous
+   * run. */
+  if (kist_run_count - ent->sampled_run > KIST_SOCKET_INFO_MAX_AGE ||
+      ent->last_run + 1 != kist_run_count)
+    return 0;
+  return ent->last_written <= ent->limit / KIST_SOCKET_INFO_REUSE_SHARE;
 }
 
 /* Update the channel's socket kernel information. */
@@ -408,7 +494,20 @@ update_socket_info(socket_table_t *table, const channel_t *chan)
   if (SCHED_BUG(!ent, chan)) {
     return; // Whelp. Entry didn't exist for some reason so nothing to do.
   }
-  update_socket_info_impl(ent);
+  if (ent->sampled_run == kist_run_count) {
+    /* We already got fresh info from a netlink dump during this run. */
+  } else if (socket_info_can_be_reused(ent)) {
+    /* Whatever we wrote last run is now in the kernel, so count it against
+     * the old limit. Some of it has probably been sent and acknowledged
+     * since, so this errs on the side of writing too little. */
+    ent->limit -= ent->last_written;
+    ++kist_stats_n_reused;
+  } else {
+    update_socket_info_impl(ent);
+    ent->sampled_run = kist_run_count;
+    ++kist_stats_n_sampled;
+  }
+  ent->last_run = kist_run_count;
   log_debug(LD_SCHED, "chan=%" PRIu64 " updated socket info, limit: %" PRIu64
                       ", cwnd: %" PRIu32 ", unacked: %" PRIu32
                       ", notsent: %" PRIu32 ", mss: %" PRIu32,
@@ -416,6 +515,142 @@ update_socket_info(socket_table_t *table, const channel_t *chan)
             ent->notsent, ent->mss);
 }
 
+/* Helper for update_socket_info_by_netlink(): compare an inode number to
+ * the inode of a socket table entry. */
+static int
+socket_table_ent_inode_cmp(const void *key, const void **member)
+{
+  const uint64_t inode = *(const uint64_t *) key;
+  const socket_table_ent_t *ent = *member;
+  if (inode < ent->inode)
+    return -1;
+  else if (inode > ent->inode)
+    return 1;
+  else
+    return 0;
+}
+
+/* Helper for update_socket_info_by_netlink(): sort socket table entries by
+ * inode. */
+static int
+socket_table_ent_sort_by_inode(const void **a_, const void **b_)
+{
+  const socket_table_ent_t *a = *a_;
+  return socket_table_ent_inode_cmp(&a->inode, b_);
+}
+
+/* Callback for kist_netlink_dump(): if the socket described by <b>info</b>
+ * belongs to one of the entries in <b>arg</b>, a sorted smartlist of socket
+ * table entries, store its TCP info in that entry. */
+static void
+socket_info_from_netlink(const kist_tcp_info_t *info, void *arg)
+{
+  smartlist_t *ents = arg;
+  socket_table_ent_t *ent =
+    smartlist_bsearch(ents, &info->inode, socket_table_ent_inode_cmp);
+  ++kist_netlink_dump_n_sockets;
+  if (!ent)
+    return;
+  ent->cwnd = info->cwnd;
+  ent->unacked = info->unacked;
+  ent->mss = info->mss;
+  ent->notsent = info->notsent;
+  socket_info_set_limit(ent);
+  ent->sampled_run = kist_run_count;
+  ++kist_stats_n_sampled;
+}
+
+/* Return true iff a netlink dump will take fewer system calls than asking
+ * about each of <b>n_sockets</b> sockets on its own.
+ *
+ * A dump covers every established TCP socket on the host, not just ours,
+ * so we estimate its cost from how many sockets the last dump reported.
+ * Until we have done one, or if it was long ago, the best we can do is to
+ * count our own. */
+STATIC int
+kist_netlink_dump_is_cheaper(int n_sockets)
+{
+  uint64_t n_dumped = (uint64_t) get_n_open_sockets();
+  if (kist_netlink_dump_n_sockets &&
+      kist_run_count - kist_netlink_dump_run <=
+        KIST_NETLINK_DUMP_SIZE_MAX_AGE) {
+    n_dumped = MAX(n_dumped, kist_netlink_dump_n_sockets);
+  }
+  const uint64_t dump_cost = n_dumped / KIST_NETLINK_SOCKETS_PER_SYSCALL + 2;
+  return n_sockets >= KIST_NETLINK_MIN_SOCKETS &&
+    (uint64_t) n_sockets * 2 > dump_cost;
+}
+
+/* For the channels in <b>pending</b>, if enough of them need fresh TCP info
+ * from the kernel, get it for all of them with one netlink dump rather than
+ * with several system calls per socket. Channels that we don't find in the
+ * dump are left for update_socket_info() to handle. */
+static void
+update_socket_info_by_netlink(socket_table_t *table,
+                              const smartlist_t *pending)
+{
+#ifdef HAVE_KIST_SUPPORT
+  if (kist_netlink_disabled || kist_no_kernel_support || kist_lite_mode)
+    return;
+
+  smartlist_t *ents = smartlist_new();
+  SMARTLIST_FOREACH_BEGIN(pending, const channel_t *, chan) {
+    socket_table_ent_t *ent = socket_table_search(table, chan);
+    if (ent && BASE_CHAN_TO_TLS((channel_t *) chan)->conn &&
+        !socket_info_can_be_reused(ent))
+      smartlist_add(ents, ent);
+  } SMARTLIST_FOREACH_END(chan);
+
+  if (!kist_netlink_dump_is_cheaper(smartlist_len(ents)))
+    goto done;
+
+  if (!SOCKET_OK(kist_netlink_sock)) {
+    kist_netlink_sock = kist_netlink_open();
+    if (!SOCKET_OK(kist_netlink_sock)) {
+      log_info(LD_SCHED, "Couldn't open a sock_diag netlink socket. KIST "
+               "will ask about each socket separately.");
+      kist_netlink_disabled = 1;
+      goto done;
+    }
+  }
+
+  /* We match sockets in the dump to ours by inode number, which we only
+   * need to look up once per socket. */
+  SMARTLIST_FOREACH_BEGIN(ents, socket_table_ent_t *, ent) {
+    if (ent->inode == 0) {
+      struct stat st;
+      const tor_socket_t sock =
+        TO_CONN(BASE_CHAN_TO_TLS((channel_t *) ent->chan)->conn)->s;
+      ++kist_stats_n_syscalls;
+      if (fstat(sock, &st) == 0)
+        ent->inode = (uint64_t) st.st_ino;
+    }
+    if (ent->inode == 0)
+      SMARTLIST_DEL_CURRENT(ents, ent);
+  } SMARTLIST_FOREACH_END(ent);
+  smartlist_sort(ents, socket_table_ent_sort_by_inode);
+
+  ++kist_stats_n_dumps;
+  kist_netlink_dump_n_sockets = 0;
+  kist_netlink_dump_run = kist_run_count;
+  if (kist_netlink_dump(kist_netlink_sock, socket_info_from_netlink, ents,
+                        &kist_stats_n_syscalls) < 0) {
+    log_notice(LD_SCHED, "KIST couldn't get socket information with a "
+               "sock_diag netlink dump. It will ask about each socket "
+               "separately instead.");
+    kist_netlink_disabled = 1;
+    tor_close_socket(kist_netlink_sock);
+    kist_netlink_sock = TOR_INVALID_SOCKET;
+  }
+
+ done:
+  smartlist_free(ents);
+#else /* !(defined(HAVE_KIST_SUPPORT)) */
+  (void) table;
+  (void) pending;
+#endif /* defined(HAVE_KIST_SUPPORT) */
+}
+
 /* Increment the channel's socket written value by the number of bytes. */
 static void
 update_socket_written(socket_table_t *table, channel_t *chan, size_t bytes)
@@ -564,6 +799,40 @@ kist_scheduler_schedule(void)
   }
 }
 
+/* Take <b>chan</b> out of the pending heap <b>cp</b> if it is still in it.
+ * While we flush a channel it stays in the heap, where something else may
+ * already have removed it, such as the channel being closed. */
+static void
+kist_pending_remove(smartlist_t *cp, channel_t *chan)
+{
+  if (chan->sched_heap_idx != -1) {
+    smartlist_pqueue_remove(cp, scheduler_compare_channels,
+                            offsetof(channel_t, sched_heap_idx), chan);
+  }
+}
+
+/* Remove every NULL from the pending heap <b>cp</b>, and rebuild it from
+ * the channels that are left. We can't use the heap operations to take out
+ * a NULL, since they keep each item's heap index up to date. */
+static void
+kist_pending_drop_nulls(smartlist_t *cp)
+{
+  smartlist_t *chans = smartlist_new();
+
+  SMARTLIST_FOREACH_BEGIN(cp, channel_t *, pchan) {
+    if (pchan) {
+      pchan->sched_heap_idx = -1;
+      smartlist_add(chans, pchan);
+    }
+  } SMARTLIST_FOREACH_END(pchan);
+  smartlist_clear(cp);
+  SMARTLIST_FOREACH(chans, channel_t *, pchan,
+                    smartlist_pqueue_add(cp, scheduler_compare_channels,
+                                         offsetof(channel_t, sched_heap_idx),
+                                         pchan));
+  smartlist_free(chans);
+}
+
 /* Function of the scheduler interface: run() */
 static void
 kist_scheduler_run(void)
@@ -579,24 +848,38 @@ kist_scheduler_run(void)
 
   outbuf_table_t outbuf_table = HT_INITIALIZER();
 
+  ++kist_run_count;
+  ++kist_stats_n_runs;
+
+  /* The socket info lookups below can't cope with a NULL in the heap. */
+  if (SCHED_BUG(smartlist_contains(cp, NULL), NULL))
+    kist_pending_drop_nulls(cp);
+
   /* For each pending channel, collect new kernel information */
-  SMARTLIST_FOREACH_BEGIN(cp, const channel_t *, pchan) {
-      init_socket_info(&socket_table, pchan);
-      update_socket_info(&socket_table, pchan);
-  } SMARTLIST_FOREACH_END(pchan);
+  SMARTLIST_FOREACH(cp, const channel_t *, pchan,
+                    init_socket_info(&socket_table, pchan));
+  update_socket_info_by_netlink(&socket_table, cp);
+  SMARTLIST_FOREACH(cp, const channel_t *, pchan,
+                    update_socket_info(&socket_table, pchan));
 
   log_debug(LD_SCHED, "Running the scheduler. %d channels pending",
             smartlist_len(cp));
 
-  /* The main scheduling loop. Loop until there are no more pending channels */
+  /* The main scheduling loop. Loop until there are no more pending channels.
+   *
+   * channels_pending is ordered by the EWMA of each channel's next circuit,
+   * so its top is the quietest circuit on any channel. We leave the channel
+   * we're serving at the top while we flush it: usually it still has cells
+   * afterwards and we only need to fix up its position in the heap, rather
+   * than popping it and pushing it back for every cell. */
   while (smartlist_len(cp) > 0) {
     /* get best channel */
-    chan = smartlist_pqueue_pop(cp, scheduler_compare_channels,
-                                offsetof(channel_t, sched_heap_idx));
+    chan = smartlist_get(cp, 0);
     if (SCHED_BUG(!chan, NULL)) {
       /* Some-freaking-how a NULL got into the channels_pending. That should
        * never happen, but it should be harmless to ignore it and keep looping.
        */
+      kist_pending_drop_nulls(cp);
       continue;
     }
     outbuf_table_add(&outbuf_table, chan);
@@ -616,8 +899,11 @@ kist_scheduler_run(void)
 
     /* Only flush and write if the per-socket limit hasn't been hit */
     if (socket_can_write(&socket_table, chan)) {
-      /* flush to channel queue/outbuf */
-      flush_result = (int)channel_flush_some_cells(chan, 1); // 1 for num cells
+      /* flush to channel queue/outbuf: as many cells as the relay code sends
+       * from one circuit at a time, if the socket has room for them. */
+      int64_t n_cells = MIN(socket_cells_can_write(&socket_table, chan),
+                            relay_get_circ_flush_batch());
+      flush_result = (int)channel_flush_some_cells(chan, n_cells);
       /* XXX: While flushing cells, it is possible that the connection write
        * fails leading to the channel to be closed which triggers a release
        * and free its entry in the socket table. And because of a engineering
@@ -627,6 +913,7 @@ kist_scheduler_run(void)
       if (!CHANNEL_IS_OPEN(chan)) {
         /* Channel isn't open so we put it back in IDLE mode. It is either
          * renegotiating its TLS session or about to be released. */
+        kist_pending_remove(cp, chan);
         scheduler_set_channel_state(chan, SCHED_CHAN_IDLE);
         continue;
       }
@@ -648,6 +935,7 @@ kist_scheduler_run(void)
                  "stop scheduling it this round.",
                  channel_state_to_string(chan->state),
                  get_scheduler_state_string(chan->scheduler_state));
+        kist_pending_remove(cp, chan);
         scheduler_set_channel_state(chan, SCHED_CHAN_WAITING_FOR_CELLS);
         continue;
       }
@@ -655,6 +943,12 @@ kist_scheduler_run(void)
 
     /* Decide what to do with the channel now */
 
+    if (!(channel_more_to_flush(chan) &&
+          socket_can_write(&socket_table, chan))) {
+      /* Anything but case 4 takes the channel out of the pending heap. */
+      kist_pending_remove(cp, chan);
+    }
+
     if (!channel_more_to_flush(chan) &&
         !socket_can_write(&socket_table, chan)) {
 
@@ -701,7 +995,11 @@ kist_scheduler_run(void)
       /* Case 4: cells to send, and still open for writes */
 
       scheduler_set_channel_state(chan, SCHED_CHAN_PENDING);
-      if (!SCHED_BUG(chan->sched_heap_idx != -1, chan)) {
+      if (chan->sched_heap_idx != -1) {
+        /* Its next circuit has changed, and so has its key. */
+        smartlist_pqueue_update(cp, scheduler_compare_channels,
+                                offsetof(channel_t, sched_heap_idx), chan);
+      } else {
         smartlist_pqueue_add(cp, scheduler_compare_channels,
                              offsetof(channel_t, sched_heap_idx), chan);
       }
@@ -755,6 +1053,20 @@ static scheduler_t kist_scheduler = {
   .on_new_options = kist_scheduler_on_new_options,
 };
 
+/* Log how much work KIST has done asking the kernel about sockets. */
+void
+scheduler_kist_log_heartbeat(void)
+{
+  if (kist_stats_n_runs == 0)
+    return;
+  log_notice(LD_HEARTBEAT, "KIST scheduler: %" PRIu64 " runs. Asked the "
+             "kernel about %" PRIu64 " sockets and reused earlier "
+             "information for %" PRIu64 ", using %" PRIu64 " system calls "
+             "(%" PRIu64 " netlink dumps).",
+             kist_stats_n_runs, kist_stats_n_sampled, kist_stats_n_reused,
+             kist_stats_n_syscalls, kist_stats_n_dumps);
+}
+
 /* Return the KIST scheduler object. If it didn't exists, return a newly
  * allocated one but init() is not called. */
 scheduler_t *
@@ -0,0 +1,193 @@
+/* Copyright (c) 2018, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * \file scheduler_kist_netlink.c
+ * \brief Ask the kernel about many TCP sockets at once, for KIST.
+ *
+ * Ordinarily, KIST makes a getsockopt() and an ioctl() call for every
+ * channel it is about to schedule, on every scheduling run.  On a busy relay
+ * that is a great many system calls.  Instead, we can ask the kernel for the
+ * TCP state of every established socket with a single sock_diag netlink
+ * dump, which takes one system call per few hundred sockets.
+ *
+ * This code lives in its own file because it needs the kernel's own
+ * definition of struct tcp_info from linux/tcp.h, which can't be included
+ * alongside the netinet/tcp.h that scheduler_kist.c uses.
+ **/
+
+#define SCHEDULER_KIST_PRIVATE
+#define SCHEDULER_PRIVATE_
+#include "core/or/or.h"
+#include "core/or/scheduler.h"
+#include "lib/net/socket.h"
+
+#ifdef HAVE_KIST_NETLINK_SUPPORT
+
+#include <sys/socket.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+#include <linux/sock_diag.h>
+#include <linux/inet_diag.h>
+#include <linux/tcp.h>
+
+/* The kernel's TCP_ESTABLISHED state, which the uapi headers don't name. */
+#define KIST_TCP_ESTABLISHED 1
+
+/* Open and return a netlink socket for sock_diag requests, or
+ * TOR_INVALID_SOCKET on failure. */
+tor_socket_t
+kist_netlink_open(void)
+{
+  return tor_open_socket_with_extensions(AF_NETLINK, SOCK_RAW,
+                                         NETLINK_SOCK_DIAG, 1, 0);
+}
+
+/* Handle one sock_diag reply message <b>msg</b> of <b>len</b> bytes: if it
+ * carries TCP info, pass it to <b>cb</b>. Return 0 on success, -1 if the
+ * kernel's struct tcp_info is too old to tell us what we need. */
+static int
+kist_netlink_handle_msg(const struct inet_diag_msg *msg, int len,
+                        kist_netlink_cb_t cb, void *arg)
+{
+  const struct rtattr *attr = (const struct rtattr *) (msg + 1);
+  int attr_len = len - (int) NLMSG_ALIGN(sizeof(*msg));
+
+  for (; RTA_OK(attr, attr_len); attr = RTA_NEXT(attr, attr_len)) {
+    if (attr->rta_type != INET_DIAG_INFO)
+      continue;
+
+    struct tcp_info tcp;
+    const size_t tcp_len = RTA_PAYLOAD(attr);
+    if (tcp_len < offsetof(struct tcp_info, tcpi_notsent_bytes) +
+                  sizeof(tcp.tcpi_notsent_bytes)) {
+      return -1;
+    }
+    memset(&tcp, 0, sizeof(tcp));
+    memcpy(&tcp, RTA_DATA(attr), MIN(tcp_len, sizeof(tcp)));
+
+    kist_tcp_info_t info;
+    info.inode = msg->idiag_inode;
+    info.cwnd = tcp.tcpi_snd_cwnd;
+    info.unacked = tcp.tcpi_unacked;
+    info.mss = tcp.tcpi_snd_mss;
+    info.notsent = tcp.tcpi_notsent_bytes;
+    cb(&info, arg);
+  }
+  return 0;
+}
+
+/* Dump the established TCP sockets of one address <b>family</b> over
+ * <b>nl_sock</b>, calling <b>cb</b> for each. Return 0 on success, -1 on
+ * failure. */
+static int
+kist_netlink_dump_family(tor_socket_t nl_sock, int family, uint32_t seq,
+                         kist_netlink_cb_t cb, void *arg,
+                         uint64_t *n_syscalls)
+{
+  struct {
+    struct nlmsghdr nlh;
+    struct inet_diag_req_v2 req;
+  } request;
+  struct sockaddr_nl kernel;
+  /* Big enough for a couple of hundred sockets per recv(). */
+  uint32_t buf[8192];
+
+  memset(&request, 0, sizeof(request));
+  request.nlh.nlmsg_len = sizeof(request);
+  request.nlh.nlmsg_type = SOCK_DIAG_BY_FAMILY;
+  request.nlh.nlmsg_flags = NLM_F_REQUEST | NLM_F_DUMP;
+  request.nlh.nlmsg_seq = seq;
+  request.req.sdiag_family = family;
+  request.req.sdiag_protocol = IPPROTO_TCP;
+  request.req.idiag_states = 1u << KIST_TCP_ESTABLISHED;
+  request.req.idiag_ext = 1u << (INET_DIAG_INFO - 1);
+
+  memset(&kernel, 0, sizeof(kernel));
+  kernel.nl_family = AF_NETLINK;
+
+  ++*n_syscalls;
+  if (sendto(nl_sock, &request, sizeof(request), 0,
+             (struct sockaddr *) &kernel, sizeof(kernel)) < 0) {
+    log_info(LD_SCHED, "Couldn't send sock_diag request: %s",
+             strerror(errno));
+    return -1;
+  }
+
+  while (1) {
+    ++*n_syscalls;
+    ssize_t n = recv(nl_sock, buf, sizeof(buf), 0);
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      log_info(LD_SCHED, "Couldn't read sock_diag reply: %s",
+               strerror(errno));
+      return -1;
+    }
+    if (n == 0)
+      return -1;
+
+    int len = (int) n;
+    const struct nlmsghdr *nlh;
+    for (nlh = (const struct nlmsghdr *) buf; NLMSG_OK(nlh, len);
+         nlh = NLMSG_NEXT(nlh, len)) {
+      if (nlh->nlmsg_seq != seq)
+        continue;
+      if (nlh->nlmsg_type == NLMSG_DONE)
+        return 0;
+      if (nlh->nlmsg_type == NLMSG_ERROR) {
+        log_info(LD_SCHED, "The kernel refused our sock_diag request.");
+        return -1;
+      }
+      if (nlh->nlmsg_type != SOCK_DIAG_BY_FAMILY)
+        continue;
+      if (kist_netlink_handle_msg(NLMSG_DATA(nlh),
+                                  (int) NLMSG_PAYLOAD(nlh, 0),
+                                  cb, arg) < 0) {
+        log_info(LD_SCHED, "The kernel's sock_diag replies don't say how "
+                 "much data is unsent.");
+        return -1;
+      }
+    }
+  }
+}
+
+/* Ask the kernel over <b>nl_sock</b> about every established TCP socket,
+ * and call <b>cb</b> with <b>arg</b> for each one.  Add the number of system
+ * calls we made to *<b>n_syscalls</b>.  Return 0 on success, -1 on
+ * failure. */
+int
+kist_netlink_dump(tor_socket_t nl_sock, kist_netlink_cb_t cb, void *arg,
+                  uint64_t *n_syscalls)
+{
+  static uint32_t seq = 0;
+
+  if (kist_netlink_dump_family(nl_sock, AF_INET, ++seq,
+                               cb, arg, n_syscalls) < 0)
+    return -1;
+  if (kist_netlink_dump_family(nl_sock, AF_INET6, ++seq,
+                               cb, arg, n_syscalls) < 0)
+    return -1;
+  return 0;
+}
+
+#else /* !(defined(HAVE_KIST_NETLINK_SUPPORT)) */
+
+tor_socket_t
+kist_netlink_open(void)
+{
+  return TOR_INVALID_SOCKET;
+}
+
+int
+kist_netlink_dump(tor_socket_t nl_sock, kist_netlink_cb_t cb, void *arg,
+                  uint64_t *n_syscalls)
+{
+  (void) nl_sock;
+  (void) cb;
+  (void) arg;
+  (void) n_syscalls;
+  return -1;
+}
+
+#endif /* defined(HAVE_KIST_NETLINK_SUPPORT) */
@@ -27,9 +27,12 @@
 #include "feature/stats/rephist.h"
 #include "feature/hibernate/hibernate.h"
 #include "app/config/statefile.h"
+#include "feature/hs/hs_cache.h"
 #include "feature/hs/hs_stats.h"
 #include "feature/hs/hs_service.h"
 #include "core/or/dos.h"
+#include "core/or/scheduler.h"
+#include "feature/relay/onion_queue.h"
 #include "feature/stats/geoip_stats.h"
 
 #include "app/config/or_state_st.h"
@@ -173,6 +176,9 @@ log_heartbeat(time_t now)
     rep_hist_log_circuit_handshake_stats(now);
     rep_hist_log_link_protocol_counts();
     dos_log_heartbeat();
+    scheduler_kist_log_heartbeat();
+    onion_queue_log_heartbeat();
+    hs_cache_log_heartbeat();
   }
 
   circuit_log_ancient_one_hop_circuits(1800);
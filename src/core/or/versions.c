@@ -8,6 +8,7 @@
  * \file versions.c
  * \brief Code to manipulate, parse, and compare Tor versions.
  */
+#define VERSIONS_PRIVATE
 #include "core/or/or.h"
 
 #include "core/or/protover.h"
@@ -377,6 +378,58 @@ sort_version_list(smartlist_t *versions, int remove_duplicates)
     smartlist_uniq(versions, compare_tor_version_str_ptr_, tor_free_);
 }
 
+/** Map from protocol list strings to the protover_summary_flags_t that
+ * summarizes them.  Most relays in a consensus share one of a few dozen
+ * protocol lists, so this saves us from parsing the same one over and
+ * over. */
+static strmap_t *protover_summary_map = NULL;
+
+/** If the summary map ever gets this large, something odd is going on:
+ * clear it rather than letting it grow without bound. */
+#define MAX_PROTOVER_SUMMARY_MAP_LEN 1024
+
+/** Set the protocol flags in <b>out</b> from the protocol list string
+ * <b>protocols</b>, parsing it only if we haven't seen it before. */
+STATIC void
+memoize_protover_summary(protover_summary_flags_t *out,
+                         const char *protocols)
+{
+  const protover_summary_flags_t *cached;
+
+  if (!protover_summary_map)
+    protover_summary_map = strmap_new();
+
+  cached = strmap_get(protover_summary_map, protocols);
+  if (cached) {
+    memcpy(out, cached, sizeof(*out));
+    tor_assert(out->protocols_known);
+    return;
+  }
+
+  memset(out, 0, sizeof(*out));
+  out->protocols_known = 1;
+  out->supports_extend2_cells =
+    protocol_list_supports_protocol(protocols, PRT_RELAY, 2);
+  out->supports_ed25519_link_handshake_compat =
+    protocol_list_supports_protocol(protocols, PRT_LINKAUTH, 3);
+  out->supports_ed25519_link_handshake_any =
+    protocol_list_supports_protocol_or_later(protocols, PRT_LINKAUTH, 3);
+  out->supports_ed25519_hs_intro =
+    protocol_list_supports_protocol(protocols, PRT_HSINTRO, 4);
+  out->supports_v3_hsdir =
+    protocol_list_supports_protocol(protocols, PRT_HSDIR,
+                                    PROTOVER_HSDIR_V3);
+  out->supports_v3_rendezvous_point =
+    protocol_list_supports_protocol(protocols, PRT_HSREND,
+                                    PROTOVER_HS_RENDEZVOUS_POINT_V3);
+
+  if (strmap_size(protover_summary_map) >= MAX_PROTOVER_SUMMARY_MAP_LEN) {
+    protover_summary_cache_free_all();
+    protover_summary_map = strmap_new();
+  }
+  strmap_set(protover_summary_map, protocols, tor_memdup(out, sizeof(*out)));
+}
+
 /** Summarize the protocols listed in <b>protocols</b> into <b>out</b>,
  * falling back or correcting them based on <b>version</b> as appropriate.
  */
@@ -388,21 +441,7 @@ summarize_protover_flags(protover_summary_flags_t *out,
   tor_assert(out);
   memset(out, 0, sizeof(*out));
   if (protocols) {
-    out->protocols_known = 1;
-    out->supports_extend2_cells =
-      protocol_list_supports_protocol(protocols, PRT_RELAY, 2);
-    out->supports_ed25519_link_handshake_compat =
-      protocol_list_supports_protocol(protocols, PRT_LINKAUTH, 3);
-    out->supports_ed25519_link_handshake_any =
-      protocol_list_supports_protocol_or_later(protocols, PRT_LINKAUTH, 3);
-    out->supports_ed25519_hs_intro =
-      protocol_list_supports_protocol(protocols, PRT_HSINTRO, 4);
-    out->supports_v3_hsdir =
-      protocol_list_supports_protocol(protocols, PRT_HSDIR,
-                                      PROTOVER_HSDIR_V3);
-    out->supports_v3_rendezvous_point =
-      protocol_list_supports_protocol(protocols, PRT_HSREND,
-                                      PROTOVER_HS_RENDEZVOUS_POINT_V3);
+    memoize_protover_summary(out, protocols);
   }
   if (version && !strcmpstart(version, "Tor ")) {
     if (!out->protocols_known) {
@@ -420,3 +459,10 @@ summarize_protover_flags(protover_summary_flags_t *out,
     }
   }
 }
+
+/** Release all storage held by the protocol summary cache. */
+void
+protover_summary_cache_free_all(void)
+{
+  strmap_free(protover_summary_map, tor_free_);
+}
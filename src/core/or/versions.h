@@ -40,5 +40,11 @@ void sort_version_list(smartlist_t *lst, int remove_duplicates);
 void summarize_protover_flags(protover_summary_flags_t *out,
                               const char *protocols,
                               const char *version);
+void protover_summary_cache_free_all(void);
+
+#ifdef VERSIONS_PRIVATE
+STATIC void memoize_protover_summary(protover_summary_flags_t *out,
+                                     const char *protocols);
+#endif
 
 #endif /* !defined(TOR_VERSIONS_H) */
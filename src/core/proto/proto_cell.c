@@ -10,6 +10,7 @@
 
 #include "core/or/connection_or.h"
 
+#include "core/or/cell_st.h"
 #include "core/or/var_cell_st.h"
 
 /** True iff the cell command <b>command</b> is one that implies a
@@ -39,6 +40,34 @@ cell_command_is_var_length(uint8_t command, int linkproto)
   }
 }
 
+/** Check <b>buf</b> for a whole fixed-length cell, using wide circuit IDs
+ * iff <b>wide_circ_ids</b> is set.  If one is found, pull it off the buffer,
+ * unpack it into *<b>out</b>, and return 1.  Otherwise return 0.
+ *
+ * This is the common case for every busy OR connection, so we copy the
+ * payload straight from the buffer into the cell, rather than copying the
+ * whole cell to a temporary buffer first. */
+int
+fetch_cell_from_buf(buf_t *buf, cell_t *out, int wide_circ_ids)
+{
+  char hdr[CELL_MAX_NETWORK_SIZE - CELL_PAYLOAD_SIZE];
+  const size_t header_len = get_cell_network_size(wide_circ_ids) -
+    CELL_PAYLOAD_SIZE;
+
+  if (buf_datalen(buf) < header_len + CELL_PAYLOAD_SIZE)
+    return 0;
+
+  buf_get_bytes(buf, hdr, header_len);
+  if (wide_circ_ids)
+    out->circ_id = ntohl(get_uint32(hdr));
+  else
+    out->circ_id = ntohs(get_uint16(hdr));
+  out->command = get_uint8(hdr + header_len - 1);
+
+  buf_get_bytes(buf, (char*) out->payload, CELL_PAYLOAD_SIZE);
+  return 1;
+}
+
 /** Check <b>buf</b> for a variable-length cell according to the rules of link
  * protocol version <b>linkproto</b>.  If one is found, pull it off the buffer
  * and assign a newly allocated var_cell_t to *<b>out</b>, and return 1.
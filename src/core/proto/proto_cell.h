@@ -9,7 +9,10 @@
 
 struct buf_t;
 struct var_cell_t;
+struct cell_t;
 
+int fetch_cell_from_buf(struct buf_t *buf, struct cell_t *out,
+                        int wide_circ_ids);
 int fetch_var_cell_from_buf(struct buf_t *buf, struct var_cell_t **out,
                             int linkproto);
 
@@ -78,6 +78,7 @@
 #include "feature/nodelist/nodelist.h"
 #include "feature/nodelist/routerinfo.h"
 #include "feature/nodelist/routerlist.h"
+#include "feature/relay/onion_queue.h"
 #include "feature/relay/router.h"
 #include "feature/relay/routermode.h"
 #include "feature/relay/selftest.h"
@@ -2261,6 +2262,20 @@ getinfo_helper_dir(control_connection_t *control_conn,
         return -1;
       }
     }
+  } else if (!strcmpstart(question, "hs/service/desc/encode-time/")) {
+    ed25519_public_key_t service_pk;
+
+    question += strlen("hs/service/desc/encode-time/");
+    if (!hs_address_is_valid(question) ||
+        hs_parse_address(question, &service_pk, NULL, NULL) < 0) {
+      *errmsg = "Invalid v3 address";
+      return -1;
+    }
+    *answer = hs_service_lookup_encode_time(&service_pk);
+    if (!*answer) {
+      *errmsg = "Unrecognized service";
+      return -1;
+    }
   } else if (!strcmp(question, "md/all")) {
     const smartlist_t *nodes = nodelist_get_list();
     tor_assert(nodes);
@@ -3245,6 +3260,13 @@ static const getinfo_item_t getinfo_items[] = {
        "Time when the accounting period ends."),
   ITEM("accounting/interval-wake", accounting,
        "Time to wake up in this accounting period."),
+  ITEM("onion-queue/wait-histogram/ntor", onion_queue,
+       "How many ntor create requests waited on the queue how long."),
+  ITEM("onion-queue/wait-histogram/tap", onion_queue,
+       "How many TAP create requests waited on the queue how long."),
+  ITEM("onion-queue/evicted", onion_queue,
+       "Number of queued create requests dropped in favor of less busy "
+       "channels."),
   ITEM("helper-nodes", entry_guards, NULL), /* deprecated */
   ITEM("entry-guards", entry_guards,
        "Which nodes are we using as entry guards?"),
@@ -3324,6 +3346,9 @@ static const getinfo_item_t getinfo_items[] = {
          "Hidden Service descriptor in client's cache by onion."),
   PREFIX("hs/service/desc/id/", dir,
          "Hidden Service descriptor in services's cache by onion."),
+  PREFIX("hs/service/desc/encode-time/", dir,
+         "Microseconds a v3 onion service took to encode its descriptors, "
+         "by onion."),
   PREFIX("net/listeners/", listeners, "Bound addresses by type"),
   ITEM("ns/all", networkstatus,
        "Brief summary of router status (v2 directory format)"),
@@ -6187,9 +6212,13 @@ sum_up_cell_stats_by_command(circuit_t *circ, cell_stats_t *cell_stats)
     } else if (!ent->exitward) {
       cell_stats->removed_cells_appward[ent->command] += 1;
       cell_stats->total_time_appward[ent->command] += ent->waiting_time * 10;
+      cell_stats->max_time_appward = MAX(cell_stats->max_time_appward,
+                                         ent->waiting_time * 10);
     } else {
       cell_stats->removed_cells_exitward[ent->command] += 1;
       cell_stats->total_time_exitward[ent->command] += ent->waiting_time * 10;
+      cell_stats->max_time_exitward = MAX(cell_stats->max_time_exitward,
+                                          ent->waiting_time * 10);
     }
   } SMARTLIST_FOREACH_END(ent);
   circuit_clear_testing_cell_stats(circ);
@@ -6253,6 +6282,9 @@ format_cell_stats(char **event_string, circuit_t *circ,
     append_cell_stats_by_command(event_parts, "InboundTime",
                                  cell_stats->removed_cells_appward,
                                  cell_stats->total_time_appward);
+    if (cell_stats->max_time_appward)
+      smartlist_add_asprintf(event_parts, "InboundMaxTime=%"PRIu64,
+                             cell_stats->max_time_appward);
   }
   if (circ->n_chan) {
     smartlist_add_asprintf(event_parts, "OutboundQueue=%lu",
@@ -6268,6 +6300,9 @@ format_cell_stats(char **event_string, circuit_t *circ,
     append_cell_stats_by_command(event_parts, "OutboundTime",
                                  cell_stats->removed_cells_exitward,
                                  cell_stats->total_time_exitward);
+    if (cell_stats->max_time_exitward)
+      smartlist_add_asprintf(event_parts, "OutboundMaxTime=%"PRIu64,
+                             cell_stats->max_time_exitward);
   }
   *event_string = smartlist_join_strings(event_parts, " ", 0, NULL);
   SMARTLIST_FOREACH(event_parts, char *, cp, tor_free(cp));
@@ -345,6 +345,10 @@ typedef struct cell_stats_t {
   uint64_t total_time_appward[CELL_COMMAND_MAX_ + 1];
   /** Total waiting time of cells in exit-ward direction by command. */
   uint64_t total_time_exitward[CELL_COMMAND_MAX_ + 1];
+  /** Longest waiting time of any cell in app-ward direction. */
+  uint64_t max_time_appward;
+  /** Longest waiting time of any cell in exit-ward direction. */
+  uint64_t max_time_exitward;
 } cell_stats_t;
 void sum_up_cell_stats_by_command(circuit_t *circ,
                                   cell_stats_t *cell_stats);
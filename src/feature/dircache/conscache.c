@@ -6,8 +6,10 @@
 #include "app/config/config.h"
 #include "feature/dircache/conscache.h"
 #include "lib/crypt_ops/crypto_util.h"
+#include "lib/fs/lockfile.h"
 #include "lib/fs/storagedir.h"
 #include "lib/encoding/confline.h"
+#include "lib/sandbox/sandbox.h"
 
 #define CCE_MAGIC 0x17162253
 
@@ -64,6 +66,22 @@ struct consensus_cache_t {
    * This is the same as the storagedir limit when MUST_UNMAP_TO_UNLINK is
    * not defined. */
   unsigned max_entries;
+
+  /** If this cache lives in a directory that is shared with other Tor
+   * processes, the name of the lockfile that decides which one of them may
+   * modify it. Otherwise NULL. */
+  char *lockfile_name;
+  /** If this is a shared cache and we are the process allowed to modify it,
+   * the lock we hold. */
+  tor_lockfile_t *lockfile;
+
+  /** Map from each label key that we index to a strmap_t, which maps each
+   * value of that label to a smartlist_t of the entries that have it, in
+   * the same order as <b>entries</b>.  NULL if we index no labels. */
+  strmap_t *label_indexes;
+  /** If true, some entries have been removed from <b>entries</b> since we
+   * last built <b>label_indexes</b>, so we must rebuild them before use. */
+  unsigned label_indexes_dirty : 1;
 };
 
 static void consensus_cache_clear(consensus_cache_t *cache);
@@ -71,6 +89,14 @@ static void consensus_cache_rescan(consensus_cache_t *);
 static void consensus_cache_entry_map(consensus_cache_t *,
                                       consensus_cache_entry_t *);
 static void consensus_cache_entry_unmap(consensus_cache_entry_t *ent);
+static void consensus_cache_index_entry(consensus_cache_t *cache,
+                                        consensus_cache_entry_t *ent);
+static void consensus_cache_rebuild_label_indexes(consensus_cache_t *cache);
+static void label_index_free_(void *index);
+
+static consensus_cache_t *consensus_cache_open_dir(const char *directory,
+                                                   int max_entries,
+                                                   int shared);
 
 /**
  * Helper: Open a consensus cache in subdirectory <b>subdir</b> of the
@@ -78,10 +104,65 @@ static void consensus_cache_entry_unmap(consensus_cache_entry_t *ent);
  */
 consensus_cache_t *
 consensus_cache_open(const char *subdir, int max_entries)
+{
+  char *directory = get_cachedir_fname(subdir);
+  consensus_cache_t *cache =
+    consensus_cache_open_dir(directory, max_entries, 0);
+  tor_free(directory);
+  return cache;
+}
+
+/**
+ * Open a consensus cache in <b>directory</b>, to hold up to
+ * <b>max_entries</b> of data, where the directory may be shared by several
+ * Tor processes on the same host.
+ *
+ * Only one process at a time may modify a shared cache: the one holding the
+ * lock on "<b>directory</b>.lock".  Every other process opens the cache
+ * read-only, and serves the entries that the lock holder has written.  Use
+ * consensus_cache_refresh() to pick up new entries, or to take over the
+ * cache if the lock holder has exited.
+ */
+consensus_cache_t *
+consensus_cache_open_shared(const char *directory, int max_entries)
+{
+  return consensus_cache_open_dir(directory, max_entries, 1);
+}
+
+/**
+ * Helper: If <b>cache</b> is a shared cache and we don't already hold its
+ * lock, try to acquire the lock without blocking.  Mark the cache writable
+ * if we hold the lock, and read-only otherwise.
+ */
+static void
+consensus_cache_try_lock(consensus_cache_t *cache)
+{
+  if (! cache->lockfile_name || cache->lockfile)
+    return;
+
+  int already_locked = 0;
+  cache->lockfile = tor_lockfile_lock(cache->lockfile_name, 0,
+                                      &already_locked);
+  if (cache->lockfile) {
+    log_info(LD_FS, "We are now responsible for maintaining the shared "
+             "consensus cache at %s.", escaped(cache->lockfile_name));
+  } else if (! already_locked) {
+    log_warn(LD_FS, "Unable to lock the shared consensus cache; we will "
+             "only read from it.");
+  }
+  storage_dir_set_read_only(cache->dir, cache->lockfile == NULL);
+}
+
+/**
+ * Helper: Open a consensus cache in <b>directory</b>, to hold up to
+ * <b>max_entries</b> of data.  If <b>shared</b> is true, other processes may
+ * be using the same directory: see consensus_cache_open_shared().
+ */
+static consensus_cache_t *
+consensus_cache_open_dir(const char *directory, int max_entries, int shared)
 {
   int storagedir_max_entries;
   consensus_cache_t *cache = tor_malloc_zero(sizeof(consensus_cache_t));
-  char *directory = get_cachedir_fname(subdir);
   cache->max_entries = max_entries;
 
 #ifdef MUST_UNMAP_TO_UNLINK
@@ -99,16 +180,53 @@ consensus_cache_open(const char *subdir, int max_entries)
 #endif /* defined(MUST_UNMAP_TO_UNLINK) */
 
   cache->dir = storage_dir_new(directory, storagedir_max_entries);
-  tor_free(directory);
   if (!cache->dir) {
     tor_free(cache);
     return NULL;
   }
 
+  if (shared) {
+    tor_asprintf(&cache->lockfile_name, "%s.lock", directory);
+    consensus_cache_try_lock(cache);
+  }
+
   consensus_cache_rescan(cache);
   return cache;
 }
 
+/**
+ * Return true iff <b>cache</b> is shared with another process that is
+ * responsible for modifying it.  No entries can be added to or removed from
+ * a read-only cache.
+ */
+int
+consensus_cache_is_read_only(const consensus_cache_t *cache)
+{
+  return storage_dir_is_read_only(cache->dir);
+}
+
+/**
+ * If <b>cache</b> is a read-only shared cache, re-read its directory to learn
+ * about entries that the process maintaining it has added or removed.  If
+ * that process has exited, take over responsibility for the cache.
+ *
+ * Entries from before the refresh remain valid for as long as somebody holds
+ * a reference to them, but are no longer part of the cache.
+ *
+ * Return 1 if the cache's contents were reloaded, and 0 otherwise.
+ */
+int
+consensus_cache_refresh(consensus_cache_t *cache)
+{
+  if (! consensus_cache_is_read_only(cache))
+    return 0;
+
+  consensus_cache_try_lock(cache);
+  storage_dir_rescan(cache->dir);
+  consensus_cache_rescan(cache);
+  return 1;
+}
+
 /** Return true if it's okay to put more entries in this cache than
  * its official file limit.
  *
@@ -148,7 +266,13 @@ consensus_cache_register_with_sandbox(consensus_cache_t *cache,
    */
   tor_assert_nonfatal_unreached();
 #endif /* defined(MUST_UNMAP_TO_UNLINK) */
-  return storage_dir_register_with_sandbox(cache->dir, cfg);
+  int problems = 0;
+  if (cache->lockfile_name) {
+    problems += sandbox_cfg_allow_open_filename(cfg,
+                                          tor_strdup(cache->lockfile_name));
+  }
+  problems += storage_dir_register_with_sandbox(cache->dir, cfg);
+  return problems ? -1 : 0;
 }
 
 /**
@@ -166,6 +290,7 @@ consensus_cache_clear(consensus_cache_t *cache)
   } SMARTLIST_FOREACH_END(ent);
   smartlist_free(cache->entries);
   cache->entries = NULL;
+  cache->label_indexes_dirty = 1;
 }
 
 /**
@@ -180,7 +305,11 @@ consensus_cache_free_(consensus_cache_t *cache)
   if (cache->entries) {
     consensus_cache_clear(cache);
   }
+  strmap_free(cache->label_indexes, label_index_free_);
   storage_dir_free(cache->dir);
+  if (cache->lockfile)
+    tor_lockfile_unlock(cache->lockfile);
+  tor_free(cache->lockfile_name);
   tor_free(cache);
 }
 
@@ -203,6 +332,9 @@ consensus_cache_add(consensus_cache_t *cache,
                     const uint8_t *data,
                     size_t datalen)
 {
+  if (consensus_cache_is_read_only(cache))
+    return NULL;
+
   char *fname = NULL;
   int r = storage_dir_save_labeled_to_file(cache->dir,
                                             labels, data, datalen, &fname);
@@ -217,6 +349,7 @@ consensus_cache_add(consensus_cache_t *cache,
   ent->in_cache = cache;
   ent->unused_since = TIME_MAX;
   smartlist_add(cache->entries, ent);
+  consensus_cache_index_entry(cache, ent);
   /* Start the reference count at 2: the caller owns one copy, and the
    * cache owns another.
    */
@@ -225,6 +358,88 @@ consensus_cache_add(consensus_cache_t *cache,
   return ent;
 }
 
+/**
+ * Helper for strmap_free: release a smartlist of entries from a label index.
+ */
+static void
+label_index_matches_free_(void *matches)
+{
+  smartlist_free_(matches);
+}
+
+/**
+ * Helper for strmap_free: release a map from label values to smartlists of
+ * entries.
+ */
+static void
+label_index_free_(void *index)
+{
+  strmap_t *map = index;
+  strmap_free(map, label_index_matches_free_);
+}
+
+/**
+ * Helper: add <b>ent</b>, which has just been appended to the entries of
+ * <b>cache</b>, to every label index that <b>cache</b> maintains.
+ */
+static void
+consensus_cache_index_entry(consensus_cache_t *cache,
+                            consensus_cache_entry_t *ent)
+{
+  if (! cache->label_indexes || cache->label_indexes_dirty)
+    return;
+  STRMAP_FOREACH(cache->label_indexes, key, strmap_t *, index) {
+    const char *value = consensus_cache_entry_get_value(ent, key);
+    if (! value)
+      continue;
+    smartlist_t *matches = strmap_get(index, value);
+    if (! matches) {
+      matches = smartlist_new();
+      strmap_set(index, value, matches);
+    }
+    smartlist_add(matches, ent);
+  } STRMAP_FOREACH_END;
+}
+
+/**
+ * Helper: make every label index in <b>cache</b> match its current list of
+ * entries.
+ */
+static void
+consensus_cache_rebuild_label_indexes(consensus_cache_t *cache)
+{
+  if (! cache->label_indexes)
+    return;
+  STRMAP_FOREACH(cache->label_indexes, key, strmap_t *, index) {
+    STRMAP_FOREACH_MODIFY(index, value, smartlist_t *, matches) {
+      smartlist_free(matches);
+      MAP_DEL_CURRENT(value);
+    } STRMAP_FOREACH_END;
+  } STRMAP_FOREACH_END;
+  cache->label_indexes_dirty = 0;
+  if (! cache->entries)
+    return;
+  SMARTLIST_FOREACH(cache->entries, consensus_cache_entry_t *, ent,
+                    consensus_cache_index_entry(cache, ent));
+}
+
+/**
+ * Tell <b>cache</b> to keep an index of its entries by the value of the
+ * label <b>key</b>, so that consensus_cache_find_all() can look them up
+ * without examining every entry.  Use this for the labels that callers
+ * search by most often.
+ */
+void
+consensus_cache_index_label(consensus_cache_t *cache, const char *key)
+{
+  if (! cache->label_indexes)
+    cache->label_indexes = strmap_new();
+  if (strmap_get(cache->label_indexes, key))
+    return;
+  strmap_set(cache->label_indexes, key, strmap_new());
+  cache->label_indexes_dirty = 1;
+}
+
 /**
  * Given a <b>cache</b>, return some entry for which <b>key</b>=<b>value</b>.
  * Return NULL if no such entry exists.
@@ -259,6 +474,24 @@ consensus_cache_find_all(smartlist_t *out,
                          const char *key,
                          const char *value)
 {
+  strmap_t *index = NULL;
+  if (key && cache->label_indexes)
+    index = strmap_get(cache->label_indexes, key);
+  if (index) {
+    if (cache->label_indexes_dirty) {
+      consensus_cache_rebuild_label_indexes(cache);
+      index = strmap_get(cache->label_indexes, key);
+    }
+    const smartlist_t *matches = strmap_get(index, value);
+    if (! matches)
+      return;
+    SMARTLIST_FOREACH_BEGIN(matches, consensus_cache_entry_t *, ent) {
+      if (ent->can_remove == 0)
+        smartlist_add(out, ent);
+    } SMARTLIST_FOREACH_END(ent);
+    return;
+  }
+
   SMARTLIST_FOREACH_BEGIN(cache->entries, consensus_cache_entry_t *, ent) {
     if (ent->can_remove == 1) {
       /* We want to delete this; pretend it isn't there. */
@@ -513,6 +746,7 @@ consensus_cache_delete_pending(consensus_cache_t *cache, int force)
     }
 
     SMARTLIST_DEL_CURRENT(cache->entries, ent);
+    cache->label_indexes_dirty = 1;
     ent->in_cache = NULL;
     char *fname = tor_strdup(ent->fname); /* save a copy */
     consensus_cache_entry_decref(ent);
@@ -15,11 +15,15 @@ HANDLE_DECL(consensus_cache_entry, consensus_cache_entry_t, )
                 consensus_cache_entry_handle_free_, (h))
 
 consensus_cache_t *consensus_cache_open(const char *subdir, int max_entries);
+consensus_cache_t *consensus_cache_open_shared(const char *directory,
+                                               int max_entries);
 void consensus_cache_free_(consensus_cache_t *cache);
 #define consensus_cache_free(cache) \
   FREE_AND_NULL(consensus_cache_t, consensus_cache_free_, (cache))
 struct sandbox_cfg_elem;
 int consensus_cache_may_overallocate(consensus_cache_t *cache);
+int consensus_cache_is_read_only(const consensus_cache_t *cache);
+int consensus_cache_refresh(consensus_cache_t *cache);
 int consensus_cache_register_with_sandbox(consensus_cache_t *cache,
                                           struct sandbox_cfg_elem **cfg);
 void consensus_cache_unmap_lazy(consensus_cache_t *cache, time_t cutoff);
@@ -31,6 +35,8 @@ consensus_cache_entry_t *consensus_cache_add(consensus_cache_t *cache,
                                            const uint8_t *data,
                                            size_t datalen);
 
+void consensus_cache_index_label(consensus_cache_t *cache, const char *key);
+
 consensus_cache_entry_t *consensus_cache_find_first(
                                              consensus_cache_t *cache,
                                              const char *key,
@@ -375,9 +375,14 @@ static void
 cdm_cache_init(void)
 {
   unsigned n_entries = consdiff_cfg.cache_max_num * 2;
+  const char *shared_dir = get_options()->SharedConsensusCacheDirectory;
 
   tor_assert(cons_diff_cache == NULL);
-  cons_diff_cache = consensus_cache_open("diff-cache", n_entries);
+  if (shared_dir) {
+    cons_diff_cache = consensus_cache_open_shared(shared_dir, n_entries);
+  } else {
+    cons_diff_cache = consensus_cache_open("diff-cache", n_entries);
+  }
   if (cons_diff_cache == NULL) {
     // LCOV_EXCL_START
     log_err(LD_FS, "Error: Couldn't open storage for consensus diffs.");
@@ -385,6 +390,13 @@ cdm_cache_init(void)
     // LCOV_EXCL_STOP
   } else {
     consdiffmgr_set_cache_flags();
+    /* These are the labels that we look entries up by. */
+    consensus_cache_index_label(cons_diff_cache, LABEL_DOCTYPE);
+    consensus_cache_index_label(cons_diff_cache, LABEL_FLAVOR);
+    consensus_cache_index_label(cons_diff_cache, LABEL_VALID_AFTER);
+    consensus_cache_index_label(cons_diff_cache, LABEL_FROM_SHA3_DIGEST);
+    consensus_cache_index_label(cons_diff_cache, LABEL_TARGET_SHA3_DIGEST);
+    consensus_cache_index_label(cons_diff_cache, LABEL_COMPRESSION_TYPE);
   }
   consdiffmgr_rescan_ev =
     mainloop_event_postloop_new(consdiffmgr_rescan_cb, NULL);
@@ -405,6 +417,40 @@ cdm_cache_get(void)
   return cons_diff_cache;
 }
 
+/**
+ * Helper: return true iff the cache that backs this manager is shared with
+ * another Tor process that is responsible for adding consensuses and
+ * building diffs.
+ */
+static int
+cdm_cache_is_read_only(void)
+{
+  return consensus_cache_is_read_only(cdm_cache_get());
+}
+
+/**
+ * Helper: drop every handle we hold to entries in the cache, and forget
+ * which diffs we have or are building.
+ */
+static void
+cdm_forget_loaded_entries(void)
+{
+  cdm_diff_t **diff, **next;
+  for (diff = HT_START(cdm_diff_ht, &cdm_diff_ht); diff; diff = next) {
+    cdm_diff_t *this = *diff;
+    next = HT_NEXT_RMV(cdm_diff_ht, &cdm_diff_ht, diff);
+    cdm_diff_free(this);
+  }
+  int i;
+  unsigned j;
+  for (i = 0; i < N_CONSENSUS_FLAVORS; ++i) {
+    for (j = 0; j < n_consensus_compression_methods(); ++j) {
+      consensus_cache_entry_handle_free(latest_consensus[i][j]);
+    }
+  }
+  memset(latest_consensus, 0, sizeof(latest_consensus));
+}
+
 /**
  * Helper: given a list of labels, prepend the hex-encoded SHA3 digest
  * of the <b>bodylen</b>-byte object at <b>body</b> to those labels,
@@ -535,6 +581,12 @@ consdiffmgr_add_consensus(const char *consensus,
     return -1;
   }
 
+  if (cdm_cache_is_read_only()) {
+    log_info(LD_DIRSERV, "Not adding this consensus to the shared consensus "
+             "cache: another Tor process is maintaining it.");
+    return -1;
+  }
+
   /* Do we already have this one? */
   consensus_cache_entry_t *entry =
     cdm_cache_lookup_consensus(flavor, valid_after);
@@ -688,10 +740,24 @@ consdiffmgr_find_diff_from(consensus_cache_entry_t **entry_out,
 /**
  * Perform periodic cleanup tasks on the consensus diff cache.  Return
  * the number of objects marked for deletion.
+ *
+ * If the cache is shared with another process that maintains it, just
+ * reload it to learn about whatever that process has changed.
  */
 int
 consdiffmgr_cleanup(void)
 {
+  if (cdm_cache_is_read_only()) {
+    if (consensus_cache_refresh(cdm_cache_get())) {
+      cdm_forget_loaded_entries();
+      if (! cdm_cache_is_read_only())
+        consdiffmgr_set_cache_flags();
+      cdm_cache_loaded = 0;
+      mark_cdm_cache_dirty();
+    }
+    return 0;
+  }
+
   smartlist_t *objects = smartlist_new();
   smartlist_t *consensuses = smartlist_new();
   smartlist_t *diffs = smartlist_new();
@@ -1095,8 +1161,10 @@ consdiffmgr_rescan(void)
     return;
 
   // Clean up here to make room for new diffs, and to ensure that older
-  // consensuses do not have any entries.
-  consdiffmgr_cleanup();
+  // consensuses do not have any entries.  (If the cache is maintained by
+  // another process, we can only look at what it has built.)
+  if (! cdm_cache_is_read_only())
+    consdiffmgr_cleanup();
 
   if (cdm_cache_loaded == 0) {
     consdiffmgr_diffs_load();
@@ -1104,6 +1172,11 @@ consdiffmgr_rescan(void)
     cdm_cache_loaded = 1;
   }
 
+  if (cdm_cache_is_read_only()) {
+    cdm_cache_dirty = 0;
+    return;
+  }
+
   for (int flav = 0; flav < N_CONSENSUS_FLAVORS; ++flav) {
     consdiffmgr_rescan_flavor_((consensus_flavor_t) flav);
   }
@@ -1237,20 +1310,7 @@ consdiffmgr_set_cache_flags(void)
 void
 consdiffmgr_free_all(void)
 {
-  cdm_diff_t **diff, **next;
-  for (diff = HT_START(cdm_diff_ht, &cdm_diff_ht); diff; diff = next) {
-    cdm_diff_t *this = *diff;
-    next = HT_NEXT_RMV(cdm_diff_ht, &cdm_diff_ht, diff);
-    cdm_diff_free(this);
-  }
-  int i;
-  unsigned j;
-  for (i = 0; i < N_CONSENSUS_FLAVORS; ++i) {
-    for (j = 0; j < n_consensus_compression_methods(); ++j) {
-      consensus_cache_entry_handle_free(latest_consensus[i][j]);
-    }
-  }
-  memset(latest_consensus, 0, sizeof(latest_consensus));
+  cdm_forget_loaded_entries();
   consensus_cache_free(cons_diff_cache);
   cons_diff_cache = NULL;
   mainloop_event_free(consdiffmgr_rescan_ev);
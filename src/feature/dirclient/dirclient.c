@@ -46,6 +46,7 @@
 #include "feature/stats/predict_ports.h"
 
 #include "lib/compress/compress.h"
+#include "lib/container/buffers.h"
 #include "lib/crypt_ops/crypto_format.h"
 #include "lib/crypt_ops/crypto_util.h"
 #include "lib/encoding/confline.h"
@@ -1331,6 +1332,7 @@ directory_initiate_request,(directory_request_t *request))
 
   /* give it an initial state */
   conn->base_.state = DIR_CONN_STATE_CONNECTING;
+  conn->request_launched_msec = monotime_coarse_absolute_msec();
 
   /* decide whether we can learn our IP address from this conn */
   /* XXXX This is a bad name for this field now. */
@@ -1968,6 +1970,270 @@ dir_client_decompress_response_body(char **bodyp, size_t *bodylenp,
   return rv;
 }
 
+/** How many bytes of a response body do we decompress at a time, as they
+ * arrive? */
+#define DIR_BODY_STREAM_CHUNK (16*1024)
+
+/** Return true iff we should decompress the response body for <b>conn</b>
+ * as it arrives, rather than waiting for all of it.  Consensus documents
+ * (and diffs) are large enough to be worth it; microdescriptors we want to
+ * start using before the rest of the batch arrives. */
+static int
+dir_client_should_stream_body(const dir_connection_t *conn)
+{
+  return (conn->base_.purpose == DIR_PURPOSE_FETCH_CONSENSUS ||
+          conn->base_.purpose == DIR_PURPOSE_FETCH_MICRODESC) &&
+    conn->base_.state == DIR_CONN_STATE_CLIENT_READING &&
+    !conn->response_not_streamed;
+}
+
+/** Helper for connection_dir_client_process_body(): if the headers of the
+ * response on <b>conn</b> have arrived, along with enough of the body to
+ * tell how it's compressed, decide whether we can decompress it as it
+ * arrives.  If we can, take the headers off the inbuf and set up the
+ * decompression.  Return 1 if we're now streaming the body, 0 if we'd
+ * better wait for the whole thing, and -1 if we don't know yet. */
+static int
+dir_client_start_body_stream(dir_connection_t *conn)
+{
+  buf_t *inbuf = TO_CONN(conn)->inbuf;
+  const int crlf_offset = buf_find_string_offset(inbuf, "\r\n\r\n", 4);
+  size_t headerlen;
+  char *headers = NULL, *content_length = NULL;
+  char prefix[8];
+  int status_code = 0;
+  compress_method_t compression = NO_METHOD;
+  int streaming = 0;
+
+  if (crlf_offset < 0 && buf_datalen(inbuf) < MAX_HEADERS_SIZE)
+    return -1;
+  if (crlf_offset < 0 || crlf_offset >= MAX_HEADERS_SIZE - 4)
+    goto done;
+  headerlen = crlf_offset + 4;
+  if (buf_datalen(inbuf) < headerlen + sizeof(prefix))
+    return -1;
+
+  headers = tor_malloc(headerlen + sizeof(prefix) + 1);
+  buf_peek(inbuf, headers, headerlen + sizeof(prefix));
+  memcpy(prefix, headers + headerlen, sizeof(prefix));
+  headers[headerlen] = '\0';
+
+  /* Anything unusual about the response, we leave to
+   * connection_dir_client_reached_eof(). */
+  if (parse_http_response(headers, &status_code, NULL, &compression,
+                          NULL) < 0 ||
+      status_code != 200)
+    goto done;
+  content_length = http_get_header(headers, "Content-Length: ");
+  if (content_length)
+    goto done;
+  if (compression == NO_METHOD || compression == UNKNOWN_METHOD ||
+      !tor_compress_supports_method(compression) ||
+      detect_compression_method(prefix, sizeof(prefix)) != compression)
+    goto done;
+  if (purpose_needs_anonymity(conn->base_.purpose, conn->router_purpose,
+                              conn->requested_resource) &&
+      !allowed_anonymous_connection_compression_method(compression))
+    goto done;
+
+  conn->response_decompress = tor_compress_new(0, compression,
+                                               HIGH_COMPRESSION);
+  if (!conn->response_decompress)
+    goto done;
+  conn->response_body = buf_new();
+  buf_drain(inbuf, headerlen);
+  conn->response_bytes_streamed = headerlen;
+  conn->response_headers = headers;
+  headers = NULL;
+  streaming = 1;
+  log_debug(LD_DIR, "Decompressing %s response body from '%s:%d' as it "
+            "arrives.", compression_method_get_name(compression),
+            conn->base_.address, conn->base_.port);
+
+ done:
+  if (!streaming)
+    conn->response_not_streamed = 1;
+  tor_free(headers);
+  tor_free(content_length);
+  return streaming;
+}
+
+/** Helper: decompress everything on <b>conn</b>'s inbuf onto the end of its
+ * response body.  If <b>done</b>, this is the end of the body.  Return 0 on
+ * success, -1 on failure. */
+static int
+dir_client_decompress_body_chunks(dir_connection_t *conn, int done)
+{
+  buf_t *inbuf = TO_CONN(conn)->inbuf;
+  char chunk[DIR_BODY_STREAM_CHUNK];
+
+  if (!done && !buf_datalen(inbuf))
+    return 0;
+
+  do {
+    const size_t n = MIN(buf_datalen(inbuf), sizeof(chunk));
+    const int last = done && n == buf_datalen(inbuf);
+    buf_get_bytes(inbuf, chunk, n);
+    conn->response_bytes_streamed += n;
+    if (buf_add_compress(conn->response_body, conn->response_decompress,
+                         chunk, n, last) < 0) {
+      log_fn(LOG_PROTOCOL_WARN, LD_HTTP,
+             "Unable to decompress HTTP body (server '%s:%d').",
+             conn->base_.address, conn->base_.port);
+      return -1;
+    }
+    if (buf_datalen(conn->response_body) >= MAX_DIR_DL_SIZE) {
+      log_warn(LD_PROTOCOL,
+               "'fetch' response too large (server '%s:%d'). Closing.",
+               conn->base_.address, conn->base_.port);
+      return -1;
+    }
+  } while (buf_datalen(inbuf));
+
+  return 0;
+}
+
+/** Return the list of microdescriptor digests that we asked for on
+ * <b>conn</b> and haven't received yet. */
+static smartlist_t *
+dir_client_microdescs_wanted(dir_connection_t *conn)
+{
+  if (!conn->microdescs_wanted) {
+    tor_assert(conn->requested_resource &&
+               !strcmpstart(conn->requested_resource, "d/"));
+    conn->microdescs_wanted = smartlist_new();
+    dir_split_resource_into_fingerprints(conn->requested_resource+2,
+                                         conn->microdescs_wanted, NULL,
+                                         DSR_DIGEST256|DSR_BASE64);
+  }
+  return conn->microdescs_wanted;
+}
+
+/** Tell the rest of Tor that some microdescriptors have arrived on
+ * <b>conn</b>, unless we told it very recently. */
+static void
+dir_client_report_arrived_microdescs(dir_connection_t *conn, time_t now,
+                                     int force)
+{
+  if (!force && conn->microdescs_reported_at == now)
+    return;
+  conn->microdescs_reported_at = now;
+  control_event_boot_dir(BOOTSTRAP_STATUS_LOADING_DESCRIPTORS,
+                         count_loading_descriptors_progress());
+  directory_info_has_arrived(now, 0, 1);
+}
+
+/** Helper for connection_dir_client_process_body(): add every complete
+ * microdescriptor in the decompressed body so far on <b>conn</b> to our
+ * cache, and leave the incomplete one at the end for later.  This way we
+ * can start building circuits with the first microdescriptors in a batch
+ * while the rest of the batch is still on its way. */
+STATIC void
+dir_client_add_arrived_microdescs(dir_connection_t *conn)
+{
+  const size_t len = buf_datalen(conn->response_body);
+  const char *p, *cut = NULL;
+  char *body;
+  smartlist_t *mds;
+  time_t now;
+
+  /* Wait for a decent amount, so that we don't rescan a small tail over and
+   * over. */
+  if (len < DIR_BODY_STREAM_CHUNK)
+    return;
+
+  body = tor_malloc(len + 1);
+  buf_get_bytes(conn->response_body, body, len);
+  body[len] = '\0';
+
+  /* Every microdescriptor starts with an onion-key line, so everything
+   * before the last one is complete. */
+  p = body;
+  while ((p = tor_memstr(p, len - (p - body), "\nonion-key"))) {
+    cut = ++p;
+  }
+  if (!cut) {
+    buf_add(conn->response_body, body, len);
+    tor_free(body);
+    return;
+  }
+  buf_add(conn->response_body, cut, len - (cut - body));
+
+  now = approx_time();
+  mds = microdescs_add_to_cache(get_microdesc_cache(), body, cut,
+                                SAVED_NOWHERE, 0, now,
+                                dir_client_microdescs_wanted(conn));
+  if (smartlist_len(mds)) {
+    log_debug(LD_DIR, "Added %d microdescriptors from '%s:%d' before the "
+              "end of the response.", smartlist_len(mds),
+              conn->base_.address, conn->base_.port);
+    conn->n_microdescs_arrived += smartlist_len(mds);
+    dir_client_report_arrived_microdescs(conn, now, 0);
+  }
+  smartlist_free(mds);
+  tor_free(body);
+}
+
+/** We are a client, and more of the server's response has arrived on
+ * <b>conn</b>.  For large documents, decompress the body as it arrives, so
+ * that we never need to hold all of the compressed body, a copy of it, and
+ * the decompressed body at once.  Return 0 on success, or -1 if we should
+ * close the connection. */
+int
+connection_dir_client_process_body(dir_connection_t *conn)
+{
+  if (!conn->response_first_byte_msec &&
+      buf_datalen(TO_CONN(conn)->inbuf))
+    conn->response_first_byte_msec = monotime_coarse_absolute_msec();
+
+  if (!conn->response_decompress) {
+    if (!dir_client_should_stream_body(conn) ||
+        dir_client_start_body_stream(conn) <= 0)
+      return 0;
+  }
+
+  if (buf_datalen(TO_CONN(conn)->inbuf) == 0)
+    return 0;
+  if (dir_client_decompress_body_chunks(conn, 0) < 0)
+    return -1;
+  if (conn->base_.purpose == DIR_PURPOSE_FETCH_MICRODESC)
+    dir_client_add_arrived_microdescs(conn);
+  return 0;
+}
+
+/** Helper for connection_dir_client_reached_eof(): finish decompressing
+ * the body that we've been decompressing as it arrived on <b>conn</b>, and
+ * hand back the headers and body as fetch_from_buf_http() would.  If
+ * <b>allow_partial</b>, a body that stops early is fine.  Return 0 on
+ * success, -1 on failure. */
+STATIC int
+dir_client_finish_body_stream(dir_connection_t *conn, int allow_partial,
+                              char **headers_out,
+                              char **body_out, size_t *body_len_out)
+{
+  size_t len, off;
+  char *body;
+
+  if (dir_client_decompress_body_chunks(conn, !allow_partial) < 0)
+    return -1;
+
+  /* Copy the body out a piece at a time, so that we free the buffer's
+   * chunks as we go. */
+  len = buf_datalen(conn->response_body);
+  body = tor_malloc(len + 1);
+  for (off = 0; off < len; off += DIR_BODY_STREAM_CHUNK) {
+    buf_get_bytes(conn->response_body, body + off,
+                  MIN(len - off, DIR_BODY_STREAM_CHUNK));
+  }
+  body[len] = '\0';
+
+  *headers_out = conn->response_headers;
+  conn->response_headers = NULL;
+  *body_out = body;
+  *body_len_out = len;
+  return 0;
+}
+
 /** We are a client, and we've finished reading the server's
  * response. Parse it and act appropriately.
  *
@@ -1998,23 +2264,33 @@ connection_dir_client_reached_eof(dir_connection_t *conn)
     purpose_needs_anonymity(conn->base_.purpose,
                             conn->router_purpose,
                             conn->requested_resource);
+  const int streamed = conn->response_decompress != NULL;
 
-  received_bytes = connection_get_inbuf_len(TO_CONN(conn));
+  /* If we've been streaming the body, most of the response has already left
+   * the inbuf. */
+  received_bytes = connection_get_inbuf_len(TO_CONN(conn)) +
+    conn->response_bytes_streamed;
 
-  switch (connection_fetch_from_buf_http(TO_CONN(conn),
-                              &headers, MAX_HEADERS_SIZE,
-                              &body, &body_len, MAX_DIR_DL_SIZE,
-                              allow_partial)) {
-    case -1: /* overflow */
-      log_warn(LD_PROTOCOL,
-               "'fetch' response too large (server '%s:%d'). Closing.",
-               conn->base_.address, conn->base_.port);
-      return -1;
-    case 0:
-      log_info(LD_HTTP,
-               "'fetch' response not all here, but we're at eof. Closing.");
+  if (streamed) {
+    if (dir_client_finish_body_stream(conn, allow_partial,
+                                      &headers, &body, &body_len) < 0)
       return -1;
-    /* case 1, fall through */
+  } else {
+    switch (connection_fetch_from_buf_http(TO_CONN(conn),
+                                &headers, MAX_HEADERS_SIZE,
+                                &body, &body_len, MAX_DIR_DL_SIZE,
+                                allow_partial)) {
+      case -1: /* overflow */
+        log_warn(LD_PROTOCOL,
+                 "'fetch' response too large (server '%s:%d'). Closing.",
+                 conn->base_.address, conn->base_.port);
+        return -1;
+      case 0:
+        log_info(LD_HTTP,
+                 "'fetch' response not all here, but we're at eof. Closing.");
+        return -1;
+      /* case 1, fall through */
+    }
   }
 
   if (parse_http_response(headers, &status_code, &date_header,
@@ -2101,7 +2377,8 @@ connection_dir_client_reached_eof(dir_connection_t *conn)
     goto done;
   }
 
-  if (dir_client_decompress_response_body(&body, &body_len,
+  if (!streamed &&
+      dir_client_decompress_response_body(&body, &body_len,
                              conn, compression, anonymized_connection) < 0) {
     rv = -1;
     goto done;
@@ -2501,6 +2778,19 @@ handle_response_fetch_desc(dir_connection_t *conn,
   return 0;
 }
 
+/** Tell the download scheduler how long the microdescriptor request on
+ * <b>conn</b> took to start answering, and how long the answer took. */
+static void
+dir_client_note_microdesc_timing(const dir_connection_t *conn)
+{
+  const uint64_t now_msec = monotime_coarse_absolute_msec();
+  if (!conn->request_launched_msec || !conn->response_first_byte_msec)
+    return;
+  microdesc_download_note_timing(conn->n_microdescs_arrived,
+         conn->response_first_byte_msec - conn->request_launched_msec,
+         now_msec - conn->response_first_byte_msec);
+}
+
 /**
  * Handler function: processes a response to a request for a group of
  * microdescriptors
@@ -2523,10 +2813,10 @@ handle_response_fetch_microdesc(dir_connection_t *conn,
   tor_assert(conn->requested_resource &&
              !strcmpstart(conn->requested_resource, "d/"));
   tor_assert_nonfatal(!tor_mem_is_zero(conn->identity_digest, DIGEST_LEN));
-  which = smartlist_new();
-  dir_split_resource_into_fingerprints(conn->requested_resource+2,
-                                       which, NULL,
-                                       DSR_DIGEST256|DSR_BASE64);
+  /* If we added some of the microdescriptors as they arrived, this is the
+   * list of the ones we're still waiting for. */
+  which = dir_client_microdescs_wanted(conn);
+  conn->microdescs_wanted = NULL;
   if (status_code != 200) {
     log_info(LD_DIR, "Received status code %d (%s) from server "
              "'%s:%d' while fetching \"/tor/micro/%s\".  I'll try again "
@@ -2547,10 +2837,11 @@ handle_response_fetch_microdesc(dir_connection_t *conn,
       /* Mark remaining ones as failed. */
       dir_microdesc_download_failed(which, status_code, conn->identity_digest);
     }
-    if (mds && smartlist_len(mds)) {
-      control_event_boot_dir(BOOTSTRAP_STATUS_LOADING_DESCRIPTORS,
-                             count_loading_descriptors_progress());
-      directory_info_has_arrived(now, 0, 1);
+    if (mds)
+      conn->n_microdescs_arrived += smartlist_len(mds);
+    if (conn->n_microdescs_arrived) {
+      dir_client_report_arrived_microdescs(conn, now, 1);
+      dir_client_note_microdesc_timing(conn);
     }
     SMARTLIST_FOREACH(which, char *, cp, tor_free(cp));
     smartlist_free(which);
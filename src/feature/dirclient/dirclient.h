@@ -93,6 +93,7 @@ int router_supports_extrainfo(const char *identity_digest, int is_authority);
 void connection_dir_client_request_failed(dir_connection_t *conn);
 void connection_dir_client_refetch_hsdesc_if_needed(
                                           dir_connection_t *dir_conn);
+int connection_dir_client_process_body(dir_connection_t *conn);
 
 #ifdef DIRCLIENT_PRIVATE
 struct directory_request_t {
@@ -162,6 +163,12 @@ STATIC int handle_response_fetch_hsdesc_v3(dir_connection_t *conn,
 STATIC int handle_response_fetch_microdesc(dir_connection_t *conn,
                                  const response_handler_args_t *args);
 
+STATIC void dir_client_add_arrived_microdescs(dir_connection_t *conn);
+STATIC int dir_client_finish_body_stream(dir_connection_t *conn,
+                                         int allow_partial,
+                                         char **headers_out,
+                                         char **body_out,
+                                         size_t *body_len_out);
 STATIC int handle_response_fetch_consensus(dir_connection_t *conn,
                                          const response_handler_args_t *args);
 
@@ -35,6 +35,31 @@ struct dir_connection_t {
   /** The compression object doing on-the-fly compression for spooled data. */
   struct tor_compress_state_t *compress_state;
 
+  /** If we're a client decompressing a response body as it arrives, the
+   * response's headers, the decompressed body so far, and the compression
+   * object doing the decompressing. */
+  char *response_headers;
+  struct buf_t *response_body;
+  struct tor_compress_state_t *response_decompress;
+  /** How many bytes of the response, headers included, we've taken off the
+   * inbuf to decompress as they arrived. */
+  size_t response_bytes_streamed;
+  /** True if we've decided to wait for all of the response body before
+   * decompressing it. */
+  unsigned int response_not_streamed:1;
+
+  /** When did we launch this request, and when did the first byte of the
+   * response arrive?  (Monotonic milliseconds, or 0 if not yet.) */
+  uint64_t request_launched_msec;
+  uint64_t response_first_byte_msec;
+
+  /** If we're a client adding microdescriptors to our cache as they arrive,
+   * the digests we asked for and haven't got yet, how many we've added so
+   * far, and when we last told the rest of Tor about them. */
+  smartlist_t *microdescs_wanted;
+  int n_microdescs_arrived;
+  time_t microdescs_reported_at;
+
   /** What rendezvous service are we querying for? */
   rend_data_t *rend_data;
 
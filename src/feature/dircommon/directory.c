@@ -365,6 +365,12 @@ connection_dir_process_inbuf(dir_connection_t *conn)
     return 0;
   }
 
+  /* If we're a client, make a start on any large response body. */
+  if (connection_dir_client_process_body(conn) < 0) {
+    connection_mark_for_close(TO_CONN(conn));
+    return -1;
+  }
+
   max_size =
     (TO_CONN(conn)->purpose == DIR_PURPOSE_FETCH_STATUS_VOTE) ?
     MAX_VOTE_DL_SIZE : MAX_DIRECTORY_OBJECT_SIZE;
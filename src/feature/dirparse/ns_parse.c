@@ -1460,6 +1460,21 @@ networkstatus_parse_vote_from_string(const char *s, const char **eos_out,
       goto err;
     }
   }
+  if (ns->type == NS_TYPE_CONSENSUS &&
+      smartlist_len(ns->routerstatus_list)) {
+    /* Move the entries into a single array: we walk all of them in path
+     * selection and in bandwidth weighting, so we want them close together
+     * in memory. */
+    const int n = smartlist_len(ns->routerstatus_list);
+    ns->routerstatus_block = tor_calloc(n, sizeof(routerstatus_t));
+    ns->n_routerstatus_block = n;
+    SMARTLIST_FOREACH_BEGIN(ns->routerstatus_list, routerstatus_t *, rs) {
+      routerstatus_t *dest = &ns->routerstatus_block[rs_sl_idx];
+      memcpy(dest, rs, sizeof(routerstatus_t));
+      tor_free(rs);
+      SMARTLIST_REPLACE_CURRENT(ns->routerstatus_list, rs, dest);
+    } SMARTLIST_FOREACH_END(rs);
+  }
   if (ns_type != NS_TYPE_CONSENSUS) {
     digest256map_t *ed_id_map = digest256map_new();
     SMARTLIST_FOREACH_BEGIN(ns->routerstatus_list, vote_routerstatus_t *,
@@ -99,8 +99,13 @@ typedef enum {
  * If the interval ends before we run out of bandwidth, we go back to
  * step one.
  *
- * Accounting is controlled by the AccountingMax, AccountingRule, and
- * AccountingStart options.
+ * Alternatively, if AccountingPacing is set, we stay up for the whole
+ * interval, and every minute we limit our global token buckets to the rate
+ * that would spread our remaining bytes over the remaining time.  The
+ * hibernation logic above stays in place in case we run out anyway.
+ *
+ * Accounting is controlled by the AccountingMax, AccountingRule,
+ * AccountingStart, and AccountingPacing options.
  */
 
 /** How many bytes have we read in this accounting interval? */
@@ -125,6 +130,11 @@ static time_t interval_wakeup_time = 0;
 /** How much bandwidth do we 'expect' to use per minute?  (0 if we have no
  * info from the last period.) */
 static uint64_t expected_bandwidth_usage = 0;
+/** If we are pacing our traffic to fit our quota, the most bytes per second
+ * that we want to read or write; 0 if we are not pacing. */
+static uint32_t pacing_rate = 0;
+/** When did we last compute pacing_rate? */
+static time_t pacing_rate_computed_at = 0;
 /** What unit are we using for our accounting? */
 static time_unit_t cfg_unit = UNIT_MONTH;
 
@@ -142,6 +152,7 @@ static int read_bandwidth_usage(void);
 static time_t start_of_accounting_period_after(time_t now);
 static time_t start_of_accounting_period_containing(time_t now);
 static void accounting_set_wakeup_time(void);
+static void accounting_update_pacing(time_t now, int force);
 static void on_hibernate_state_change(hibernate_state_t prev_state);
 static void hibernate_schedule_wakeup_event(time_t now, time_t end_time);
 static void wakeup_event_callback(mainloop_event_t *ev, void *data);
@@ -312,6 +323,94 @@ accounting_get_end_time,(void))
   return interval_end_time;
 }
 
+/** Return true iff we should spread our accounting quota over the whole
+ * interval, rather than running at full speed and then hibernating. */
+static int
+accounting_pacing_is_enabled(const or_options_t *options)
+{
+  return accounting_is_enabled(options) && options->AccountingPacing;
+}
+
+/** How often, in seconds, do we recompute our pacing rate? */
+#define PACING_UPDATE_INTERVAL 60
+/** The lowest rate, in bytes per second, that we'll pace ourselves to.  Any
+ * slower and we'd be of little use to the network: better to run out of
+ * quota and hibernate as usual. */
+#define PACING_MIN_RATE RELAY_REQUIRED_MIN_BANDWIDTH
+
+/** Return the number of bytes per second that we can read and write until
+ * <b>end</b> without exceeding <b>acct_max</b>, given that at <b>now</b> we
+ * have used <b>used</b> bytes as counted by the AccountingRule <b>rule</b>.
+ * Never return more than <b>max_rate</b>, or (unless <b>max_rate</b> is
+ * lower) less than PACING_MIN_RATE. */
+STATIC uint32_t
+accounting_compute_pacing_rate(uint64_t acct_max, uint64_t used, int rule,
+                               time_t now, time_t end, uint32_t max_rate)
+{
+  uint64_t remaining = (used < acct_max) ? acct_max - used : 0;
+  time_t time_left = end - now;
+  uint64_t rate;
+
+  if (time_left < PACING_UPDATE_INTERVAL)
+    time_left = PACING_UPDATE_INTERVAL;
+  /* Our token buckets limit reading and writing separately, so if both of
+   * them count against the same quota, each one gets half. */
+  if (rule == ACCT_SUM)
+    remaining /= 2;
+
+  rate = remaining / time_left;
+  if (rate < PACING_MIN_RATE)
+    rate = PACING_MIN_RATE;
+  if (rate > max_rate)
+    rate = max_rate;
+  return (uint32_t) rate;
+}
+
+/** If we are pacing our traffic to fit our accounting quota, return the most
+ * bytes per second that we should read or write.  Otherwise return 0. */
+uint32_t
+accounting_get_pacing_rate(void)
+{
+  if (! accounting_pacing_is_enabled(get_options()))
+    return 0;
+  return pacing_rate;
+}
+
+/** If we are pacing our traffic, and it has been PACING_UPDATE_INTERVAL
+ * seconds since we last did so (or <b>force</b> is true), recompute our
+ * pacing rate from the bytes and time left in this interval, and apply it to
+ * the global token buckets. */
+static void
+accounting_update_pacing(time_t now, int force)
+{
+  const or_options_t *options = get_options();
+  uint32_t rate;
+
+  if (! accounting_pacing_is_enabled(options)) {
+    pacing_rate = 0;
+    pacing_rate_computed_at = 0;
+    return;
+  }
+  if (!force && now < pacing_rate_computed_at + PACING_UPDATE_INTERVAL)
+    return;
+
+  rate = accounting_compute_pacing_rate(options->AccountingMax,
+                                        get_accounting_bytes(),
+                                        options->AccountingRule,
+                                        now, interval_end_time,
+                              (uint32_t) MIN(options->BandwidthRate,
+                                             UINT32_MAX));
+  pacing_rate_computed_at = now;
+  if (rate == pacing_rate)
+    return;
+
+  log_info(LD_ACCT, "Pacing our traffic to %u bytes per second, so that "
+           "our accounting quota lasts until the end of the interval.",
+           (unsigned) rate);
+  pacing_rate = rate;
+  connection_bucket_adjust(options);
+}
+
 /** Called from connection.c to tell us that <b>seconds</b> seconds have
  * passed, <b>n_read</b> bytes have been read, and <b>n_written</b>
  * bytes have been written. */
@@ -458,6 +557,7 @@ configure_accounting(time_t now)
     }
   }
   accounting_set_wakeup_time();
+  accounting_update_pacing(now, 1);
 }
 
 /** Return the relevant number of bytes sent/received this interval
@@ -580,6 +680,7 @@ accounting_run_housekeeping(time_t now)
       log_warn(LD_FS, "Couldn't record bandwidth usage to disk.");
     }
   }
+  accounting_update_pacing(now, 0);
 }
 
 /** Based on our interval and our estimated bandwidth, choose a
@@ -617,6 +718,21 @@ accounting_set_wakeup_time(void)
     crypto_rand(digest, DIGEST_LEN);
   }
 
+  if (accounting_pacing_is_enabled(get_options())) {
+    char buf1[ISO_TIME_LEN+1];
+    char buf2[ISO_TIME_LEN+1];
+    format_local_iso_time(buf1, interval_start_time);
+    format_local_iso_time(buf2, interval_end_time);
+    interval_wakeup_time = interval_start_time;
+
+    log_notice(LD_ACCT,
+           "Configured accounting. This interval begins at %s "
+           "and ends at %s. We will stay awake, and limit our bandwidth so "
+           "that our quota lasts the whole interval.",
+           buf1, buf2);
+    return;
+  }
+
   if (!expected_bandwidth_usage) {
     char buf1[ISO_TIME_LEN+1];
     char buf2[ISO_TIME_LEN+1];
@@ -1220,6 +1336,8 @@ accounting_free_all(void)
   hibernate_state = HIBERNATE_STATE_INITIAL;
   hibernate_end_time = 0;
   shutdown_time = 0;
+  pacing_rate = 0;
+  pacing_rate_computed_at = 0;
 }
 
 #ifdef TOR_UNIT_TESTS
@@ -18,6 +18,7 @@ int accounting_parse_options(const or_options_t *options, int validate_only);
 MOCK_DECL(int, accounting_is_enabled, (const or_options_t *options));
 int accounting_get_interval_length(void);
 MOCK_DECL(time_t, accounting_get_end_time, (void));
+uint32_t accounting_get_pacing_rate(void);
 void configure_accounting(time_t now);
 uint64_t get_accounting_bytes(void);
 void accounting_run_housekeeping(time_t now);
@@ -52,6 +53,11 @@ typedef enum {
   HIBERNATE_STATE_INITIAL=5
 } hibernate_state_t;
 
+STATIC uint32_t accounting_compute_pacing_rate(uint64_t acct_max,
+                                               uint64_t used, int rule,
+                                               time_t now, time_t end,
+                                               uint32_t max_rate);
+
 #ifdef TOR_UNIT_TESTS
 void hibernate_set_state_for_testing_(hibernate_state_t newstate);
 #endif
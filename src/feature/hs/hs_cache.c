@@ -13,6 +13,7 @@
 #include "app/config/config.h"
 #include "lib/crypt_ops/crypto_format.h"
 #include "lib/crypt_ops/crypto_util.h"
+#include "lib/memarea/memarea.h"
 #include "feature/hs/hs_ident.h"
 #include "feature/hs/hs_common.h"
 #include "feature/hs/hs_client.h"
@@ -24,140 +25,400 @@
 
 #include "feature/nodelist/networkstatus_st.h"
 
+#include "siphash.h"
+
 static int cached_client_descriptor_has_expired(time_t now,
            const hs_cache_client_descriptor_t *cached_desc);
 
 /********************** Directory HS cache ******************/
 
-/* Directory descriptor cache. Map indexed by blinded key. */
-static digest256map_t *hs_cache_v3_dir;
+/* The directory descriptor cache keeps each descriptor, along with the few
+ * plaintext fields it needs, in the arena of a segment: one per
+ * HS_CACHE_DIR_SEGMENT_LEN seconds of arrivals. A segment goes away all at
+ * once, when every descriptor in it has expired or been replaced, so cleaning
+ * the cache mostly only has to look at the segments. Before then, once
+ * enough of a segment belongs to descriptors we've removed, we copy the rest
+ * into a new arena to get the memory back.
+ *
+ * Descriptors are looked up by blinded key in an open-addressing hash table
+ * of pointers, probed linearly. */
+
+/* Segments of the directory descriptor cache, oldest first. */
+static smartlist_t *hs_cache_v3_dir_segments;
+
+/* The directory descriptor index: a power of two number of slots, each of
+ * them NULL or pointing to a cached descriptor, and how many aren't NULL. */
+static hs_cache_dir_descriptor_t **dir_index_slots;
+static size_t dir_index_n_slots;
+static size_t dir_index_n_used;
+
+/* The fewest slots the directory descriptor index has. */
+#define DIR_INDEX_MIN_SLOTS 64
+
+/* We compact a directory cache segment once at least 1 in this many of the
+ * bytes it holds belong to descriptors that aren't cached anymore. */
+#define DIR_SEGMENT_COMPACT_FRACTION 2
+
+/* Return the slot where the index starts looking for <b>key</b>. Anyone can
+ * pick a blinded key, so we use a keyed hash to keep them from all landing
+ * in the same place. */
+static inline size_t
+dir_index_home_slot(const uint8_t *key)
+{
+  return (size_t) siphash24g(key, ED25519_PUBKEY_LEN) &
+         (dir_index_n_slots - 1);
+}
 
-/* Remove a given descriptor from our cache. */
-static void
-remove_v3_desc_as_dir(const hs_cache_dir_descriptor_t *desc)
+/* Return the index slot holding the descriptor for <b>key</b>, or if there
+ * is none, the empty slot where it would go. */
+static size_t
+dir_index_find_slot(const uint8_t *key)
 {
-  tor_assert(desc);
-  digest256map_remove(hs_cache_v3_dir, desc->key);
+  size_t i = dir_index_home_slot(key);
+
+  while (dir_index_slots[i] &&
+         tor_memneq(dir_index_slots[i]->key, key, ED25519_PUBKEY_LEN)) {
+    i = (i + 1) & (dir_index_n_slots - 1);
+  }
+  return i;
 }
 
-/* Store a given descriptor in our cache. */
+/* Rebuild the directory descriptor index with <b>n_slots</b> slots. */
 static void
-store_v3_desc_as_dir(hs_cache_dir_descriptor_t *desc)
+dir_index_resize(size_t n_slots)
 {
-  tor_assert(desc);
-  digest256map_set(hs_cache_v3_dir, desc->key, desc);
+  hs_cache_dir_descriptor_t **old_slots = dir_index_slots;
+  size_t old_n_slots = dir_index_n_slots;
+
+  dir_index_slots = tor_calloc(n_slots, sizeof(*dir_index_slots));
+  dir_index_n_slots = n_slots;
+  for (size_t i = 0; i < old_n_slots; ++i) {
+    if (old_slots[i]) {
+      dir_index_slots[dir_index_find_slot(old_slots[i]->key)] = old_slots[i];
+    }
+  }
+  tor_free(old_slots);
+}
+
+/* Add <b>desc</b> to the directory descriptor index, replacing whatever it
+ * had for the same key. */
+STATIC void
+dir_index_add(hs_cache_dir_descriptor_t *desc)
+{
+  size_t i;
+
+  /* Keep the index at most half full, so that probes stay short. */
+  if ((dir_index_n_used + 1) * 2 > dir_index_n_slots) {
+    dir_index_resize(dir_index_n_slots * 2);
+  }
+  i = dir_index_find_slot(desc->key);
+  if (!dir_index_slots[i]) {
+    ++dir_index_n_used;
+  }
+  dir_index_slots[i] = desc;
+}
+
+/* Remove <b>desc</b> from the directory descriptor index, if it's there. */
+STATIC void
+dir_index_remove(const hs_cache_dir_descriptor_t *desc)
+{
+  const size_t mask = dir_index_n_slots - 1;
+  size_t hole = dir_index_find_slot(desc->key);
+
+  if (dir_index_slots[hole] != desc) {
+    return;
+  }
+  dir_index_slots[hole] = NULL;
+  --dir_index_n_used;
+
+  /* Move back any following entry that the hole would leave unreachable from
+   * its home slot, and so on with the hole it leaves in turn. */
+  for (size_t i = (hole + 1) & mask; dir_index_slots[i]; i = (i + 1) & mask) {
+    size_t home = dir_index_home_slot(dir_index_slots[i]->key);
+    if (((i - home) & mask) >= ((i - hole) & mask)) {
+      dir_index_slots[hole] = dir_index_slots[i];
+      dir_index_slots[i] = NULL;
+      hole = i;
+    }
+  }
+
+  if (dir_index_n_slots > DIR_INDEX_MIN_SLOTS &&
+      dir_index_n_used * 8 < dir_index_n_slots) {
+    dir_index_resize(dir_index_n_slots / 2);
+  }
 }
 
 /* Query our cache and return the entry or NULL if not found. */
-static hs_cache_dir_descriptor_t *
+STATIC hs_cache_dir_descriptor_t *
 lookup_v3_desc_as_dir(const uint8_t *key)
 {
   tor_assert(key);
-  return digest256map_get(hs_cache_v3_dir, key);
+  if (!dir_index_slots) {
+    return NULL;
+  }
+  return dir_index_slots[dir_index_find_slot(key)];
 }
 
-#define cache_dir_desc_free(val) \
-  FREE_AND_NULL(hs_cache_dir_descriptor_t, cache_dir_desc_free_, (val))
+/* Return true iff the cached descriptor <b>desc</b> has expired at
+ * <b>now</b>. */
+static int
+dir_desc_has_expired(const hs_cache_dir_descriptor_t *desc, time_t now)
+{
+  return desc->created_ts <= now - (time_t) desc->lifetime_sec;
+}
+
+/* Return the size of a cache entry in bytes. */
+static size_t
+cache_get_dir_entry_size(const hs_cache_dir_descriptor_t *entry)
+{
+  return sizeof(*entry) + strlen(entry->encoded_desc) + 1;
+}
 
-/* Free a directory descriptor object. */
+#define dir_segment_free(seg) \
+  FREE_AND_NULL(hs_cache_dir_segment_t, dir_segment_free_, (seg))
+
+/* Free a directory cache segment, with all the descriptors in its arena.
+ * They must not be in the index anymore. */
 static void
-cache_dir_desc_free_(hs_cache_dir_descriptor_t *desc)
+dir_segment_free_(hs_cache_dir_segment_t *seg)
 {
-  if (desc == NULL) {
+  if (seg == NULL) {
     return;
   }
-  hs_desc_plaintext_data_free(desc->plaintext_data);
-  tor_free(desc->encoded_desc);
-  tor_free(desc);
+  smartlist_free(seg->descs);
+  memarea_drop_all(seg->area);
+  tor_free(seg);
+}
+
+/* Return the directory cache segment that a descriptor arriving at
+ * <b>now</b> belongs in, creating it if need be. */
+static hs_cache_dir_segment_t *
+dir_segment_for_arrival(time_t now)
+{
+  hs_cache_dir_segment_t *seg = smartlist_len(hs_cache_v3_dir_segments) ?
+    smartlist_get(hs_cache_v3_dir_segments,
+                  smartlist_len(hs_cache_v3_dir_segments) - 1) : NULL;
+
+  /* If the clock went backward, we keep using the newest segment. */
+  if (seg == NULL || now >= seg->start_ts + HS_CACHE_DIR_SEGMENT_LEN) {
+    seg = tor_malloc_zero(sizeof(*seg));
+    seg->start_ts = now - (now % HS_CACHE_DIR_SEGMENT_LEN);
+    seg->area = memarea_new();
+    seg->descs = smartlist_new();
+    smartlist_add(hs_cache_v3_dir_segments, seg);
+  }
+  return seg;
 }
 
-/* Helper function: Use by the free all function using the digest256map
- * interface to cache entries. */
+/* Take into account, in the times of <b>seg</b>, the descriptor
+ * <b>desc</b> that it holds. */
 static void
-cache_dir_desc_free_void(void *ptr)
+dir_segment_note_desc(hs_cache_dir_segment_t *seg,
+                      const hs_cache_dir_descriptor_t *desc)
 {
-  cache_dir_desc_free_(ptr);
+  const time_t expiry_ts = desc->created_ts + (time_t) desc->lifetime_sec;
+
+  seg->newest_ts = MAX(seg->newest_ts, desc->created_ts);
+  if (!seg->first_expiry_ts || expiry_ts < seg->first_expiry_ts) {
+    seg->first_expiry_ts = expiry_ts;
+  }
+  seg->expiry_ts = MAX(seg->expiry_ts, expiry_ts);
 }
 
-/* Create a new directory cache descriptor object from a encoded descriptor.
- * On success, return the heap-allocated cache object, otherwise return NULL if
- * we can't decode the descriptor. */
-static hs_cache_dir_descriptor_t *
-cache_dir_desc_new(const char *desc)
+/* Recompute the times of <b>seg</b> from the descriptors it still has
+ * cached. */
+static void
+dir_segment_update_times(hs_cache_dir_segment_t *seg)
 {
-  hs_cache_dir_descriptor_t *dir_desc;
+  seg->newest_ts = seg->first_expiry_ts = seg->expiry_ts = 0;
+  SMARTLIST_FOREACH(seg->descs, const hs_cache_dir_descriptor_t *, desc,
+                    if (desc->is_cached) dir_segment_note_desc(seg, desc));
+}
 
-  tor_assert(desc);
+/* Return true iff enough of <b>seg</b> belongs to descriptors that aren't
+ * cached anymore that we should compact it. */
+static int
+dir_segment_should_compact(const hs_cache_dir_segment_t *seg)
+{
+  return seg->n_dead_bytes > 0 &&
+    seg->n_dead_bytes * DIR_SEGMENT_COMPACT_FRACTION >= seg->n_bytes;
+}
 
-  dir_desc = tor_malloc_zero(sizeof(hs_cache_dir_descriptor_t));
-  dir_desc->plaintext_data =
-    tor_malloc_zero(sizeof(hs_desc_plaintext_data_t));
-  dir_desc->encoded_desc = tor_strdup(desc);
+/* Copy the descriptors still cached in <b>seg</b> into a new arena, and
+ * free the old one along with the descriptors that aren't cached anymore.
+ * Return the number of bytes freed. */
+static size_t
+dir_segment_compact(hs_cache_dir_segment_t *seg)
+{
+  memarea_t *old_area = seg->area;
+  smartlist_t *old_descs = seg->descs;
+  const size_t bytes_removed = seg->n_dead_bytes;
+
+  seg->area = memarea_new();
+  seg->descs = smartlist_new();
+  SMARTLIST_FOREACH_BEGIN(old_descs, const hs_cache_dir_descriptor_t *,
+                          desc) {
+    hs_cache_dir_descriptor_t *copy;
+    if (!desc->is_cached) {
+      continue;
+    }
+    copy = memarea_memdup(seg->area, desc, sizeof(*desc));
+    copy->encoded_desc = memarea_strdup(seg->area, desc->encoded_desc);
+    /* This replaces the old copy in the index. */
+    dir_index_add(copy);
+    smartlist_add(seg->descs, copy);
+  } SMARTLIST_FOREACH_END(desc);
+  smartlist_free(old_descs);
+  memarea_drop_all(old_area);
+
+  seg->n_bytes -= bytes_removed;
+  seg->n_dead_bytes = 0;
+  /* Update our cache entry allocation size for the OOM. */
+  rend_cache_decrement_allocation(bytes_removed);
+  return bytes_removed;
+}
 
-  if (hs_desc_decode_plaintext(desc, dir_desc->plaintext_data) < 0) {
-    log_debug(LD_DIR, "Unable to decode descriptor. Rejecting.");
-    goto err;
+/* Remove the cached descriptor <b>desc</b> from the index. Its memory stays
+ * in the arena of its segment until the segment is compacted or freed. */
+static void
+dir_desc_uncache(hs_cache_dir_descriptor_t *desc)
+{
+  tor_assert(desc->is_cached);
+
+  dir_index_remove(desc);
+  desc->is_cached = 0;
+  desc->segment->n_cached--;
+  desc->segment->n_dead_bytes += cache_get_dir_entry_size(desc);
+  {
+    char key_b64[BASE64_DIGEST256_LEN + 1];
+    digest256_to_base64(key_b64, (const char *) desc->key);
+    log_info(LD_REND, "Removing v3 descriptor '%s' from HSDir cache",
+             safe_str_client(key_b64));
   }
+}
 
-  /* The blinded pubkey is the indexed key. */
-  dir_desc->key = dir_desc->plaintext_data->blinded_pubkey.pubkey;
-  dir_desc->created_ts = time(NULL);
-  return dir_desc;
+/* Remove what is left of the directory cache segment <b>seg</b> from the
+ * cache, and free it. Return the number of bytes freed. The caller must
+ * remove it from the segment list. */
+static size_t
+dir_segment_drop(hs_cache_dir_segment_t *seg)
+{
+  size_t bytes_removed = seg->n_bytes;
 
- err:
-  cache_dir_desc_free(dir_desc);
-  return NULL;
+  SMARTLIST_FOREACH(seg->descs, hs_cache_dir_descriptor_t *, desc,
+                    if (desc->is_cached) dir_desc_uncache(desc));
+  /* Update our cache entry allocation size for the OOM. */
+  rend_cache_decrement_allocation(bytes_removed);
+  dir_segment_free(seg);
+  return bytes_removed;
 }
 
-/* Return the size of a cache entry in bytes. */
-static size_t
-cache_get_dir_entry_size(const hs_cache_dir_descriptor_t *entry)
+/* Remove a given descriptor from our cache, and free its segment if nothing
+ * else in it is still cached, or compact it if it's mostly dead. */
+static void
+remove_v3_desc_as_dir(hs_cache_dir_descriptor_t *desc)
+{
+  hs_cache_dir_segment_t *seg;
+
+  tor_assert(desc);
+  seg = desc->segment;
+  dir_desc_uncache(desc);
+  if (seg->n_cached == 0) {
+    smartlist_remove_keeporder(hs_cache_v3_dir_segments, seg);
+    dir_segment_drop(seg);
+  } else if (dir_segment_should_compact(seg)) {
+    dir_segment_compact(seg);
+  }
+}
+
+/* Store a given descriptor in our cache. */
+static void
+store_v3_desc_as_dir(hs_cache_dir_descriptor_t *desc)
 {
-  return (sizeof(*entry) + hs_desc_plaintext_obj_size(entry->plaintext_data)
-          + strlen(entry->encoded_desc));
+  tor_assert(desc);
+  dir_index_add(desc);
+  desc->is_cached = 1;
+  desc->segment->n_cached++;
 }
 
-/* Try to store a valid version 3 descriptor in the directory cache. Return 0
- * on success else a negative value is returned indicating that we have a
- * newer version in our cache. On error, caller is responsible to free the
- * given descriptor desc. */
+/* Create a new directory cache descriptor object, arriving at <b>now</b>,
+ * from the encoded descriptor <b>desc</b> and its decoded
+ * <b>plaintext_data</b>. It lives in the arena of the segment for
+ * <b>now</b>. */
+static hs_cache_dir_descriptor_t *
+cache_dir_desc_new(const char *desc,
+                   const hs_desc_plaintext_data_t *plaintext_data,
+                   time_t now)
+{
+  hs_cache_dir_segment_t *seg;
+  hs_cache_dir_descriptor_t *dir_desc;
+  size_t entry_size;
+
+  tor_assert(desc);
+  tor_assert(plaintext_data);
+
+  seg = dir_segment_for_arrival(now);
+  dir_desc = memarea_alloc_zero(seg->area, sizeof(*dir_desc));
+  /* The blinded pubkey is the indexed key. */
+  memcpy(dir_desc->key, plaintext_data->blinded_pubkey.pubkey,
+         sizeof(dir_desc->key));
+  dir_desc->created_ts = now;
+  dir_desc->lifetime_sec = plaintext_data->lifetime_sec;
+  dir_desc->revision_counter = plaintext_data->revision_counter;
+  dir_desc->encoded_desc = memarea_strdup(seg->area, desc);
+  dir_desc->segment = seg;
+
+  smartlist_add(seg->descs, dir_desc);
+  dir_segment_note_desc(seg, dir_desc);
+
+  /* Update our total cache size with this entry for the OOM. This uses the
+   * old HS protocol cache subsystem for which we are tied with. It stays
+   * counted until its segment is compacted or goes. */
+  entry_size = cache_get_dir_entry_size(dir_desc);
+  seg->n_bytes += entry_size;
+  rend_cache_increment_allocation(entry_size);
+
+  return dir_desc;
+}
+
+/* Try to store a valid version 3 descriptor, encoded as <b>desc</b> and with
+ * the decoded <b>plaintext_data</b>, in the directory cache. Return 0 on
+ * success else a negative value is returned indicating that we have a
+ * newer version in our cache. */
 static int
-cache_store_v3_as_dir(hs_cache_dir_descriptor_t *desc)
+cache_store_v3_as_dir(const char *desc,
+                      const hs_desc_plaintext_data_t *plaintext_data)
 {
   hs_cache_dir_descriptor_t *cache_entry;
+  const time_t now = approx_time();
 
   tor_assert(desc);
+  tor_assert(plaintext_data);
 
   /* Verify if we have an entry in the cache for that key and if yes, check
    * if we should replace it? */
-  cache_entry = lookup_v3_desc_as_dir(desc->key);
+  cache_entry = lookup_v3_desc_as_dir(plaintext_data->blinded_pubkey.pubkey);
   if (cache_entry != NULL) {
     /* Only replace descriptor if revision-counter is greater than the one
-     * in our cache */
-    if (cache_entry->plaintext_data->revision_counter >=
-        desc->plaintext_data->revision_counter) {
+     * in our cache, or if ours has expired. */
+    if (!dir_desc_has_expired(cache_entry, now) &&
+        cache_entry->revision_counter >= plaintext_data->revision_counter) {
       log_info(LD_REND, "Descriptor revision counter in our cache is "
                "greater or equal than the one we received (%d/%d). "
                "Rejecting!",
-               (int)cache_entry->plaintext_data->revision_counter,
-               (int)desc->plaintext_data->revision_counter);
+               (int)cache_entry->revision_counter,
+               (int)plaintext_data->revision_counter);
       goto err;
     }
     /* We now know that the descriptor we just received is a new one so
      * remove the entry we currently have from our cache so we can then
      * store the new one. */
     remove_v3_desc_as_dir(cache_entry);
-    rend_cache_decrement_allocation(cache_get_dir_entry_size(cache_entry));
-    cache_dir_desc_free(cache_entry);
   }
   /* Store the descriptor we just got. We are sure here that either we
    * don't have the entry or we have a newer descriptor and the old one
    * has been removed from the cache. */
-  store_v3_desc_as_dir(desc);
-
-  /* Update our total cache size with this entry for the OOM. This uses the
-   * old HS protocol cache subsystem for which we are tied with. */
-  rend_cache_increment_allocation(cache_get_dir_entry_size(desc));
+  store_v3_desc_as_dir(cache_dir_desc_new(desc, plaintext_data, now));
 
   /* XXX: Update HS statistics. We should have specific stats for v3. */
 
@@ -188,8 +449,10 @@ cache_lookup_v3_as_dir(const char *query, const char **desc_out)
     goto err;
   }
 
+  /* Expired entries stay in the index until their segment goes, but we
+   * don't serve them. */
   entry = lookup_v3_desc_as_dir(blinded_key.pubkey);
-  if (entry != NULL) {
+  if (entry != NULL && !dir_desc_has_expired(entry, approx_time())) {
     found = 1;
     if (desc_out) {
       *desc_out = entry->encoded_desc;
@@ -204,8 +467,10 @@ cache_lookup_v3_as_dir(const char *query, const char **desc_out)
 
 /* Clean the v3 cache by removing any entry that has expired using the
  * <b>global_cutoff</b> value. If <b>global_cutoff</b> is 0, the cleaning
- * process will use the lifetime found in the plaintext data section. Return
- * the number of bytes cleaned. */
+ * process will use the lifetime found in the plaintext data section, and
+ * only compact segments once enough of them has expired. Otherwise, we're
+ * short of memory, so we compact every segment we removed anything from.
+ * Return the number of bytes actually freed. */
 STATIC size_t
 cache_clean_v3_as_dir(time_t now, time_t global_cutoff)
 {
@@ -214,77 +479,113 @@ cache_clean_v3_as_dir(time_t now, time_t global_cutoff)
   /* Code flow error if this ever happens. */
   tor_assert(global_cutoff >= 0);
 
-  if (!hs_cache_v3_dir) { /* No cache to clean. Just return. */
+  if (!hs_cache_v3_dir_segments) { /* No cache to clean. Just return. */
     return 0;
   }
 
-  DIGEST256MAP_FOREACH_MODIFY(hs_cache_v3_dir, key,
-                              hs_cache_dir_descriptor_t *, entry) {
-    size_t entry_size;
-    time_t cutoff = global_cutoff;
-    if (!cutoff) {
-      /* Cutoff is the lifetime of the entry found in the descriptor. */
-      cutoff = now - entry->plaintext_data->lifetime_sec;
+  SMARTLIST_FOREACH_BEGIN(hs_cache_v3_dir_segments,
+                          hs_cache_dir_segment_t *, seg) {
+    if (global_cutoff && seg->newest_ts > global_cutoff) {
+      /* Only some entries of this segment are older than the cutoff: remove
+       * those from the cache. */
+      SMARTLIST_FOREACH(seg->descs, hs_cache_dir_descriptor_t *, desc,
+                        if (desc->is_cached &&
+                            desc->created_ts <= global_cutoff)
+                          dir_desc_uncache(desc));
+    } else if (!global_cutoff && seg->expiry_ts > now) {
+      /* Some entries of this segment haven't expired yet: remove the ones
+       * that have, if there are any. */
+      if (seg->first_expiry_ts > now) {
+        continue;
+      }
+      SMARTLIST_FOREACH(seg->descs, hs_cache_dir_descriptor_t *, desc,
+                        if (desc->is_cached &&
+                            dir_desc_has_expired(desc, now))
+                          dir_desc_uncache(desc));
+    } else {
+      /* Here, our whole segment has expired, remove and free. */
+      SMARTLIST_DEL_CURRENT_KEEPORDER(hs_cache_v3_dir_segments, seg);
+      bytes_removed += dir_segment_drop(seg);
+      continue;
     }
 
-    /* If the entry has been created _after_ the cutoff, not expired so
-     * continue to the next entry in our v3 cache. */
-    if (entry->created_ts > cutoff) {
+    if (seg->n_cached == 0) {
+      SMARTLIST_DEL_CURRENT_KEEPORDER(hs_cache_v3_dir_segments, seg);
+      bytes_removed += dir_segment_drop(seg);
       continue;
     }
-    /* Here, our entry has expired, remove and free. */
-    MAP_DEL_CURRENT(key);
-    entry_size = cache_get_dir_entry_size(entry);
-    bytes_removed += entry_size;
-    /* Entry is not in the cache anymore, destroy it. */
-    cache_dir_desc_free(entry);
-    /* Update our cache entry allocation size for the OOM. */
-    rend_cache_decrement_allocation(entry_size);
-    /* Logging. */
-    {
-      char key_b64[BASE64_DIGEST256_LEN + 1];
-      digest256_to_base64(key_b64, (const char *) key);
-      log_info(LD_REND, "Removing v3 descriptor '%s' from HSDir cache",
-               safe_str_client(key_b64));
+    dir_segment_update_times(seg);
+    if (global_cutoff ? seg->n_dead_bytes > 0 :
+                        dir_segment_should_compact(seg)) {
+      bytes_removed += dir_segment_compact(seg);
     }
-  } DIGEST256MAP_FOREACH_END;
+  } SMARTLIST_FOREACH_END(seg);
 
   return bytes_removed;
 }
 
+/* Log how many descriptors the directory cache holds and how much memory
+ * they take, if it holds any. */
+void
+hs_cache_log_heartbeat(void)
+{
+  size_t total = dir_index_n_slots * sizeof(*dir_index_slots);
+
+  if (dir_index_n_used == 0) {
+    return;
+  }
+
+  SMARTLIST_FOREACH_BEGIN(hs_cache_v3_dir_segments,
+                          hs_cache_dir_segment_t *, seg) {
+    size_t allocated, used;
+    memarea_get_stats(seg->area, &allocated, &used);
+    total += sizeof(*seg) + allocated +
+             smartlist_len(seg->descs) * sizeof(void *);
+  } SMARTLIST_FOREACH_END(seg);
+
+  log_notice(LD_HEARTBEAT,
+             "Our onion service directory cache holds %"TOR_PRIuSZ
+             " v3 descriptors in %d segments, using %"TOR_PRIuSZ
+             " bytes (%"TOR_PRIuSZ" per descriptor).",
+             dir_index_n_used, smartlist_len(hs_cache_v3_dir_segments),
+             total, total / dir_index_n_used);
+}
+
 /* Given an encoded descriptor, store it in the directory cache depending on
  * which version it is. Return a negative value on error. On success, 0 is
  * returned. */
 int
 hs_cache_store_as_dir(const char *desc)
 {
-  hs_cache_dir_descriptor_t *dir_desc = NULL;
+  hs_desc_plaintext_data_t plaintext_data;
+  int ret = -1;
 
   tor_assert(desc);
 
-  /* Create a new cache object. This can fail if the descriptor plaintext data
-   * is unparseable which in this case a log message will be triggered. */
-  dir_desc = cache_dir_desc_new(desc);
-  if (dir_desc == NULL) {
+  /* Decode the descriptor plaintext data. This can fail if it is
+   * unparseable which in this case a log message will be triggered. */
+  memset(&plaintext_data, 0, sizeof(plaintext_data));
+  if (hs_desc_decode_plaintext(desc, &plaintext_data) < 0) {
+    log_debug(LD_DIR, "Unable to decode descriptor. Rejecting.");
     goto err;
   }
 
   /* Call the right function against the descriptor version. At this point,
    * we are sure that the descriptor's version is supported else the
    * decoding would have failed. */
-  switch (dir_desc->plaintext_data->version) {
+  switch (plaintext_data.version) {
   case HS_VERSION_THREE:
   default:
-    if (cache_store_v3_as_dir(dir_desc) < 0) {
+    if (cache_store_v3_as_dir(desc, &plaintext_data) < 0) {
       goto err;
     }
     break;
   }
-  return 0;
+  ret = 0;
 
  err:
-  cache_dir_desc_free(dir_desc);
-  return -1;
+  hs_desc_plaintext_data_free_contents(&plaintext_data);
+  return ret;
 }
 
 /* Using the query, lookup in our directory cache the entry. If found, 1 is
@@ -960,8 +1261,11 @@ void
 hs_cache_init(void)
 {
   /* Calling this twice is very wrong code flow. */
-  tor_assert(!hs_cache_v3_dir);
-  hs_cache_v3_dir = digest256map_new();
+  tor_assert(!hs_cache_v3_dir_segments);
+  hs_cache_v3_dir_segments = smartlist_new();
+  dir_index_n_slots = DIR_INDEX_MIN_SLOTS;
+  dir_index_n_used = 0;
+  dir_index_slots = tor_calloc(dir_index_n_slots, sizeof(*dir_index_slots));
 
   tor_assert(!hs_cache_v3_client);
   hs_cache_v3_client = digest256map_new();
@@ -974,8 +1278,13 @@ hs_cache_init(void)
 void
 hs_cache_free_all(void)
 {
-  digest256map_free(hs_cache_v3_dir, cache_dir_desc_free_void);
-  hs_cache_v3_dir = NULL;
+  if (hs_cache_v3_dir_segments) {
+    SMARTLIST_FOREACH(hs_cache_v3_dir_segments, hs_cache_dir_segment_t *, seg,
+                      dir_segment_free(seg));
+    smartlist_free(hs_cache_v3_dir_segments);
+  }
+  tor_free(dir_index_slots);
+  dir_index_n_slots = dir_index_n_used = 0;
 
   digest256map_free(hs_cache_v3_client, cache_client_desc_free_void);
   hs_cache_v3_client = NULL;
@@ -43,24 +43,36 @@ typedef struct hs_cache_client_intro_state_t {
   digest256map_t *intro_points;
 } hs_cache_client_intro_state_t;
 
+/* The directory cache keeps the descriptors that arrive within this many
+ * seconds of each other in the same segment. */
+#define HS_CACHE_DIR_SEGMENT_LEN (15 * 60)
+
 /* Descriptor representation on the directory side which is a subset of
- * information that the HSDir can decode and serve it. */
+ * information that the HSDir can decode and serve it. It lives in the arena
+ * of the segment of the directory cache it arrived in. */
 typedef struct hs_cache_dir_descriptor_t {
   /* This object is indexed using the blinded pubkey located in the plaintext
-   * data which is populated only once the descriptor has been successfully
-   * decoded and validated. This simply points to that pubkey. */
-  const uint8_t *key;
+   * data of the descriptor. */
+  uint8_t key[ED25519_PUBKEY_LEN];
 
   /* When does this entry has been created. Used to expire entries. */
   time_t created_ts;
 
-  /* Descriptor plaintext information. Obviously, we can't decrypt the
-   * encrypted part of the descriptor. */
-  hs_desc_plaintext_data_t *plaintext_data;
+  /* Lifetime and revision counter from the descriptor plaintext data.
+   * Obviously, we can't decrypt the encrypted part of the descriptor. */
+  uint32_t lifetime_sec;
+  uint64_t revision_counter;
 
   /* Encoded descriptor which is basically in text form. It's a NUL terminated
    * string thus safe to strlen(). */
-  char *encoded_desc;
+  const char *encoded_desc;
+
+  /* The segment whose arena holds this entry. */
+  struct hs_cache_dir_segment_t *segment;
+
+  /* True iff this entry is in the cache index, and hasn't been replaced or
+   * removed. */
+  unsigned int is_cached : 1;
 } hs_cache_dir_descriptor_t;
 
 /* Public API */
@@ -68,6 +80,7 @@ typedef struct hs_cache_dir_descriptor_t {
 void hs_cache_init(void);
 void hs_cache_free_all(void);
 void hs_cache_clean_as_dir(time_t now);
+void hs_cache_log_heartbeat(void);
 size_t hs_cache_handle_oom(time_t now, size_t min_remove_bytes);
 
 unsigned int hs_cache_get_max_descriptor_size(void);
@@ -120,7 +133,37 @@ typedef struct hs_cache_client_descriptor_t {
   char *encoded_desc;
 } hs_cache_client_descriptor_t;
 
+/** Descriptors that arrived in the directory cache within the same
+ * HS_CACHE_DIR_SEGMENT_LEN seconds, allocated together. */
+typedef struct hs_cache_dir_segment_t {
+  /* Descriptors arriving from this time on go in this segment, until
+   * HS_CACHE_DIR_SEGMENT_LEN seconds later. */
+  time_t start_ts;
+  /* When the newest descriptor in this segment arrived. */
+  time_t newest_ts;
+  /* When the first and the last descriptor still cached in this segment
+   * expire. */
+  time_t first_expiry_ts;
+  time_t expiry_ts;
+
+  /* Arena holding the hs_cache_dir_descriptor_t objects of this segment and
+   * their encoded descriptors. */
+  struct memarea_t *area;
+  /* Every hs_cache_dir_descriptor_t in the arena, cached or not. */
+  smartlist_t *descs;
+  /* How many of them are still cached. */
+  unsigned int n_cached;
+  /* How many bytes we counted for them in the rend cache allocation. */
+  size_t n_bytes;
+  /* How many of those bytes belong to descriptors that aren't cached
+   * anymore. */
+  size_t n_dead_bytes;
+} hs_cache_dir_segment_t;
+
 STATIC size_t cache_clean_v3_as_dir(time_t now, time_t global_cutoff);
+STATIC hs_cache_dir_descriptor_t *lookup_v3_desc_as_dir(const uint8_t *key);
+STATIC void dir_index_add(hs_cache_dir_descriptor_t *desc);
+STATIC void dir_index_remove(const hs_cache_dir_descriptor_t *desc);
 
 STATIC hs_cache_client_descriptor_t *
 lookup_v3_desc_as_client(const uint8_t *key);
@@ -202,12 +202,15 @@ hs_circuitmap_get_circuit_impl(hs_token_type_t type,
 
   tor_assert(the_hs_circuitmap);
 
-  /* Check the circuitmap if we have a circuit with this token */
+  /* Check the circuitmap if we have a circuit with this token. The search
+   * token is only read, so it can point at the caller's bytes rather than a
+   * copy of them. */
   {
-    hs_token_t *search_hs_token = hs_token_new(type, token_len, token);
-    tor_assert(search_hs_token);
-    found_circ = get_circuit_with_token(search_hs_token);
-    hs_token_free(search_hs_token);
+    hs_token_t search_hs_token;
+    search_hs_token.type = type;
+    search_hs_token.token_len = token_len;
+    search_hs_token.token = (uint8_t *) token;
+    found_circ = get_circuit_with_token(&search_hs_token);
   }
 
   /* Check that the circuit is useful to us */
@@ -53,9 +53,9 @@ get_auth_key_from_cell(ed25519_public_key_t *auth_key_out,
   }
   case RELAY_COMMAND_INTRODUCE1:
   {
-    const trn_cell_introduce1_t *c_cell = cell;
-    key_array = trn_cell_introduce1_getconstarray_auth_key(cell);
-    auth_key_len = trn_cell_introduce1_getlen_auth_key(c_cell);
+    const hs_intro_introduce1_view_t *c_cell = cell;
+    key_array = c_cell->auth_key;
+    auth_key_len = c_cell->auth_key_len;
     break;
   }
   default:
@@ -378,41 +378,95 @@ send_introduce_ack_cell(or_circuit_t *circ, hs_intro_ack_status_t status)
   return ret;
 }
 
+/* Parse the INTRODUCE1 cell in <b>request</b> of size <b>request_len</b>
+ * into <b>view</b>, without copying anything: the view points into
+ * <b>request</b>, so the request must outlive it. This accepts exactly what
+ * trn_cell_introduce1_parse() accepts. Return the number of bytes parsed on
+ * success, -1 if the cell is invalid or -2 if it is truncated. */
+ssize_t
+hs_intro_parse_introduce1(hs_intro_introduce1_view_t *view,
+                          const uint8_t *request, size_t request_len)
+{
+  const uint8_t *ptr = request;
+  size_t remaining = request_len;
+  uint8_t n_extensions, i;
+
+  tor_assert(view);
+  tor_assert(request);
+
+#define CHECK_REMAINING(n) \
+  do { if (remaining < (n)) return -2; } while (0)
+
+  CHECK_REMAINING(DIGEST_LEN);
+  view->legacy_key_id = ptr;
+  ptr += DIGEST_LEN; remaining -= DIGEST_LEN;
+
+  CHECK_REMAINING(1);
+  view->auth_key_type = *ptr;
+  ptr += 1; remaining -= 1;
+  if (view->auth_key_type != HS_INTRO_AUTH_KEY_TYPE_LEGACY0 &&
+      view->auth_key_type != HS_INTRO_AUTH_KEY_TYPE_LEGACY1 &&
+      view->auth_key_type != HS_INTRO_AUTH_KEY_TYPE_ED25519) {
+    return -1;
+  }
+
+  CHECK_REMAINING(2);
+  view->auth_key_len = ntohs(get_uint16(ptr));
+  ptr += 2; remaining -= 2;
+  CHECK_REMAINING(view->auth_key_len);
+  view->auth_key = ptr;
+  ptr += view->auth_key_len; remaining -= view->auth_key_len;
+
+  /* Extensions are reserved: step over them. */
+  CHECK_REMAINING(1);
+  n_extensions = *ptr;
+  ptr += 1; remaining -= 1;
+  for (i = 0; i < n_extensions; ++i) {
+    uint8_t field_len;
+    CHECK_REMAINING(2);
+    field_len = ptr[1];
+    ptr += 2; remaining -= 2;
+    CHECK_REMAINING(field_len);
+    ptr += field_len; remaining -= field_len;
+  }
+
+#undef CHECK_REMAINING
+
+  /* The rest of the cell is the encrypted section. */
+  view->encrypted = ptr;
+  view->encrypted_len = remaining;
+
+  return (ssize_t) request_len;
+}
+
 /* Validate a parsed INTRODUCE1 <b>cell</b>. Return 0 if valid or else a
  * negative value for an invalid cell that should be NACKed. */
 STATIC int
-validate_introduce1_parsed_cell(const trn_cell_introduce1_t *cell)
+validate_introduce1_parsed_cell(const hs_intro_introduce1_view_t *cell)
 {
-  size_t legacy_key_id_len;
-  const uint8_t *legacy_key_id;
-
   tor_assert(cell);
 
   /* This code path SHOULD NEVER be reached if the cell is a legacy type so
    * safety net here. The legacy ID must be zeroes in this case. */
-  legacy_key_id_len = trn_cell_introduce1_getlen_legacy_key_id(cell);
-  legacy_key_id = trn_cell_introduce1_getconstarray_legacy_key_id(cell);
-  if (BUG(!tor_mem_is_zero((char *) legacy_key_id, legacy_key_id_len))) {
+  if (BUG(!tor_mem_is_zero((char *) cell->legacy_key_id, DIGEST_LEN))) {
     goto invalid;
   }
 
   /* The auth key of an INTRODUCE1 should be of type ed25519 thus leading to a
    * known fixed length as well. */
-  if (trn_cell_introduce1_get_auth_key_type(cell) !=
-      HS_INTRO_AUTH_KEY_TYPE_ED25519) {
+  if (cell->auth_key_type != HS_INTRO_AUTH_KEY_TYPE_ED25519) {
     log_fn(LOG_PROTOCOL_WARN, LD_PROTOCOL,
            "Rejecting invalid INTRODUCE1 cell auth key type. "
            "Responding with NACK.");
     goto invalid;
   }
-  if (trn_cell_introduce1_get_auth_key_len(cell) != ED25519_PUBKEY_LEN ||
-      trn_cell_introduce1_getlen_auth_key(cell) != ED25519_PUBKEY_LEN) {
+  if (cell->auth_key_len != ED25519_PUBKEY_LEN) {
     log_fn(LOG_PROTOCOL_WARN, LD_PROTOCOL,
            "Rejecting invalid INTRODUCE1 cell auth key length. "
            "Responding with NACK.");
     goto invalid;
   }
-  if (trn_cell_introduce1_getlen_encrypted(cell) == 0) {
+  if (cell->encrypted_len == 0) {
     log_fn(LOG_PROTOCOL_WARN, LD_PROTOCOL,
            "Rejecting invalid INTRODUCE1 cell encrypted length. "
            "Responding with NACK.");
@@ -435,17 +489,17 @@ handle_introduce1(or_circuit_t *client_circ, const uint8_t *request,
 {
   int ret = -1;
   or_circuit_t *service_circ;
-  trn_cell_introduce1_t *parsed_cell;
+  hs_intro_introduce1_view_t parsed_cell;
   hs_intro_ack_status_t status = HS_INTRO_ACK_STATUS_SUCCESS;
 
   tor_assert(client_circ);
   tor_assert(request);
 
-  /* Parse cell. Note that we can only parse the non encrypted section for
-   * which we'll use the authentication key to find the service introduction
-   * circuit and relay the cell on it. */
-  ssize_t cell_size = trn_cell_introduce1_parse(&parsed_cell, request,
-                                               request_len);
+  /* Parse cell in place. Note that we can only parse the non encrypted
+   * section for which we'll use the authentication key to find the service
+   * introduction circuit and relay the cell on it. */
+  ssize_t cell_size = hs_intro_parse_introduce1(&parsed_cell, request,
+                                                request_len);
   if (cell_size < 0) {
     log_fn(LOG_PROTOCOL_WARN, LD_PROTOCOL,
            "Rejecting %s INTRODUCE1 cell. Responding with NACK.",
@@ -456,7 +510,7 @@ handle_introduce1(or_circuit_t *client_circ, const uint8_t *request,
   }
 
   /* Once parsed validate the cell format. */
-  if (validate_introduce1_parsed_cell(parsed_cell) < 0) {
+  if (validate_introduce1_parsed_cell(&parsed_cell) < 0) {
     /* Inform client that the INTRODUCE1 has bad format. */
     status = HS_INTRO_ACK_STATUS_BAD_FORMAT;
     goto send_ack;
@@ -465,7 +519,8 @@ handle_introduce1(or_circuit_t *client_circ, const uint8_t *request,
   /* Find introduction circuit through our circuit map. */
   {
     ed25519_public_key_t auth_key;
-    get_auth_key_from_cell(&auth_key, RELAY_COMMAND_INTRODUCE1, parsed_cell);
+    get_auth_key_from_cell(&auth_key, RELAY_COMMAND_INTRODUCE1,
+                           &parsed_cell);
     service_circ = hs_circuitmap_get_intro_circ_v3_relay_side(&auth_key);
     if (service_circ == NULL) {
       char b64_key[ED25519_BASE64_LEN + 1];
@@ -481,7 +536,7 @@ handle_introduce1(or_circuit_t *client_circ, const uint8_t *request,
   }
 
   /* Relay the cell to the service on its intro circuit with an INTRODUCE2
-   * cell which is the same exact payload. */
+   * cell which is the same exact payload: only the relay command changes. */
   if (relay_send_command_from_edge(CONTROL_CELL_ID, TO_CIRCUIT(service_circ),
                                    RELAY_COMMAND_INTRODUCE2,
                                    (char *) request, request_len, NULL)) {
@@ -510,7 +565,6 @@ handle_introduce1(or_circuit_t *client_circ, const uint8_t *request,
     circuit_mark_for_close(TO_CIRCUIT(client_circ), END_CIRC_REASON_INTERNAL);
   }
  done:
-  trn_cell_introduce1_free(parsed_cell);
   return ret;
 }
 
@@ -39,11 +39,29 @@ typedef struct hs_intropoint_t {
   smartlist_t *link_specifiers;
 } hs_intropoint_t;
 
+/* An INTRODUCE1 cell parsed in place: the pointers point into the payload
+ * it was parsed from. */
+typedef struct hs_intro_introduce1_view_t {
+  /* Always zeroes for a non legacy cell. DIGEST_LEN bytes. */
+  const uint8_t *legacy_key_id;
+
+  /* Authentication key material. */
+  uint8_t auth_key_type;
+  uint16_t auth_key_len;
+  const uint8_t *auth_key;
+
+  /* Encrypted section, up to the end of the cell. */
+  const uint8_t *encrypted;
+  size_t encrypted_len;
+} hs_intro_introduce1_view_t;
+
 int hs_intro_received_establish_intro(or_circuit_t *circ,
                                       const uint8_t *request,
                                       size_t request_len);
 int hs_intro_received_introduce1(or_circuit_t *circ, const uint8_t *request,
                                  size_t request_len);
+ssize_t hs_intro_parse_introduce1(hs_intro_introduce1_view_t *view,
+                                  const uint8_t *request, size_t request_len);
 
 MOCK_DECL(int, hs_intro_send_intro_established_cell,(or_circuit_t *circ));
 
@@ -70,7 +88,8 @@ get_auth_key_from_cell(ed25519_public_key_t *auth_key_out,
 STATIC int introduce1_cell_is_legacy(const uint8_t *request);
 STATIC int handle_introduce1(or_circuit_t *client_circ,
                              const uint8_t *request, size_t request_len);
-STATIC int validate_introduce1_parsed_cell(const trn_cell_introduce1_t *cell);
+STATIC int validate_introduce1_parsed_cell(
+                                  const hs_intro_introduce1_view_t *cell);
 STATIC int circuit_is_suitable_for_introduce1(const or_circuit_t *circ);
 
 #endif /* defined(HS_INTROPOINT_PRIVATE) */
@@ -32,6 +32,7 @@
 #include "lib/crypt_ops/crypto_rand.h"
 #include "lib/crypt_ops/crypto_rand.h"
 #include "lib/crypt_ops/crypto_util.h"
+#include "lib/time/compat_time.h"
 
 #include "feature/hs/hs_circuit.h"
 #include "feature/hs/hs_common.h"
@@ -1332,6 +1333,7 @@ service_descriptor_free_(hs_service_descriptor_t *desc)
     smartlist_free(desc->previous_hsdirs);
   }
   crypto_ope_free(desc->ope_cipher);
+  tor_free(desc->encoded_desc);
   tor_free(desc);
 }
 
@@ -1665,28 +1667,73 @@ setup_desc_intro_point(const ed25519_keypair_t *signing_kp,
   return ret;
 }
 
+/* Helper: free a hs_desc_intro_point_t given as a void pointer. */
+static void
+desc_intro_point_free_void(void *obj)
+{
+  hs_desc_intro_point_free_(obj);
+}
+
+/* Return true iff the descriptor intro point <b>desc_ip</b>, built for an
+ * earlier upload, has certificates that are valid for long enough that we
+ * can put it in a new descriptor as is, at time <b>now</b>. */
+static int
+desc_intro_point_is_reusable(const hs_desc_intro_point_t *desc_ip,
+                             time_t now)
+{
+  /* All the certificates of an intro point are made at once with the same
+   * lifetime, so looking at one of them is enough. */
+  return desc_ip->auth_key_cert &&
+         desc_ip->auth_key_cert->valid_until >=
+           now + HS_DESC_CERT_LIFETIME / 2;
+}
+
 /* Using the given descriptor from the given service, build the descriptor
  * intro point list so we can then encode the descriptor for publication. This
  * function does not pick intro points, they have to be in the descriptor
  * current map. Cryptographic material (keys) must be initialized in the
- * descriptor for this function to make sense. */
-static void
+ * descriptor for this function to make sense.
+ *
+ * Signing their certificates is the costly part of building intro points, so
+ * we keep those from the last time we were called for an intro point we
+ * still have, as long as their certificates are far enough from expiring. */
+STATIC void
 build_desc_intro_points(const hs_service_t *service,
                         hs_service_descriptor_t *desc, time_t now)
 {
   hs_desc_encrypted_data_t *encrypted;
+  digest256map_t *previous_ips;
 
   tor_assert(service);
   tor_assert(desc);
 
   /* Ease our life. */
   encrypted = &desc->desc->encrypted_data;
-  /* Cleanup intro points, we are about to set them from scratch. */
+
+  /* Set aside the intro points we can reuse, indexed by authentication key,
+   * and cleanup the rest: we are about to set them from scratch. */
+  previous_ips = digest256map_new();
+  SMARTLIST_FOREACH_BEGIN(encrypted->intro_points,
+                          hs_desc_intro_point_t *, desc_ip) {
+    if (desc_intro_point_is_reusable(desc_ip, now)) {
+      hs_desc_intro_point_t *dup =
+        digest256map_set(previous_ips,
+                         desc_ip->auth_key_cert->signed_key.pubkey, desc_ip);
+      hs_desc_intro_point_free(dup);
+      SMARTLIST_DEL_CURRENT(encrypted->intro_points, desc_ip);
+    }
+  } SMARTLIST_FOREACH_END(desc_ip);
   hs_descriptor_clear_intro_points(desc->desc);
 
   DIGEST256MAP_FOREACH(desc->intro_points.map, key,
                        const hs_service_intro_point_t *, ip) {
-    hs_desc_intro_point_t *desc_ip = hs_desc_intro_point_new();
+    hs_desc_intro_point_t *desc_ip =
+      digest256map_remove(previous_ips, ip->auth_key_kp.pubkey.pubkey);
+    if (desc_ip) {
+      smartlist_add(encrypted->intro_points, desc_ip);
+      continue;
+    }
+    desc_ip = hs_desc_intro_point_new();
     if (setup_desc_intro_point(&desc->signing_kp, ip, now, desc_ip) < 0) {
       hs_desc_intro_point_free(desc_ip);
       continue;
@@ -1694,6 +1741,8 @@ build_desc_intro_points(const hs_service_t *service,
     /* We have a valid descriptor intro point. Add it to the list. */
     smartlist_add(encrypted->intro_points, desc_ip);
   } DIGEST256MAP_FOREACH_END;
+
+  digest256map_free(previous_ips, desc_intro_point_free_void);
 }
 
 /* Populate the descriptor encrypted section from the given service object.
@@ -2795,15 +2844,42 @@ run_build_circuit_event(time_t now)
   } FOR_EACH_SERVICE_END;
 }
 
-/* Encode and sign the service descriptor desc and upload it to the given
- * hidden service directory.  This does nothing if PublishHidServDescriptors
- * is false. */
+/* Encode and sign the service descriptor <b>desc</b> of <b>service</b> for
+ * upload, replacing the copy we encoded for its last upload, and note in the
+ * service state how long that took. Return 0 on success else -1. */
+static int
+service_desc_encode_for_upload(hs_service_t *service,
+                               hs_service_descriptor_t *desc)
+{
+  monotime_t start, end;
+  uint64_t usec;
+  int ret;
+
+  tor_assert(service);
+  tor_assert(desc);
+
+  tor_free(desc->encoded_desc);
+
+  monotime_get(&start);
+  ret = service_encode_descriptor(service, desc, &desc->signing_kp,
+                                  &desc->encoded_desc);
+  monotime_get(&end);
+
+  usec = monotime_diff_usec(&start, &end);
+  service->state.desc_encode_usec_last = usec;
+  service->state.desc_encode_usec_total += usec;
+  service->state.n_desc_encodes++;
+
+  return ret;
+}
+
+/* Upload the service descriptor desc, as encoded by
+ * service_desc_encode_for_upload(), to the given hidden service directory.
+ * This does nothing if PublishHidServDescriptors is false. */
 static void
 upload_descriptor_to_hsdir(const hs_service_t *service,
                            hs_service_descriptor_t *desc, const node_t *hsdir)
 {
-  char *encoded_desc = NULL;
-
   tor_assert(service);
   tor_assert(desc);
   tor_assert(hsdir);
@@ -2816,15 +2892,13 @@ upload_descriptor_to_hsdir(const hs_service_t *service,
     goto end;
   }
 
-  /* First of all, we'll encode the descriptor. This should NEVER fail but
-   * just in case, let's make sure we have an actual usable descriptor. */
-  if (BUG(service_encode_descriptor(service, desc, &desc->signing_kp,
-                                    &encoded_desc) < 0)) {
+  /* If encoding failed, we have no usable descriptor to upload. */
+  if (!desc->encoded_desc) {
     goto end;
   }
 
   /* Time to upload the descriptor to the directory. */
-  hs_service_upload_desc_to_dir(encoded_desc, service->config.version,
+  hs_service_upload_desc_to_dir(desc->encoded_desc, service->config.version,
                                 &service->keys.identity_pk,
                                 &desc->blinded_kp.pubkey, hsdir->rs);
 
@@ -2854,7 +2928,6 @@ upload_descriptor_to_hsdir(const hs_service_t *service,
   }
 
  end:
-  tor_free(encoded_desc);
   return;
 }
 
@@ -2934,9 +3007,12 @@ set_descriptor_revision_counter(hs_service_descriptor_t *hs_desc, time_t now,
 /* Encode and sign the service descriptor desc and upload it to the
  * responsible hidden service directories. If for_next_period is true, the set
  * of directories are selected using the next hsdir_index. This does nothing
- * if PublishHidServDescriptors is false. */
+ * if PublishHidServDescriptors is false.
+ *
+ * The descriptor is encoded and signed once, and all the directories get that
+ * same copy. */
 STATIC void
-upload_descriptor_to_all(const hs_service_t *service,
+upload_descriptor_to_all(hs_service_t *service,
                          hs_service_descriptor_t *desc)
 {
   smartlist_t *responsible_dirs = NULL;
@@ -2951,6 +3027,14 @@ upload_descriptor_to_all(const hs_service_t *service,
    * the directory. Closing all pending requests avoids that. */
   close_directory_connections(service, desc);
 
+  /* Encode the descriptor. This should NEVER fail but just in case, if it
+   * does, we have no descriptor and won't upload anything this time. */
+  if (get_options()->PublishHidServDescriptors &&
+      BUG(service_desc_encode_for_upload(service, desc) < 0)) {
+    log_warn(LD_BUG, "Unable to encode descriptor for service %s.",
+             safe_str_client(service->onion_address));
+  }
+
   /* Get our list of responsible HSDir. */
   responsible_dirs = smartlist_new();
   /* The parameter 0 means that we aren't a client so tell the function to use
@@ -3619,6 +3703,10 @@ hs_service_lookup_current_desc(const ed25519_public_key_t *pk)
   service = find_service(hs_service_map, pk);
   if (service && service->desc_current) {
     char *encoded_desc = NULL;
+    /* If we have uploaded the descriptor, that is the one to report. */
+    if (service->desc_current->encoded_desc) {
+      return tor_strdup(service->desc_current->encoded_desc);
+    }
     /* No matter what is the result (which should never be a failure), return
      * the encoded variable, if success it will contain the right thing else
      * it will be NULL. */
@@ -3632,6 +3720,28 @@ hs_service_lookup_current_desc(const ed25519_public_key_t *pk)
   return NULL;
 }
 
+/* Given the public key of a service, return a newly allocated string
+ * describing how long the service took to encode and sign the descriptors it
+ * uploaded, in microseconds: for the last one, and for all of them together.
+ * Return NULL if we have no such service. */
+char *
+hs_service_lookup_encode_time(const ed25519_public_key_t *pk)
+{
+  const hs_service_t *service;
+  char *answer = NULL;
+
+  tor_assert(pk);
+
+  service = find_service(hs_service_map, pk);
+  if (service) {
+    tor_asprintf(&answer, "LAST=%" PRIu64 " TOTAL=%" PRIu64 " COUNT=%" PRIu32,
+                 service->state.desc_encode_usec_last,
+                 service->state.desc_encode_usec_total,
+                 service->state.n_desc_encodes);
+  }
+  return answer;
+}
+
 /* Return the number of service we have configured and usable. */
 unsigned int
 hs_service_get_num_services(void)
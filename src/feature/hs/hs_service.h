@@ -142,6 +142,10 @@ typedef struct hs_service_descriptor_t {
   /** The OPE cipher for encrypting revision counters for this descriptor.
    *  Tied to the descriptor blinded key. */
   struct crypto_ope_t *ope_cipher;
+
+  /** The descriptor as we last encoded and signed it for upload, or NULL if
+   *  we haven't uploaded it yet. Every HSDir of an upload gets this copy. */
+  char *encoded_desc;
 } hs_service_descriptor_t;
 
 /* Service key material. */
@@ -245,6 +249,13 @@ typedef struct hs_service_state_t {
   /* When is the next time we should rotate our descriptors. This is has to be
    * done at the start time of the next SRV protocol run. */
   time_t next_rotation_time;
+
+  /* How long, in microseconds, it took to encode and sign the last
+   * descriptor we uploaded, and all of them together. */
+  uint64_t desc_encode_usec_last;
+  uint64_t desc_encode_usec_total;
+  /* How many descriptors we've encoded and signed for upload. */
+  uint32_t n_desc_encodes;
 } hs_service_state_t;
 
 /* Representation of a service running on this tor instance. */
@@ -314,6 +325,7 @@ int hs_service_receive_introduce2(origin_circuit_t *circ,
 void hs_service_intro_circ_has_closed(origin_circuit_t *circ);
 
 char *hs_service_lookup_current_desc(const ed25519_public_key_t *pk);
+char *hs_service_lookup_encode_time(const ed25519_public_key_t *pk);
 
 hs_service_add_ephemeral_status_t
 hs_service_add_ephemeral(ed25519_secret_key_t *sk, smartlist_t *ports,
@@ -404,8 +416,11 @@ service_authorized_client_free_(hs_service_authorized_client_t *client);
 STATIC int
 write_address_to_file(const hs_service_t *service, const char *fname_);
 
-STATIC void upload_descriptor_to_all(const hs_service_t *service,
+STATIC void upload_descriptor_to_all(hs_service_t *service,
                                      hs_service_descriptor_t *desc);
+STATIC void build_desc_intro_points(const hs_service_t *service,
+                                    hs_service_descriptor_t *desc,
+                                    time_t now);
 
 STATIC void service_desc_schedule_upload(hs_service_descriptor_t *desc,
                                          time_t now,
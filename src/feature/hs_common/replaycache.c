@@ -16,6 +16,16 @@
  * RSA-encrypted portion of the handshake, since the rest of the handshake is
  * malleable.)
  *
+ * The cache is a list of cuckoo filters, each one taking entries for a
+ * while before we start a new one.  Looking up or adding an entry is a
+ * couple of bucket reads per filter, and aging entries out means dropping
+ * whole filters from the front of the list, so neither depends on how many
+ * entries we hold.  The price is that a filter can claim to hold something
+ * it was never shown, with a probability we choose when creating the cache:
+ * that is, we sometimes reject an INTRODUCE2 cell as a replay when it isn't
+ * one, but never accept a replay as new.  Entries also stay in the cache for
+ * up to one scrub interval past the horizon, for the same reason.
+ *
  * This module is used from rendservice.c.
  */
 
@@ -23,6 +33,188 @@
 
 #include "core/or/or.h"
 #include "feature/hs_common/replaycache.h"
+#include "lib/crypt_ops/crypto_rand.h"
+#include "lib/crypt_ops/crypto_util.h"
+
+/** How many fingerprints each filter bucket holds. */
+#define REPLAYCACHE_BUCKET_SLOTS 4
+/** How many buckets the smallest filter has. */
+#define REPLAYCACHE_MIN_BUCKETS 64
+/** How many entries we'll move around trying to insert one entry before we
+ * give up and call the filter full. */
+#define REPLAYCACHE_MAX_KICKS 500
+/** When a filter fills up before its time, how much bigger its successor
+ * should be. */
+#define REPLAYCACHE_GROWTH 4
+/** The false positive rate we use unless asked for another one. */
+#define REPLAYCACHE_DEFAULT_FP_RATE 1e-6
+/** How many live filters we size our fingerprints for: the false positive
+ * rate we were asked for holds across this many of them at once. */
+#define REPLAYCACHE_FP_GENERATIONS 8
+
+/** Allocate a new, empty filter of <b>n_buckets</b> buckets that starts
+ * taking entries at <b>present</b>. */
+static replaycache_filter_t *
+replaycache_filter_new(size_t n_buckets, time_t present)
+{
+  replaycache_filter_t *f = tor_malloc_zero(sizeof(*f));
+  f->start_ts = f->newest_ts = present;
+  f->n_buckets = n_buckets;
+  f->slots = tor_calloc(n_buckets * REPLAYCACHE_BUCKET_SLOTS,
+                        sizeof(*f->slots));
+  return f;
+}
+
+/** Free the filter <b>f</b>. */
+static void
+replaycache_filter_free_(replaycache_filter_t *f)
+{
+  if (!f)
+    return;
+  tor_free(f->slots);
+  tor_free(f);
+}
+#define replaycache_filter_free(f) \
+  FREE_AND_NULL(replaycache_filter_t, replaycache_filter_free_, (f))
+
+/** Return the other bucket of <b>f</b> that an entry with fingerprint
+ * <b>fp</b> in bucket <b>idx</b> could live in. */
+static inline size_t
+replaycache_filter_alt_bucket(const replaycache_filter_t *f, size_t idx,
+                              uint32_t fp)
+{
+  return (idx ^ (size_t) (fp * UINT32_C(0x5bd1e995))) & (f->n_buckets - 1);
+}
+
+/** Return true iff bucket <b>idx</b> of <b>f</b> holds <b>fp</b>. */
+static inline int
+replaycache_bucket_has(const replaycache_filter_t *f, size_t idx, uint32_t fp)
+{
+  const uint32_t *bucket = f->slots + idx * REPLAYCACHE_BUCKET_SLOTS;
+  int i;
+  for (i = 0; i < REPLAYCACHE_BUCKET_SLOTS; ++i) {
+    if (bucket[i] == fp)
+      return 1;
+  }
+  return 0;
+}
+
+/** Put <b>fp</b> in a free slot of bucket <b>idx</b> of <b>f</b>. Return 0
+ * on success, -1 if the bucket is full. */
+static inline int
+replaycache_bucket_insert(replaycache_filter_t *f, size_t idx, uint32_t fp)
+{
+  uint32_t *bucket = f->slots + idx * REPLAYCACHE_BUCKET_SLOTS;
+  int i;
+  for (i = 0; i < REPLAYCACHE_BUCKET_SLOTS; ++i) {
+    if (bucket[i] == 0) {
+      bucket[i] = fp;
+      return 0;
+    }
+  }
+  return -1;
+}
+
+/** Return true iff <b>f</b> probably holds the entry with hash <b>h</b> and
+ * fingerprint <b>fp</b>. */
+static int
+replaycache_filter_contains(const replaycache_filter_t *f, uint64_t h,
+                            uint32_t fp)
+{
+  const size_t idx = (size_t) h & (f->n_buckets - 1);
+  return f->victim == fp ||
+    replaycache_bucket_has(f, idx, fp) ||
+    replaycache_bucket_has(f, replaycache_filter_alt_bucket(f, idx, fp), fp);
+}
+
+/** Add the entry with hash <b>h</b> and fingerprint <b>fp</b> to <b>f</b>,
+ * moving other entries to their alternate buckets if we must.  This always
+ * succeeds, but may leave <b>f</b> marked as full. */
+static void
+replaycache_filter_insert(replaycache_filter_t *f, uint64_t h, uint32_t fp)
+{
+  size_t idx = (size_t) h & (f->n_buckets - 1);
+  int n;
+
+  ++f->n_items;
+  if (f->n_items * 16 >= f->n_buckets * REPLAYCACHE_BUCKET_SLOTS * 15) {
+    /* Past this load, inserts start to take a lot of kicks. */
+    f->is_full = 1;
+  }
+
+  if (replaycache_bucket_insert(f, idx, fp) == 0)
+    return;
+  idx = replaycache_filter_alt_bucket(f, idx, fp);
+  if (replaycache_bucket_insert(f, idx, fp) == 0)
+    return;
+
+  /* Both buckets are full: evict someone from one of them, and find them a
+   * new home in their other bucket, and so on. */
+  for (n = 0; n < REPLAYCACHE_MAX_KICKS; ++n) {
+    uint32_t *slot = f->slots + idx * REPLAYCACHE_BUCKET_SLOTS +
+      ((fp ^ n) % REPLAYCACHE_BUCKET_SLOTS);
+    uint32_t evicted = *slot;
+    *slot = fp;
+    fp = evicted;
+    idx = replaycache_filter_alt_bucket(f, idx, fp);
+    if (replaycache_bucket_insert(f, idx, fp) == 0)
+      return;
+  }
+
+  /* Nowhere left to put it: keep it to one side, and stop using this
+   * filter for new entries. */
+  f->victim = fp;
+  f->is_full = 1;
+}
+
+/** Return true iff everything in <b>f</b> is older than the horizon of
+ * <b>r</b> as of <b>present</b>. */
+static int
+replaycache_filter_has_expired(const replaycache_t *r,
+                               const replaycache_filter_t *f, time_t present)
+{
+  return r->horizon != 0 && f->newest_ts < present - r->horizon;
+}
+
+/** Return how long each filter of <b>r</b> should take new entries for, or 0
+ * if it should take them until it is full. */
+static time_t
+replaycache_filter_lifetime(const replaycache_t *r)
+{
+  /* Entries live in a filter until its newest entry passes the horizon, so
+   * no filter should take entries for longer than that. */
+  if (r->scrub_interval == 0 ||
+      (r->horizon != 0 && r->scrub_interval > r->horizon))
+    return r->horizon;
+  return r->scrub_interval;
+}
+
+/** Return the filter of <b>r</b> that should take new entries at
+ * <b>present</b>, starting a new one if the newest is full or has been
+ * taking entries for long enough. */
+static replaycache_filter_t *
+replaycache_current_filter(replaycache_t *r, time_t present)
+{
+  replaycache_filter_t *cur = NULL;
+  size_t n_wanted = 0, n_buckets = REPLAYCACHE_MIN_BUCKETS;
+  const time_t lifetime = replaycache_filter_lifetime(r);
+
+  if (smartlist_len(r->filters) > 0) {
+    cur = smartlist_get(r->filters, smartlist_len(r->filters) - 1);
+    if (!cur->is_full &&
+        (lifetime == 0 || present < cur->start_ts + lifetime)) {
+      return cur;
+    }
+    /* Size the next filter from how busy this one was. */
+    n_wanted = cur->n_items * (cur->is_full ? REPLAYCACHE_GROWTH : 2);
+  }
+
+  while (n_buckets * REPLAYCACHE_BUCKET_SLOTS < n_wanted)
+    n_buckets <<= 1;
+  cur = replaycache_filter_new(n_buckets, present);
+  smartlist_add(r->filters, cur);
+  return cur;
+}
 
 /** Free the replaycache r and all of its entries.
  */
@@ -34,8 +226,13 @@ replaycache_free_(replaycache_t *r)
     return;
   }
 
-  if (r->digests_seen) digest256map_free(r->digests_seen, tor_free_);
+  if (r->filters) {
+    SMARTLIST_FOREACH(r->filters, replaycache_filter_t *, f,
+                      replaycache_filter_free(f));
+    smartlist_free(r->filters);
+  }
 
+  memwipe(&r->key, 0, sizeof(r->key));
   tor_free(r);
 }
 
@@ -45,8 +242,19 @@ replaycache_free_(replaycache_t *r)
  */
 replaycache_t *
 replaycache_new(time_t horizon, time_t interval)
+{
+  return replaycache_new_with_fp_rate(horizon, interval,
+                                      REPLAYCACHE_DEFAULT_FP_RATE);
+}
+
+/** As replaycache_new(), but allow the cache to report entries that it
+ * wasn't given as seen with a probability of about <b>fp_rate</b>.
+ */
+replaycache_t *
+replaycache_new_with_fp_rate(time_t horizon, time_t interval, double fp_rate)
 {
   replaycache_t *r = NULL;
+  unsigned fp_bits = 8;
 
   if (horizon < 0) {
     log_info(LD_BUG, "replaycache_new() called with negative"
@@ -60,11 +268,26 @@ replaycache_new(time_t horizon, time_t interval)
     interval = 0;
   }
 
-  r = tor_malloc(sizeof(*r));
+  if (!(fp_rate > 0 && fp_rate < 1)) {
+    log_info(LD_BUG, "replaycache_new() called with a false positive rate"
+        " out of range");
+    fp_rate = REPLAYCACHE_DEFAULT_FP_RATE;
+  }
+
+  /* A lookup compares the fingerprint against two buckets in each live
+   * filter; choose enough bits that all those comparisons together are
+   * unlikely to match by chance. */
+  while (fp_bits < 32 &&
+         (double) (UINT64_C(1) << fp_bits) * fp_rate <
+         2 * REPLAYCACHE_BUCKET_SLOTS * REPLAYCACHE_FP_GENERATIONS)
+    ++fp_bits;
+
+  r = tor_malloc_zero(sizeof(*r));
   r->scrub_interval = interval;
-  r->scrubbed = 0;
   r->horizon = horizon;
-  r->digests_seen = digest256map_new();
+  r->fp_mask = (uint32_t) ((UINT64_C(1) << fp_bits) - 1);
+  crypto_rand((char *) &r->key, sizeof(r->key));
+  r->filters = smartlist_new();
 
  err:
   return r;
@@ -78,8 +301,10 @@ replaycache_add_and_test_internal(
     time_t *elapsed)
 {
   int rv = 0;
-  uint8_t digest[DIGEST256_LEN];
-  time_t *access_time;
+  uint64_t h;
+  uint32_t fp;
+  replaycache_filter_t *found = NULL, *cur;
+  int i;
 
   /* sanity check */
   if (present <= 0 || !r || !data || len == 0) {
@@ -88,46 +313,50 @@ replaycache_add_and_test_internal(
     goto done;
   }
 
-  /* compute digest */
-  crypto_digest256((char *)digest, (const char *)data, len, DIGEST_SHA256);
+  /* drop whatever has aged out, so we don't look through it */
+  replaycache_scrub_if_needed_internal(present, r);
 
-  /* check map */
-  access_time = digest256map_get(r->digests_seen, digest);
+  /* The low bits of the hash pick a bucket; the high bits are the
+   * fingerprint, which can't be 0 since that marks an empty slot. */
+  h = siphash24(data, (unsigned long) len, &r->key);
+  fp = (uint32_t) (h >> 32) & r->fp_mask;
+  if (fp == 0)
+    fp = 1;
 
-  /* seen before? */
-  if (access_time != NULL) {
-    /*
-     * If it's far enough in the past, no hit.  If the horizon is zero, we
-     * never expire.
-     */
-    if (*access_time >= present - r->horizon || r->horizon == 0) {
-      /* replay cache hit, return 1 */
-      rv = 1;
-      /* If we want to output an elapsed time, do so */
-      if (elapsed) {
-        if (present >= *access_time) {
-          *elapsed = present - *access_time;
-        } else {
-          /* We shouldn't really be seeing hits from the future, but... */
-          *elapsed = 0;
-        }
-      }
+  /* seen before? Look at the newest filters first. */
+  for (i = smartlist_len(r->filters) - 1; i >= 0; --i) {
+    replaycache_filter_t *f = smartlist_get(r->filters, i);
+    if (!replaycache_filter_has_expired(r, f, present) &&
+        replaycache_filter_contains(f, h, fp)) {
+      found = f;
+      break;
     }
+  }
+
+  if (found) {
+    /* replay cache hit, return 1 */
+    rv = 1;
     /*
-     * If it's ahead of the cached time, update
+     * If we want to output an elapsed time, do so.  We only know when the
+     * filter last took an entry, so this is a lower bound.
      */
-    if (*access_time < present) {
-      *access_time = present;
+    if (elapsed) {
+      if (present >= found->newest_ts) {
+        *elapsed = present - found->newest_ts;
+      } else {
+        /* We shouldn't really be seeing hits from the future, but... */
+        *elapsed = 0;
+      }
     }
-  } else {
-    /* No, so no hit and update the digest map with the current time */
-    access_time = tor_malloc(sizeof(*access_time));
-    *access_time = present;
-    digest256map_set(r->digests_seen, digest, access_time);
   }
 
-  /* now scrub the cache if it's time */
-  replaycache_scrub_if_needed_internal(present, r);
+  /* Remember it in the newest filter, so that it stays as long as if it were
+   * new. */
+  cur = replaycache_current_filter(r, present);
+  if (found != cur)
+    replaycache_filter_insert(cur, h, fp);
+  if (cur->newest_ts < present)
+    cur->newest_ts = present;
 
  done:
   return rv;
@@ -138,43 +367,22 @@ replaycache_add_and_test_internal(
 STATIC void
 replaycache_scrub_if_needed_internal(time_t present, replaycache_t *r)
 {
-  digest256map_iter_t *itr = NULL;
-  const uint8_t *digest;
-  void *valp;
-  time_t *access_time;
-
   /* sanity check */
-  if (!r || !(r->digests_seen)) {
+  if (!r || !(r->filters)) {
     log_info(LD_BUG, "replaycache_scrub_if_needed_internal() called with"
         " stupid parameters; please fix this.");
     return;
   }
 
-  /* scrub time yet? (scrubbed == 0 indicates never scrubbed before) */
-  if (present - r->scrubbed < r->scrub_interval && r->scrubbed > 0) return;
-
-  /* if we're never expiring, don't bother scrubbing */
-  if (r->horizon == 0) return;
-
-  /* okay, scrub time */
-  itr = digest256map_iter_init(r->digests_seen);
-  while (!digest256map_iter_done(itr)) {
-    digest256map_iter_get(itr, &digest, &valp);
-    access_time = (time_t *)valp;
-    /* aged out yet? */
-    if (*access_time < present - r->horizon) {
-      /* Advance the iterator and remove this one */
-      itr = digest256map_iter_next_rmv(r->digests_seen, itr);
-      /* Free the value removed */
-      tor_free(access_time);
-    } else {
-      /* Just advance the iterator */
-      itr = digest256map_iter_next(r->digests_seen, itr);
-    }
+  /* Filters age out oldest first, and every entry in a filter ages out with
+   * it, so we only need to look at the front of the list. */
+  while (smartlist_len(r->filters) > 0) {
+    replaycache_filter_t *f = smartlist_get(r->filters, 0);
+    if (!replaycache_filter_has_expired(r, f, present))
+      break;
+    smartlist_del_keeporder(r->filters, 0);
+    replaycache_filter_free(f);
   }
-
-  /* update scrubbed timestamp */
-  if (present > r->scrubbed) r->scrubbed = present;
 }
 
 /** Test the buffer of length len point to by data against the replay cache r;
@@ -198,8 +406,8 @@ replaycache_add_test_and_elapsed(
   return replaycache_add_and_test_internal(time(NULL), r, data, len, elapsed);
 }
 
-/** Scrub aged entries out of r if sufficiently long has elapsed since r was
- * last scrubbed.
+/** Scrub aged entries out of r.  This only has to look at the oldest
+ * filters, so it is cheap to call often.
  */
 void
 replaycache_scrub_if_needed(replaycache_t *r)
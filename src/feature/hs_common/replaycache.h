@@ -13,20 +13,45 @@ typedef struct replaycache_t replaycache_t;
 
 #ifdef REPLAYCACHE_PRIVATE
 
+#include "siphash.h"
+
+/** One generation of a replay cache: a cuckoo filter holding fingerprints of
+ * everything we were shown between <b>start_ts</b> and <b>newest_ts</b>. */
+typedef struct replaycache_filter_t {
+  /* When this filter started taking entries */
+  time_t start_ts;
+  /* When this filter last took (or refreshed) an entry */
+  time_t newest_ts;
+  /* Fingerprints, REPLAYCACHE_BUCKET_SLOTS per bucket; 0 is an empty slot */
+  uint32_t *slots;
+  /* Number of buckets; always a power of two */
+  size_t n_buckets;
+  /* Number of fingerprints stored, including the victim */
+  size_t n_items;
+  /* A fingerprint that we couldn't find a slot for, or 0 */
+  uint32_t victim;
+  /* True iff this filter shouldn't take any more entries */
+  unsigned int is_full:1;
+} replaycache_filter_t;
+
 struct replaycache_t {
-  /* Scrub interval */
+  /*
+   * Scrub interval
+   * (how long each filter takes new entries, so how often we can drop one;
+   * 0 means the horizon)
+   */
   time_t scrub_interval;
-  /* Last scrubbed */
-  time_t scrubbed;
   /*
    * Horizon
    * (don't return true on digests in the cache but older than this)
    */
   time_t horizon;
-  /*
-   * Digest map: keys are digests, values are times the digest was last seen
-   */
-  digest256map_t *digests_seen;
+  /* Mask for the fingerprint bits we store per entry */
+  uint32_t fp_mask;
+  /* Key for hashing entries */
+  struct sipkey key;
+  /* List of replaycache_filter_t, oldest first */
+  smartlist_t *filters;
 };
 
 #endif /* defined(REPLAYCACHE_PRIVATE) */
@@ -37,6 +62,8 @@ void replaycache_free_(replaycache_t *r);
 #define replaycache_free(r) \
   FREE_AND_NULL(replaycache_t, replaycache_free_, (r))
 replaycache_t * replaycache_new(time_t horizon, time_t interval);
+replaycache_t * replaycache_new_with_fp_rate(time_t horizon, time_t interval,
+                                             double fp_rate);
 
 #ifdef REPLAYCACHE_PRIVATE
 
@@ -8,8 +8,12 @@
  *  less-frequently-changing router information.
  */
 
+#define MICRODESC_PRIVATE
 #include "core/or/or.h"
 
+#include "lib/container/buffers.h"
+#include "lib/crypt_ops/crypto_curve25519.h"
+#include "lib/crypt_ops/crypto_ed25519.h"
 #include "lib/fdio/fdio.h"
 
 #include "app/config/config.h"
@@ -52,6 +56,8 @@ struct microdesc_cache_t {
   char *cache_fname;
   /** Name of the journal file. */
   char *journal_fname;
+  /** Name of the file holding a snapshot of the parsed cache file. */
+  char *snapshot_fname;
   /** Mmap'd contents of the cache file, or NULL if there is none. */
   tor_mmap_t *cache_content;
   /** Number of bytes used in the journal file. */
@@ -257,6 +263,7 @@ get_microdesc_cache_noload(void)
     HT_INIT(microdesc_map, &cache->map);
     cache->cache_fname = get_cachedir_fname("cached-microdescs");
     cache->journal_fname = get_cachedir_fname("cached-microdescs.new");
+    cache->snapshot_fname = get_cachedir_fname("cached-microdescs.snapshot");
     the_microdesc_cache = cache;
   }
   return the_microdesc_cache;
@@ -478,6 +485,428 @@ microdesc_cache_clear(microdesc_cache_t *cache)
   cache->bytes_dropped = 0;
 }
 
+/* Microdescriptor cache snapshots.
+ *
+ * Parsing the cache file is a large part of what we do at startup on a slow
+ * machine: every microdescriptor has to be tokenized, and its keys decoded
+ * from base64.  So if MicrodescCacheSnapshot is set, we save the parsed
+ * fields of the microdescriptors in the cache file to a snapshot file when
+ * we exit, and on the next start we rebuild the microdesc_t objects from it
+ * instead of parsing the cache file again.  Only this cache is covered:
+ * the consensus is still parsed and checked, and the nodelist rebuilt from
+ * it, at every start.
+ *
+ * The snapshot names the cache file it describes by size and SHA256 digest,
+ * and ends with a SHA256 digest of everything before it.  If either digest
+ * doesn't match, or anything in the snapshot is out of bounds, we ignore
+ * the snapshot and parse the cache file as usual.  The journal is always
+ * parsed.
+ *
+ * All integers are in network order.  The format is:
+ *
+ *   header:  magic[8] version[4] n_records[4] cache_len[8]
+ *            cache_digest[32]
+ *   record:  off[8] bodylen[4] last_listed[8] digest[32]
+ *            onion_pkey_len[2] onion_pkey[onion_pkey_len] flags[1]
+ *            [curve25519_key[32]] [ed25519_key[32]] [ipv6_addr[16] port[2]]
+ *            [n_family[2] (len[2] member[len])*n_family]
+ *            [policy] [ipv6_policy]
+ *   policy:  is_accept[1] n_entries[2] (min_port[2] max_port[2])*n_entries
+ *   trailer: digest[32] of everything above
+ */
+
+/** Magic string at the start of a microdescriptor cache snapshot. */
+#define MD_SNAPSHOT_MAGIC "TorMDSnp"
+/** The version of the snapshot format that we write, and the only one we
+ * read. */
+#define MD_SNAPSHOT_VERSION 1
+/** Length of a snapshot header. */
+#define MD_SNAPSHOT_HEADER_LEN (8 + 4 + 4 + 8 + DIGEST256_LEN)
+
+/** Flags for optional fields in a snapshot record. */
+#define MD_SNAPSHOT_F_CURVE25519   (1<<0)
+#define MD_SNAPSHOT_F_ED25519      (1<<1)
+#define MD_SNAPSHOT_F_IPV6         (1<<2)
+#define MD_SNAPSHOT_F_FAMILY       (1<<3)
+#define MD_SNAPSHOT_F_POLICY       (1<<4)
+#define MD_SNAPSHOT_F_IPV6_POLICY  (1<<5)
+
+/** Helper: append <b>v</b> to <b>buf</b> as a <b>n</b>-byte integer in
+ * network order. */
+static void
+md_snapshot_add_uint(buf_t *buf, uint64_t v, int n)
+{
+  char tmp[8];
+  int i;
+  for (i = n - 1; i >= 0; --i) {
+    tmp[i] = (char)(v & 0xff);
+    v >>= 8;
+  }
+  buf_add(buf, tmp, n);
+}
+
+/** Helper: append <b>policy</b> to <b>buf</b>. */
+static void
+md_snapshot_add_policy(buf_t *buf, const short_policy_t *policy)
+{
+  unsigned i;
+  md_snapshot_add_uint(buf, policy->is_accept, 1);
+  md_snapshot_add_uint(buf, policy->n_entries, 2);
+  for (i = 0; i < policy->n_entries; ++i) {
+    md_snapshot_add_uint(buf, policy->entries[i].min_port, 2);
+    md_snapshot_add_uint(buf, policy->entries[i].max_port, 2);
+  }
+}
+
+/** Encode a snapshot of every microdescriptor in <b>mds</b>, which must all
+ * be saved in the cache file whose contents are the <b>cache_len</b> bytes
+ * at <b>cache_body</b>.  Return the snapshot in a newly allocated string, and
+ * set *<b>len_out</b> to its length. */
+STATIC char *
+microdesc_snapshot_encode(const smartlist_t *mds,
+                          const char *cache_body, size_t cache_len,
+                          size_t *len_out)
+{
+  buf_t *buf = buf_new();
+  char digest[DIGEST256_LEN];
+  char *result;
+  size_t len;
+
+  crypto_digest256(digest, cache_body, cache_len, DIGEST_SHA256);
+  buf_add(buf, MD_SNAPSHOT_MAGIC, 8);
+  md_snapshot_add_uint(buf, MD_SNAPSHOT_VERSION, 4);
+  md_snapshot_add_uint(buf, smartlist_len(mds), 4);
+  md_snapshot_add_uint(buf, cache_len, 8);
+  buf_add(buf, digest, DIGEST256_LEN);
+
+  SMARTLIST_FOREACH_BEGIN(mds, const microdesc_t *, md) {
+    uint8_t flags = 0;
+    tor_assert(md->saved_location == SAVED_IN_CACHE);
+    tor_assert(md->onion_pkey_len <= UINT16_MAX);
+
+    if (md->onion_curve25519_pkey)
+      flags |= MD_SNAPSHOT_F_CURVE25519;
+    if (md->ed25519_identity_pkey)
+      flags |= MD_SNAPSHOT_F_ED25519;
+    if (tor_addr_family(&md->ipv6_addr) == AF_INET6)
+      flags |= MD_SNAPSHOT_F_IPV6;
+    if (md->family)
+      flags |= MD_SNAPSHOT_F_FAMILY;
+    if (md->exit_policy)
+      flags |= MD_SNAPSHOT_F_POLICY;
+    if (md->ipv6_exit_policy)
+      flags |= MD_SNAPSHOT_F_IPV6_POLICY;
+
+    md_snapshot_add_uint(buf, md->off, 8);
+    md_snapshot_add_uint(buf, md->bodylen, 4);
+    md_snapshot_add_uint(buf, (uint64_t)(int64_t)md->last_listed, 8);
+    buf_add(buf, md->digest, DIGEST256_LEN);
+    md_snapshot_add_uint(buf, md->onion_pkey_len, 2);
+    buf_add(buf, md->onion_pkey, md->onion_pkey_len);
+    md_snapshot_add_uint(buf, flags, 1);
+
+    if (md->onion_curve25519_pkey)
+      buf_add(buf, (const char *)md->onion_curve25519_pkey->public_key,
+              CURVE25519_PUBKEY_LEN);
+    if (md->ed25519_identity_pkey)
+      buf_add(buf, (const char *)md->ed25519_identity_pkey->pubkey,
+              ED25519_PUBKEY_LEN);
+    if (flags & MD_SNAPSHOT_F_IPV6) {
+      buf_add(buf, (const char *)tor_addr_to_in6_addr8(&md->ipv6_addr), 16);
+      md_snapshot_add_uint(buf, md->ipv6_orport, 2);
+    }
+    if (md->family) {
+      md_snapshot_add_uint(buf, smartlist_len(md->family), 2);
+      SMARTLIST_FOREACH_BEGIN(md->family, const char *, member) {
+        const size_t member_len = strlen(member);
+        md_snapshot_add_uint(buf, member_len, 2);
+        buf_add(buf, member, member_len);
+      } SMARTLIST_FOREACH_END(member);
+    }
+    if (md->exit_policy)
+      md_snapshot_add_policy(buf, md->exit_policy);
+    if (md->ipv6_exit_policy)
+      md_snapshot_add_policy(buf, md->ipv6_exit_policy);
+  } SMARTLIST_FOREACH_END(md);
+
+  result = buf_extract(buf, &len);
+  buf_free(buf);
+
+  result = tor_realloc(result, len + DIGEST256_LEN);
+  crypto_digest256(result + len, result, len, DIGEST_SHA256);
+  *len_out = len + DIGEST256_LEN;
+  return result;
+}
+
+/** A position in a snapshot that we're decoding. */
+typedef struct md_snapshot_reader_t {
+  /** The next byte to read. */
+  const uint8_t *cp;
+  /** How many bytes are left. */
+  size_t remaining;
+} md_snapshot_reader_t;
+
+/** Helper: if <b>r</b> has at least <b>n</b> bytes left, return a pointer
+ * to the next <b>n</b> and advance past them.  Otherwise return NULL. */
+static const uint8_t *
+md_snapshot_take(md_snapshot_reader_t *r, size_t n)
+{
+  const uint8_t *cp = r->cp;
+  if (n > r->remaining)
+    return NULL;
+  r->cp += n;
+  r->remaining -= n;
+  return cp;
+}
+
+/** Helper: read an <b>n</b>-byte integer in network order from <b>r</b>
+ * into *<b>out</b>.  Return 0 on success, -1 if there aren't enough bytes
+ * left. */
+static int
+md_snapshot_take_uint(md_snapshot_reader_t *r, int n, uint64_t *out)
+{
+  const uint8_t *cp = md_snapshot_take(r, n);
+  uint64_t v = 0;
+  int i;
+  if (!cp)
+    return -1;
+  for (i = 0; i < n; ++i)
+    v = (v << 8) | cp[i];
+  *out = v;
+  return 0;
+}
+
+/** Helper: read a policy from <b>r</b>.  Return it on success, or NULL if
+ * it is truncated or malformed. */
+static short_policy_t *
+md_snapshot_take_policy(md_snapshot_reader_t *r)
+{
+  uint64_t is_accept, n_entries, min_port, max_port;
+  short_policy_t *policy;
+  unsigned i;
+
+  if (md_snapshot_take_uint(r, 1, &is_accept) < 0 || is_accept > 1 ||
+      md_snapshot_take_uint(r, 2, &n_entries) < 0 || n_entries == 0 ||
+      n_entries * 4 > r->remaining)
+    return NULL;
+
+  policy = tor_malloc_zero(offsetof(short_policy_t, entries) +
+                           sizeof(short_policy_entry_t) * n_entries);
+  policy->is_accept = (unsigned) is_accept;
+  policy->n_entries = (unsigned) n_entries;
+  for (i = 0; i < n_entries; ++i) {
+    if (md_snapshot_take_uint(r, 2, &min_port) < 0 ||
+        md_snapshot_take_uint(r, 2, &max_port) < 0 ||
+        min_port < 1 || min_port > max_port) {
+      short_policy_free(policy);
+      return NULL;
+    }
+    policy->entries[i].min_port = (uint16_t) min_port;
+    policy->entries[i].max_port = (uint16_t) max_port;
+  }
+  return policy;
+}
+
+/** Helper: read one snapshot record from <b>r</b>, for a cache file whose
+ * contents are the <b>cache_len</b> bytes at <b>cache_body</b>.  Return a
+ * new microdesc_t whose body points into the cache file, or NULL if the
+ * record is truncated or malformed. */
+static microdesc_t *
+md_snapshot_take_microdesc(md_snapshot_reader_t *r,
+                           const char *cache_body, size_t cache_len)
+{
+  microdesc_t *md = tor_malloc_zero(sizeof(microdesc_t));
+  uint64_t off, bodylen, last_listed, pkey_len, flags, port, n, len;
+  const uint8_t *cp;
+
+  if (md_snapshot_take_uint(r, 8, &off) < 0 ||
+      md_snapshot_take_uint(r, 4, &bodylen) < 0 ||
+      md_snapshot_take_uint(r, 8, &last_listed) < 0)
+    goto err;
+  if (off > cache_len || bodylen > cache_len - off || bodylen < 9 ||
+      fast_memneq(cache_body + off, "onion-key", 9))
+    goto err;
+  md->saved_location = SAVED_IN_CACHE;
+  md->off = (off_t) off;
+  md->body = (char *) cache_body + off;
+  md->bodylen = (size_t) bodylen;
+  md->last_listed = (time_t)(int64_t) last_listed;
+
+  if (!(cp = md_snapshot_take(r, DIGEST256_LEN)))
+    goto err;
+  memcpy(md->digest, cp, DIGEST256_LEN);
+
+  if (md_snapshot_take_uint(r, 2, &pkey_len) < 0 || pkey_len == 0 ||
+      !(cp = md_snapshot_take(r, pkey_len)))
+    goto err;
+  md->onion_pkey = tor_memdup(cp, pkey_len);
+  md->onion_pkey_len = (size_t) pkey_len;
+
+  if (md_snapshot_take_uint(r, 1, &flags) < 0)
+    goto err;
+
+  if (flags & MD_SNAPSHOT_F_CURVE25519) {
+    if (!(cp = md_snapshot_take(r, CURVE25519_PUBKEY_LEN)))
+      goto err;
+    md->onion_curve25519_pkey =
+      tor_memdup(cp, sizeof(curve25519_public_key_t));
+  }
+  if (flags & MD_SNAPSHOT_F_ED25519) {
+    if (!(cp = md_snapshot_take(r, ED25519_PUBKEY_LEN)))
+      goto err;
+    md->ed25519_identity_pkey = tor_memdup(cp, sizeof(ed25519_public_key_t));
+  }
+  if (flags & MD_SNAPSHOT_F_IPV6) {
+    if (!(cp = md_snapshot_take(r, 16)) ||
+        md_snapshot_take_uint(r, 2, &port) < 0)
+      goto err;
+    tor_addr_from_ipv6_bytes(&md->ipv6_addr, (const char *) cp);
+    md->ipv6_orport = (uint16_t) port;
+  }
+  if (flags & MD_SNAPSHOT_F_FAMILY) {
+    md->family = smartlist_new();
+    if (md_snapshot_take_uint(r, 2, &n) < 0)
+      goto err;
+    while (n--) {
+      if (md_snapshot_take_uint(r, 2, &len) < 0 ||
+          !(cp = md_snapshot_take(r, len)))
+        goto err;
+      smartlist_add(md->family, tor_memdup_nulterm(cp, len));
+    }
+  }
+  if ((flags & MD_SNAPSHOT_F_POLICY) &&
+      !(md->exit_policy = md_snapshot_take_policy(r)))
+    goto err;
+  if ((flags & MD_SNAPSHOT_F_IPV6_POLICY) &&
+      !(md->ipv6_exit_policy = md_snapshot_take_policy(r)))
+    goto err;
+
+  return md;
+ err:
+  microdesc_free(md);
+  return NULL;
+}
+
+/** Decode the <b>snap_len</b>-byte snapshot at <b>snap</b>, for a cache
+ * file whose contents are the <b>cache_len</b> bytes at <b>cache_body</b>.
+ * Return a newly allocated list of the microdescriptors it holds, whose
+ * bodies point into the cache file.  If the snapshot is corrupt, or is for
+ * some other cache file, return NULL. */
+STATIC smartlist_t *
+microdesc_snapshot_decode(const char *snap, size_t snap_len,
+                          const char *cache_body, size_t cache_len)
+{
+  md_snapshot_reader_t r;
+  char digest[DIGEST256_LEN];
+  uint64_t version, n_records, snap_cache_len;
+  const uint8_t *snap_cache_digest;
+  smartlist_t *result = NULL;
+
+  if (snap_len < MD_SNAPSHOT_HEADER_LEN + DIGEST256_LEN ||
+      fast_memneq(snap, MD_SNAPSHOT_MAGIC, 8))
+    return NULL;
+  snap_len -= DIGEST256_LEN;
+  crypto_digest256(digest, snap, snap_len, DIGEST_SHA256);
+  if (tor_memneq(digest, snap + snap_len, DIGEST256_LEN))
+    return NULL;
+
+  r.cp = (const uint8_t *) snap + 8;
+  r.remaining = snap_len - 8;
+  md_snapshot_take_uint(&r, 4, &version);
+  md_snapshot_take_uint(&r, 4, &n_records);
+  md_snapshot_take_uint(&r, 8, &snap_cache_len);
+  snap_cache_digest = md_snapshot_take(&r, DIGEST256_LEN);
+  if (version != MD_SNAPSHOT_VERSION || snap_cache_len != cache_len)
+    return NULL;
+  crypto_digest256(digest, cache_body, cache_len, DIGEST_SHA256);
+  if (tor_memneq(digest, snap_cache_digest, DIGEST256_LEN))
+    return NULL;
+
+  result = smartlist_new();
+  while (n_records--) {
+    microdesc_t *md = md_snapshot_take_microdesc(&r, cache_body, cache_len);
+    if (!md)
+      goto err;
+    smartlist_add(result, md);
+  }
+  if (r.remaining)
+    goto err;
+
+  return result;
+ err:
+  SMARTLIST_FOREACH(result, microdesc_t *, md, microdesc_free(md));
+  smartlist_free(result);
+  return NULL;
+}
+
+/** Try to load the microdescriptors in the cache file of <b>cache</b>,
+ * which must be mapped, from its snapshot file.  Return a newly allocated
+ * list of them on success, or NULL if we have no usable snapshot. */
+static smartlist_t *
+microdesc_cache_load_snapshot(microdesc_cache_t *cache)
+{
+  tor_mmap_t *snap;
+  smartlist_t *mds;
+
+  tor_assert(cache->cache_content);
+  if (!get_options()->MicrodescCacheSnapshot)
+    return NULL;
+  if (!(snap = tor_mmap_file(cache->snapshot_fname)))
+    return NULL;
+
+  mds = microdesc_snapshot_decode(snap->data, snap->size,
+                                  cache->cache_content->data,
+                                  cache->cache_content->size);
+  if (mds) {
+    log_info(LD_DIR, "Loaded %d microdescriptors from the cache snapshot.",
+             smartlist_len(mds));
+  } else {
+    log_notice(LD_DIR, "Microdescriptor cache snapshot didn't match the "
+               "cache file. Parsing the cache instead.");
+  }
+  tor_munmap_file(snap);
+  return mds;
+}
+
+/** If MicrodescCacheSnapshot is set, save a snapshot of the
+ * microdescriptors in our cache file, so that we can load them without
+ * parsing the cache file when we next start.  Return 0 on success or if
+ * there is nothing to save, and -1 on failure. */
+int
+microdesc_cache_save_snapshot(void)
+{
+  microdesc_cache_t *cache = the_microdesc_cache;
+  microdesc_t **mdp;
+  smartlist_t *mds;
+  char *snap;
+  size_t snap_len;
+  int r;
+
+  if (!get_options()->MicrodescCacheSnapshot)
+    return 0;
+  if (!cache || !cache->cache_content)
+    return 0;
+
+  mds = smartlist_new();
+  HT_FOREACH(mdp, microdesc_map, &cache->map) {
+    if ((*mdp)->saved_location == SAVED_IN_CACHE && (*mdp)->body)
+      smartlist_add(mds, *mdp);
+  }
+  snap = microdesc_snapshot_encode(mds, cache->cache_content->data,
+                                   cache->cache_content->size, &snap_len);
+  r = write_bytes_to_file(cache->snapshot_fname, snap, snap_len, 1);
+  if (r < 0) {
+    log_warn(LD_DIR, "Couldn't write microdescriptor cache snapshot to %s.",
+             escaped(cache->snapshot_fname));
+  } else {
+    log_info(LD_DIR, "Saved a snapshot of %d cached microdescriptors.",
+             smartlist_len(mds));
+  }
+  smartlist_free(mds);
+  tor_free(snap);
+  return r;
+}
+
 /** Reload the contents of <b>cache</b> from disk.  If it is empty, load it
  * for the first time.  Return 0 on success, -1 on failure. */
 int
@@ -495,8 +924,15 @@ microdesc_cache_reload(microdesc_cache_t *cache)
 
   mm = cache->cache_content = tor_mmap_file(cache->cache_fname);
   if (mm) {
-    added = microdescs_add_to_cache(cache, mm->data, mm->data+mm->size,
-                                    SAVED_IN_CACHE, 0, -1, NULL);
+    smartlist_t *from_snapshot = microdesc_cache_load_snapshot(cache);
+    if (from_snapshot) {
+      added = microdescs_add_list_to_cache(cache, from_snapshot,
+                                           SAVED_IN_CACHE, 0);
+      smartlist_free(from_snapshot);
+    } else {
+      added = microdescs_add_to_cache(cache, mm->data, mm->data+mm->size,
+                                      SAVED_IN_CACHE, 0, -1, NULL);
+    }
     if (added) {
       total += smartlist_len(added);
       smartlist_free(added);
@@ -900,6 +1336,7 @@ microdesc_free_all(void)
     microdesc_cache_clear(the_microdesc_cache);
     tor_free(the_microdesc_cache->cache_fname);
     tor_free(the_microdesc_cache->journal_fname);
+    tor_free(the_microdesc_cache->snapshot_fname);
     tor_free(the_microdesc_cache);
   }
 
@@ -28,6 +28,7 @@ void microdesc_cache_clean(microdesc_cache_t *cache, time_t cutoff, int force);
 int microdesc_cache_rebuild(microdesc_cache_t *cache, int force);
 int microdesc_cache_reload(microdesc_cache_t *cache);
 void microdesc_cache_clear(microdesc_cache_t *cache);
+int microdesc_cache_save_snapshot(void);
 
 microdesc_t *microdesc_cache_lookup_by_digest256(microdesc_cache_t *cache,
                                                  const char *d);
@@ -56,5 +57,15 @@ void microdesc_note_outdated_dirserver(const char *relay_digest);
 int microdesc_relay_is_outdated_dirserver(const char *relay_digest);
 void microdesc_reset_outdated_dirservers_list(void);
 
+#ifdef MICRODESC_PRIVATE
+STATIC char *microdesc_snapshot_encode(const smartlist_t *mds,
+                                       const char *cache_body,
+                                       size_t cache_len, size_t *len_out);
+STATIC smartlist_t *microdesc_snapshot_decode(const char *snap,
+                                              size_t snap_len,
+                                              const char *cache_body,
+                                              size_t cache_len);
+#endif /* defined(MICRODESC_PRIVATE) */
+
 #endif /* !defined(TOR_MICRODESC_H) */
 
@@ -45,6 +45,7 @@
 #include "core/or/channel.h"
 #include "core/or/channelpadding.h"
 #include "core/or/circuitmux.h"
+#include "core/or/circuitmux_class.h"
 #include "core/or/circuitmux_ewma.h"
 #include "core/or/circuitstats.h"
 #include "core/or/connection_edge.h"
@@ -389,12 +390,20 @@ networkstatus_vote_free_(networkstatus_t *ns)
       SMARTLIST_FOREACH(ns->routerstatus_list, vote_routerstatus_t *, rs,
                         vote_routerstatus_free(rs));
     } else {
-      SMARTLIST_FOREACH(ns->routerstatus_list, routerstatus_t *, rs,
-                        routerstatus_free(rs));
+      SMARTLIST_FOREACH_BEGIN(ns->routerstatus_list, routerstatus_t *, rs) {
+        if (rs >= ns->routerstatus_block &&
+            rs < ns->routerstatus_block + ns->n_routerstatus_block) {
+          /* Owned by routerstatus_block; just free its contents. */
+          tor_free(rs->exitsummary);
+        } else {
+          routerstatus_free(rs);
+        }
+      } SMARTLIST_FOREACH_END(rs);
     }
 
     smartlist_free(ns->routerstatus_list);
   }
+  tor_free(ns->routerstatus_block);
 
   if (ns->bw_file_headers) {
     SMARTLIST_FOREACH(ns->bw_file_headers, char *, c, tor_free(c));
@@ -2088,8 +2097,9 @@ networkstatus_set_current_consensus(const char *consensus,
     /* XXXXNM Microdescs: needs a non-ns variant. ???? NM*/
     update_consensus_networkstatus_fetch_time(now);
 
-    /* Change the cell EWMA settings */
+    /* Change the cell EWMA and circuit class settings */
     cmux_ewma_set_options(options, c);
+    cmux_class_set_options(c);
 
     /* XXXX this call might be unnecessary here: can changing the
      * current consensus really alter our view of any OR's rate limits? */
@@ -90,6 +90,13 @@ struct networkstatus_t {
    * are routerstatus_t. */
   smartlist_t *routerstatus_list;
 
+  /** For a parsed consensus, a single array holding the routerstatus_t
+   * objects in routerstatus_list, so that walking the list touches
+   * contiguous memory.  NULL if the entries were allocated one by one. */
+  routerstatus_t *routerstatus_block;
+  /** Number of elements in routerstatus_block. */
+  int n_routerstatus_block;
+
   /** If present, a map from descriptor digest to elements of
    * routerstatus_list. */
   digestmap_t *desc_digest_map;
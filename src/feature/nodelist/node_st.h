@@ -35,16 +35,8 @@ struct node_t {
   /** Position of the node within the list of nodes */
   int nodelist_idx;
 
-  /** The identity digest of this node_t.  No more than one node_t per
-   * identity may exist at a time. */
-  char identity[DIGEST_LEN];
-
-  /** The ed25519 identity of this node_t. This field is nonzero iff we
-   * currently have an ed25519 identity for this node in either md or ri,
-   * _and_ this node has been inserted to the ed25519-to-node map in the
-   * nodelist.
-   */
-  ed25519_public_key_t ed25519_id;
+  /* The fields that path selection examines for every candidate node come
+   * next, so that they share as few cache lines as possible. */
 
   microdesc_t *md;
   routerinfo_t *ri;
@@ -82,13 +74,38 @@ struct node_t {
    * XX/teor - can this become out of date if the torrc changes? */
   unsigned int ipv6_preferred:1;
 
+  /** True iff family_id tells us exactly which other nodes share a declared
+   * family with this one.  Only meaningful while the node is in the
+   * nodelist; see nodelist_refresh_families(). */
+  unsigned int family_is_exact:1;
+  /** If nonzero, this node and the other nodes with the same family_id
+   * are joined by declarations of mutual family. */
+  int family_id;
+
   /** According to the geoip db what country is this router in? */
   /* XXXprop186 what is this suppose to mean with multiple OR ports? */
   country_t country;
 
+  /** The identity digest of this node_t.  No more than one node_t per
+   * identity may exist at a time. */
+  char identity[DIGEST_LEN];
+
+  /** The ed25519 identity of this node_t. This field is nonzero iff we
+   * currently have an ed25519 identity for this node in either md or ri,
+   * _and_ this node has been inserted to the ed25519-to-node map in the
+   * nodelist.
+   */
+  ed25519_public_key_t ed25519_id;
+
   /* The below items are used only by authdirservers for
    * reachability testing. */
 
+  /** The distinct addresses of this node that we've added to the nodelist's
+   * address set, so that we can take them out again when they change. */
+  tor_addr_t *addrs_in_set;
+  /** How many entries there are in addrs_in_set. */
+  int n_addrs_in_set;
+
   /** When was the last time we could reach this OR? */
   time_t last_reachable;        /* IPv4. */
   time_t last_reachable6;       /* IPv6. */
@@ -64,6 +64,7 @@
 #include "feature/nodelist/routerset.h"
 #include "feature/nodelist/torcert.h"
 #include "feature/rend/rendservice.h"
+#include "lib/container/bitarray.h"
 #include "lib/encoding/binascii.h"
 #include "lib/err/backtrace.h"
 #include "lib/geoip/geoip.h"
@@ -111,7 +112,15 @@ static void count_usable_descriptors(int *num_present,
 static void update_router_have_minimum_dir_info(void);
 static double get_frac_paths_needed_for_circs(const or_options_t *options,
                                               const networkstatus_t *ns);
-static void node_add_to_address_set(const node_t *node);
+static void node_update_address_set(node_t *node);
+static void node_remove_from_address_set(node_t *node);
+static void nodelist_clear_families(void);
+
+/** Incremented whenever a node is added to or removed from the nodelist, or
+ * whenever a node's routerinfo, routerstatus, or country changes.  Anything
+ * that caches facts about nodes by their nodelist_idx is stale once this
+ * changes. */
+static uint64_t nodelist_generation = 1;
 
 /** A nodelist_t holds a node_t object for every router we're "willing to use
  * for something".  Specifically, it should hold a node_t for every node that
@@ -138,6 +147,14 @@ typedef struct nodelist_t {
    * nodelist.  We use this to detect outdated nodelists that need to be
    * rebuilt using a newer consensus. */
   time_t live_consensus_valid_after;
+
+  /* The families that nodes declare, as computed by
+   * nodelist_refresh_families(): the list at index N-1 holds every node
+   * whose family_id is N. */
+  smartlist_t *families;
+  /* True if a node has joined or left the nodelist, or some node's declared
+   * family may have changed, since we last computed <b>families</b>. */
+  unsigned int families_dirty:1;
 } nodelist_t;
 
 static inline unsigned int
@@ -232,6 +249,15 @@ node_get_by_ed25519_id,(const ed25519_public_key_t *ed_id))
   return node_get_mutable_by_ed25519_id(ed_id);
 }
 
+/** Return a number that changes whenever the set of nodes in the nodelist,
+ * their order, or the routerinfo, routerstatus, or country of any node
+ * changes. */
+uint64_t
+nodelist_get_generation(void)
+{
+  return nodelist_generation;
+}
+
 /** Internal: return the node_t whose identity_digest is
  * <b>identity_digest</b>.  If none exists, create a new one, add it to the
  * nodelist, and return it.
@@ -254,6 +280,8 @@ node_get_or_create(const char *identity_digest)
   node->nodelist_idx = smartlist_len(the_nodelist->nodes) - 1;
 
   node->country = -1;
+  ++nodelist_generation;
+  the_nodelist->families_dirty = 1;
 
   return node;
 }
@@ -438,36 +466,114 @@ node_addrs_changed(node_t *node)
 {
   node->last_reachable = node->last_reachable6 = 0;
   node->country = -1;
+  ++nodelist_generation;
+}
+
+/** The most distinct addresses a node can have: IPv4 and IPv6 from its
+ * routerstatus and routerinfo, and IPv6 from its microdescriptor. */
+#define NODE_MAX_ADDRS_IN_SET 5
+
+/** Add <b>addr</b> to the <b>n</b> addresses in <b>addrs</b> unless it is
+ * already there. */
+static void
+node_addrs_add_distinct(tor_addr_t *addrs, int *n, const tor_addr_t *addr)
+{
+  int i;
+  for (i = 0; i < *n; ++i) {
+    if (tor_addr_eq(&addrs[i], addr))
+      return;
+  }
+  tor_assert(*n < NODE_MAX_ADDRS_IN_SET);
+  tor_addr_copy(&addrs[(*n)++], addr);
+}
+
+/** Return true iff <b>addr</b> is one of the <b>n</b> addresses in
+ * <b>addrs</b>. */
+static int
+node_addrs_contain(const tor_addr_t *addrs, int n, const tor_addr_t *addr)
+{
+  int i;
+  for (i = 0; i < n; ++i) {
+    if (tor_addr_eq(&addrs[i], addr))
+      return 1;
+  }
+  return 0;
 }
 
-/** Add all address information about <b>node</b> to the current address
- * set (if there is one).
+/** Bring the current address set (if there is one) up to date with the
+ * address information about <b>node</b>: add the addresses it has gained
+ * since we last looked, and remove the ones it has lost.
  */
 static void
-node_add_to_address_set(const node_t *node)
+node_update_address_set(node_t *node)
 {
+  tor_addr_t addrs[NODE_MAX_ADDRS_IN_SET];
+  tor_addr_t a;
+  int n = 0, i;
+
   if (!the_nodelist || !the_nodelist->node_addrs)
     return;
 
-  /* These various address sources can be redundant, but it's likely faster
-   * to add them all than to compare them all for equality. */
-
   if (node->rs) {
-    if (node->rs->addr)
-      address_set_add_ipv4h(the_nodelist->node_addrs, node->rs->addr);
+    if (node->rs->addr) {
+      tor_addr_from_ipv4h(&a, node->rs->addr);
+      node_addrs_add_distinct(addrs, &n, &a);
+    }
     if (!tor_addr_is_null(&node->rs->ipv6_addr))
-      address_set_add(the_nodelist->node_addrs, &node->rs->ipv6_addr);
+      node_addrs_add_distinct(addrs, &n, &node->rs->ipv6_addr);
   }
   if (node->ri) {
-    if (node->ri->addr)
-      address_set_add_ipv4h(the_nodelist->node_addrs, node->ri->addr);
+    if (node->ri->addr) {
+      tor_addr_from_ipv4h(&a, node->ri->addr);
+      node_addrs_add_distinct(addrs, &n, &a);
+    }
     if (!tor_addr_is_null(&node->ri->ipv6_addr))
-      address_set_add(the_nodelist->node_addrs, &node->ri->ipv6_addr);
+      node_addrs_add_distinct(addrs, &n, &node->ri->ipv6_addr);
   }
   if (node->md) {
     if (!tor_addr_is_null(&node->md->ipv6_addr))
-      address_set_add(the_nodelist->node_addrs, &node->md->ipv6_addr);
+      node_addrs_add_distinct(addrs, &n, &node->md->ipv6_addr);
+  }
+
+  /* Most of the time, nothing has changed. */
+  if (n == node->n_addrs_in_set) {
+    for (i = 0; i < n; ++i) {
+      if (!tor_addr_eq(&addrs[i], &node->addrs_in_set[i]))
+        break;
+    }
+    if (i == n)
+      return;
   }
+
+  for (i = 0; i < node->n_addrs_in_set; ++i) {
+    if (!node_addrs_contain(addrs, n, &node->addrs_in_set[i]))
+      address_set_remove(the_nodelist->node_addrs, &node->addrs_in_set[i]);
+  }
+  for (i = 0; i < n; ++i) {
+    if (!node_addrs_contain(node->addrs_in_set, node->n_addrs_in_set,
+                            &addrs[i]))
+      address_set_add(the_nodelist->node_addrs, &addrs[i]);
+  }
+
+  tor_free(node->addrs_in_set);
+  node->n_addrs_in_set = n;
+  if (n)
+    node->addrs_in_set = tor_memdup(addrs, n * sizeof(tor_addr_t));
+}
+
+/** Remove all the addresses of <b>node</b> from the current address set (if
+ * there is one). */
+static void
+node_remove_from_address_set(node_t *node)
+{
+  int i;
+
+  if (the_nodelist && the_nodelist->node_addrs) {
+    for (i = 0; i < node->n_addrs_in_set; ++i)
+      address_set_remove(the_nodelist->node_addrs, &node->addrs_in_set[i]);
+  }
+  tor_free(node->addrs_in_set);
+  node->n_addrs_in_set = 0;
 }
 
 /** Return true if <b>addr</b> is the address of some node in the nodelist.
@@ -493,12 +599,14 @@ nodelist_set_routerinfo(routerinfo_t *ri, routerinfo_t **ri_old_out)
 {
   node_t *node;
   const char *id_digest;
+  const smartlist_t *old_family;
   int had_router = 0;
   tor_assert(ri);
 
   init_nodelist();
   id_digest = ri->cache_info.identity_digest;
   node = node_get_or_create(id_digest);
+  old_family = node_get_declared_family(node);
 
   node_remove_from_ed25519_map(node);
 
@@ -514,6 +622,11 @@ nodelist_set_routerinfo(routerinfo_t *ri, routerinfo_t **ri_old_out)
       *ri_old_out = NULL;
   }
   node->ri = ri;
+  ++nodelist_generation;
+  /* Most new descriptors declare the same family as the old ones: only
+   * recompute the families when one doesn't. */
+  if (!smartlist_strings_eq(old_family, node_get_declared_family(node)))
+    the_nodelist->families_dirty = 1;
 
   node_add_to_ed25519_map(node);
 
@@ -534,7 +647,7 @@ nodelist_set_routerinfo(routerinfo_t *ri, routerinfo_t **ri_old_out)
                          networkstatus_get_latest_consensus());
   }
 
-  node_add_to_address_set(node);
+  node_update_address_set(node);
 
   return node;
 }
@@ -570,6 +683,7 @@ nodelist_add_microdesc(microdesc_t *md)
 
   node->md = md;
   md->held_by_nodes++;
+  the_nodelist->families_dirty = 1;
   /* Setting the HSDir index requires the ed25519 identity key which can
    * only be found either in the ri or md. This is why this is called here.
    * Only nodes supporting HSDir=2 protocol version needs this index. */
@@ -577,7 +691,7 @@ nodelist_add_microdesc(microdesc_t *md)
     node_set_hsdir_index(node, ns);
   }
   node_add_to_ed25519_map(node);
-  node_add_to_address_set(node);
+  node_update_address_set(node);
 
   return node;
 }
@@ -610,12 +724,16 @@ nodelist_set_consensus(networkstatus_t *ns)
 
   SMARTLIST_FOREACH(the_nodelist->nodes, node_t *, node,
                     node->rs = NULL);
+  ++nodelist_generation;
 
-  /* Conservatively estimate that every node will have 2 addresses. */
-  const int estimated_addresses = smartlist_len(ns->routerstatus_list) *
-                                  get_estimated_address_per_node();
-  address_set_free(the_nodelist->node_addrs);
-  the_nodelist->node_addrs = address_set_new(estimated_addresses);
+  /* The address set lives as long as the nodelist: we only update it for
+   * the nodes that changed. Conservatively estimate that every node will
+   * have 2 addresses. */
+  if (!the_nodelist->node_addrs) {
+    const int estimated_addresses = smartlist_len(ns->routerstatus_list) *
+                                    get_estimated_address_per_node();
+    the_nodelist->node_addrs = address_set_new(estimated_addresses);
+  }
 
   SMARTLIST_FOREACH_BEGIN(ns->routerstatus_list, routerstatus_t *, rs) {
     node_t *node = node_get_or_create(rs->identity_digest);
@@ -630,6 +748,7 @@ nodelist_set_consensus(networkstatus_t *ns)
                                                        rs->descriptor_digest);
         if (node->md)
           node->md->held_by_nodes++;
+        the_nodelist->families_dirty = 1;
         node_add_to_ed25519_map(node);
       }
     }
@@ -658,13 +777,9 @@ nodelist_set_consensus(networkstatus_t *ns)
 
   } SMARTLIST_FOREACH_END(rs);
 
+  /* This also brings the address set up to date with the nodes we keep. */
   nodelist_purge();
 
-  /* Now add all the nodes we have to the address set. */
-  SMARTLIST_FOREACH_BEGIN(the_nodelist->nodes, node_t *, node) {
-    node_add_to_address_set(node);
-  } SMARTLIST_FOREACH_END(node);
-
   if (! authdir) {
     SMARTLIST_FOREACH_BEGIN(the_nodelist->nodes, node_t *, node) {
       /* We have no routerstatus for this router. Clear flags so we can skip
@@ -715,9 +830,11 @@ nodelist_remove_microdesc(const char *identity_digest, microdesc_t *md)
   if (node && node->md == md) {
     node->md = NULL;
     md->held_by_nodes--;
+    the_nodelist->families_dirty = 1;
     if (! node_get_ed25519_id(node)) {
       node_remove_from_ed25519_map(node);
     }
+    node_update_address_set(node);
   }
 }
 
@@ -728,9 +845,14 @@ nodelist_remove_routerinfo(routerinfo_t *ri)
   node_t *node = node_get_mutable_by_id(ri->cache_info.identity_digest);
   if (node && node->ri == ri) {
     node->ri = NULL;
+    ++nodelist_generation;
+    if (ri->declared_family)
+      the_nodelist->families_dirty = 1;
     if (! node_is_usable(node)) {
       nodelist_drop_node(node, 1);
       node_free(node);
+    } else {
+      node_update_address_set(node);
     }
   }
 }
@@ -747,6 +869,7 @@ nodelist_drop_node(node_t *node, int remove_from_ht)
     tor_assert(tmp == node);
   }
   node_remove_from_ed25519_map(node);
+  node_remove_from_address_set(node);
 
   idx = node->nodelist_idx;
   tor_assert(idx >= 0);
@@ -758,6 +881,8 @@ nodelist_drop_node(node_t *node, int remove_from_ht)
     tmp->nodelist_idx = idx;
   }
   node->nodelist_idx = -1;
+  ++nodelist_generation;
+  the_nodelist->families_dirty = 1;
 }
 
 /** Return a newly allocated smartlist of the nodes that have <b>md</b> as
@@ -788,11 +913,12 @@ node_free_(node_t *node)
   if (node->md)
     node->md->held_by_nodes--;
   tor_assert(node->nodelist_idx == -1);
+  tor_free(node->addrs_in_set);
   tor_free(node);
 }
 
 /** Remove all entries from the nodelist that don't have enough info to be
- * usable for anything. */
+ * usable for anything, and update the address set for the rest. */
 void
 nodelist_purge(void)
 {
@@ -808,9 +934,11 @@ nodelist_purge(void)
       /* An md is only useful if there is an rs. */
       node->md->held_by_nodes--;
       node->md = NULL;
+      the_nodelist->families_dirty = 1;
     }
 
     if (node_is_usable(node)) {
+      node_update_address_set(node);
       iter = HT_NEXT(nodelist_map, &the_nodelist->nodes_by_id, iter);
     } else {
       iter = HT_NEXT_RMV(nodelist_map, &the_nodelist->nodes_by_id, iter);
@@ -828,6 +956,7 @@ nodelist_free_all(void)
   if (PREDICT_UNLIKELY(the_nodelist == NULL))
     return;
 
+  ++nodelist_generation;
   HT_CLEAR(nodelist_map, &the_nodelist->nodes_by_id);
   HT_CLEAR(nodelist_ed_map, &the_nodelist->nodes_by_ed_id);
   SMARTLIST_FOREACH_BEGIN(the_nodelist->nodes, node_t *, node) {
@@ -837,6 +966,9 @@ nodelist_free_all(void)
 
   smartlist_free(the_nodelist->nodes);
 
+  nodelist_clear_families();
+  smartlist_free(the_nodelist->families);
+
   address_set_free(the_nodelist->node_addrs);
   the_nodelist->node_addrs = NULL;
 
@@ -1849,7 +1981,11 @@ node_set_country(node_t *node)
   else if (node->ri)
     tor_addr_from_ipv4h(&addr, node->ri->addr);
 
-  node->country = geoip_get_country_by_addr(&addr);
+  country_t country = geoip_get_country_by_addr(&addr);
+  if (country != node->country) {
+    node->country = country;
+    ++nodelist_generation;
+  }
 }
 
 /** Set the country code of all routers in the routerlist. */
@@ -1905,6 +2041,227 @@ node_in_nickname_smartlist(const smartlist_t *lst, const node_t *node)
   return 0;
 }
 
+/** Return true iff <b>node1</b> and <b>node2</b> each list the other in
+ * their declared families.  This is the slow way to find out: see
+ * nodes_in_same_family(). */
+int
+nodes_declare_same_family(const node_t *node1, const node_t *node2)
+{
+  const smartlist_t *f1, *f2;
+  f1 = node_get_declared_family(node1);
+  f2 = node_get_declared_family(node2);
+  return f1 && f2 &&
+    node_in_nickname_smartlist(f1, node2) &&
+    node_in_nickname_smartlist(f2, node1);
+}
+
+/** Helper: compare two nodes by their position in the nodelist. */
+static int
+compare_nodes_by_idx_(const void **a_, const void **b_)
+{
+  const node_t *a = *a_, *b = *b_;
+  if (a->nodelist_idx < b->nodelist_idx)
+    return -1;
+  return a->nodelist_idx > b->nodelist_idx;
+}
+
+/** Helper: compare the node <b>key</b> to *<b>member</b> by their position
+ * in the nodelist. */
+static int
+compare_node_to_node_by_idx_(const void *key, const void **member)
+{
+  return compare_nodes_by_idx_(&key, member);
+}
+
+/** Return true iff the family member <b>name</b> is a plain "$" followed by
+ * a hex identity digest, which can only ever match that one relay. */
+static int
+family_name_is_hex_id(const char *name)
+{
+  return name[0] == '$' && strlen(name) == HEX_DIGEST_LEN + 1;
+}
+
+/** Return the representative of <b>idx</b>'s set in the union-find forest
+ * <b>parent</b>, halving the path to it as we go. */
+static int
+family_find(int *parent, int idx)
+{
+  while (parent[idx] != idx) {
+    parent[idx] = parent[parent[idx]];
+    idx = parent[idx];
+  }
+  return idx;
+}
+
+/** Free every family in the nodelist's list of families. */
+static void
+nodelist_clear_families(void)
+{
+  if (!the_nodelist->families)
+    return;
+  SMARTLIST_FOREACH(the_nodelist->families, smartlist_t *, family,
+                    smartlist_free(family));
+  smartlist_clear(the_nodelist->families);
+}
+
+/** Work out the declared families of all the nodes in the nodelist.
+ *
+ * Two nodes share a declared family when each lists the other, so we build
+ * a graph with an edge for every such pair, and use a union-find forest to
+ * split it into connected components.  Each component with more than one
+ * node gets a family ID, which we store in its nodes' family_id.
+ *
+ * Sharing a family isn't transitive, though: if A and B list each other,
+ * and B and C list each other, A and C might not.  So we only set
+ * family_is_exact for a node when its component is a clique, and when
+ * neither it nor any node it lists names a family member by nickname,
+ * since we only follow edges for members named by identity.  For these
+ * nodes, comparing family IDs gives exactly the same answer as
+ * nodes_declare_same_family(); for the rest, we fall back to that. */
+static void
+nodelist_refresh_families(void)
+{
+  smartlist_t *nodes = the_nodelist->nodes;
+  const int n_nodes = smartlist_len(nodes);
+  smartlist_t **named = tor_calloc(n_nodes, sizeof(smartlist_t *));
+  int *parent = tor_calloc(n_nodes, sizeof(int));
+  int *set_size = tor_calloc(n_nodes, sizeof(int));
+  int *n_edges = tor_calloc(n_nodes, sizeof(int));
+  int *family_of_set = tor_calloc(n_nodes, sizeof(int));
+  uint64_t *set_edges = tor_calloc(n_nodes, sizeof(uint64_t));
+  bitarray_t *by_nickname = bitarray_init_zero(n_nodes);
+  int i;
+
+  if (!the_nodelist->families)
+    the_nodelist->families = smartlist_new();
+  nodelist_clear_families();
+
+  /* Find the nodes that each node's declared family names by identity. */
+  for (i = 0; i < n_nodes; ++i) {
+    node_t *node = smartlist_get(nodes, i);
+    const smartlist_t *declared = node_get_declared_family(node);
+
+    parent[i] = i;
+    set_size[i] = 1;
+    node->family_id = 0;
+    node->family_is_exact = 1;
+    if (!declared)
+      continue;
+
+    named[i] = smartlist_new();
+    SMARTLIST_FOREACH_BEGIN(declared, const char *, name) {
+      char digest[DIGEST_LEN];
+      const node_t *member;
+      if (!family_name_is_hex_id(name)) {
+        bitarray_set(by_nickname, i);
+        node->family_is_exact = 0;
+        continue;
+      }
+      if (base16_decode(digest, sizeof(digest), name + 1,
+                        HEX_DIGEST_LEN) != sizeof(digest))
+        continue;
+      member = node_get_by_id(digest);
+      if (member && member != node)
+        smartlist_add(named[i], (node_t *) member);
+    } SMARTLIST_FOREACH_END(name);
+    smartlist_sort(named[i], compare_nodes_by_idx_);
+    smartlist_uniq(named[i], compare_nodes_by_idx_, NULL);
+  }
+
+  /* Join every pair of nodes that name each other. */
+  for (i = 0; i < n_nodes; ++i) {
+    node_t *node = smartlist_get(nodes, i);
+    if (!named[i])
+      continue;
+    SMARTLIST_FOREACH_BEGIN(named[i], const node_t *, member) {
+      const int j = member->nodelist_idx;
+      int root_i, root_j;
+      if (bitarray_is_set(by_nickname, j))
+        node->family_is_exact = 0;
+      if (j < i || !named[j] ||
+          !smartlist_bsearch(named[j], node, compare_node_to_node_by_idx_))
+        continue;
+      ++n_edges[i];
+      ++n_edges[j];
+      root_i = family_find(parent, i);
+      root_j = family_find(parent, j);
+      if (root_i == root_j)
+        continue;
+      if (set_size[root_i] < set_size[root_j]) {
+        int tmp = root_i;
+        root_i = root_j;
+        root_j = tmp;
+      }
+      parent[root_j] = root_i;
+      set_size[root_i] += set_size[root_j];
+    } SMARTLIST_FOREACH_END(member);
+  }
+
+  /* Give each component with more than one node a family ID. */
+  for (i = 0; i < n_nodes; ++i) {
+    node_t *node = smartlist_get(nodes, i);
+    const int root = family_find(parent, i);
+    if (set_size[root] < 2)
+      continue;
+    if (!family_of_set[root]) {
+      smartlist_add(the_nodelist->families, smartlist_new());
+      family_of_set[root] = smartlist_len(the_nodelist->families);
+    }
+    node->family_id = family_of_set[root];
+    smartlist_add(smartlist_get(the_nodelist->families, node->family_id - 1),
+                  node);
+    set_edges[root] += n_edges[i];
+  }
+
+  /* Components that aren't cliques need the slow check. */
+  for (i = 0; i < n_nodes; ++i) {
+    node_t *node = smartlist_get(nodes, i);
+    const int root = family_find(parent, i);
+    const uint64_t size = set_size[root];
+    if (node->family_id && set_edges[root] != size * (size - 1))
+      node->family_is_exact = 0;
+    if (named[i])
+      smartlist_free(named[i]);
+  }
+
+  the_nodelist->families_dirty = 0;
+
+  tor_free(named);
+  tor_free(parent);
+  tor_free(set_size);
+  tor_free(n_edges);
+  tor_free(family_of_set);
+  tor_free(set_edges);
+  bitarray_free(by_nickname);
+}
+
+/** Return true iff we need to recompute the families of the nodes in the
+ * nodelist before we use them. */
+STATIC int
+nodelist_families_are_stale(void)
+{
+  return !the_nodelist->families || the_nodelist->families_dirty;
+}
+
+/** Return true iff <b>node</b> is in the nodelist, and its family_id says
+ * exactly which nodes share its declared family.  Recompute the nodelist's
+ * families first if a node has come or gone, or a declared family has
+ * changed, since we last did. */
+static int
+node_family_is_exact(const node_t *node)
+{
+  if (!the_nodelist ||
+      node->nodelist_idx < 0 ||
+      node->nodelist_idx >= smartlist_len(the_nodelist->nodes) ||
+      smartlist_get(the_nodelist->nodes, node->nodelist_idx) != node)
+    return 0;
+
+  if (nodelist_families_are_stale())
+    nodelist_refresh_families();
+
+  return node->family_is_exact;
+}
+
 /** Return true iff r1 and r2 are in the same family, but not the same
  * router. */
 int
@@ -1922,14 +2279,12 @@ nodes_in_same_family(const node_t *node1, const node_t *node2)
   }
 
   /* Are they in the same family because the agree they are? */
-  {
-    const smartlist_t *f1, *f2;
-    f1 = node_get_declared_family(node1);
-    f2 = node_get_declared_family(node2);
-    if (f1 && f2 &&
-        node_in_nickname_smartlist(f1, node2) &&
-        node_in_nickname_smartlist(f2, node1))
+  if (node1 != node2 &&
+      node_family_is_exact(node1) && node_family_is_exact(node2)) {
+    if (node1->family_id && node1->family_id == node2->family_id)
       return 1;
+  } else if (nodes_declare_same_family(node1, node2)) {
+    return 1;
   }
 
   /* Are they in the same option because the user says they are? */
@@ -1986,7 +2341,13 @@ nodelist_add_node_and_family(smartlist_t *sl, const node_t *node)
 
   /* Now, add all nodes in the declared_family of this node, if they
    * also declare this node to be in their family. */
-  if (declared_family) {
+  if (declared_family && node_family_is_exact(node)) {
+    /* We already know who they are. */
+    if (node->family_id) {
+      smartlist_add_all(sl, smartlist_get(the_nodelist->families,
+                                          node->family_id - 1));
+    }
+  } else if (declared_family) {
     /* Add every r such that router declares familyness with node, and node
      * declares familyhood with router. */
     SMARTLIST_FOREACH_BEGIN(declared_family, const char *, name) {
@@ -98,6 +98,7 @@ const struct curve25519_public_key_t *node_get_curve25519_onion_key(
 crypto_pk_t *node_get_rsa_onion_key(const node_t *node);
 
 MOCK_DECL(smartlist_t *, nodelist_get_list, (void));
+uint64_t nodelist_get_generation(void);
 
 /* Temporary during transition to multiple addresses.  */
 void node_get_addr(const node_t *node, tor_addr_t *addr_out);
@@ -107,6 +108,7 @@ void nodelist_refresh_countries(void);
 void node_set_country(node_t *node);
 void nodelist_add_node_and_family(smartlist_t *nodes, const node_t *node);
 int nodes_in_same_family(const node_t *node1, const node_t *node2);
+int nodes_declare_same_family(const node_t *node1, const node_t *node2);
 
 const node_t *router_find_exact_exit_enclave(const char *address,
                                              uint16_t port);
@@ -159,6 +161,7 @@ int count_loading_descriptors_progress(void);
 
 STATIC void
 node_set_hsdir_index(node_t *node, const networkstatus_t *ns);
+STATIC int nodelist_families_are_stale(void);
 
 #endif /* defined(TOR_UNIT_TESTS) */
 
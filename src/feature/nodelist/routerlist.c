@@ -1434,6 +1434,7 @@ routerlist_free_all(void)
     smartlist_free(warned_nicknames);
     warned_nicknames = NULL;
   }
+  microdesc_download_timing_reset();
   authcert_free_all();
 }
 
@@ -2418,6 +2419,87 @@ max_dl_per_request(const or_options_t *options, int purpose)
  * want more, or until TestingClientMaxIntervalWithoutRequest has passed. */
 #define MAX_DL_TO_DELAY 16
 
+/** Don't record timings for microdescriptor requests that got fewer than
+ * this many answers: they tell us more about latency noise than about
+ * throughput. */
+#define MIN_MD_DL_TO_MEASURE 8
+/** Try to make each microdescriptor request spend at least this many times
+ * as long receiving its answer as it spent waiting for the answer to
+ * start. */
+#define MD_DL_TRANSFER_PER_LATENCY 4
+/** Try not to make any microdescriptor request take longer than this many
+ * msec to arrive, so that a slow source doesn't hold up too many of the
+ * microdescriptors we want. */
+#define MD_DL_MAX_TRANSFER_MSEC 10000
+
+/** A moving average of how long our recent microdescriptor requests waited
+ * for the first byte of their answers, and of how long each microdescriptor
+ * in the answers took to arrive after that, in msec.  Zero if we have no
+ * measurements yet. */
+static double md_dl_latency_msec = 0;
+static double md_dl_msec_per_md = 0;
+
+/** A microdescriptor request that received <b>n_mds</b> microdescriptors
+ * has finished: its answer started <b>latency_msec</b> after we launched
+ * it, and took <b>transfer_msec</b> to arrive.  Remember this, so we can
+ * size our next requests to suit. */
+void
+microdesc_download_note_timing(int n_mds, uint64_t latency_msec,
+                               uint64_t transfer_msec)
+{
+  const double per_md = (double)MAX(transfer_msec, 1) / n_mds;
+  if (n_mds < MIN_MD_DL_TO_MEASURE)
+    return;
+  if (md_dl_msec_per_md <= 0) {
+    md_dl_latency_msec = (double)latency_msec;
+    md_dl_msec_per_md = per_md;
+  } else {
+    md_dl_latency_msec = (3 * md_dl_latency_msec + latency_msec) / 4;
+    md_dl_msec_per_md = (3 * md_dl_msec_per_md + per_md) / 4;
+  }
+  log_debug(LD_DIR, "Microdescriptor requests now take about %.0f msec to "
+            "start answering, and %.2f msec per microdescriptor.",
+            md_dl_latency_msec, md_dl_msec_per_md);
+}
+
+/** Forget our microdescriptor request timings. */
+STATIC void
+microdesc_download_timing_reset(void)
+{
+  md_dl_latency_msec = md_dl_msec_per_md = 0;
+}
+
+/** Return how many of our <b>n_downloadable</b> microdescriptors to ask
+ * for in each request, given that we can ask for at most
+ * <b>max_dl_per_req</b> in one request.
+ *
+ * If we know how our recent requests went, make each request big enough
+ * that its latency is small next to its transfer time, but not so big that
+ * it takes forever to arrive.  When those goals disagree, latency wins,
+ * since an extra round trip costs us more than a slow request. */
+STATIC int
+microdesc_dl_batch_size(int n_downloadable, int max_dl_per_req)
+{
+  const int most = MIN(CEIL_DIV(n_downloadable, MIN_REQUESTS),
+                       max_dl_per_req);
+  int n_per_request = most;
+
+  if (md_dl_msec_per_md > 0) {
+    const double fastest =
+      MD_DL_TRANSFER_PER_LATENCY * md_dl_latency_msec / md_dl_msec_per_md;
+    const double slowest = MD_DL_MAX_TRANSFER_MSEC / md_dl_msec_per_md;
+    if (n_per_request > slowest)
+      n_per_request = (int)slowest;
+    if (n_per_request < fastest)
+      n_per_request = (int)MIN(fastest, most);
+  }
+
+  if (n_per_request < MIN_DL_PER_REQUEST) {
+    n_per_request = MIN(MIN_DL_PER_REQUEST, n_downloadable);
+  }
+  return n_per_request;
+}
+
 /** Given a <b>purpose</b> (FETCH_MICRODESC or FETCH_SERVERDESC) and a list of
  * router descriptor digests or microdescriptor digest256s in
  * <b>downloadable</b>, decide whether to delay fetching until we have more.
@@ -2492,14 +2574,18 @@ launch_descriptor_downloads(int purpose,
       PDS_NO_EXISTING_SERVERDESC_FETCH;
   }
 
-  n_per_request = CEIL_DIV(n_downloadable, MIN_REQUESTS);
   max_dl_per_req = max_dl_per_request(options, purpose);
+  if (fetch_microdesc) {
+    n_per_request = microdesc_dl_batch_size(n_downloadable, max_dl_per_req);
+  } else {
+    n_per_request = CEIL_DIV(n_downloadable, MIN_REQUESTS);
 
-  if (n_per_request > max_dl_per_req)
-    n_per_request = max_dl_per_req;
+    if (n_per_request > max_dl_per_req)
+      n_per_request = max_dl_per_req;
 
-  if (n_per_request < MIN_DL_PER_REQUEST) {
-    n_per_request = MIN(MIN_DL_PER_REQUEST, n_downloadable);
+    if (n_per_request < MIN_DL_PER_REQUEST) {
+      n_per_request = MIN(MIN_DL_PER_REQUEST, n_downloadable);
+    }
   }
 
   if (n_downloadable > n_per_request)
@@ -179,6 +179,8 @@ void routers_sort_by_identity(smartlist_t *routers);
 void refresh_all_country_info(void);
 
 void list_pending_microdesc_downloads(digest256map_t *result);
+void microdesc_download_note_timing(int n_mds, uint64_t latency_msec,
+                                    uint64_t transfer_msec);
 void launch_descriptor_downloads(int purpose,
                                  smartlist_t *downloadable,
                                  const routerstatus_t *source,
@@ -202,6 +204,9 @@ MOCK_DECL(STATIC void, initiate_descriptor_downloads,
           (const routerstatus_t *source, int purpose, smartlist_t *digests,
            int lo, int hi, int pds_flags));
 
+STATIC void microdesc_download_timing_reset(void);
+STATIC int microdesc_dl_batch_size(int n_downloadable, int max_dl_per_req);
+
 #endif /* defined(ROUTERLIST_PRIVATE) */
 
 #endif /* !defined(TOR_ROUTERLIST_H) */
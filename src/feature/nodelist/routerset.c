@@ -35,6 +35,7 @@ n * Copyright (c) 2001-2004, Roger Dingledine.
 #include "feature/nodelist/nodelist.h"
 #include "feature/nodelist/routerset.h"
 #include "lib/geoip/geoip.h"
+#include "lib/intmath/bits.h"
 
 #include "core/or/addr_policy_st.h"
 #include "core/or/extend_info_st.h"
@@ -55,6 +56,55 @@ routerset_new(void)
   return result;
 }
 
+/** Discard the cached node membership bits in <b>set</b>.  Called whenever
+ * the contents of <b>set</b> change. */
+static void
+routerset_forget_node_bits(routerset_t *set)
+{
+  bitarray_free(set->node_known);
+  bitarray_free(set->node_member);
+  set->n_node_bits = 0;
+  set->node_bits_generation = 0;
+}
+
+/** Make sure that the node membership bits in <b>set</b> describe the
+ * current nodelist, discarding them if the nodelist has changed since they
+ * were computed.  Return the current nodelist. */
+static const smartlist_t *
+routerset_prepare_node_bits(routerset_t *set)
+{
+  const smartlist_t *nodes = nodelist_get_list();
+  const uint64_t generation = nodelist_get_generation();
+  const int n_nodes = smartlist_len(nodes);
+
+  if (set->node_bits_generation != generation ||
+      set->n_node_bits < n_nodes) {
+    routerset_forget_node_bits(set);
+    set->node_known = bitarray_init_zero(n_nodes);
+    set->node_member = bitarray_init_zero(n_nodes);
+    set->n_node_bits = n_nodes;
+    set->node_bits_generation = generation;
+  }
+  return nodes;
+}
+
+/** Compute the membership bit for every node in the current nodelist that
+ * we have not yet checked against <b>set</b>.  Return the current
+ * nodelist. */
+static const smartlist_t *
+routerset_compute_all_node_bits(routerset_t *set)
+{
+  const smartlist_t *nodes = routerset_prepare_node_bits(set);
+  SMARTLIST_FOREACH_BEGIN(nodes, const node_t *, node) {
+    if (bitarray_is_set(set->node_known, node_sl_idx))
+      continue;
+    bitarray_set(set->node_known, node_sl_idx);
+    if (routerset_contains_node_uncached(set, node))
+      bitarray_set(set->node_member, node_sl_idx);
+  } SMARTLIST_FOREACH_END(node);
+  return nodes;
+}
+
 /** If <b>c</b> is a country code in the form {cc}, return a newly allocated
  * string holding the "cc" part.  Else, return NULL. */
 STATIC char *
@@ -77,6 +127,7 @@ void
 routerset_refresh_countries(routerset_t *target)
 {
   int cc;
+  routerset_forget_node_bits(target);
   bitarray_free(target->countries);
 
   if (!geoip_is_loaded(AF_INET)) {
@@ -159,6 +210,7 @@ routerset_parse(routerset_t *target, const char *s, const char *description)
   policy_expand_unspec(&target->policies);
   smartlist_add_all(target->list, list);
   smartlist_free(list);
+  routerset_forget_node_bits(target);
   if (added_countries)
     routerset_refresh_countries(target);
   return r;
@@ -329,9 +381,10 @@ routerset_contains_routerstatus(const routerset_t *set,
                             country);
 }
 
-/** Return true iff <b>node</b> is in <b>set</b>. */
-int
-routerset_contains_node(const routerset_t *set, const node_t *node)
+/** Return true iff <b>node</b> is in <b>set</b>, without looking at the
+ * cached node membership bits. */
+STATIC int
+routerset_contains_node_uncached(const routerset_t *set, const node_t *node)
 {
   if (node->rs)
     return routerset_contains_routerstatus(set, node->rs, node->country);
@@ -341,6 +394,35 @@ routerset_contains_node(const routerset_t *set, const node_t *node)
     return 0;
 }
 
+/** Return true iff <b>node</b> is in <b>set</b>.
+ *
+ * For nodes in the nodelist, we remember the answer in a bitmap indexed by
+ * nodelist_idx, which stays valid until the nodelist or <b>set</b>
+ * changes. */
+int
+routerset_contains_node(const routerset_t *set, const node_t *node)
+{
+  if (!set || !set->list)
+    return 0;
+
+  /* The cache is not part of the set's logical value. */
+  routerset_t *mutable_set = (routerset_t *) set;
+  const smartlist_t *nodes = routerset_prepare_node_bits(mutable_set);
+  const int idx = node->nodelist_idx;
+  if (idx < 0 || idx >= smartlist_len(nodes) ||
+      smartlist_get(nodes, idx) != node) {
+    /* Not in the nodelist: we can't cache anything about it. */
+    return routerset_contains_node_uncached(set, node);
+  }
+
+  if (!bitarray_is_set(set->node_known, idx)) {
+    bitarray_set(mutable_set->node_known, idx);
+    if (routerset_contains_node_uncached(set, node))
+      bitarray_set(mutable_set->node_member, idx);
+  }
+  return bitarray_is_set(set->node_member, idx) != 0;
+}
+
 /** Return true iff <b>routerset</b> contains the bridge <b>bridge</b>. */
 int
 routerset_contains_bridge(const routerset_t *set, const bridge_info_t *bridge)
@@ -376,16 +458,33 @@ routerset_get_all_nodes(smartlist_t *out, const routerset_t *routerset,
         }
     });
   } else {
-    /* We need to iterate over the routerlist to get all the ones of the
-     * right kind. */
-    smartlist_t *nodes = nodelist_get_list();
-    SMARTLIST_FOREACH(nodes, const node_t *, node, {
+    /* We need to look at every node to get all the ones of the right
+     * kind: compute membership for all of them, and then combine the two
+     * sets a word at a time. */
+    const smartlist_t *nodes =
+      routerset_compute_all_node_bits((routerset_t *) routerset);
+    const bitarray_t *exclude_bits = NULL;
+    if (excludeset && excludeset->list) {
+      routerset_compute_all_node_bits((routerset_t *) excludeset);
+      exclude_bits = excludeset->node_member;
+    }
+    const int n_nodes = smartlist_len(nodes);
+    const int n_words = (n_nodes + BITARRAY_MASK) >> BITARRAY_SHIFT;
+    int w;
+    for (w = 0; w < n_words; ++w) {
+      unsigned int word = routerset->node_member[w];
+      if (exclude_bits)
+        word &= ~exclude_bits[w];
+      while (word) {
+        const int bit = tor_log2(word & (~word + 1));
+        const node_t *node = smartlist_get(nodes,
+                                           (w << BITARRAY_SHIFT) + bit);
+        word &= word - 1;
         if (running_only && !node->is_running)
           continue;
-        if (routerset_contains_node(routerset, node) &&
-            !routerset_contains_node(excludeset, node))
-          smartlist_add(out, (void*)node);
-    });
+        smartlist_add(out, (void*)node);
+      }
+    }
   }
 }
 
@@ -459,5 +558,6 @@ routerset_free_(routerset_t *routerset)
   strmap_free(routerset->names, NULL);
   digestmap_free(routerset->digests, NULL);
   bitarray_free(routerset->countries);
+  routerset_forget_node_bits(routerset);
   tor_free(routerset);
 }
@@ -52,6 +52,8 @@ STATIC int routerset_contains(const routerset_t *set, const tor_addr_t *addr,
                    uint16_t orport,
                    const char *nickname, const char *id_digest,
                    country_t country);
+STATIC int routerset_contains_node_uncached(const routerset_t *set,
+                                            const node_t *node);
 
 /** A routerset specifies constraints on a set of possible routerinfos, based
  * on their names, identities, or addresses.  It is optimized for determining
@@ -84,6 +86,19 @@ struct routerset_t {
    * routerset_refresh_countries() whenever the geoip country list is
    * reloaded. */
   bitarray_t *countries;
+
+  /** Cached membership of the nodes in the nodelist, indexed by their
+   * nodelist_idx.  Bit i of <b>node_known</b> is set once we have checked
+   * node i against this set; bit i of <b>node_member</b> is then set iff
+   * node i is a member.  Both are only meaningful while the nodelist's
+   * generation is <b>node_bits_generation</b>. */
+  bitarray_t *node_known;
+  bitarray_t *node_member;
+  /** Number of bits allocated in node_known and node_member. */
+  int n_node_bits;
+  /** The value of nodelist_get_generation() when we last reset the node
+   * membership bits, or 0 if we have none. */
+  uint64_t node_bits_generation;
 };
 #endif /* defined(ROUTERSET_PRIVATE) */
 #endif /* !defined(TOR_ROUTERSET_H) */
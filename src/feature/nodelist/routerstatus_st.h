@@ -12,19 +12,10 @@
 /** Contents of a single router entry in a network status object.
  */
 struct routerstatus_t {
-  time_t published_on; /**< When was this router published? */
-  char nickname[MAX_NICKNAME_LEN+1]; /**< The nickname this router says it
-                                      * has. */
-  char identity_digest[DIGEST_LEN]; /**< Digest of the router's identity
-                                     * key. */
-  /** Digest of the router's most recent descriptor or microdescriptor.
-   * If it's a descriptor, we only use the first DIGEST_LEN bytes. */
-  char descriptor_digest[DIGEST256_LEN];
-  uint32_t addr; /**< IPv4 address for this router, in host order. */
-  uint16_t or_port; /**< IPv4 OR port for this router. */
-  uint16_t dir_port; /**< Directory port for this router. */
-  tor_addr_t ipv6_addr; /**< IPv6 address for this router. */
-  uint16_t ipv6_orport; /**< IPv6 OR port for this router. */
+  /* ---- The fields that we examine when choosing nodes for paths and
+   * weighting them by bandwidth come first, so that they share a cache
+   * line. */
+
   unsigned int is_authority:1; /**< True iff this router is an authority. */
   unsigned int is_exit:1; /**< True iff this router is a good exit. */
   unsigned int is_stable:1; /**< True iff this router stays up a long time. */
@@ -52,6 +43,8 @@ struct routerstatus_t {
   unsigned int has_exitsummary:1; /**< The vote/consensus had exit summaries */
   unsigned int bw_is_unmeasured:1; /**< This is a consensus entry, with
                                     * the Unmeasured flag set. */
+  /** The consensus has guardfraction information for this router. */
+  unsigned int has_guardfraction:1;
 
   /** Flags to summarize the protocol versions for this routerstatus_t. */
   protover_summary_flags_t pv;
@@ -59,11 +52,23 @@ struct routerstatus_t {
   uint32_t bandwidth_kb; /**< Bandwidth (capacity) of the router as reported in
                        * the vote/consensus, in kilobytes/sec. */
 
-  /** The consensus has guardfraction information for this router. */
-  unsigned int has_guardfraction:1;
   /** The guardfraction value of this router. */
   uint32_t guardfraction_percentage;
 
+  time_t published_on; /**< When was this router published? */
+  char nickname[MAX_NICKNAME_LEN+1]; /**< The nickname this router says it
+                                      * has. */
+  char identity_digest[DIGEST_LEN]; /**< Digest of the router's identity
+                                     * key. */
+  /** Digest of the router's most recent descriptor or microdescriptor.
+   * If it's a descriptor, we only use the first DIGEST_LEN bytes. */
+  char descriptor_digest[DIGEST256_LEN];
+  uint32_t addr; /**< IPv4 address for this router, in host order. */
+  uint16_t or_port; /**< IPv4 OR port for this router. */
+  uint16_t dir_port; /**< Directory port for this router. */
+  tor_addr_t ipv6_addr; /**< IPv6 address for this router. */
+  uint16_t ipv6_orport; /**< IPv6 OR port for this router. */
+
   char *exitsummary; /**< exit policy summary -
                       * XXX weasel: this probably should not stay a string. */
 
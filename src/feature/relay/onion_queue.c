@@ -21,6 +21,9 @@
  *      them to worker threads.
  *   <li>Expiring onionskins on the relay side if they have waited for
  *     too long.
+ *   <li>Serving the channels that sent us onionskins round-robin, so that a
+ *     single client flooding us with CREATE cells can't crowd everybody
+ *     else out of the queue.
  * </ul>
  **/
 
@@ -30,27 +33,40 @@
 
 #include "app/config/config.h"
 #include "core/mainloop/cpuworker.h"
+#include "core/or/channel.h"
 #include "core/or/circuitlist.h"
 #include "core/or/onion.h"
 #include "feature/nodelist/networkstatus.h"
+#include "ht.h"
 
 #include "core/or/or_circuit_st.h"
 
+struct onion_source_t;
+
 /** Type for a linked list of circuits that are waiting for a free CPU worker
  * to process a waiting onion handshake. */
 typedef struct onion_queue_t {
   TOR_TAILQ_ENTRY(onion_queue_t) next;
+  /** Link in the queue of the source that sent us this onionskin. */
+  TOR_TAILQ_ENTRY(onion_queue_t) next_from_source;
   or_circuit_t *circ;
   uint16_t handshake_type;
   create_cell_t *onionskin;
   time_t when_added;
+  /** Coarse monotonic timestamp of when we queued this, for the wait
+   * histogram. */
+  uint32_t when_added_ts;
+  /** The source that sent us this onionskin. */
+  struct onion_source_t *source;
 } onion_queue_t;
 
 /** 5 seconds on the onion queue til we just send back a destroy */
 #define ONIONQUEUE_WAIT_CUTOFF 5
 
 /** Array of queues of circuits waiting for CPU workers. An element is NULL
- * if that queue is empty.*/
+ * if that queue is empty.  These queues are in arrival order, and are only
+ * used to find requests that have waited too long: the order in which we
+ * process requests is decided by ol_sources[]. */
 static TOR_TAILQ_HEAD(onion_queue_head_t, onion_queue_t)
               ol_list[MAX_ONION_HANDSHAKE_TYPE+1] =
 { TOR_TAILQ_HEAD_INITIALIZER(ol_list[0]), /* tap */
@@ -61,6 +77,74 @@ static TOR_TAILQ_HEAD(onion_queue_head_t, onion_queue_t)
 /** Number of entries of each type currently in each element of ol_list[]. */
 static int ol_entries[MAX_ONION_HANDSHAKE_TYPE+1];
 
+/** The pending onionskins of one handshake type that arrived over a single
+ * channel.  We serve these round-robin, so that every channel gets a turn no
+ * matter how many requests it has queued. */
+typedef struct onion_source_t {
+  HT_ENTRY(onion_source_t) node;
+  /** Global identifier of the channel that these requests arrived on, or 0
+   * if we don't know. */
+  uint64_t chan_id;
+  uint16_t handshake_type;
+  /** Number of entries in <b>pending</b>. */
+  int n_pending;
+  /** This source's requests, oldest first. */
+  TOR_TAILQ_HEAD(, onion_queue_t) pending;
+  /** Link in ol_sources[handshake_type]. */
+  TOR_TAILQ_ENTRY(onion_source_t) next_active;
+} onion_source_t;
+
+/** Return a hash of the channel and handshake type of <b>src</b>. */
+static inline unsigned int
+onion_source_hash(const onion_source_t *src)
+{
+  return (unsigned) siphash24g(&src->chan_id, sizeof(src->chan_id)) ^
+    src->handshake_type;
+}
+
+/** Return true iff <b>a</b> and <b>b</b> are for the same channel and
+ * handshake type. */
+static inline int
+onion_sources_eq(const onion_source_t *a, const onion_source_t *b)
+{
+  return a->chan_id == b->chan_id && a->handshake_type == b->handshake_type;
+}
+
+/** Map from channel and handshake type to every source with pending
+ * requests. */
+static HT_HEAD(onion_source_map, onion_source_t)
+     onion_source_map = HT_INITIALIZER();
+
+HT_PROTOTYPE(onion_source_map, onion_source_t, node, onion_source_hash,
+             onion_sources_eq)
+HT_GENERATE2(onion_source_map, onion_source_t, node, onion_source_hash,
+             onion_sources_eq, 0.6, tor_reallocarray_, tor_free_)
+
+/** For each handshake type, the sources with pending requests, in the order
+ * we will next serve them. */
+static TOR_TAILQ_HEAD(onion_source_ring_t, onion_source_t)
+              ol_sources[MAX_ONION_HANDSHAKE_TYPE+1] =
+{ TOR_TAILQ_HEAD_INITIALIZER(ol_sources[0]), /* tap */
+  TOR_TAILQ_HEAD_INITIALIZER(ol_sources[1]), /* fast */
+  TOR_TAILQ_HEAD_INITIALIZER(ol_sources[2]), /* ntor */
+};
+
+/** Upper bounds, in msec, of the buckets of our queue wait histogram.  The
+ * last bucket holds everything that waited longer. */
+static const uint32_t onion_wait_bucket_msec[ONION_QUEUE_WAIT_N_BUCKETS-1] =
+  { 1, 4, 16, 64, 256, 1024, 4096 };
+
+/** How many onionskins of each type have waited how long on the queue,
+ * since startup. */
+static uint64_t onion_wait_hist[MAX_ONION_HANDSHAKE_TYPE+1]
+                               [ONION_QUEUE_WAIT_N_BUCKETS];
+/** The contents of onion_wait_hist when we last logged a heartbeat. */
+static uint64_t onion_wait_hist_at_heartbeat[MAX_ONION_HANDSHAKE_TYPE+1]
+                                            [ONION_QUEUE_WAIT_N_BUCKETS];
+/** How many queued requests we have dropped, since startup, to make room for
+ * a request from a source with fewer requests queued. */
+static uint64_t onion_queue_n_evicted = 0;
+
 static int num_ntors_per_tap(void);
 static void onion_queue_entry_remove(onion_queue_t *victim);
 
@@ -133,14 +217,99 @@ have_room_for_onionskin(uint16_t type)
   return 1;
 }
 
-/** Add <b>circ</b> to the end of ol_list and return 0, except
- * if ol_list is too long, in which case do nothing and return -1.
+/** Return the identifier of the channel that <b>circ</b>'s create request
+ * arrived on, or 0 if it has none. */
+static uint64_t
+onion_source_chan_id(const or_circuit_t *circ)
+{
+  return circ->p_chan ? circ->p_chan->global_identifier : 0;
+}
+
+/** Return the source for requests of type <b>type</b> arriving on the
+ * channel with identifier <b>chan_id</b>, or NULL if it has nothing
+ * queued. */
+static onion_source_t *
+onion_source_find(uint64_t chan_id, uint16_t type)
+{
+  onion_source_t search;
+  search.chan_id = chan_id;
+  search.handshake_type = type;
+  return HT_FIND(onion_source_map, &onion_source_map, &search);
+}
+
+/** Return the source for requests of type <b>type</b> arriving on the
+ * channel with identifier <b>chan_id</b>, creating it and putting it at the
+ * back of the round-robin ring if it has nothing queued. */
+static onion_source_t *
+onion_source_get(uint64_t chan_id, uint16_t type)
+{
+  onion_source_t *src = onion_source_find(chan_id, type);
+  if (src)
+    return src;
+  src = tor_malloc_zero(sizeof(onion_source_t));
+  src->chan_id = chan_id;
+  src->handshake_type = type;
+  TOR_TAILQ_INIT(&src->pending);
+  HT_INSERT(onion_source_map, &onion_source_map, src);
+  TOR_TAILQ_INSERT_TAIL(&ol_sources[type], src, next_active);
+  return src;
+}
+
+/** Return the source with the most requests of type <b>type</b> queued, or
+ * NULL if nothing is queued. */
+static onion_source_t *
+onion_source_find_largest(uint16_t type)
+{
+  onion_source_t *src, *largest = NULL;
+  TOR_TAILQ_FOREACH(src, &ol_sources[type], next_active) {
+    if (!largest || src->n_pending > largest->n_pending)
+      largest = src;
+  }
+  return largest;
+}
+
+/** The queue for requests of type <b>type</b> is full.  If some other source
+ * is using more than its share of it compared to the source with identifier
+ * <b>chan_id</b>, drop that source's newest request to make room, and
+ * return 0.  Otherwise return -1. */
+static int
+onion_queue_evict_for(uint64_t chan_id, uint16_t type)
+{
+  onion_source_t *largest = onion_source_find_largest(type);
+  const onion_source_t *ours = onion_source_find(chan_id, type);
+  const int our_pending = ours ? ours->n_pending : 0;
+  onion_queue_t *victim;
+  or_circuit_t *circ;
+
+  /* Only evict if it would leave the largest source with at least as much
+   * as the new arrival will have, so two sources can't keep evicting each
+   * other's requests. */
+  if (!largest || largest == ours || largest->n_pending <= our_pending + 1)
+    return -1;
+
+  victim = TOR_TAILQ_LAST(&largest->pending, onion_queue_head_t);
+  circ = victim->circ;
+  onion_queue_entry_remove(victim);
+  ++onion_queue_n_evicted;
+  log_info(LD_CIRC, "Dropping a queued create request to make room for one "
+           "from a less busy channel.");
+  if (! TO_CIRCUIT(circ)->marked_for_close) {
+    circuit_mark_for_close(TO_CIRCUIT(circ), END_CIRC_REASON_RESOURCELIMIT);
+  }
+  return 0;
+}
+
+/** Add <b>circ</b> to the end of its channel's queue and return 0, except
+ * if ol_list is too long and we can't make room by dropping a request from a
+ * busier channel, in which case do nothing and return -1.
  */
 int
 onion_pending_add(or_circuit_t *circ, create_cell_t *onionskin)
 {
   onion_queue_t *tmp;
+  onion_source_t *src;
   time_t now = time(NULL);
+  const uint64_t chan_id = onion_source_chan_id(circ);
 
   if (onionskin->handshake_type > MAX_ONION_HANDSHAKE_TYPE) {
     /* LCOV_EXCL_START
@@ -151,13 +320,8 @@ onion_pending_add(or_circuit_t *circ, create_cell_t *onionskin)
     /* LCOV_EXCL_STOP */
   }
 
-  tmp = tor_malloc_zero(sizeof(onion_queue_t));
-  tmp->circ = circ;
-  tmp->handshake_type = onionskin->handshake_type;
-  tmp->onionskin = onionskin;
-  tmp->when_added = now;
-
-  if (!have_room_for_onionskin(onionskin->handshake_type)) {
+  if (!have_room_for_onionskin(onionskin->handshake_type) &&
+      onion_queue_evict_for(chan_id, onionskin->handshake_type) < 0) {
 #define WARN_TOO_MANY_CIRC_CREATIONS_INTERVAL (60)
     static ratelim_t last_warned =
       RATELIM_INIT(WARN_TOO_MANY_CIRC_CREATIONS_INTERVAL);
@@ -171,10 +335,16 @@ onion_pending_add(or_circuit_t *circ, create_cell_t *onionskin)
                "restricted exit policy.%s",m);
       tor_free(m);
     }
-    tor_free(tmp);
     return -1;
   }
 
+  tmp = tor_malloc_zero(sizeof(onion_queue_t));
+  tmp->circ = circ;
+  tmp->handshake_type = onionskin->handshake_type;
+  tmp->onionskin = onionskin;
+  tmp->when_added = now;
+  tmp->when_added_ts = monotime_coarse_get_stamp();
+
   ++ol_entries[onionskin->handshake_type];
   log_info(LD_OR, "New create (%s). Queues now ntor=%d and tap=%d.",
     onionskin->handshake_type == ONION_HANDSHAKE_TYPE_NTOR ? "ntor" : "tap",
@@ -183,6 +353,10 @@ onion_pending_add(or_circuit_t *circ, create_cell_t *onionskin)
 
   circ->onionqueue_entry = tmp;
   TOR_TAILQ_INSERT_TAIL(&ol_list[onionskin->handshake_type], tmp, next);
+  src = onion_source_get(chan_id, onionskin->handshake_type);
+  tmp->source = src;
+  TOR_TAILQ_INSERT_TAIL(&src->pending, tmp, next_from_source);
+  ++src->n_pending;
 
   /* cull elderly requests. */
   while (1) {
@@ -258,24 +432,46 @@ decide_next_handshake_type(void)
   return ONION_HANDSHAKE_TYPE_TAP;
 }
 
+/** Note in our histogram that an onionskin of type <b>type</b> waited
+ * <b>msec</b> milliseconds on the queue. */
+static void
+onion_queue_note_wait(uint16_t type, uint64_t msec)
+{
+  int i;
+  for (i = 0; i < ONION_QUEUE_WAIT_N_BUCKETS-1; ++i) {
+    if (msec <= onion_wait_bucket_msec[i])
+      break;
+  }
+  ++onion_wait_hist[type][i];
+}
+
 /** Remove the highest priority item from ol_list[] and return it, or
- * return NULL if the lists are empty.
+ * return NULL if the lists are empty.  Within a handshake type, we take the
+ * oldest request of the next channel in round-robin order.
  */
 or_circuit_t *
 onion_next_task(create_cell_t **onionskin_out)
 {
   or_circuit_t *circ;
   uint16_t handshake_to_choose = decide_next_handshake_type();
-  onion_queue_t *head = TOR_TAILQ_FIRST(&ol_list[handshake_to_choose]);
+  onion_source_t *src = TOR_TAILQ_FIRST(&ol_sources[handshake_to_choose]);
+  onion_queue_t *head;
 
-  if (!head)
+  if (!src)
     return NULL; /* no onions pending, we're done */
 
+  head = TOR_TAILQ_FIRST(&src->pending);
+  tor_assert(head);
   tor_assert(head->circ);
   tor_assert(head->handshake_type <= MAX_ONION_HANDSHAKE_TYPE);
 //  tor_assert(head->circ->p_chan); /* make sure it's still valid */
 /* XXX I only commented out the above line to make the unit tests
  * more manageable. That's probably not good long-term. -RD */
+
+  /* This source has had its turn: move it to the back of the ring. */
+  TOR_TAILQ_REMOVE(&ol_sources[handshake_to_choose], src, next_active);
+  TOR_TAILQ_INSERT_TAIL(&ol_sources[handshake_to_choose], src, next_active);
+
   circ = head->circ;
   if (head->onionskin)
     --ol_entries[head->handshake_type];
@@ -284,6 +480,10 @@ onion_next_task(create_cell_t **onionskin_out)
     ol_entries[ONION_HANDSHAKE_TYPE_NTOR],
     ol_entries[ONION_HANDSHAKE_TYPE_TAP]);
 
+  onion_queue_note_wait(head->handshake_type,
+                        monotime_coarse_stamp_units_to_approx_msec(
+                          monotime_coarse_get_stamp() - head->when_added_ts));
+
   *onionskin_out = head->onionskin;
   head->onionskin = NULL; /* prevent free. */
   circ->onionqueue_entry = NULL;
@@ -334,6 +534,16 @@ onion_queue_entry_remove(onion_queue_t *victim)
 
   TOR_TAILQ_REMOVE(&ol_list[victim->handshake_type], victim, next);
 
+  if (victim->source) {
+    onion_source_t *src = victim->source;
+    TOR_TAILQ_REMOVE(&src->pending, victim, next_from_source);
+    if (--src->n_pending == 0) {
+      TOR_TAILQ_REMOVE(&ol_sources[src->handshake_type], src, next_active);
+      HT_REMOVE(onion_source_map, &onion_source_map, src);
+      tor_free(src);
+    }
+  }
+
   if (victim->circ)
     victim->circ->onionqueue_entry = NULL;
 
@@ -356,6 +566,85 @@ clear_pending_onions(void)
       onion_queue_entry_remove(victim);
     }
     tor_assert(TOR_TAILQ_EMPTY(&ol_list[i]));
+    tor_assert(TOR_TAILQ_EMPTY(&ol_sources[i]));
   }
   memset(ol_entries, 0, sizeof(ol_entries));
+  HT_CLEAR(onion_source_map, &onion_source_map);
+}
+
+/** Return the number of requests of type <b>handshake_type</b> pending from
+ * the channel with global identifier <b>chan_id</b>. */
+int
+onion_num_pending_from_chan(uint64_t chan_id, uint16_t handshake_type)
+{
+  const onion_source_t *src = onion_source_find(chan_id, handshake_type);
+  return src ? src->n_pending : 0;
+}
+
+/** Return a newly allocated string of the form "1=N,4=N,...,inf=N",
+ * describing how many onionskins waited on the queue for up to how many
+ * msec, using the counts in <b>hist</b> minus those in <b>base</b> (if
+ * provided). */
+static char *
+onion_queue_format_wait_hist(const uint64_t *hist, const uint64_t *base)
+{
+  smartlist_t *elts = smartlist_new();
+  char *result;
+  int i;
+  for (i = 0; i < ONION_QUEUE_WAIT_N_BUCKETS; ++i) {
+    const uint64_t n = hist[i] - (base ? base[i] : 0);
+    if (i < ONION_QUEUE_WAIT_N_BUCKETS-1)
+      smartlist_add_asprintf(elts, "%" PRIu32 "=%" PRIu64,
+                             onion_wait_bucket_msec[i], n);
+    else
+      smartlist_add_asprintf(elts, "inf=%" PRIu64, n);
+  }
+  result = smartlist_join_strings(elts, ",", 0, NULL);
+  SMARTLIST_FOREACH(elts, char *, cp, tor_free(cp));
+  smartlist_free(elts);
+  return result;
+}
+
+/** Log how long onionskins have waited on the queue since the last
+ * heartbeat, and how many we've dropped in favor of less busy channels. */
+void
+onion_queue_log_heartbeat(void)
+{
+  char *ntor = onion_queue_format_wait_hist(
+                   onion_wait_hist[ONION_HANDSHAKE_TYPE_NTOR],
+                   onion_wait_hist_at_heartbeat[ONION_HANDSHAKE_TYPE_NTOR]);
+  char *tap = onion_queue_format_wait_hist(
+                   onion_wait_hist[ONION_HANDSHAKE_TYPE_TAP],
+                   onion_wait_hist_at_heartbeat[ONION_HANDSHAKE_TYPE_TAP]);
+
+  log_notice(LD_HEARTBEAT,
+             "Onion queue wait times (msec) since last heartbeat: "
+             "ntor [%s], tap [%s]. %" PRIu64 " queued requests dropped in "
+             "favor of less busy channels since startup.",
+             ntor, tap, onion_queue_n_evicted);
+
+  memcpy(onion_wait_hist_at_heartbeat, onion_wait_hist,
+         sizeof(onion_wait_hist));
+  tor_free(ntor);
+  tor_free(tap);
+}
+
+/** Helper used to implement GETINFO onion-queue/... */
+int
+getinfo_helper_onion_queue(control_connection_t *conn,
+                           const char *question, char **answer,
+                           const char **errmsg)
+{
+  (void) conn;
+  (void) errmsg;
+  if (!strcmp(question, "onion-queue/wait-histogram/ntor")) {
+    *answer = onion_queue_format_wait_hist(
+                           onion_wait_hist[ONION_HANDSHAKE_TYPE_NTOR], NULL);
+  } else if (!strcmp(question, "onion-queue/wait-histogram/tap")) {
+    *answer = onion_queue_format_wait_hist(
+                           onion_wait_hist[ONION_HANDSHAKE_TYPE_TAP], NULL);
+  } else if (!strcmp(question, "onion-queue/evicted")) {
+    tor_asprintf(answer, "%" PRIu64, onion_queue_n_evicted);
+  }
+  return 0;
 }
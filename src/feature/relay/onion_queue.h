@@ -14,10 +14,20 @@
 
 struct create_cell_t;
 
+/** Number of buckets in our histogram of how long onionskins wait on the
+ * queue. */
+#define ONION_QUEUE_WAIT_N_BUCKETS 8
+
 int onion_pending_add(or_circuit_t *circ, struct create_cell_t *onionskin);
 or_circuit_t *onion_next_task(struct create_cell_t **onionskin_out);
 int onion_num_pending(uint16_t handshake_type);
 void onion_pending_remove(or_circuit_t *circ);
 void clear_pending_onions(void);
+int onion_num_pending_from_chan(uint64_t chan_id, uint16_t handshake_type);
+
+void onion_queue_log_heartbeat(void);
+int getinfo_helper_onion_queue(control_connection_t *conn,
+                               const char *question, char **answer,
+                               const char **errmsg);
 
 #endif
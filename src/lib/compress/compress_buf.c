@@ -38,6 +38,7 @@ buf_add_compress(buf_t *buf, tor_compress_state_t *state,
 
   do {
     int need_new_chunk = 0;
+    const size_t old_data_len = data_len;
     if (!buf->tail || ! CHUNK_REMAINING_CAPACITY(buf->tail)) {
       size_t cap = data_len / 4;
       buf_add_chunk_with_capacity(buf, cap, 1);
@@ -68,6 +69,11 @@ buf_add_compress(buf_t *buf, tor_compress_state_t *state,
           /* We've consumed all the input data, though, so there's no
            * point in forging ahead right now. */
           over = 1;
+        } else if (avail == old_avail && data_len == old_data_len) {
+          /* We had room, but the compression module neither took any input
+           * nor gave any output: it's waiting for input that will never
+           * come, as when we're finishing a truncated stream. */
+          return -1;
         }
         break;
     }
@@ -717,6 +717,31 @@ smartlist_heapify(smartlist_t *sl,
   }
 }
 
+/** Helper. <b>sl</b> may have at most one element that is out of order
+ * with respect to its parent, at index <b>idx</b>.  Move it towards the top
+ * of the heap until it is in order.  Return its new index. */
+static inline int
+smartlist_sift_up(smartlist_t *sl,
+                  int (*compare)(const void *a, const void *b),
+                  int idx_field_offset,
+                  int idx)
+{
+  while (idx) {
+    int parent = PARENT(idx);
+    if (compare(sl->list[idx], sl->list[parent]) < 0) {
+      void *tmp = sl->list[parent];
+      sl->list[parent] = sl->list[idx];
+      sl->list[idx] = tmp;
+      UPDATE_IDX(parent);
+      UPDATE_IDX(idx);
+      idx = parent;
+    } else {
+      break;
+    }
+  }
+  return idx;
+}
+
 /** Insert <b>item</b> into the heap stored in <b>sl</b>, where order is
  * determined by <b>compare</b> and the offset of the item in the heap is
  * stored in an int-typed field at position <b>idx_field_offset</b> within
@@ -728,23 +753,10 @@ smartlist_pqueue_add(smartlist_t *sl,
                      int idx_field_offset,
                      void *item)
 {
-  int idx;
   smartlist_add(sl,item);
   UPDATE_IDX(sl->num_used-1);
 
-  for (idx = sl->num_used - 1; idx; ) {
-    int parent = PARENT(idx);
-    if (compare(sl->list[idx], sl->list[parent]) < 0) {
-      void *tmp = sl->list[parent];
-      sl->list[parent] = sl->list[idx];
-      sl->list[idx] = tmp;
-      UPDATE_IDX(parent);
-      UPDATE_IDX(idx);
-      idx = parent;
-    } else {
-      return;
-    }
-  }
+  smartlist_sift_up(sl, compare, idx_field_offset, sl->num_used - 1);
 }
 
 /** Remove and return the top-priority item from the heap stored in <b>sl</b>,
@@ -797,6 +809,28 @@ smartlist_pqueue_remove(smartlist_t *sl,
   }
 }
 
+/** The priority of <b>item</b>, which is in the heap stored in <b>sl</b>,
+ * has changed: move it to its correct position.  Order is determined by
+ * <b>compare</b> and the item's position is stored at position
+ * <b>idx_field_offset</b> within the item.
+ *
+ * This is cheaper than removing the item and adding it back, and much
+ * cheaper than popping the top item only to push it again after changing
+ * it. */
+void
+smartlist_pqueue_update(smartlist_t *sl,
+                        int (*compare)(const void *a, const void *b),
+                        int idx_field_offset,
+                        void *item)
+{
+  int idx = IDX_OF_ITEM(item);
+  tor_assert(idx >= 0);
+  tor_assert(sl->list[idx] == item);
+
+  if (smartlist_sift_up(sl, compare, idx_field_offset, idx) == idx)
+    smartlist_heapify(sl, compare, idx_field_offset, idx);
+}
+
 /** Assert that the heap property is correctly maintained by the heap stored
  * in <b>sl</b>, where order is determined by <b>compare</b>. */
 void
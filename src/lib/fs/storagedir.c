@@ -14,6 +14,7 @@
 
 #include "lib/fs/storagedir.h"
 
+#include "lib/container/map.h"
 #include "lib/container/smartlist.h"
 #include "lib/encoding/confline.h"
 #include "lib/fs/dir.h"
@@ -43,6 +44,21 @@
 
 #define FNAME_MIN_NUM 1000
 
+/** Cached metadata for a single file within a storage_dir_t. We keep one of
+ * these for every file we know about, so that computing usage and choosing
+ * files to remove does not require us to stat() every file again. */
+typedef struct storage_dir_ent_t {
+  /** The size of the file, if size_known is set. */
+  uint64_t size;
+  /** The modification time of the file, if mtime_known is set. */
+  time_t mtime;
+  /** True iff we have learned <b>size</b>, either from a stat() or because
+   * we wrote the file ourselves. */
+  unsigned int size_known : 1;
+  /** True iff we have learned <b>mtime</b> from a stat(). */
+  unsigned int mtime_known : 1;
+} storage_dir_ent_t;
+
 /** A storage_dir_t represents a directory full of similar cached
  * files. Filenames are decimal integers. Files can be cleaned as needed
  * to limit total disk usage. */
@@ -52,9 +68,19 @@ struct storage_dir_t {
   /** Either NULL, or a directory listing of the directory (as a smartlist
    * of strings */
   smartlist_t *contents;
+  /** Either NULL, or a map from every filename in <b>contents</b> to a
+   * storage_dir_ent_t describing that file. Kept in sync with
+   * <b>contents</b>. */
+  strmap_t *index;
   /** The largest number of non-temporary files we'll place in the
    * directory. */
   int max_files;
+  /** Offset (from FNAME_MIN_NUM) of the first filename to try when looking
+   * for an unused one. */
+  int next_fname_hint;
+  /** If true, then some other process is responsible for adding and
+   * removing files in this directory: we may only read from it. */
+  int read_only;
   /** If true, then 'usage' has been computed. */
   int usage_known;
   /** The total number of bytes used in this directory */
@@ -76,6 +102,59 @@ storage_dir_new(const char *dirname, int max_files)
   return d;
 }
 
+/**
+ * Helper: forget everything we know about the files in <b>d</b>.
+ */
+static void
+storage_dir_clear_contents(storage_dir_t *d)
+{
+  if (d->contents) {
+    SMARTLIST_FOREACH(d->contents, char *, cp, tor_free(cp));
+    smartlist_free(d->contents);
+  }
+  strmap_free(d->index, tor_free_);
+}
+
+/**
+ * Helper: Record that <b>d</b> contains a file called <b>fname</b>, and
+ * return its index entry.  Requires that the contents field of <b>d</b> is
+ * set, and that <b>fname</b> is not already present.
+ */
+static storage_dir_ent_t *
+storage_dir_add_entry(storage_dir_t *d, const char *fname)
+{
+  storage_dir_ent_t *ent = tor_malloc_zero(sizeof(storage_dir_ent_t));
+  smartlist_add(d->contents, tor_strdup(fname));
+  strmap_set(d->index, fname, ent);
+  return ent;
+}
+
+/**
+ * Helper: Make sure that we know the size and modification time of the file
+ * described by <b>ent</b>, called <b>fname</b> within <b>d</b>.  Return 0 if
+ * we know them, or -1 if the file could not be examined.
+ */
+static int
+storage_dir_entry_stat(storage_dir_t *d, const char *fname,
+                       storage_dir_ent_t *ent)
+{
+  if (ent->size_known && ent->mtime_known)
+    return 0;
+
+  char *path = NULL;
+  struct stat st;
+  int r = -1;
+  tor_asprintf(&path, "%s/%s", d->directory, fname);
+  if (stat(sandbox_intern_string(path), &st) == 0) {
+    ent->size = st.st_size;
+    ent->mtime = st.st_mtime;
+    ent->size_known = ent->mtime_known = 1;
+    r = 0;
+  }
+  tor_free(path);
+  return r;
+}
+
 /**
  * Drop all in-RAM storage for <b>d</b>.  Does not delete any files.
  */
@@ -85,10 +164,7 @@ storage_dir_free_(storage_dir_t *d)
   if (d == NULL)
     return;
   tor_free(d->directory);
-  if (d->contents) {
-    SMARTLIST_FOREACH(d->contents, char *, cp, tor_free(cp));
-    smartlist_free(d->contents);
-  }
+  storage_dir_clear_contents(d);
   tor_free(d);
 }
 
@@ -125,7 +201,29 @@ storage_dir_register_with_sandbox(storage_dir_t *d, sandbox_cfg_t **cfg)
 }
 
 /**
- * Remove all files in <b>d</b> whose names end with ".tmp".
+ * Mark <b>d</b> as read-only if <b>read_only</b> is true, or as writable
+ * otherwise.  A read-only storage_dir_t never creates, renames, or removes
+ * files: it is used when some other process owns the directory.
+ */
+void
+storage_dir_set_read_only(storage_dir_t *d, int read_only)
+{
+  d->read_only = !!read_only;
+}
+
+/**
+ * Return true iff <b>d</b> has been marked as read-only.
+ */
+int
+storage_dir_is_read_only(const storage_dir_t *d)
+{
+  return d->read_only;
+}
+
+/**
+ * Remove all files in <b>d</b> whose names end with ".tmp".  (If <b>d</b> is
+ * read-only, the files are only removed from our listing, since another
+ * process may still be writing them.)
  *
  * Requires that the contents field of <b>d</b> is set.
  */
@@ -137,6 +235,12 @@ storage_dir_clean_tmpfiles(storage_dir_t *d)
   SMARTLIST_FOREACH_BEGIN(d->contents, char *, fname) {
     if (strcmpend(fname, ".tmp"))
       continue;
+    if (d->read_only) {
+      SMARTLIST_DEL_CURRENT(d->contents, fname);
+      tor_free_(strmap_remove(d->index, fname));
+      tor_free(fname);
+      continue;
+    }
     char *path = NULL;
     tor_asprintf(&path, "%s/%s", d->directory, fname);
     if (unlink(sandbox_intern_string(path))) {
@@ -147,6 +251,7 @@ storage_dir_clean_tmpfiles(storage_dir_t *d)
     }
     tor_free(path);
     SMARTLIST_DEL_CURRENT(d->contents, fname);
+    tor_free_(strmap_remove(d->index, fname));
     tor_free(fname);
   } SMARTLIST_FOREACH_END(fname);
 
@@ -156,18 +261,19 @@ storage_dir_clean_tmpfiles(storage_dir_t *d)
 /**
  * Re-scan the directory <b>d</b> to learn its contents.
  */
-static int
+int
 storage_dir_rescan(storage_dir_t *d)
 {
-  if (d->contents) {
-    SMARTLIST_FOREACH(d->contents, char *, cp, tor_free(cp));
-    smartlist_free(d->contents);
-  }
+  storage_dir_clear_contents(d);
   d->usage = 0;
   d->usage_known = 0;
   if (NULL == (d->contents = tor_listdir(d->directory))) {
     return -1;
   }
+  d->index = strmap_new();
+  SMARTLIST_FOREACH(d->contents, const char *, fname,
+             strmap_set(d->index, fname,
+                        tor_malloc_zero(sizeof(storage_dir_ent_t))));
   storage_dir_clean_tmpfiles(d);
   return 0;
 }
@@ -185,6 +291,9 @@ storage_dir_list(storage_dir_t *d)
 
 /**
  * Return the total number of bytes used for storage in <b>d</b>.
+ *
+ * Only files whose sizes we have not already learned are examined; files
+ * that we wrote or examined before are accounted for from the index.
  */
 uint64_t
 storage_dir_get_usage(storage_dir_t *d)
@@ -194,13 +303,12 @@ storage_dir_get_usage(storage_dir_t *d)
 
   uint64_t total = 0;
   SMARTLIST_FOREACH_BEGIN(storage_dir_list(d), const char *, cp) {
-    char *path = NULL;
-    struct stat st;
-    tor_asprintf(&path, "%s/%s", d->directory, cp);
-    if (stat(sandbox_intern_string(path), &st) == 0) {
-      total += st.st_size;
+    storage_dir_ent_t *ent = strmap_get(d->index, cp);
+    if (BUG(!ent))
+      continue;
+    if (ent->size_known || storage_dir_entry_stat(d, cp, ent) == 0) {
+      total += ent->size;
     }
-    tor_free(path);
   } SMARTLIST_FOREACH_END(cp);
 
   d->usage = total;
@@ -258,11 +366,13 @@ find_unused_fname(storage_dir_t *d)
 
   char buf[16];
   int i;
-  /* Yuck; this is quadratic.  Fortunately, that shouldn't matter much,
-   * since disk writes are more expensive by a lot. */
-  for (i = FNAME_MIN_NUM; i < FNAME_MIN_NUM + d->max_files; ++i) {
-    tor_snprintf(buf, sizeof(buf), "%d", i);
-    if (!smartlist_contains_string(d->contents, buf)) {
+  /* Start looking just after the last name we handed out, so that filling
+   * up a large directory doesn't require a quadratic number of probes. */
+  for (i = 0; i < d->max_files; ++i) {
+    const int n = (d->next_fname_hint + i) % d->max_files;
+    tor_snprintf(buf, sizeof(buf), "%d", FNAME_MIN_NUM + n);
+    if (!strmap_get(d->index, buf)) {
+      d->next_fname_hint = (n + 1) % d->max_files;
       return tor_strdup(buf);
     }
   }
@@ -278,6 +388,8 @@ storage_dir_save_chunks_to_file(storage_dir_t *d,
                                 char **fname_out)
 {
   uint64_t total_length = 0;
+  if (d->read_only)
+    return -1;
   char *fname = find_unused_fname(d);
   if (!fname)
     return -1;
@@ -295,8 +407,11 @@ storage_dir_save_chunks_to_file(storage_dir_t *d,
     if (fname_out) {
       *fname_out = tor_strdup(fname);
     }
-    if (d->contents)
-      smartlist_add(d->contents, tor_strdup(fname));
+    if (d->contents) {
+      storage_dir_ent_t *ent = storage_dir_add_entry(d, fname);
+      ent->size = total_length;
+      ent->size_known = 1;
+    }
   }
   tor_free(fname);
   tor_free(path);
@@ -447,6 +562,21 @@ storage_dir_read_labeled(storage_dir_t *dir,
   return result;
 }
 
+/**
+ * Helper: remove <b>fname</b> from the list of files we believe to be in
+ * <b>d</b>, along with its index entry.
+ */
+static void
+storage_dir_forget_file(storage_dir_t *d, const char *fname)
+{
+  if (! d->contents)
+    return;
+  /* <b>fname</b> may be the copy in d->contents, which the removal frees:
+   * drop the index entry first. */
+  tor_free_(strmap_remove(d->index, fname));
+  smartlist_string_remove(d->contents, fname);
+}
+
 /* Reduce the cached usage amount in <b>d</b> by <b>removed_file_size</b>.
  * This function is a no-op if <b>d->usage_known</b> is 0. */
 static void
@@ -480,15 +610,23 @@ void
 storage_dir_remove_file(storage_dir_t *d,
                         const char *fname)
 {
+  if (d->read_only)
+    return;
+
   char *path = NULL;
   tor_asprintf(&path, "%s/%s", d->directory, fname);
   const char *ipath = sandbox_intern_string(path);
 
+  storage_dir_ent_t *ent = d->index ? strmap_get(d->index, fname) : NULL;
   uint64_t size = 0;
   if (d->usage_known) {
-    struct stat st;
-    if (stat(ipath, &st) == 0) {
-      size = st.st_size;
+    if (ent && ent->size_known) {
+      size = ent->size;
+    } else {
+      struct stat st;
+      if (stat(ipath, &st) == 0) {
+        size = st.st_size;
+      }
     }
   }
   if (unlink(ipath) == 0) {
@@ -499,9 +637,7 @@ storage_dir_remove_file(storage_dir_t *d,
     tor_free(path);
     return;
   }
-  if (d->contents) {
-    smartlist_string_remove(d->contents, fname);
-  }
+  storage_dir_forget_file(d, fname);
 
   tor_free(path);
 }
@@ -510,7 +646,7 @@ storage_dir_remove_file(storage_dir_t *d,
 typedef struct shrinking_dir_entry_t {
   time_t mtime;
   uint64_t size;
-  char *path;
+  char *fname;
 } shrinking_dir_entry_t;
 
 /** Helper: use with qsort to sort shrinking_dir_entry_t structs. */
@@ -534,6 +670,10 @@ shrinking_dir_entry_compare(const void *a_, const void *b_)
  * <b>min_to_remove</b> files have been removed... or until there is
  * nothing left to remove.
  *
+ * We only examine files whose size and modification time are not already
+ * in our index, so repeated calls on a large directory don't need to stat()
+ * every file again.
+ *
  * Return 0 on success; -1 on failure.
  */
 int
@@ -546,7 +686,10 @@ storage_dir_shrink(storage_dir_t *d,
     return 0;
   }
 
-  if (storage_dir_rescan(d) < 0)
+  if (d->read_only)
+    return -1;
+
+  if (! d->contents && storage_dir_rescan(d) < 0)
     return -1;
 
   const uint64_t orig_usage = storage_dir_get_usage(d);
@@ -559,11 +702,11 @@ storage_dir_shrink(storage_dir_t *d,
   shrinking_dir_entry_t *ents = tor_calloc(n, sizeof(shrinking_dir_entry_t));
   SMARTLIST_FOREACH_BEGIN(d->contents, const char *, fname) {
     shrinking_dir_entry_t *ent = &ents[fname_sl_idx];
-    struct stat st;
-    tor_asprintf(&ent->path, "%s/%s", d->directory, fname);
-    if (stat(sandbox_intern_string(ent->path), &st) == 0) {
-      ent->mtime = st.st_mtime;
-      ent->size = st.st_size;
+    storage_dir_ent_t *dent = strmap_get(d->index, fname);
+    ent->fname = tor_strdup(fname);
+    if (dent && storage_dir_entry_stat(d, fname, dent) == 0) {
+      ent->mtime = dent->mtime;
+      ent->size = dent->size;
     }
   } SMARTLIST_FOREACH_END(fname);
 
@@ -571,20 +714,34 @@ storage_dir_shrink(storage_dir_t *d,
 
   int idx = 0;
   while ((d->usage > target_size || min_to_remove > 0) && idx < n) {
-    if (unlink(sandbox_intern_string(ents[idx].path)) == 0) {
+    char *path = NULL;
+    tor_asprintf(&path, "%s/%s", d->directory, ents[idx].fname);
+    if (unlink(sandbox_intern_string(path)) == 0) {
       storage_dir_reduce_usage(d, ents[idx].size);
+      if (d->index)
+        tor_free_(strmap_remove(d->index, ents[idx].fname));
       --min_to_remove;
     }
+    tor_free(path);
     ++idx;
   }
 
+  /* Drop the removed files from our listing in a single pass, rather than
+   * searching the list once per removed file. */
+  if (d->contents) {
+    SMARTLIST_FOREACH_BEGIN(d->contents, char *, fname) {
+      if (!strmap_get(d->index, fname)) {
+        SMARTLIST_DEL_CURRENT(d->contents, fname);
+        tor_free(fname);
+      }
+    } SMARTLIST_FOREACH_END(fname);
+  }
+
   for (idx = 0; idx < n; ++idx) {
-    tor_free(ents[idx].path);
+    tor_free(ents[idx].fname);
   }
   tor_free(ents);
 
-  storage_dir_rescan(d);
-
   return 0;
 }
 
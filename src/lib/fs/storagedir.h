@@ -26,6 +26,9 @@ void storage_dir_free_(storage_dir_t *d);
 
 int storage_dir_register_with_sandbox(storage_dir_t *d,
                                       struct sandbox_cfg_elem **cfg);
+void storage_dir_set_read_only(storage_dir_t *d, int read_only);
+int storage_dir_is_read_only(const storage_dir_t *d);
+int storage_dir_rescan(storage_dir_t *d);
 const struct smartlist_t *storage_dir_list(storage_dir_t *d);
 uint64_t storage_dir_get_usage(storage_dir_t *d);
 struct tor_mmap_t *storage_dir_map(storage_dir_t *d, const char *fname);
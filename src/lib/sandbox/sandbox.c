@@ -79,6 +79,9 @@
 #ifdef HAVE_LINUX_NETFILTER_IPV6_IP6_TABLES_H
 #include <linux/netfilter_ipv6/ip6_tables.h>
 #endif
+#ifdef HAVE_KIST_NETLINK_SUPPORT
+#include <linux/netlink.h>
+#endif
 
 #if defined(HAVE_EXECINFO_H) && defined(HAVE_BACKTRACE) && \
   defined(HAVE_BACKTRACE_SYMBOLS_FD) && defined(HAVE_SIGACTION)
@@ -702,6 +705,16 @@ sb_socket(scmp_filter_ctx ctx, sandbox_cfg_t *filter)
   if (rc)
     return rc;
 
+#ifdef HAVE_KIST_NETLINK_SUPPORT
+  /* KIST asks the kernel about TCP sockets with sock_diag dumps. */
+  rc = seccomp_rule_add_3(ctx, SCMP_ACT_ALLOW, SCMP_SYS(socket),
+      SCMP_CMP(0, SCMP_CMP_EQ, PF_NETLINK),
+      SCMP_CMP_MASKED(1, SOCK_CLOEXEC, SOCK_RAW),
+      SCMP_CMP(2, SCMP_CMP_EQ, NETLINK_SOCK_DIAG));
+  if (rc)
+    return rc;
+#endif /* defined(HAVE_KIST_NETLINK_SUPPORT) */
+
   return 0;
 }
 
@@ -15,6 +15,65 @@ use errors::ProtoverError;
 /// A single version number.
 pub type Version = u32;
 
+/// The largest `Version` that fits in a `ProtoBitset`.
+///
+/// C_RUST_COUPLED: protover.h `PROTOVER_BITSET_MAX_VERSION`
+pub const BITSET_MAX_VERSION: Version = 63;
+
+/// A `ProtoBitset` stores the `Version`s from 0 through `BITSET_MAX_VERSION`
+/// of a single subprotocol as one bit each, for fast set operations.  Every
+/// version in use today fits.
+///
+/// # Examples
+///
+/// ```
+/// use protover::protoset::ProtoBitset;
+///
+/// let a: ProtoBitset = ProtoBitset::from_range(1, 5);
+/// let b: ProtoBitset = ProtoBitset::from_range(4, 100);
+///
+/// assert_eq!(a.intersection(&b), ProtoBitset::from_range(4, 5));
+/// assert_eq!(a.union(&b).count(), 63);
+/// assert!(b.contains(&63));
+/// assert!(!b.contains(&64));
+/// ```
+#[derive(Clone, Copy, Debug, Default, Eq, PartialEq, Hash)]
+pub struct ProtoBitset(pub u64);
+
+impl ProtoBitset {
+    /// Make a `ProtoBitset` of the versions from `low` through `high` that
+    /// fit in one.
+    pub fn from_range(low: Version, high: Version) -> Self {
+        if low > high || low > BITSET_MAX_VERSION {
+            return ProtoBitset(0);
+        }
+        let high: Version = cmp::min(high, BITSET_MAX_VERSION);
+
+        ProtoBitset((u64::max_value() >> (BITSET_MAX_VERSION - high)) & (u64::max_value() << low))
+    }
+
+    pub fn union(&self, other: &Self) -> Self {
+        ProtoBitset(self.0 | other.0)
+    }
+
+    pub fn intersection(&self, other: &Self) -> Self {
+        ProtoBitset(self.0 & other.0)
+    }
+
+    /// Return how many `Version`s are in this set.
+    pub fn count(&self) -> u32 {
+        self.0.count_ones()
+    }
+
+    pub fn is_empty(&self) -> bool {
+        self.0 == 0
+    }
+
+    pub fn contains(&self, version: &Version) -> bool {
+        *version <= BITSET_MAX_VERSION && (self.0 >> *version) & 1 == 1
+    }
+}
+
 /// A `ProtoSet` stores an ordered `Vec<T>` of `(low, high)` pairs of ranges of
 /// non-overlapping protocol versions.
 ///
@@ -141,6 +200,31 @@ impl ProtoSet {
         self.into()
     }
 
+    /// Return the `Version`s in this `ProtoSet` that fit in a `ProtoBitset`.
+    ///
+    /// # Examples
+    ///
+    /// ```
+    /// # use protover::errors::ProtoverError;
+    /// use protover::protoset::ProtoSet;
+    /// use protover::protoset::ProtoBitset;
+    ///
+    /// # fn do_test() -> Result<bool, ProtoverError> {
+    /// let protoset: ProtoSet = "1-3,60-70".parse()?;
+    ///
+    /// assert_eq!(protoset.bitset(), ProtoBitset(0xf00000000000000e));
+    /// #
+    /// # Ok(true)
+    /// # }
+    /// # fn main() { do_test(); }  // wrap the test so we can use the ? operator
+    /// ```
+    pub fn bitset(&self) -> ProtoBitset {
+        self.iter()
+            .fold(ProtoBitset::default(), |bits, &(low, high)| {
+                bits.union(&ProtoBitset::from_range(low, high))
+            })
+    }
+
     pub fn len(&self) -> usize {
         let mut length: usize = 0;
 
@@ -529,6 +613,27 @@ mod test {
         };
     }
 
+    #[test]
+    fn test_bitset_from_range() {
+        assert_eq!(ProtoBitset(1), ProtoBitset::from_range(0, 0));
+        assert_eq!(ProtoBitset(1 << 63), ProtoBitset::from_range(63, 63));
+        assert_eq!(ProtoBitset(0x3c), ProtoBitset::from_range(2, 5));
+        assert_eq!(ProtoBitset(u64::max_value()), ProtoBitset::from_range(0, 4294967294));
+        assert_eq!(ProtoBitset(0), ProtoBitset::from_range(64, 100));
+        assert_eq!(ProtoBitset(0), ProtoBitset::from_range(5, 4));
+    }
+
+    #[test]
+    fn test_bitset_contains() {
+        let bits: ProtoBitset = ProtoBitset::from_range(62, 70);
+
+        assert!(!bits.contains(&61));
+        assert!(bits.contains(&62));
+        assert!(bits.contains(&63));
+        assert!(!bits.contains(&64));
+        assert_eq!(2, bits.count());
+    }
+
     #[test]
     fn test_versions_from_str() {
         test_protoset_contains_versions!(&[], "");
@@ -1,6 +1,7 @@
 // Copyright (c) 2016-2018, The Tor Project, Inc. */
 // See LICENSE for licensing information */
 
+use std::cmp;
 use std::collections::hash_map;
 use std::collections::HashMap;
 use std::ffi::CStr;
@@ -12,8 +13,10 @@ use std::string::String;
 use external::c_tor_version_as_new_as;
 
 use errors::ProtoverError;
+use protoset::ProtoBitset;
 use protoset::ProtoSet;
 use protoset::Version;
+use protoset::BITSET_MAX_VERSION;
 
 /// The first version of Tor that included "proto" entries in its descriptors.
 /// Authorities should use this to decide whether to guess proto lines.
@@ -639,6 +642,10 @@ impl ProtoverVote {
         proto_entries: &[UnvalidatedProtoEntry],
         threshold: &usize,
     ) -> UnvalidatedProtoEntry {
+        // Most versions fit in a bitset, so count those in a fixed-size array
+        // per protocol, and only use a map for the rest.
+        let mut bitset_count: HashMap<UnknownProtocol, [usize; BITSET_MAX_VERSION as usize + 1]> =
+            HashMap::new();
         let mut all_count: ProtoverVote = ProtoverVote::default();
         let mut final_output: UnvalidatedProtoEntry = UnvalidatedProtoEntry::default();
 
@@ -648,39 +655,79 @@ impl ProtoverVote {
 
         // parse and collect all of the protos and their versions and collect them
         for vote in proto_entries {
-            // C_RUST_DIFFERS: This doesn't actually differ, bu this check on
-            // the total is here to make it match.  Because the C version calls
-            // expand_protocol_list() which checks if there would be too many
-            // subprotocols *or* individual version numbers, i.e. more than
-            // MAX_PROTOCOLS_TO_EXPAND, and does this *per vote*, we need to
-            // match it's behaviour and ensure we're not allowing more than it
-            // would.
+            // C_RUST_COUPLED: proto_vote_tally_add() in protover.c adds up
+            // the number of versions listed in each vote, and skips the
+            // whole vote if that total is more than MAX_PROTOCOLS_TO_EXPAND.
+            // vote.len() is the same total, so we skip the same votes.
             if vote.len() > MAX_PROTOCOLS_TO_EXPAND {
                 continue;
             }
 
             for (protocol, versions) in vote.iter() {
-                let supported_vers: &mut HashMap<Version, usize> =
-                    all_count.entry(protocol.clone()).or_insert(HashMap::new());
+                let mut bits: u64 = versions.bitset().0;
+                if bits != 0 {
+                    let counts = bitset_count
+                        .entry(protocol.clone())
+                        .or_insert([0; BITSET_MAX_VERSION as usize + 1]);
+                    while bits != 0 {
+                        counts[bits.trailing_zeros() as usize] += 1;
+                        bits &= bits - 1;
+                    }
+                }
 
-                for version in versions.clone().expand() {
-                    let counter: &mut usize = supported_vers.entry(version).or_insert(0);
-                    *counter += 1;
+                for &(low, high) in versions.iter() {
+                    if high <= BITSET_MAX_VERSION {
+                        continue;
+                    }
+                    let supported_vers: &mut HashMap<Version, usize> =
+                        all_count.entry(protocol.clone()).or_insert(HashMap::new());
+
+                    for version in cmp::max(low, BITSET_MAX_VERSION + 1)..(high + 1) {
+                        let counter: &mut usize = supported_vers.entry(version).or_insert(0);
+                        *counter += 1;
+                    }
                 }
             }
         }
 
+        let mut voted: HashMap<UnknownProtocol, Vec<Version>> = HashMap::new();
+
+        for (protocol, counts) in bitset_count {
+            let voted_bits: ProtoBitset = counts
+                .iter()
+                .enumerate()
+                .filter(|&(_, count)| *count >= *threshold && *count > 0)
+                .fold(ProtoBitset::default(), |bits, (version, _)| {
+                    bits.union(&ProtoBitset::from_range(version as Version, version as Version))
+                });
+
+            if !voted_bits.is_empty() {
+                voted.insert(
+                    protocol,
+                    (0..(BITSET_MAX_VERSION + 1))
+                        .filter(|version| voted_bits.contains(version))
+                        .collect(),
+                );
+            }
+        }
+
         for (protocol, mut versions) in all_count {
             // Go through and remove versions that are less than the threshold
             versions.retain(|_, count| *count as usize >= *threshold);
 
             if versions.len() > 0 {
-                let voted_versions: Vec<Version> = versions.keys().cloned().collect();
-                let voted_protoset: ProtoSet = ProtoSet::from(voted_versions);
-
-                final_output.insert(protocol, voted_protoset);
+                voted
+                    .entry(protocol)
+                    .or_insert(Vec::new())
+                    .extend(versions.keys().cloned());
             }
         }
+
+        for (protocol, voted_versions) in voted {
+            let voted_protoset: ProtoSet = ProtoSet::from(voted_versions);
+
+            final_output.insert(protocol, voted_protoset);
+        }
         final_output
     }
 }
@@ -233,6 +233,39 @@ fn protover_compute_vote_handles_duplicated_versions() {
     assert_eq!("Cons=1-2", ProtoverVote::compute(protocols, &2).to_string());
 }
 
+#[test]
+fn protover_compute_vote_handles_versions_past_the_bitset() {
+    let protocols: &[UnvalidatedProtoEntry] = &[
+        "Foo=1,62-66".parse().unwrap(),
+        "Foo=63-64,100".parse().unwrap(),
+        "Foo=64".parse().unwrap(),
+    ];
+    let listed = ProtoverVote::compute(protocols, &2);
+    assert_eq!("Foo=63-64", listed.to_string());
+}
+
+#[test]
+fn protover_compute_vote_counts_the_ends_of_the_bitset() {
+    let protocols: &[UnvalidatedProtoEntry] = &[
+        "Foo=1,63 Bar=1-63".parse().unwrap(),
+        "Foo=1,62-63 Bar=63".parse().unwrap(),
+        "Foo=2 Bar=1".parse().unwrap(),
+    ];
+    assert_eq!(
+        "Bar=1,63 Foo=1,63",
+        ProtoverVote::compute(protocols, &2).to_string()
+    );
+    assert_eq!(
+        "Bar=1-63 Foo=1-2,62-63",
+        ProtoverVote::compute(protocols, &1).to_string()
+    );
+    assert_eq!(
+        "Bar=1-63 Foo=1-2,62-63",
+        ProtoverVote::compute(protocols, &0).to_string()
+    );
+    assert_eq!("", ProtoverVote::compute(protocols, &3).to_string());
+}
+
 #[test]
 fn protover_compute_vote_handles_invalid_proto_entries() {
     let protocols: &[UnvalidatedProtoEntry] = &[
@@ -10,9 +10,13 @@
 
 #include "orconfig.h"
 
+#define SCHEDULER_PRIVATE_
+#define TOR_CHANNEL_INTERNAL_
+
 #include "core/or/or.h"
 #include "core/crypto/onion_tap.h"
 #include "core/crypto/relay_crypto.h"
+#include "core/or/address_set.h"
 
 #ifdef ENABLE_OPENSSL
 #include <openssl/opensslv.h>
@@ -22,21 +26,50 @@
 #include <openssl/obj_mac.h>
 #endif
 
+#include "core/or/channel.h"
 #include "core/or/circuitlist.h"
+#include "core/or/circuitmux.h"
+#include "core/or/circuitmux_ewma.h"
+#include "core/or/command.h"
+#include "core/or/protover.h"
+#include "core/or/relay.h"
+#include "core/or/scheduler.h"
+#include "core/or/versions.h"
+#include "core/proto/proto_cell.h"
 #include "app/config/config.h"
 #include "lib/crypt_ops/crypto_curve25519.h"
 #include "lib/crypt_ops/crypto_dh.h"
 #include "core/crypto/onion_ntor.h"
 #include "lib/crypt_ops/crypto_ed25519.h"
 #include "lib/crypt_ops/crypto_rand.h"
+#include "lib/evloop/compat_libevent.h"
 #include "feature/dircommon/consdiff.h"
+#include "feature/hs/hs_circuitmap.h"
+#include "feature/hs/hs_intropoint.h"
+#include "feature/hs_common/replaycache.h"
+#include "feature/dircache/conscache.h"
 #include "lib/compress/compress.h"
+#include "lib/container/buffers.h"
+#include "lib/net/buffers_net.h"
+#include "lib/encoding/confline.h"
+#include "lib/fs/storagedir.h"
+#include "feature/dirparse/ns_parse.h"
+#include "feature/nodelist/networkstatus.h"
+#include "feature/nodelist/nodelist.h"
+#include "feature/nodelist/routerlist.h"
+#include "feature/nodelist/routerset.h"
+#include "lib/crypt_ops/crypto_format.h"
 
 #include "core/or/cell_st.h"
+#include "core/or/cell_queue_st.h"
 #include "core/or/or_circuit_st.h"
+#include "feature/nodelist/networkstatus_st.h"
+#include "feature/nodelist/routerinfo_st.h"
+#include "feature/nodelist/routerstatus_st.h"
 
 #include "lib/crypt_ops/digestset.h"
 #include "lib/crypt_ops/crypto_init.h"
+#include "trunnel/hs/cell_introduce1.h"
 
 #if defined(HAVE_CLOCK_GETTIME) && defined(CLOCK_PROCESS_CPUTIME_ID)
 static uint64_t nanostart;
@@ -551,6 +584,1111 @@ bench_cell_ops(void)
   tor_free(cell);
 }
 
+/** Helper for bench_cell_inbuf: pass <b>n_blocks</b> copies of the
+ * <b>blocklen</b> bytes at <b>block</b> through the socket pair <b>fds</b>
+ * into an OR connection's inbuf, and pull cells off the inbuf as the OR
+ * connection code does.  If <b>copy</b> is true, copy each cell off the
+ * buffer before unpacking it, as we used to.  Return the number of cells
+ * that we read. */
+static int
+bench_cell_inbuf_impl(tor_socket_t fds[2], const char *block,
+                      size_t blocklen, int n_blocks, int copy)
+{
+  buf_t *inbuf = buf_new();
+  int i, n_cells = 0;
+  for (i = 0; i < n_blocks; ++i) {
+    int eof = 0, err = 0;
+    if (write_all_to_socket(fds[0], block, blocklen) < 0)
+      break;
+    while (buf_datalen(inbuf) < blocklen) {
+      if (buf_read_from_socket(inbuf, fds[1], blocklen, &eof, &err) < 0)
+        goto done;
+    }
+    while (1) {
+      cell_t cell;
+      if (copy) {
+        char tmp[CELL_MAX_NETWORK_SIZE];
+        if (buf_datalen(inbuf) < CELL_MAX_NETWORK_SIZE)
+          break;
+        buf_get_bytes(inbuf, tmp, CELL_MAX_NETWORK_SIZE);
+        cell.circ_id = ntohl(get_uint32(tmp));
+        cell.command = get_uint8(tmp+4);
+        memcpy(cell.payload, tmp+5, CELL_PAYLOAD_SIZE);
+      } else if (! fetch_cell_from_buf(inbuf, &cell, 1)) {
+        break;
+      }
+      /* Look at the whole cell, as channel_tls_handle_cell() would. */
+      n_cells += (cell.command == CELL_RELAY &&
+                  !tor_mem_is_zero((char*)cell.payload, CELL_PAYLOAD_SIZE));
+    }
+  }
+ done:
+  buf_free(inbuf);
+  return n_cells;
+}
+
+/** Run benchmarks for moving cells from a transport socket, such as the one
+ * that connects us to a pluggable transport over the ExtORPort, into the
+ * cells that our OR connection code handles. */
+static void
+bench_cell_inbuf(void)
+{
+  const int cells_per_block = 128, n_blocks = 2000;
+  const size_t blocklen = cells_per_block * CELL_MAX_NETWORK_SIZE;
+  char *block = tor_malloc(blocklen);
+  tor_socket_t fds[2];
+  uint64_t start, end;
+  int i, copy;
+
+  for (i = 0; i < cells_per_block; ++i) {
+    char *cp = block + i * CELL_MAX_NETWORK_SIZE;
+    set_uint32(cp, htonl(i + 1));
+    set_uint8(cp+4, CELL_RELAY);
+    crypto_rand(cp+5, CELL_PAYLOAD_SIZE);
+  }
+  if (tor_socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0) {
+    printf("Couldn't make a socket pair.\n");
+    tor_free(block);
+    return;
+  }
+
+  reset_perftime();
+  for (copy = 0; copy <= 1; ++copy) {
+    start = perftime();
+    int n = bench_cell_inbuf_impl(fds, block, blocklen, n_blocks, copy);
+    end = perftime();
+    printf("Cells from socket to inbuf%s: %.2f ns per cell; %.1f MB/s\n",
+           copy ? " (copying)" : "", NANOCOUNT(start, end, n),
+           blocklen * n_blocks * 1000.0 / (end - start));
+  }
+
+  tor_close_socket_simple(fds[0]);
+  tor_close_socket_simple(fds[1]);
+  tor_free(block);
+}
+
+/** Run benchmarks for storage_dir_t with a large number of files. */
+static void
+bench_storagedir(void)
+{
+  const int n_files = 10000;
+  const char body[] = "An ephemeral file, full of sound and fury.";
+  uint64_t start, end;
+  char *dirname = NULL;
+  int i, failures = 0;
+  const char *tmpdir = getenv("TMPDIR");
+
+  tor_asprintf(&dirname, "%s/tor_bench_storagedir_%d",
+               tmpdir ? tmpdir : "/tmp", (int) getpid());
+  storage_dir_t *d = storage_dir_new(dirname, n_files);
+  if (!d) {
+    printf("Couldn't create %s\n", dirname);
+    tor_free(dirname);
+    return;
+  }
+
+  reset_perftime();
+  start = perftime();
+  for (i = 0; i < n_files; ++i) {
+    failures += storage_dir_save_string_to_file(d, body, 1, NULL) < 0;
+  }
+  end = perftime();
+  printf("storage_dir_save_string_to_file: %.2f usec per file\n",
+         MICROCOUNT(start, end, n_files));
+
+  start = perftime();
+  uint64_t usage = storage_dir_get_usage(d);
+  end = perftime();
+  printf("storage_dir_get_usage (%d files): %.2f usec\n",
+         n_files, MICROCOUNT(start, end, 1));
+
+  storage_dir_free(d);
+  d = storage_dir_new(dirname, n_files);
+  start = perftime();
+  usage = storage_dir_get_usage(d);
+  end = perftime();
+  printf("storage_dir_get_usage after reopening: %.2f usec\n",
+         MICROCOUNT(start, end, 1));
+
+  start = perftime();
+  storage_dir_shrink(d, usage / 2, 0);
+  end = perftime();
+  printf("storage_dir_shrink to half: %.2f usec\n",
+         MICROCOUNT(start, end, 1));
+
+  const smartlist_t *remaining = storage_dir_list(d);
+  int n_remove = smartlist_len(remaining) / 2;
+  start = perftime();
+  for (i = 0; i < n_remove; ++i) {
+    storage_dir_remove_file(d, smartlist_get(remaining, 0));
+  }
+  end = perftime();
+  printf("storage_dir_remove_file: %.2f usec per file\n",
+         MICROCOUNT(start, end, n_remove));
+
+  start = perftime();
+  storage_dir_remove_all(d);
+  end = perftime();
+  printf("storage_dir_remove_all: %.2f usec\n", MICROCOUNT(start, end, 1));
+
+  if (failures)
+    printf("ERROR: storage_dir_save_string_to_file failed %d times.\n",
+           failures);
+
+  storage_dir_free(d);
+  rmdir(dirname);
+  tor_free(dirname);
+}
+
+/** Helper for bench_conscache: look up <b>n</b> consensus diffs in
+ * <b>cache</b> by their source digests, the way consdiffmgr does, and
+ * return the number that we found. */
+static int
+bench_conscache_lookups(consensus_cache_t *cache, char **digests, int n)
+{
+  smartlist_t *matches = smartlist_new();
+  int i, found = 0;
+  for (i = 0; i < n; ++i) {
+    smartlist_clear(matches);
+    consensus_cache_find_all(matches, cache, "from-sha3-digest", digests[i]);
+    consensus_cache_filter_list(matches, "consensus-flavor", "microdesc");
+    consensus_cache_filter_list(matches, "document-type", "consensus-diff");
+    found += smartlist_len(matches);
+  }
+  smartlist_free(matches);
+  return found;
+}
+
+/** Run benchmarks for looking up consensus diffs in a consensus_cache_t
+ * with as many entries as a busy directory cache holds. */
+static void
+bench_conscache(void)
+{
+  const int n_entries = 5000, n_lookups = 1000;
+  const char *compression[] = { "identity", "gzip", "x-zstd", "x-tor-lzma" };
+  char **digests = tor_calloc(n_entries, sizeof(char *));
+  uint64_t start, end;
+  char *dirname = NULL, *lockname = NULL;
+  int i, found;
+  const char *tmpdir = getenv("TMPDIR");
+
+  tor_asprintf(&dirname, "%s/tor_bench_conscache_%d",
+               tmpdir ? tmpdir : "/tmp", (int) getpid());
+  tor_asprintf(&lockname, "%s.lock", dirname);
+  consensus_cache_t *cache = consensus_cache_open_shared(dirname, n_entries);
+  if (!cache) {
+    printf("Couldn't create %s\n", dirname);
+    goto done;
+  }
+
+  for (i = 0; i < n_entries; ++i) {
+    uint8_t d[DIGEST256_LEN];
+    char hex[HEX_DIGEST256_LEN+1];
+    config_line_t *labels = NULL;
+    crypto_rand((char *)d, sizeof(d));
+    base16_encode(hex, sizeof(hex), (const char *)d, sizeof(d));
+    digests[i] = tor_strdup(hex);
+    config_line_append(&labels, "document-type", "consensus-diff");
+    config_line_append(&labels, "consensus-flavor",
+                       (i & 1) ? "microdesc" : "ns");
+    config_line_append(&labels, "from-sha3-digest", hex);
+    config_line_append(&labels, "target-sha3-digest", hex);
+    config_line_append(&labels, "compression", compression[i % 4]);
+    consensus_cache_entry_t *ent =
+      consensus_cache_add(cache, labels, (const uint8_t *)"diff", 4);
+    config_free_lines(labels);
+    consensus_cache_entry_decref(ent);
+  }
+
+  reset_perftime();
+  start = perftime();
+  found = bench_conscache_lookups(cache, digests, n_lookups);
+  end = perftime();
+  printf("Diff lookup in %d entries, no index: %.2f usec (%d found)\n",
+         n_entries, MICROCOUNT(start, end, n_lookups), found);
+
+  consensus_cache_index_label(cache, "from-sha3-digest");
+  consensus_cache_find_first(cache, "from-sha3-digest", digests[0]);
+  start = perftime();
+  found = bench_conscache_lookups(cache, digests, n_lookups);
+  end = perftime();
+  printf("Diff lookup in %d entries, indexed: %.2f usec (%d found)\n",
+         n_entries, MICROCOUNT(start, end, n_lookups), found);
+
+  smartlist_t *all = smartlist_new();
+  consensus_cache_find_all(all, cache, NULL, NULL);
+  SMARTLIST_FOREACH(all, consensus_cache_entry_t *, ent,
+                    consensus_cache_entry_mark_for_removal(ent));
+  smartlist_free(all);
+  consensus_cache_delete_pending(cache, 1);
+
+ done:
+  consensus_cache_free(cache);
+  rmdir(dirname);
+  unlink(lockname);
+  for (i = 0; i < n_entries; ++i)
+    tor_free(digests[i]);
+  tor_free(digests);
+  tor_free(lockname);
+  tor_free(dirname);
+}
+
+/** Return a newly allocated, unsigned microdescriptor consensus listing
+ * <b>n_relays</b> synthetic relays, suitable for feeding to the parser. */
+static char *
+bench_make_md_consensus(int n_relays)
+{
+  smartlist_t *chunks = smartlist_new();
+  char va[ISO_TIME_LEN+1], fu[ISO_TIME_LEN+1], vu[ISO_TIME_LEN+1];
+  char pub[ISO_TIME_LEN+1];
+  char hex[HEX_DIGEST_LEN+1], hex2[HEX_DIGEST_LEN+1];
+  const time_t now = time(NULL);
+  int i;
+
+  format_iso_time(va, now);
+  format_iso_time(fu, now + 3600);
+  format_iso_time(vu, now + 3*3600);
+  format_iso_time(pub, now - 3600);
+  smartlist_add_asprintf(chunks,
+       "network-status-version 3 microdesc\n"
+       "vote-status consensus\n"
+       "consensus-method 28\n"
+       "valid-after %s\nfresh-until %s\nvalid-until %s\n"
+       "voting-delay 300 300\n"
+       "known-flags Exit Fast Guard Running Stable V2Dir Valid\n"
+       "params CircuitPriorityHalflifeMsec=30000\n", va, fu, vu);
+
+  base16_encode(hex, sizeof(hex), "AuthorityIdentity...", DIGEST_LEN);
+  base16_encode(hex2, sizeof(hex2), "AuthorityVoteDigest.", DIGEST_LEN);
+  smartlist_add_asprintf(chunks,
+       "dir-source bench %s 127.0.0.1 127.0.0.1 80 443\n"
+       "contact nobody\nvote-digest %s\n", hex, hex2);
+
+  for (i = 0; i < n_relays; ++i) {
+    char id[DIGEST_LEN], md[DIGEST256_LEN];
+    char id64[BASE64_DIGEST_LEN+1], md64[BASE64_DIGEST256_LEN+1];
+    /* Entries must be sorted by identity, so put the index up front. */
+    memset(id, 0, sizeof(id));
+    set_uint32(id, htonl(i));
+    crypto_rand(id+4, sizeof(id)-4);
+    crypto_rand(md, sizeof(md));
+    digest_to_base64(id64, id);
+    digest256_to_base64(md64, md);
+    smartlist_add_asprintf(chunks,
+       "r relay%d %s %s 10.%d.%d.%d 9001 0\n"
+       "m %s\n"
+       "s Fast%s Running%s V2Dir Valid\n"
+       "v Tor 0.4.0.5\n"
+       "pr Cons=1-2 Desc=1-2 DirCache=1-2 HSDir=1-2 HSIntro=3-4 HSRend=1-2 "
+       "Link=1-5 LinkAuth=1,3 Microdesc=1-2 Relay=1-2\n"
+       "w Bandwidth=%d\n",
+       i, id64, pub, (i>>16)&255, (i>>8)&255, i&255, md64,
+       (i % 3) ? " Guard" : "", (i % 2) ? " Stable" : "",
+       1 + (int)crypto_rand_int(20000));
+  }
+
+  {
+    char sig[256], sig64[512];
+    crypto_rand(sig, sizeof(sig));
+    base64_encode(sig64, sizeof(sig64), sig, sizeof(sig),
+                  BASE64_ENCODE_MULTILINE);
+    smartlist_add_asprintf(chunks,
+       "directory-footer\n"
+       "directory-signature sha256 %s %s\n"
+       "-----BEGIN SIGNATURE-----\n%s"
+       "-----END SIGNATURE-----\n", hex, hex2, sig64);
+  }
+
+  char *result = smartlist_join_strings(chunks, "", 0, NULL);
+  SMARTLIST_FOREACH(chunks, char *, cp, tor_free(cp));
+  smartlist_free(chunks);
+  return result;
+}
+
+/** Run benchmarks for parsing a large consensus and scanning the
+ * resulting routerstatus entries. */
+static void
+bench_consensus(void)
+{
+  const int n_relays = 7000;
+  const int n_parses = 10;
+  const int n_scans = 1000;
+  uint64_t start, end;
+  networkstatus_t *ns = NULL;
+  int i;
+
+  char *body = bench_make_md_consensus(n_relays);
+
+  reset_perftime();
+  start = perftime();
+  for (i = 0; i < n_parses; ++i) {
+    networkstatus_vote_free(ns);
+    ns = networkstatus_parse_vote_from_string(body, NULL, NS_TYPE_CONSENSUS);
+  }
+  end = perftime();
+  if (!ns) {
+    puts("Couldn't parse the synthetic consensus.");
+    tor_free(body);
+    return;
+  }
+  printf("Parse a %d-relay consensus: %.2f msec\n", n_relays,
+         MICROCOUNT(start, end, n_parses) / 1000);
+
+  /* Walk the routerstatus entries the way path selection does, looking
+   * only at their flags and bandwidths. */
+  uint64_t total_bw = 0;
+  start = perftime();
+  for (i = 0; i < n_scans; ++i) {
+    SMARTLIST_FOREACH_BEGIN(ns->routerstatus_list, const routerstatus_t *,
+                            rs) {
+      if (rs->is_flagged_running && rs->is_valid && rs->is_fast &&
+          (rs->is_possible_guard || rs->is_stable) && rs->has_bandwidth)
+        total_bw += rs->bandwidth_kb;
+    } SMARTLIST_FOREACH_END(rs);
+  }
+  end = perftime();
+  printf("Scan routerstatus flags and bandwidths: %.2f nsec per entry%s\n",
+         NANOCOUNT(start, end, n_scans * (uint64_t)n_relays),
+         total_bw ? "" : " (no bandwidth found!)");
+
+  networkstatus_vote_free(ns);
+  tor_free(body);
+}
+
+/** Run benchmarks for routerset membership checks against a large
+ * nodelist, as path selection does with ExcludeNodes and friends. */
+static void
+bench_routerset(void)
+{
+  const int n_nodes = 7000;
+  const int n_excluded_ids = 1000;
+  const int iters = 100;
+  routerinfo_t **ris = tor_calloc(n_nodes, sizeof(routerinfo_t *));
+  smartlist_t *elts = smartlist_new();
+  smartlist_t *out = smartlist_new();
+  routerset_t *exclude = routerset_new();
+  routerset_t *exits = routerset_new();
+  uint64_t start, end;
+  int i;
+
+  for (i = 0; i < n_nodes; ++i) {
+    ris[i] = tor_malloc_zero(sizeof(routerinfo_t));
+    tor_asprintf(&ris[i]->nickname, "relay%d", i);
+    ris[i]->addr = 0x0a000000 + i;
+    ris[i]->or_port = 9001;
+    crypto_rand(ris[i]->cache_info.identity_digest, DIGEST_LEN);
+    nodelist_set_routerinfo(ris[i], NULL);
+  }
+  for (i = 0; i < n_excluded_ids; ++i) {
+    char hex[HEX_DIGEST_LEN+1];
+    base16_encode(hex, sizeof(hex),
+                  ris[crypto_rand_int(n_nodes)]->cache_info.identity_digest,
+                  DIGEST_LEN);
+    smartlist_add_asprintf(elts, "$%s", hex);
+  }
+  for (i = 0; i < 32; ++i)
+    smartlist_add_asprintf(elts, "10.0.%d.0/28", i * 8);
+  char *s = smartlist_join_strings(elts, ",", 0, NULL);
+  routerset_parse(exclude, s, "ExcludeNodes");
+  routerset_parse(exits, "10.0.0.0/20", "ExitNodes");
+  tor_free(s);
+
+  const smartlist_t *nodes = nodelist_get_list();
+  reset_perftime();
+  start = perftime();
+  smartlist_add_all(out, nodes);
+  routerset_subtract_nodes(out, exclude);
+  end = perftime();
+  printf("routerset_subtract_nodes (%d nodes, %d elements): "
+         "%.2f usec on first call\n",
+         n_nodes, smartlist_len(elts), MICROCOUNT(start, end, 1));
+  start = perftime();
+  for (i = 0; i < iters; ++i) {
+    smartlist_clear(out);
+    smartlist_add_all(out, nodes);
+    routerset_subtract_nodes(out, exclude);
+  }
+  end = perftime();
+  printf("routerset_subtract_nodes: %.2f usec per later call (%d left)\n",
+         MICROCOUNT(start, end, iters), smartlist_len(out));
+
+  start = perftime();
+  for (i = 0; i < iters; ++i) {
+    smartlist_clear(out);
+    routerset_get_all_nodes(out, exits, exclude, 0);
+  }
+  end = perftime();
+  printf("routerset_get_all_nodes with exclusions: "
+         "%.2f usec per call (%d found)\n",
+         MICROCOUNT(start, end, iters), smartlist_len(out));
+
+  nodelist_free_all();
+  for (i = 0; i < n_nodes; ++i)
+    routerinfo_free(ris[i]);
+  tor_free(ris);
+  SMARTLIST_FOREACH(elts, char *, cp, tor_free(cp));
+  smartlist_free(elts);
+  smartlist_free(out);
+  routerset_free(exclude);
+  routerset_free(exits);
+}
+
+/** Run benchmarks for declared-family checks during path selection, with a
+ * nodelist that has several very large families. */
+static void
+bench_node_family(void)
+{
+  const int n_nodes = 7000;
+  /* Family sizes: five huge families, and many small ones. */
+  const int family_sizes[] = { 300, 300, 300, 300, 300, 50, 50, 50, 50, 50,
+                               50, 50, 50, 50, 50, 10, 10, 10, 10, 10 };
+  const int n_paths = 20;
+  or_options_t *options = get_options_mutable();
+  routerinfo_t **ris = tor_calloc(n_nodes, sizeof(routerinfo_t *));
+  node_t **nodes = tor_calloc(n_nodes, sizeof(node_t *));
+  smartlist_t *family = smartlist_new();
+  uint64_t start, end;
+  int i, j, k, first, found;
+  const int old_enforce = options->EnforceDistinctSubnets;
+
+  options->EnforceDistinctSubnets = 0;
+  for (i = 0; i < n_nodes; ++i) {
+    ris[i] = tor_malloc_zero(sizeof(routerinfo_t));
+    tor_asprintf(&ris[i]->nickname, "relay%d", i);
+    crypto_rand(ris[i]->cache_info.identity_digest, DIGEST_LEN);
+  }
+  for (first = 0, i = 0; i < (int) ARRAY_LENGTH(family_sizes); ++i) {
+    for (j = first; j < first + family_sizes[i]; ++j) {
+      ris[j]->declared_family = smartlist_new();
+      for (k = first; k < first + family_sizes[i]; ++k) {
+        char hex[HEX_DIGEST_LEN+1];
+        base16_encode(hex, sizeof(hex), ris[k]->cache_info.identity_digest,
+                      DIGEST_LEN);
+        smartlist_add_asprintf(ris[j]->declared_family, "$%s", hex);
+      }
+    }
+    first += family_sizes[i];
+  }
+  for (i = 0; i < n_nodes; ++i)
+    nodes[i] = nodelist_set_routerinfo(ris[i], NULL);
+  /* The first check computes the families. */
+  nodes_in_same_family(nodes[0], nodes[1]);
+
+  /* For each path, check every candidate against three chosen hops. */
+  for (k = 0; k < 2; ++k) {
+    reset_perftime();
+    start = perftime();
+    found = 0;
+    for (i = 0; i < n_paths; ++i) {
+      const node_t *hops[3];
+      for (j = 0; j < 3; ++j)
+        hops[j] = nodes[crypto_rand_int(first)];
+      for (j = 0; j < n_nodes; ++j) {
+        if (k == 0)
+          found += nodes_declare_same_family(nodes[j], hops[0]) ||
+            nodes_declare_same_family(nodes[j], hops[1]) ||
+            nodes_declare_same_family(nodes[j], hops[2]);
+        else
+          found += nodes_in_same_family(nodes[j], hops[0]) ||
+            nodes_in_same_family(nodes[j], hops[1]) ||
+            nodes_in_same_family(nodes[j], hops[2]);
+      }
+    }
+    end = perftime();
+    printf("%s: %.2f nsec per candidate (%d in a hop's family)\n",
+           k == 0 ? "Comparing declared families" : "Comparing family IDs",
+           NANOCOUNT(start, end, n_paths * n_nodes), found);
+  }
+
+  /* Exclude the families of a path's hops, as circuitbuild.c does. */
+  start = perftime();
+  for (i = 0; i < n_paths; ++i) {
+    smartlist_clear(family);
+    for (j = 0; j < 3; ++j)
+      nodelist_add_node_and_family(family, nodes[crypto_rand_int(first)]);
+  }
+  end = perftime();
+  printf("nodelist_add_node_and_family: %.2f usec per path\n",
+         MICROCOUNT(start, end, n_paths));
+
+  /* Recomputing the families after a relay declares a different family:
+   * a descriptor declaring the same one wouldn't make us recompute. */
+  {
+    routerinfo_t *ri = tor_malloc_zero(sizeof(routerinfo_t));
+    memcpy(ri->cache_info.identity_digest, ris[0]->cache_info.identity_digest,
+           DIGEST_LEN);
+    ri->nickname = tor_strdup(ris[0]->nickname);
+    ri->declared_family = smartlist_new();
+    SMARTLIST_FOREACH(ris[0]->declared_family, const char *, cp,
+                      if (cp_sl_idx > 0)
+                        smartlist_add_strdup(ri->declared_family, cp));
+    nodelist_set_routerinfo(ri, NULL);
+    routerinfo_free(ris[0]);
+    ris[0] = ri;
+  }
+  start = perftime();
+  nodes_in_same_family(nodes[0], nodes[1]);
+  end = perftime();
+  printf("Recomputing families for %d nodes: %.2f msec\n",
+         n_nodes, NANOCOUNT(start, end, 1) / 1e6);
+
+  options->EnforceDistinctSubnets = old_enforce;
+  nodelist_free_all();
+  for (i = 0; i < n_nodes; ++i)
+    routerinfo_free(ris[i]);
+  tor_free(ris);
+  tor_free(nodes);
+  smartlist_free(family);
+}
+
+/** How many channel comparisons the scheduler heap made, for
+ * bench_scheduler_heap(). */
+static uint64_t bench_n_channel_cmps = 0;
+
+/** Helper for bench_scheduler_heap(): count and compare two channels. */
+static int
+bench_compare_channels(const void *a, const void *b)
+{
+  ++bench_n_channel_cmps;
+  return scheduler_compare_channels(a, b);
+}
+
+/** A handful of distinct protocol lists, as in a real consensus. */
+static const char *bench_protocol_lists[] = {
+  "Cons=1-2 Desc=1-2 DirCache=1-2 HSDir=1-2 HSIntro=3-4 HSRend=1-2 "
+  "Link=1-5 LinkAuth=1,3 Microdesc=1-2 Relay=1-2",
+  "Cons=1-2 Desc=1-2 DirCache=1-2 HSDir=1-2 HSIntro=3-4 HSRend=1-2 "
+  "Link=1-5 LinkAuth=1,3 Microdesc=1-2 Relay=1-2 Padding=1",
+  "Cons=1-2 Desc=1-2 DirCache=1-2 HSDir=1 HSIntro=3 HSRend=1-2 "
+  "Link=1-4 LinkAuth=1 Microdesc=1-2 Relay=1-2",
+  "Cons=1 Desc=1 DirCache=1 HSDir=1 HSIntro=3 HSRend=1 Link=1-4 "
+  "LinkAuth=1 Microdesc=1 Relay=1-2",
+};
+
+/** Run benchmarks for summarizing relays' protocol lists, as we do for every
+ * routerstatus when we parse a consensus. */
+static void
+bench_protover_summary(void)
+{
+  const char *versions[] = {
+    "Tor 0.3.4.9", "Tor 0.3.5.7", "Tor 0.2.9.17", "Tor 0.3.0.7",
+  };
+  const int iters = 7000, n_lists = ARRAY_LENGTH(bench_protocol_lists);
+  protover_summary_flags_t flags;
+  uint64_t start, end;
+  int i, k, n_hsdir;
+
+  for (k = 0; k < 2; ++k) {
+    protover_summary_cache_free_all();
+    reset_perftime();
+    start = perftime();
+    n_hsdir = 0;
+    for (i = 0; i < iters; ++i) {
+      if (k == 0)
+        protover_summary_cache_free_all();
+      summarize_protover_flags(&flags, bench_protocol_lists[i % n_lists],
+                               versions[(i / 3) % ARRAY_LENGTH(versions)]);
+      n_hsdir += flags.supports_v3_hsdir;
+    }
+    end = perftime();
+    printf("%s: %.2f usec per relay (%d HSDirs)\n",
+           k == 0 ? "Parsing every protocol list" :
+           "Parsing each protocol list once",
+           MICROCOUNT(start, end, iters), n_hsdir);
+  }
+  protover_summary_cache_free_all();
+}
+
+/** Run benchmarks for computing an authority's vote on the protocol lists
+ * of every relay it knows about. */
+static void
+bench_protover_vote(void)
+{
+  const int n_relays = 7000, iters = 10;
+  const int n_lists = ARRAY_LENGTH(bench_protocol_lists);
+  smartlist_t *lists = smartlist_new();
+  uint64_t start, end;
+  char *result = NULL;
+  int i;
+
+  for (i = 0; i < n_relays; ++i) {
+    smartlist_add(lists, (void*) bench_protocol_lists[i % n_lists]);
+  }
+
+  reset_perftime();
+  start = perftime();
+  for (i = 0; i < iters; ++i) {
+    tor_free(result);
+    result = protover_compute_vote(lists, n_relays / 2);
+  }
+  end = perftime();
+  printf("Voting on %d protocol lists: %.2f msec (%s)\n", n_relays,
+         NANOCOUNT(start, end, iters) / 1e6, result);
+
+  tor_free(result);
+  smartlist_free(lists);
+}
+
+/** Run benchmarks for a replay cache holding a million entries: adding new
+ * ones, and replaying them. */
+static void
+bench_replaycache(void)
+{
+  const int n_entries = 1000000, entry_len = 32;
+  char *entries = tor_malloc(n_entries * entry_len);
+  replaycache_t *r = replaycache_new(REND_REPLAY_TIME_INTERVAL,
+                                     REND_REPLAY_TIME_INTERVAL);
+  uint64_t start, end;
+  int i, n_hits = 0;
+
+  crypto_rand(entries, n_entries * entry_len);
+
+  reset_perftime();
+  start = perftime();
+  for (i = 0; i < n_entries; ++i) {
+    n_hits += replaycache_add_and_test(r, entries + i * entry_len,
+                                       entry_len);
+  }
+  end = perftime();
+  printf("Adding %d new replay cache entries: %.2f nsec per entry "
+         "(%d hits)\n", n_entries, NANOCOUNT(start, end, n_entries),
+         n_hits);
+
+  n_hits = 0;
+  start = perftime();
+  for (i = 0; i < n_entries; ++i) {
+    n_hits += replaycache_add_and_test(r, entries + i * entry_len,
+                                       entry_len);
+  }
+  end = perftime();
+  printf("Replaying %d replay cache entries: %.2f nsec per entry "
+         "(%d hits)\n", n_entries, NANOCOUNT(start, end, n_entries),
+         n_hits);
+
+  replaycache_free(r);
+  tor_free(entries);
+}
+
+/** Run benchmarks for the pending-channel heap of the KIST scheduler, with
+ * many channels that always have cells to send.  Compare popping the best
+ * channel and pushing it back after every cell with leaving it in place and
+ * updating its key. */
+/** Run benchmarks for an address set the size of the nodelist's: building
+ * it, querying it, and updating it as relays change address. */
+static void
+bench_address_set(void)
+{
+  const int n_addrs = 16000, n_queries = 1000000;
+  tor_addr_t *addrs = tor_calloc(n_addrs * 2, sizeof(*addrs));
+  address_set_t *set;
+  uint64_t start, end;
+  int i, n_found;
+
+  /* The first half go in the set; the second half are strangers. */
+  for (i = 0; i < n_addrs * 2; ++i) {
+    if (i % 4 == 0) {
+      uint8_t a6[16];
+      crypto_rand((char *) a6, sizeof(a6));
+      tor_addr_from_ipv6_bytes(&addrs[i], (const char *) a6);
+    } else {
+      tor_addr_from_ipv4h(&addrs[i], crypto_rand_int(INT_MAX));
+    }
+  }
+
+  reset_perftime();
+  start = perftime();
+  set = address_set_new(n_addrs);
+  for (i = 0; i < n_addrs; ++i)
+    address_set_add(set, &addrs[i]);
+  end = perftime();
+  printf("Building a set of %d addresses: %.2f usec (%.2f nsec per "
+         "address)\n", n_addrs, MICROCOUNT(start, end, 1),
+         NANOCOUNT(start, end, n_addrs));
+
+  n_found = 0;
+  start = perftime();
+  for (i = 0; i < n_queries; ++i)
+    n_found += address_set_probably_contains(set, &addrs[i % (n_addrs*2)]);
+  end = perftime();
+  printf("Querying it: %.2f nsec per query (%d of %d found)\n",
+         NANOCOUNT(start, end, n_queries), n_found, n_queries);
+
+  n_found = 0;
+  start = perftime();
+  for (i = 0; i < n_queries; ++i)
+    n_found += address_set_probably_contains(set,
+                                   &addrs[n_addrs + (i % n_addrs)]);
+  end = perftime();
+  printf("Querying it for strangers: %.2f nsec per query (%d false "
+         "positives)\n", NANOCOUNT(start, end, n_queries), n_found);
+
+  /* Move 1% of the addresses at a time, the way a new consensus would,
+   * swapping members with strangers. */
+  start = perftime();
+  for (i = 0; i < n_addrs; ++i) {
+    address_set_remove(set, &addrs[i]);
+    address_set_add(set, &addrs[n_addrs + i]);
+  }
+  end = perftime();
+  printf("Changing 1%% of its addresses: %.2f usec (%.2f nsec per "
+         "address)\n", MICROCOUNT(start, end, 100),
+         NANOCOUNT(start, end, n_addrs));
+
+  address_set_free(set);
+  tor_free(addrs);
+}
+
+/** Run benchmarks for what an intro point does with an INTRODUCE1 cell
+ * before relaying it: parse it, and find the service's intro circuit. */
+static void
+bench_introduce1(void)
+{
+  const int n_services = 1000, n_cells = 1000, iters = 1000000;
+  const size_t encrypted_len = 300;
+  const size_t cell_len = DIGEST_LEN + 1 + 2 + ED25519_PUBKEY_LEN + 1 +
+    encrypted_len;
+  ed25519_public_key_t *keys = tor_calloc(n_services, sizeof(*keys));
+  uint8_t *cells = tor_malloc_zero(n_cells * cell_len);
+  uint64_t start, end;
+  int i, n_found;
+
+  hs_circuitmap_init();
+  for (i = 0; i < n_services; ++i) {
+    or_circuit_t *circ = or_circuit_new(0, NULL);
+    circ->base_.purpose = CIRCUIT_PURPOSE_INTRO_POINT;
+    crypto_rand((char *) keys[i].pubkey, sizeof(keys[i].pubkey));
+    hs_circuitmap_register_intro_circ_v3_relay_side(circ, &keys[i]);
+  }
+
+  /* Each cell introduces a client to one of the services. */
+  for (i = 0; i < n_cells; ++i) {
+    uint8_t *cell = cells + i * cell_len;
+    cell[DIGEST_LEN] = HS_INTRO_AUTH_KEY_TYPE_ED25519;
+    set_uint16(cell + DIGEST_LEN + 1, htons(ED25519_PUBKEY_LEN));
+    memcpy(cell + DIGEST_LEN + 3, keys[i % n_services].pubkey,
+           ED25519_PUBKEY_LEN);
+    crypto_rand((char *) cell + cell_len - encrypted_len, encrypted_len);
+  }
+
+  reset_perftime();
+  n_found = 0;
+  start = perftime();
+  for (i = 0; i < iters; ++i) {
+    const uint8_t *cell = cells + (i % n_cells) * cell_len;
+    trn_cell_introduce1_t *parsed = NULL;
+    ed25519_public_key_t auth_key;
+    if (trn_cell_introduce1_parse(&parsed, cell, cell_len) < 0)
+      continue;
+    memcpy(auth_key.pubkey, trn_cell_introduce1_getconstarray_auth_key(parsed),
+           ED25519_PUBKEY_LEN);
+    n_found += !! hs_circuitmap_get_intro_circ_v3_relay_side(&auth_key);
+    trn_cell_introduce1_free(parsed);
+  }
+  end = perftime();
+  printf("Parsing a copy of INTRODUCE1 and finding its circuit: "
+         "%.2f nsec per cell (%d found)\n",
+         NANOCOUNT(start, end, iters), n_found);
+
+  n_found = 0;
+  start = perftime();
+  for (i = 0; i < iters; ++i) {
+    const uint8_t *cell = cells + (i % n_cells) * cell_len;
+    hs_intro_introduce1_view_t view;
+    ed25519_public_key_t auth_key;
+    if (hs_intro_parse_introduce1(&view, cell, cell_len) < 0)
+      continue;
+    memcpy(auth_key.pubkey, view.auth_key, ED25519_PUBKEY_LEN);
+    n_found += !! hs_circuitmap_get_intro_circ_v3_relay_side(&auth_key);
+  }
+  end = perftime();
+  printf("Parsing INTRODUCE1 in place and finding its circuit: "
+         "%.2f nsec per cell (%d found)\n",
+         NANOCOUNT(start, end, iters), n_found);
+
+  circuit_free_all();
+  hs_circuitmap_free_all();
+  tor_free(cells);
+  tor_free(keys);
+}
+
+static void
+bench_scheduler_heap(void)
+{
+  const int n_chans = 10000;
+  const int circs_per_chan = 4;
+  const int n_cells = 1000000;
+  channel_t **chans = tor_calloc(n_chans, sizeof(channel_t *));
+  or_circuit_t **circs =
+    tor_calloc(n_chans * circs_per_chan, sizeof(or_circuit_t *));
+  smartlist_t *heap = smartlist_new();
+  const int idx_offset = offsetof(channel_t, sched_heap_idx);
+  uint64_t start, end;
+  int i, j, pass;
+
+  cmux_ewma_set_options(NULL, NULL);
+
+  for (i = 0; i < n_chans; ++i) {
+    chans[i] = tor_malloc_zero(sizeof(channel_t));
+    chans[i]->global_identifier = i + 1;
+    chans[i]->sched_heap_idx = -1;
+    chans[i]->cmux = circuitmux_alloc();
+    circuitmux_set_policy(chans[i]->cmux, &ewma_policy);
+    for (j = 0; j < circs_per_chan; ++j) {
+      or_circuit_t *circ = tor_malloc_zero(sizeof(or_circuit_t));
+      circ->base_.magic = OR_CIRCUIT_MAGIC;
+      circ->base_.purpose = CIRCUIT_PURPOSE_OR;
+      circ->base_.n_chan = chans[i];
+      circ->base_.n_circ_id = j + 1;
+      circuitmux_attach_circuit(chans[i]->cmux, TO_CIRCUIT(circ),
+                                CELL_DIRECTION_OUT);
+      circuitmux_set_num_cells(chans[i]->cmux, TO_CIRCUIT(circ),
+                               2 * n_cells);
+      circs[i * circs_per_chan + j] = circ;
+    }
+  }
+
+  for (pass = 0; pass < 2; ++pass) {
+    destroy_cell_queue_t *dq = NULL;
+    smartlist_clear(heap);
+    for (i = 0; i < n_chans; ++i) {
+      chans[i]->sched_heap_idx = -1;
+      smartlist_pqueue_add(heap, bench_compare_channels, idx_offset,
+                           chans[i]);
+    }
+
+    bench_n_channel_cmps = 0;
+    reset_perftime();
+    start = perftime();
+    for (i = 0; i < n_cells; ++i) {
+      channel_t *chan;
+      if (pass == 0)
+        chan = smartlist_pqueue_pop(heap, bench_compare_channels, idx_offset);
+      else
+        chan = smartlist_get(heap, 0);
+      circuit_t *circ = circuitmux_get_first_active_circuit(chan->cmux, &dq);
+      circuitmux_notify_xmit_cells(chan->cmux, circ, 1);
+      if (pass == 0)
+        smartlist_pqueue_add(heap, bench_compare_channels, idx_offset, chan);
+      else
+        smartlist_pqueue_update(heap, bench_compare_channels, idx_offset,
+                                chan);
+    }
+    end = perftime();
+    printf("%s, %d channels: %.2f nsec per cell, "
+           "%.1f channel comparisons per cell\n",
+           pass == 0 ? "Pop and push" : "Update in place", n_chans,
+           NANOCOUNT(start, end, n_cells),
+           ((double)bench_n_channel_cmps) / n_cells);
+  }
+
+  for (i = 0; i < n_chans; ++i) {
+    for (j = 0; j < circs_per_chan; ++j) {
+      circuitmux_detach_circuit(chans[i]->cmux,
+                                TO_CIRCUIT(circs[i * circs_per_chan + j]));
+      tor_free(circs[i * circs_per_chan + j]);
+    }
+    circuitmux_free(chans[i]->cmux);
+    tor_free(chans[i]);
+  }
+  tor_free(chans);
+  tor_free(circs);
+  smartlist_free(heap);
+}
+
+/** Helper for bench_cell_flush(): accept and drop a cell. */
+static int
+bench_write_packed_cell(channel_t *chan, packed_cell_t *cell)
+{
+  (void) chan;
+  (void) cell;
+  return 0;
+}
+
+/** Run benchmarks for moving cells from circuit queues to a channel, with
+ * and without sending cells from a circuit in batches. */
+static void
+bench_cell_flush(void)
+{
+  const int n_circs = 100;
+  const int cells_per_circ = 500;
+  const int n_rounds = 20;
+  const int batches[] = { 1, 4, 16 };
+  channel_t *chan = tor_malloc_zero(sizeof(channel_t));
+  or_circuit_t **circs = tor_calloc(n_circs, sizeof(or_circuit_t *));
+  networkstatus_t *ns = tor_malloc_zero(sizeof(networkstatus_t));
+  cell_t cell;
+  unsigned b;
+  int i, round;
+
+  memset(&cell, 0, sizeof(cell));
+  cell.command = CELL_RELAY;
+  ns->net_params = smartlist_new();
+  cmux_ewma_set_options(NULL, NULL);
+
+  channel_init(chan);
+  chan->state = CHANNEL_STATE_OPEN;
+  chan->write_packed_cell = bench_write_packed_cell;
+  chan->wide_circ_ids = 1;
+  chan->cmux = circuitmux_alloc();
+  circuitmux_set_policy(chan->cmux, &ewma_policy);
+  for (i = 0; i < n_circs; ++i) {
+    circs[i] = tor_malloc_zero(sizeof(or_circuit_t));
+    circs[i]->base_.magic = OR_CIRCUIT_MAGIC;
+    circs[i]->base_.purpose = CIRCUIT_PURPOSE_OR;
+    circs[i]->base_.n_chan = chan;
+    circs[i]->base_.n_circ_id = i + 1;
+    cell_queue_init(&circs[i]->base_.n_chan_cells);
+    circuitmux_attach_circuit(chan->cmux, TO_CIRCUIT(circs[i]),
+                              CELL_DIRECTION_OUT);
+  }
+
+  for (b = 0; b < ARRAY_LENGTH(batches); ++b) {
+    uint64_t elapsed = 0, n_cells = 0;
+    char *param = NULL;
+    tor_asprintf(&param, "circ_flush_batch=%d", batches[b]);
+    smartlist_add(ns->net_params, param);
+    relay_consensus_has_changed(ns);
+
+    reset_perftime();
+    for (round = 0; round < n_rounds; ++round) {
+      uint64_t start, end;
+      int n;
+      for (i = 0; i < n_circs; ++i) {
+        cell_queue_t *queue = &circs[i]->base_.n_chan_cells;
+        while (queue->n < cells_per_circ)
+          cell_queue_append_packed_copy(NULL, queue, 1, &cell, 1, 0);
+        circuitmux_set_num_cells(chan->cmux, TO_CIRCUIT(circs[i]),
+                                 queue->n);
+      }
+      start = perftime();
+      while ((n = channel_flush_from_first_active_circuit(chan, 1000)) > 0)
+        n_cells += n;
+      end = perftime();
+      elapsed += end - start;
+    }
+    printf("Flush with batches of %d cells: %.2f nsec per cell, "
+           "%.0f cells per second\n", batches[b],
+           NANOCOUNT(0, elapsed, n_cells),
+           ((double)n_cells) * 1e9 / elapsed);
+
+    smartlist_clear(ns->net_params);
+    tor_free(param);
+  }
+
+  relay_consensus_has_changed(ns);
+  for (i = 0; i < n_circs; ++i) {
+    circuitmux_detach_circuit(chan->cmux, TO_CIRCUIT(circs[i]));
+    tor_free(circs[i]);
+  }
+  tor_free(circs);
+  circuitmux_free(chan->cmux);
+  tor_free(chan);
+  smartlist_free(ns->net_params);
+  tor_free(ns);
+}
+
+/** Run benchmarks for relaying inbound cells, with the cells of several
+ * circuits mixed together on one channel, as a middle relay would see them:
+ * first one cell at a time, then in batches grouped by circuit. */
+static void
+bench_cell_batch(void)
+{
+  const int n_circs = 64;
+  const int n_cells = 160000;
+  const int batch = COMMAND_CELL_BATCH_MAX;
+  const int n_busy = 4;
+  circid_t busy[4];
+  channel_t *chans[2];
+  or_circuit_t **circs = tor_calloc(n_circs, sizeof(or_circuit_t *));
+  cell_t *cells = tor_calloc(batch, sizeof(cell_t));
+  cell_t *templates = tor_calloc(n_cells, sizeof(cell_t));
+  char keys[CPATH_KEY_MATERIAL_LEN];
+  struct tor_libevent_cfg cfg;
+  or_options_t *options = get_options_mutable();
+  int order[COMMAND_CELL_BATCH_MAX];
+  const int vanilla = SCHEDULER_VANILLA;
+  int i, j, pass;
+
+  memset(&cfg, 0, sizeof(cfg));
+  tor_libevent_initialize(&cfg);
+  options->SchedulerTypes_ = smartlist_new();
+  smartlist_add(options->SchedulerTypes_, tor_memdup(&vanilla,
+                                                     sizeof(vanilla)));
+  scheduler_init();
+  cmux_ewma_set_options(NULL, NULL);
+  options->MaxMemInQueues = options->MaxMemInQueues_low_threshold =
+    UINT64_C(1) << 40;
+
+  /* chans[0] is the inbound channel, and chans[1] the outbound one. */
+  for (i = 0; i < 2; ++i) {
+    chans[i] = tor_malloc_zero(sizeof(channel_t));
+    channel_init(chans[i]);
+    chans[i]->state = CHANNEL_STATE_OPEN;
+    chans[i]->wide_circ_ids = 1;
+    chans[i]->cmux = circuitmux_alloc();
+    circuitmux_set_policy(chans[i]->cmux, &ewma_policy);
+  }
+  for (i = 0; i < n_circs; ++i) {
+    circs[i] = or_circuit_new(i + 1, chans[0]);
+    circuit_set_n_circid_chan(TO_CIRCUIT(circs[i]), i + 1, chans[1]);
+    circs[i]->base_.state = CIRCUIT_STATE_OPEN;
+    crypto_rand(keys, sizeof(keys));
+    relay_crypto_init(&circs[i]->crypto, keys, sizeof(keys), 0, 0);
+  }
+  /* Each batch interleaves the cells of a few busy circuits. */
+  for (i = 0; i < n_cells; ++i) {
+    if (i % batch == 0) {
+      for (j = 0; j < n_busy; ++j)
+        busy[j] = 1 + crypto_rand_int(n_circs);
+    }
+    templates[i].circ_id = busy[i % n_busy];
+    templates[i].command = CELL_RELAY;
+    crypto_rand((char *) templates[i].payload, CELL_PAYLOAD_SIZE);
+  }
+
+  for (pass = 0; pass < 2; ++pass) {
+    uint64_t start, end;
+    reset_perftime();
+    start = perftime();
+    for (i = 0; i < n_cells; i += batch) {
+      memcpy(cells, &templates[i], batch * sizeof(cell_t));
+      if (pass == 0) {
+        for (j = 0; j < batch; ++j)
+          command_process_cell(chans[0], &cells[j]);
+      } else {
+        command_order_cell_batch(cells, batch, order);
+        relay_cell_batch_begin();
+        for (j = 0; j < batch; ++j)
+          command_process_cell(chans[0], &cells[order[j]]);
+        relay_cell_batch_end();
+      }
+    }
+    end = perftime();
+    printf("%s, %d circuits: %.2f nsec per cell (%d queued)\n",
+           pass == 0 ? "One cell at a time" : "Batched by circuit", n_circs,
+           NANOCOUNT(start, end, n_cells),
+           (int) circuitmux_num_cells(chans[1]->cmux));
+
+    for (i = 0; i < n_circs; ++i) {
+      cell_queue_clear(&circs[i]->base_.n_chan_cells);
+      circuitmux_set_num_cells(chans[1]->cmux, TO_CIRCUIT(circs[i]), 0);
+    }
+  }
+
+  for (i = 0; i < n_circs; ++i) {
+    circuitmux_detach_circuit(chans[0]->cmux, TO_CIRCUIT(circs[i]));
+    circuitmux_detach_circuit(chans[1]->cmux, TO_CIRCUIT(circs[i]));
+  }
+  circuit_free_all();
+  for (i = 0; i < 2; ++i) {
+    circuitmux_free(chans[i]->cmux);
+    tor_free(chans[i]);
+  }
+  tor_free(circs);
+  tor_free(cells);
+  tor_free(templates);
+}
+
 static void
 bench_dh(void)
 {
@@ -659,6 +1797,20 @@ static struct benchmark_t benchmarks[] = {
 
   ENT(cell_aes),
   ENT(cell_ops),
+  ENT(cell_inbuf),
+  ENT(storagedir),
+  ENT(conscache),
+  ENT(consensus),
+  ENT(routerset),
+  ENT(node_family),
+  ENT(protover_summary),
+  ENT(protover_vote),
+  ENT(replaycache),
+  ENT(introduce1),
+  ENT(address_set),
+  ENT(scheduler_heap),
+  ENT(cell_flush),
+  ENT(cell_batch),
   ENT(dh),
 
 #ifdef ENABLE_OPENSSL
@@ -58,6 +58,7 @@
 #include "app/config/statefile.h"
 #include "lib/crypt_ops/crypto_curve25519.h"
 
+#include "core/or/channel.h"
 #include "core/or/extend_info_st.h"
 #include "core/or/or_circuit_st.h"
 #include "feature/rend/rend_encoded_v2_service_descriptor_st.h"
@@ -354,6 +355,113 @@ test_onion_queues(void *arg)
   tor_free(onionskin);
 }
 
+static int n_onion_queue_marked = 0;
+
+static void
+mock_onion_queue_mark_for_close(circuit_t *circ, int reason, int line,
+                                const char *file)
+{
+  (void) reason;
+  (void) line;
+  (void) file;
+  circ->marked_for_close = 1;
+  ++n_onion_queue_marked;
+}
+
+static void
+test_onion_queue_fairness(void *arg)
+{
+  uint8_t buf[NTOR_ONIONSKIN_LEN] = {0};
+  channel_t *flooder = tor_malloc_zero(sizeof(channel_t));
+  channel_t *client = tor_malloc_zero(sizeof(channel_t));
+  or_circuit_t *flood_circs[60], *client_circs[3];
+  create_cell_t *onionskin = NULL;
+  or_options_t *options = get_options_mutable();
+  const int old_num_cpus = options->NumCPUs;
+  const int old_max_delay = options->MaxOnionQueueDelay;
+  int i;
+  (void)arg;
+
+  MOCK(circuit_mark_for_close_, mock_onion_queue_mark_for_close);
+  n_onion_queue_marked = 0;
+  /* Make the queue fill up after 50 ntor requests. */
+  options->NumCPUs = 1;
+  options->MaxOnionQueueDelay = 10;
+
+  flooder->global_identifier = 1000;
+  client->global_identifier = 1001;
+  memset(flood_circs, 0, sizeof(flood_circs));
+  memset(client_circs, 0, sizeof(client_circs));
+
+  /* One channel fills the queue; past that, it gets no more room. */
+  for (i = 0; i < 60; ++i) {
+    create_cell_t *cc = tor_malloc_zero(sizeof(create_cell_t));
+    create_cell_init(cc, CELL_CREATE2, ONION_HANDSHAKE_TYPE_NTOR,
+                     NTOR_ONIONSKIN_LEN, buf);
+    flood_circs[i] = or_circuit_new(0, NULL);
+    flood_circs[i]->p_chan = flooder;
+    if (onion_pending_add(flood_circs[i], cc) < 0)
+      tor_free(cc);
+  }
+  tt_int_op(50, OP_EQ, onion_num_pending(ONION_HANDSHAKE_TYPE_NTOR));
+  tt_int_op(50, OP_EQ,
+            onion_num_pending_from_chan(1000, ONION_HANDSHAKE_TYPE_NTOR));
+  tt_int_op(0, OP_EQ, n_onion_queue_marked);
+
+  /* Another channel still gets in, at the flooder's expense. */
+  for (i = 0; i < 3; ++i) {
+    create_cell_t *cc = tor_malloc_zero(sizeof(create_cell_t));
+    create_cell_init(cc, CELL_CREATE2, ONION_HANDSHAKE_TYPE_NTOR,
+                     NTOR_ONIONSKIN_LEN, buf);
+    client_circs[i] = or_circuit_new(0, NULL);
+    client_circs[i]->p_chan = client;
+    tt_int_op(0, OP_EQ, onion_pending_add(client_circs[i], cc));
+  }
+  tt_int_op(50, OP_EQ, onion_num_pending(ONION_HANDSHAKE_TYPE_NTOR));
+  tt_int_op(47, OP_EQ,
+            onion_num_pending_from_chan(1000, ONION_HANDSHAKE_TYPE_NTOR));
+  tt_int_op(3, OP_EQ,
+            onion_num_pending_from_chan(1001, ONION_HANDSHAKE_TYPE_NTOR));
+  tt_int_op(3, OP_EQ, n_onion_queue_marked);
+  /* The flooder's newest requests were the ones dropped. */
+  tt_assert(TO_CIRCUIT(flood_circs[49])->marked_for_close);
+  tt_assert(! TO_CIRCUIT(flood_circs[46])->marked_for_close);
+
+  /* The two channels take turns, even though the flooder got there
+   * first. */
+  for (i = 0; i < 3; ++i) {
+    tt_ptr_op(flood_circs[i], OP_EQ, onion_next_task(&onionskin));
+    tor_free(onionskin);
+    tt_ptr_op(client_circs[i], OP_EQ, onion_next_task(&onionskin));
+    tor_free(onionskin);
+  }
+  tt_ptr_op(flood_circs[3], OP_EQ, onion_next_task(&onionskin));
+  tor_free(onionskin);
+  tt_int_op(0, OP_EQ,
+            onion_num_pending_from_chan(1001, ONION_HANDSHAKE_TYPE_NTOR));
+
+ done:
+  clear_pending_onions();
+  UNMOCK(circuit_mark_for_close_);
+  options->NumCPUs = old_num_cpus;
+  options->MaxOnionQueueDelay = old_max_delay;
+  for (i = 0; i < 60; ++i) {
+    if (flood_circs[i]) {
+      flood_circs[i]->p_chan = NULL;
+      circuit_free_(TO_CIRCUIT(flood_circs[i]));
+    }
+  }
+  for (i = 0; i < 3; ++i) {
+    if (client_circs[i]) {
+      client_circs[i]->p_chan = NULL;
+      circuit_free_(TO_CIRCUIT(client_circs[i]));
+    }
+  }
+  tor_free(flooder);
+  tor_free(client);
+  tor_free(onionskin);
+}
+
 static crypto_cipher_t *crypto_rand_aes_cipher = NULL;
 
 // Mock replacement for crypto_rand: Generates bytes from a provided AES_CTR
@@ -820,6 +928,7 @@ static struct testcase_t test_array[] = {
   ENT(onion_handshake),
   { "bad_onion_handshake", test_bad_onion_handshake, 0, NULL, NULL },
   ENT(onion_queues),
+  FORK(onion_queue_fairness),
   { "ntor_handshake", test_ntor_handshake, 0, NULL, NULL },
   { "fast_handshake", test_fast_handshake, 0, NULL, NULL },
   FORK(circuit_timeout),
@@ -100,7 +100,118 @@ test_accounting_limits(void *arg)
 
 #undef NS_SUBMODULE
 
+static void
+test_accounting_pacing_rate(void *arg)
+{
+  const time_t now = 1000000;
+  const uint32_t fast = 10*1024*1024;
+  (void) arg;
+
+  /* 1 GB left over 10000 seconds. */
+  tt_uint_op(accounting_compute_pacing_rate(2000000000, 1000000000, ACCT_MAX,
+                                            now, now + 10000, fast),
+             OP_EQ, 100000);
+  /* With the sum rule, reading and writing share the quota. */
+  tt_uint_op(accounting_compute_pacing_rate(2000000000, 1000000000, ACCT_SUM,
+                                            now, now + 10000, fast),
+             OP_EQ, 50000 < RELAY_REQUIRED_MIN_BANDWIDTH ?
+                    RELAY_REQUIRED_MIN_BANDWIDTH : 50000);
+  /* Never faster than we're configured to go... */
+  tt_uint_op(accounting_compute_pacing_rate(2000000000, 0, ACCT_MAX,
+                                            now, now + 60, fast),
+             OP_EQ, fast);
+  /* ... nor slower than a useful relay, even with no quota left ... */
+  tt_uint_op(accounting_compute_pacing_rate(2000000000, 3000000000, ACCT_MAX,
+                                            now, now + 10000, fast),
+             OP_EQ, RELAY_REQUIRED_MIN_BANDWIDTH);
+  /* ... unless we're configured to go slower than that. */
+  tt_uint_op(accounting_compute_pacing_rate(2000000000, 3000000000, ACCT_MAX,
+                                            now, now + 10000, 1000),
+             OP_EQ, 1000);
+  /* Past the end of the interval, spread what's left over a minute. */
+  tt_uint_op(accounting_compute_pacing_rate(2000000000, 1999400000, ACCT_MAX,
+                                            now, now - 5, fast),
+             OP_EQ, 10000 < RELAY_REQUIRED_MIN_BANDWIDTH ?
+                    RELAY_REQUIRED_MIN_BANDWIDTH : 10000);
+
+ done:
+  ;
+}
+
+static or_state_t *pacing_state;
+static or_state_t *
+mock_get_or_state_pacing(void)
+{
+  return pacing_state;
+}
+
+/*
+ * Simulate a month of a relay that can go faster than its quota allows,
+ * and make sure that with AccountingPacing, it stays up all month and uses
+ * almost all its quota.
+ */
+static void
+test_accounting_pacing_month(void *arg)
+{
+  or_options_t *options = get_options_mutable();
+  const uint64_t acct_max = UINT64_C(1000000000000); /* 1 TB */
+  time_t now = time(NULL);
+  time_t start, end;
+  uint64_t busy_rate = 10*1024*1024, quiet_rate = 100*1024;
+  (void) arg;
+
+  MOCK(get_or_state, mock_get_or_state_pacing);
+  pacing_state = or_state_new();
+
+  options->AccountingMax = acct_max;
+  options->AccountingRule = ACCT_MAX;
+  options->AccountingPacing = 1;
+  options->BandwidthRate = options->BandwidthBurst = busy_rate;
+  tt_int_op(accounting_parse_options(options, 0), OP_EQ, 0);
+
+  configure_accounting(now);
+  end = accounting_get_end_time();
+  start = end - accounting_get_interval_length();
+  tt_int_op(end - now, OP_GT, 0);
+  consider_hibernation(now);
+  tt_assert(! we_are_hibernating());
+
+  /* Start from the beginning of the interval. */
+  now = start;
+  configure_accounting(now);
+  tt_uint_op(accounting_get_pacing_rate(), OP_GT, 0);
+  tt_uint_op(accounting_get_pacing_rate(), OP_LT, busy_rate);
+
+  while (now + 60 < end) {
+    /* Half of each day we could run flat out; the other half we're
+     * quiet. */
+    uint64_t demand = ((now - start) % 86400 < 43200) ? busy_rate : quiet_rate;
+    uint64_t rate = MIN(demand, accounting_get_pacing_rate());
+    accounting_add_bytes((size_t)(rate * 60), (size_t)(rate * 60), 1);
+    now += 60;
+    accounting_run_housekeeping(now);
+    consider_hibernation(now);
+    tt_uint_op(get_accounting_bytes(), OP_LE, acct_max);
+    if (now < end - 86400)
+      tt_assert(! we_are_hibernating());
+  }
+
+  /* We used most of our quota, and not too much. */
+  tt_uint_op(get_accounting_bytes(), OP_GE, acct_max / 100 * 90);
+  tt_uint_op(get_accounting_bytes(), OP_LE, acct_max);
+
+  /* Without pacing, we go back to the configured rate. */
+  options->AccountingPacing = 0;
+  tt_uint_op(accounting_get_pacing_rate(), OP_EQ, 0);
+
+ done:
+  UNMOCK(get_or_state);
+  or_state_free(pacing_state);
+}
+
 struct testcase_t accounting_tests[] = {
   { "bwlimits", test_accounting_limits, TT_FORK, NULL, NULL },
+  { "pacing_rate", test_accounting_pacing_rate, 0, NULL, NULL },
+  { "pacing_month", test_accounting_pacing_month, TT_FORK, NULL, NULL },
   END_OF_TESTCASES
 };
@@ -84,6 +84,60 @@ test_contains(void *arg)
   address_set_free(set);
 }
 
+static void
+test_remove(void *arg)
+{
+  address_set_t *set = NULL;
+  tor_addr_t addr_v4, *addrs = NULL;
+  const int n_addrs = 1000;
+  int i;
+
+  (void) arg;
+
+  tor_addr_parse(&addr_v4, "42.42.42.42");
+
+  /* Start small, so that we have to grow. */
+  set = address_set_new(1);
+  tt_assert(set);
+
+  /* An address stays until it has been removed as often as it was added. */
+  address_set_add(set, &addr_v4);
+  address_set_add_ipv4h(set, tor_addr_to_ipv4h(&addr_v4));
+  tt_int_op(address_set_size(set), OP_EQ, 1);
+  address_set_remove(set, &addr_v4);
+  tt_int_op(address_set_probably_contains(set, &addr_v4), OP_EQ, 1);
+  address_set_remove_ipv4h(set, tor_addr_to_ipv4h(&addr_v4));
+  tt_int_op(address_set_probably_contains(set, &addr_v4), OP_EQ, 0);
+  tt_int_op(address_set_size(set), OP_EQ, 0);
+  /* Removing what isn't there does nothing. */
+  address_set_remove(set, &addr_v4);
+  tt_int_op(address_set_size(set), OP_EQ, 0);
+
+  addrs = tor_calloc(n_addrs, sizeof(*addrs));
+  for (i = 0; i < n_addrs; ++i) {
+    tor_addr_from_ipv4h(&addrs[i], 0x0a000000 + i);
+    address_set_add(set, &addrs[i]);
+  }
+  tt_int_op(address_set_size(set), OP_EQ, n_addrs);
+  for (i = 0; i < n_addrs; ++i) {
+    tt_int_op(address_set_probably_contains(set, &addrs[i]), OP_EQ, 1);
+  }
+  tt_int_op(address_set_probably_contains(set, &addr_v4), OP_EQ, 0);
+
+  /* Take out every other one: the rest must stay. */
+  for (i = 0; i < n_addrs; i += 2) {
+    address_set_remove(set, &addrs[i]);
+  }
+  tt_int_op(address_set_size(set), OP_EQ, n_addrs / 2);
+  for (i = 0; i < n_addrs; ++i) {
+    tt_int_op(address_set_probably_contains(set, &addrs[i]), OP_EQ, i % 2);
+  }
+
+ done:
+  address_set_free(set);
+  tor_free(addrs);
+}
+
 static void
 test_nodelist(void *arg)
 {
@@ -169,11 +223,70 @@ test_nodelist(void *arg)
   UNMOCK(get_estimated_address_per_node);
 }
 
+/* Check that the nodelist's address set follows relays as their addresses
+ * change and as they leave the consensus. */
+static void
+test_nodelist_update(void *arg)
+{
+  routerstatus_t *rs = NULL, *rs2 = NULL;
+  tor_addr_t addr_a, addr_b;
+
+  (void) arg;
+
+  MOCK(networkstatus_get_latest_consensus,
+       mock_networkstatus_get_latest_consensus);
+  MOCK(networkstatus_get_latest_consensus_by_flavor,
+       mock_networkstatus_get_latest_consensus_by_flavor);
+
+  dummy_ns = tor_malloc_zero(sizeof(*dummy_ns));
+  dummy_ns->flavor = FLAV_MICRODESC;
+  dummy_ns->routerstatus_list = smartlist_new();
+
+  tor_addr_parse(&addr_a, "42.42.42.42");
+  tor_addr_parse(&addr_b, "43.43.43.43");
+
+  rs = tor_malloc_zero(sizeof(*rs));
+  crypto_rand(rs->identity_digest, sizeof(rs->identity_digest));
+  rs->addr = tor_addr_to_ipv4h(&addr_a);
+  smartlist_add(dummy_ns->routerstatus_list, rs);
+  nodelist_set_consensus(dummy_ns);
+  tt_int_op(nodelist_probably_contains_address(&addr_a), OP_EQ, 1);
+  tt_int_op(nodelist_probably_contains_address(&addr_b), OP_EQ, 0);
+
+  /* The same relay moves. */
+  rs2 = tor_memdup(rs, sizeof(*rs));
+  rs2->addr = tor_addr_to_ipv4h(&addr_b);
+  smartlist_clear(dummy_ns->routerstatus_list);
+  smartlist_add(dummy_ns->routerstatus_list, rs2);
+  nodelist_set_consensus(dummy_ns);
+  tt_int_op(nodelist_probably_contains_address(&addr_a), OP_EQ, 0);
+  tt_int_op(nodelist_probably_contains_address(&addr_b), OP_EQ, 1);
+
+  /* Then leaves. */
+  smartlist_clear(dummy_ns->routerstatus_list);
+  nodelist_set_consensus(dummy_ns);
+  tt_int_op(nodelist_probably_contains_address(&addr_a), OP_EQ, 0);
+  tt_int_op(nodelist_probably_contains_address(&addr_b), OP_EQ, 0);
+
+ done:
+  routerstatus_free(rs);
+  routerstatus_free(rs2);
+  smartlist_clear(dummy_ns->routerstatus_list);
+  networkstatus_vote_free(dummy_ns);
+  nodelist_free_all();
+  UNMOCK(networkstatus_get_latest_consensus);
+  UNMOCK(networkstatus_get_latest_consensus_by_flavor);
+}
+
 struct testcase_t address_set_tests[] = {
   { "contains", test_contains, TT_FORK,
     NULL, NULL },
+  { "remove", test_remove, TT_FORK,
+    NULL, NULL },
   { "nodelist", test_nodelist, TT_FORK,
     NULL, NULL },
+  { "nodelist_update", test_nodelist_update, TT_FORK,
+    NULL, NULL },
 
   END_OF_TESTCASES
 };
@@ -653,6 +653,43 @@ test_buffers_compress(void *arg)
   ;
 }
 
+static void
+test_buffers_uncompress_truncated(void *arg)
+{
+  char *msg = NULL;
+  char *compressed = NULL;
+  size_t compressed_len;
+  buf_t *buf = NULL;
+  tor_compress_state_t *state = NULL;
+  (void)arg;
+
+  msg = tor_malloc(4096);
+  crypto_rand(msg, 4096);
+  tt_int_op(0, OP_EQ, tor_compress(&compressed, &compressed_len,
+                                   msg, 4096, ZLIB_METHOD));
+
+  /* Finishing a stream that's missing its end should fail, not spin. */
+  buf = buf_new();
+  state = tor_compress_new(0, ZLIB_METHOD, HIGH_COMPRESSION);
+  tt_int_op(buf_add_compress(buf, state, compressed, compressed_len / 2, 0),
+            OP_EQ, 0);
+  tt_int_op(buf_add_compress(buf, state, "", 0, 1), OP_EQ, -1);
+  tor_compress_free(state);
+  buf_clear(buf);
+
+  /* The whole stream is fine, though. */
+  state = tor_compress_new(0, ZLIB_METHOD, HIGH_COMPRESSION);
+  tt_int_op(buf_add_compress(buf, state, compressed, compressed_len, 1),
+            OP_EQ, 0);
+  tt_int_op(buf_datalen(buf), OP_EQ, 4096);
+
+ done:
+  buf_free(buf);
+  tor_compress_free(state);
+  tor_free(msg);
+  tor_free(compressed);
+}
+
 static const uint8_t *tls_read_ptr;
 static int n_remaining;
 static int next_reply_val[16];
@@ -818,6 +855,8 @@ struct testcase_t buffer_tests[] = {
     &passthrough_setup, (char*)"x-tor-lzma" },
   { "compress/none", test_buffers_compress, TT_FORK,
     &passthrough_setup, (char*)"identity" },
+  { "uncompress_truncated", test_buffers_uncompress_truncated, 0,
+    NULL, NULL },
 
   END_OF_TESTCASES
 };
@@ -3,17 +3,21 @@
 
 #define TOR_CHANNEL_INTERNAL_
 #define CIRCUITMUX_PRIVATE
+#define CIRCUITMUX_CLASS_PRIVATE
 #define CIRCUITMUX_EWMA_PRIVATE
 #define RELAY_PRIVATE
 #include "core/or/or.h"
 #include "core/or/channel.h"
+#include "core/or/circuitlist.h"
 #include "core/or/circuitmux.h"
+#include "core/or/circuitmux_class.h"
 #include "core/or/circuitmux_ewma.h"
 #include "core/or/relay.h"
 #include "core/or/scheduler.h"
 #include "test/test.h"
 
 #include "core/or/destroy_cell_queue_st.h"
+#include "core/or/or_circuit_st.h"
 
 #include <math.h>
 
@@ -125,9 +129,215 @@ test_cmux_compute_ticks(void *arg)
   ;
 }
 
+static void
+test_cmux_class_of_circuit(void *arg)
+{
+  or_circuit_t *or_circ = tor_malloc_zero(sizeof(or_circuit_t));
+  (void) arg;
+
+  or_circ->base_.magic = OR_CIRCUIT_MAGIC;
+  or_circ->base_.purpose = CIRCUIT_PURPOSE_OR;
+  tt_int_op(cmux_class_of_circuit(TO_CIRCUIT(or_circ)), OP_EQ,
+            CMUX_CLASS_GENERAL);
+
+  or_circ->base_.purpose = CIRCUIT_PURPOSE_INTRO_POINT;
+  tt_int_op(cmux_class_of_circuit(TO_CIRCUIT(or_circ)), OP_EQ,
+            CMUX_CLASS_ONION_SERVICE);
+  or_circ->base_.purpose = CIRCUIT_PURPOSE_REND_ESTABLISHED;
+  tt_int_op(cmux_class_of_circuit(TO_CIRCUIT(or_circ)), OP_EQ,
+            CMUX_CLASS_ONION_SERVICE);
+
+  /* A BEGIN_DIR makes it a directory circuit. */
+  or_circ->base_.purpose = CIRCUIT_PURPOSE_OR;
+  or_circ->base_.dirreq_id = 7;
+  tt_int_op(cmux_class_of_circuit(TO_CIRCUIT(or_circ)), OP_EQ,
+            CMUX_CLASS_DIRECTORY);
+
+ done:
+  tor_free(or_circ);
+}
+
+#define N_SIM_GENERAL 10
+#define N_SIM_CIRCS (N_SIM_GENERAL + 2)
+
+/** Simulate a channel using <b>policy</b> to carry N_SIM_GENERAL bulk
+ * circuits, one onion service circuit and one directory circuit, all of
+ * which always have cells waiting.  Send <b>n_cells</b> cells, and set
+ * <b>gap_out</b>[cls] to the mean number of cells sent between consecutive
+ * cells of each class: the latency a newly queued cell of that class would
+ * see. */
+static void
+simulate_cmux_classes(const circuitmux_policy_t *policy, int n_cells,
+                      double *gap_out)
+{
+  channel_t *chan = new_fake_channel();
+  circuitmux_t *cmux = circuitmux_alloc();
+  or_circuit_t *circs[N_SIM_CIRCS];
+  int last_sent[CMUX_CLASS_MAX_+1];
+  uint64_t gap_sum[CMUX_CLASS_MAX_+1];
+  uint64_t n_gaps[CMUX_CLASS_MAX_+1];
+  destroy_cell_queue_t *dq = NULL;
+  int i;
+
+  memset(gap_sum, 0, sizeof(gap_sum));
+  memset(n_gaps, 0, sizeof(n_gaps));
+  for (i = 0; i <= CMUX_CLASS_MAX_; ++i)
+    last_sent[i] = -1;
+
+  circuitmux_set_policy(cmux, policy);
+  for (i = 0; i < N_SIM_CIRCS; ++i) {
+    circs[i] = tor_malloc_zero(sizeof(or_circuit_t));
+    circs[i]->base_.magic = OR_CIRCUIT_MAGIC;
+    circs[i]->base_.purpose = CIRCUIT_PURPOSE_OR;
+    circs[i]->base_.n_chan = chan;
+    circs[i]->base_.n_circ_id = i + 1;
+  }
+  circs[N_SIM_GENERAL]->base_.purpose = CIRCUIT_PURPOSE_REND_ESTABLISHED;
+  circs[N_SIM_GENERAL + 1]->base_.dirreq_id = 1;
+
+  for (i = 0; i < N_SIM_CIRCS; ++i) {
+    circuitmux_attach_circuit(cmux, TO_CIRCUIT(circs[i]), CELL_DIRECTION_OUT);
+    circuitmux_set_num_cells(cmux, TO_CIRCUIT(circs[i]), n_cells);
+  }
+
+  for (i = 0; i < n_cells; ++i) {
+    circuit_t *circ = circuitmux_get_first_active_circuit(cmux, &dq);
+    cmux_class_t cls;
+    tor_assert(circ);
+    cls = cmux_class_of_circuit(circ);
+    if (last_sent[cls] >= 0) {
+      gap_sum[cls] += i - last_sent[cls];
+      ++n_gaps[cls];
+    }
+    last_sent[cls] = i;
+    circuitmux_notify_xmit_cells(cmux, circ, 1);
+  }
+
+  for (i = 0; i <= CMUX_CLASS_MAX_; ++i)
+    gap_out[i] = n_gaps[i] ? ((double)gap_sum[i]) / n_gaps[i] : -1.0;
+
+  for (i = 0; i < N_SIM_CIRCS; ++i) {
+    circuitmux_detach_circuit(cmux, TO_CIRCUIT(circs[i]));
+    tor_free(circs[i]);
+  }
+  circuitmux_free(cmux);
+  channel_free(chan);
+}
+
+static void
+test_cmux_class_latency(void *arg)
+{
+  double ewma_gap[CMUX_CLASS_MAX_+1], class_gap[CMUX_CLASS_MAX_+1];
+  (void) arg;
+
+  scheduler_init();
+  cmux_ewma_set_options(NULL, NULL);
+  cmux_class_set_options(NULL);
+  tt_ptr_op(cmux_get_default_policy(), OP_EQ, &ewma_policy);
+
+  simulate_cmux_classes(&ewma_policy, 12000, ewma_gap);
+  simulate_cmux_classes(&class_policy, 12000, class_gap);
+
+  /* EWMA alone shares the channel equally between the twelve circuits. */
+  tt_double_op(fabs(ewma_gap[CMUX_CLASS_ONION_SERVICE] - 12.0), OP_LT, 1.0);
+  tt_double_op(fabs(ewma_gap[CMUX_CLASS_DIRECTORY] - 12.0), OP_LT, 1.0);
+
+  /* With classes, the weights are 7:2:1, however many circuits are in each
+   * class. */
+  tt_double_op(fabs(class_gap[CMUX_CLASS_GENERAL] - 10.0/7), OP_LT, 0.1);
+  tt_double_op(fabs(class_gap[CMUX_CLASS_ONION_SERVICE] - 5.0), OP_LT, 0.5);
+  tt_double_op(fabs(class_gap[CMUX_CLASS_DIRECTORY] - 10.0), OP_LT, 1.0);
+
+ done:
+  ;
+}
+
+/** Attach a new circuit to <b>cmux</b> on <b>chan</b>, give it cells to
+ * send, and send <b>n_sent</b> of them, so that its EWMA reflects that. */
+static or_circuit_t *
+attach_busy_circuit(circuitmux_t *cmux, channel_t *chan, circid_t id,
+                    int dirreq, unsigned n_sent)
+{
+  or_circuit_t *circ = tor_malloc_zero(sizeof(or_circuit_t));
+  circ->base_.magic = OR_CIRCUIT_MAGIC;
+  circ->base_.purpose = CIRCUIT_PURPOSE_OR;
+  circ->base_.n_chan = chan;
+  circ->base_.n_circ_id = id;
+  circ->base_.dirreq_id = dirreq;
+  circuitmux_attach_circuit(cmux, TO_CIRCUIT(circ), CELL_DIRECTION_OUT);
+  circuitmux_set_num_cells(cmux, TO_CIRCUIT(circ), n_sent + 10);
+  if (n_sent)
+    circuitmux_notify_xmit_cells(cmux, TO_CIRCUIT(circ), n_sent);
+  return circ;
+}
+
+static void
+test_cmux_class_compare(void *arg)
+{
+  channel_t *chan1 = new_fake_channel(), *chan2 = new_fake_channel();
+  channel_t *chan3 = new_fake_channel();
+  circuitmux_t *bulk = circuitmux_alloc(), *dir = circuitmux_alloc();
+  circuitmux_t *ewma = circuitmux_alloc();
+  or_circuit_t *bulk_circ = NULL, *dir_circ = NULL, *ewma_circ = NULL;
+  (void) arg;
+
+  scheduler_init();
+  cmux_ewma_set_options(NULL, NULL);
+  cmux_class_set_options(NULL);
+
+  /* One channel's next cell is from a busy bulk circuit; the other's is
+   * from a quiet directory circuit.  The directory channel goes first,
+   * even though the general class has the larger weight. */
+  circuitmux_set_policy(bulk, &class_policy);
+  circuitmux_set_policy(dir, &class_policy);
+  bulk_circ = attach_busy_circuit(bulk, chan1, 1, 0, 500);
+  dir_circ = attach_busy_circuit(dir, chan2, 1, 7, 5);
+  tt_int_op(circuitmux_compare_muxes(bulk, dir), OP_EQ, 1);
+  tt_int_op(circuitmux_compare_muxes(dir, bulk), OP_EQ, -1);
+
+  /* But a directory circuit that has been busier than the bulk one has to
+   * wait its turn. */
+  circuitmux_set_num_cells(dir, TO_CIRCUIT(dir_circ), 2000);
+  circuitmux_notify_xmit_cells(dir, TO_CIRCUIT(dir_circ), 2000);
+  tt_int_op(circuitmux_compare_muxes(bulk, dir), OP_EQ, -1);
+  circuitmux_detach_circuit(dir, TO_CIRCUIT(dir_circ));
+  tor_free(dir_circ);
+
+  /* While the consensus is turning classes on or off, channels with
+   * different policies are still compared by EWMA. */
+  circuitmux_set_policy(ewma, &ewma_policy);
+  ewma_circ = attach_busy_circuit(ewma, chan3, 1, 0, 500);
+  dir_circ = attach_busy_circuit(dir, chan2, 2, 7, 5);
+  tt_int_op(circuitmux_compare_muxes(ewma, dir), OP_EQ, 1);
+  tt_int_op(circuitmux_compare_muxes(dir, ewma), OP_EQ, -1);
+
+ done:
+  if (bulk_circ) {
+    circuitmux_detach_circuit(bulk, TO_CIRCUIT(bulk_circ));
+    tor_free(bulk_circ);
+  }
+  if (dir_circ) {
+    circuitmux_detach_circuit(dir, TO_CIRCUIT(dir_circ));
+    tor_free(dir_circ);
+  }
+  if (ewma_circ) {
+    circuitmux_detach_circuit(ewma, TO_CIRCUIT(ewma_circ));
+    tor_free(ewma_circ);
+  }
+  circuitmux_free(bulk);
+  circuitmux_free(dir);
+  circuitmux_free(ewma);
+  channel_free(chan1);
+  channel_free(chan2);
+  channel_free(chan3);
+}
+
 struct testcase_t circuitmux_tests[] = {
   { "destroy_cell_queue", test_cmux_destroy_cell_queue, TT_FORK, NULL, NULL },
   { "compute_ticks", test_cmux_compute_ticks, TT_FORK, NULL, NULL },
+  { "class_of_circuit", test_cmux_class_of_circuit, TT_FORK, NULL, NULL },
+  { "class_latency", test_cmux_class_latency, TT_FORK, NULL, NULL },
+  { "class_compare", test_cmux_class_compare, TT_FORK, NULL, NULL },
   END_OF_TESTCASES
 };
 
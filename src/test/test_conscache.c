@@ -328,6 +328,141 @@ test_conscache_filter(void *arg)
   smartlist_free(lst);
 }
 
+static void
+test_conscache_shared(void *arg)
+{
+  (void)arg;
+  consensus_cache_t *writer = NULL, *reader = NULL;
+  consensus_cache_entry_t *ent = NULL;
+  config_line_t *labels = NULL;
+  const uint8_t *bp = NULL;
+  size_t sz = 0;
+
+  char *dir = tor_strdup(get_fname_rnd("shared_cache"));
+  writer = consensus_cache_open_shared(dir, 128);
+  tt_assert(writer);
+  tt_assert(! consensus_cache_is_read_only(writer));
+
+  /* The lock is held, so the second process gets a read-only view. */
+  reader = consensus_cache_open_shared(dir, 128);
+  tt_assert(reader);
+  tt_assert(consensus_cache_is_read_only(reader));
+
+  config_line_append(&labels, "Hello", "world");
+  tt_ptr_op(NULL, OP_EQ,
+            consensus_cache_add(reader, labels, (const uint8_t*)"abc", 3));
+  ent = consensus_cache_add(writer, labels, (const uint8_t*)"xyzzy", 5);
+  tt_assert(ent);
+  consensus_cache_entry_decref(ent);
+  ent = NULL;
+
+  /* The reader doesn't see the new entry until it refreshes. */
+  tt_ptr_op(NULL, OP_EQ, consensus_cache_find_first(reader, "Hello", "world"));
+  tt_int_op(0, OP_EQ, consensus_cache_refresh(writer));
+  tt_int_op(1, OP_EQ, consensus_cache_refresh(reader));
+  ent = consensus_cache_find_first(reader, "Hello", "world");
+  tt_assert(ent);
+  tt_int_op(0, OP_EQ, consensus_cache_entry_get_body(ent, &bp, &sz));
+  tt_int_op(sz, OP_EQ, 5);
+  tt_mem_op(bp, OP_EQ, "xyzzy", 5);
+
+  /* Removing entries from a read-only cache leaves the files alone. */
+  consensus_cache_entry_mark_for_removal(ent);
+  consensus_cache_delete_pending(reader, 1);
+  tt_assert(consensus_cache_find_first(writer, "Hello", "world"));
+  ent = NULL;
+
+  /* Once the writer is gone, the reader takes over. */
+  consensus_cache_free(writer);
+  tt_int_op(1, OP_EQ, consensus_cache_refresh(reader));
+  tt_assert(! consensus_cache_is_read_only(reader));
+  tt_assert(consensus_cache_find_first(reader, "Hello", "world"));
+  ent = consensus_cache_add(reader, labels, (const uint8_t*)"abc", 3);
+  tt_assert(ent);
+  consensus_cache_entry_decref(ent);
+  ent = NULL;
+
+ done:
+  config_free_lines(labels);
+  consensus_cache_free(writer);
+  consensus_cache_free(reader);
+  tor_free(dir);
+}
+
+static void
+test_conscache_indexed(void *arg)
+{
+  (void)arg;
+  const int N = 30;
+  smartlist_t *lst = smartlist_new();
+  char num[8];
+  int i;
+
+  char *dir = tor_strdup(get_fname_rnd("indexed_cache"));
+  consensus_cache_t *cache = consensus_cache_open_shared(dir, 128);
+  tt_assert(cache);
+
+  for (i = 0; i < N; ++i) {
+    config_line_t *labels = NULL;
+    tor_snprintf(num, sizeof(num), "%d", i);
+    config_line_append(&labels, "index", num);
+    tor_snprintf(num, sizeof(num), "%d", i % 3);
+    config_line_append(&labels, "mod3", num);
+    if (i == 10)
+      consensus_cache_index_label(cache, "mod3");
+    consensus_cache_entry_t *ent =
+      consensus_cache_add(cache, labels, (const uint8_t*)"x", 1);
+    config_free_lines(labels);
+    tt_assert(ent);
+    consensus_cache_entry_decref(ent);
+  }
+
+  /* Entries added before and after we asked for the index are both found,
+   * in the order they were added. */
+  consensus_cache_find_all(lst, cache, "mod3", "1");
+  tt_int_op(smartlist_len(lst), OP_EQ, 10);
+  for (i = 0; i < 10; ++i) {
+    tor_snprintf(num, sizeof(num), "%d", i * 3 + 1);
+    tt_str_op(num, OP_EQ,
+              consensus_cache_entry_get_value(smartlist_get(lst, i), "index"));
+  }
+  smartlist_clear(lst);
+  consensus_cache_find_all(lst, cache, "mod3", "3");
+  tt_int_op(smartlist_len(lst), OP_EQ, 0);
+
+  /* Entries marked for removal vanish at once, and stay gone once they are
+   * deleted. */
+  consensus_cache_entry_t *ent = consensus_cache_find_first(cache,
+                                                            "index", "4");
+  tt_assert(ent);
+  consensus_cache_entry_mark_for_removal(ent);
+  smartlist_clear(lst);
+  consensus_cache_find_all(lst, cache, "mod3", "1");
+  tt_int_op(smartlist_len(lst), OP_EQ, 9);
+  consensus_cache_delete_pending(cache, 0);
+  smartlist_clear(lst);
+  consensus_cache_find_all(lst, cache, "mod3", "1");
+  tt_int_op(smartlist_len(lst), OP_EQ, 9);
+  tt_str_op("1", OP_EQ,
+            consensus_cache_entry_get_value(smartlist_get(lst, 0), "index"));
+  tt_str_op("7", OP_EQ,
+            consensus_cache_entry_get_value(smartlist_get(lst, 1), "index"));
+
+  /* The index survives reloading the cache. */
+  consensus_cache_free(cache);
+  cache = consensus_cache_open_shared(dir, 128);
+  tt_assert(cache);
+  consensus_cache_index_label(cache, "mod3");
+  smartlist_clear(lst);
+  consensus_cache_find_all(lst, cache, "mod3", "2");
+  tt_int_op(smartlist_len(lst), OP_EQ, 10);
+
+ done:
+  consensus_cache_free(cache);
+  smartlist_free(lst);
+  tor_free(dir);
+}
+
 #define ENT(name)                                               \
   { #name, test_conscache_ ## name, TT_FORK, NULL, NULL }
 
@@ -336,5 +471,7 @@ struct testcase_t conscache_tests[] = {
   ENT(simple_usage),
   ENT(cleanup),
   ENT(filter),
+  ENT(shared),
+  ENT(indexed),
   END_OF_TESTCASES
 };
@@ -772,6 +772,35 @@ test_container_pqueue(void *arg)
   tt_int_op(smartlist_len(sl),OP_EQ, 0);
   OK();
 
+  /* Now test update, moving entries both down and up. */
+  smartlist_pqueue_add(sl, cmp, offset, &cows);
+  smartlist_pqueue_add(sl, cmp, offset, &fish);
+  smartlist_pqueue_add(sl, cmp, offset, &frogs);
+  smartlist_pqueue_add(sl, cmp, offset, &apples);
+  smartlist_pqueue_add(sl, cmp, offset, &squid);
+  smartlist_pqueue_add(sl, cmp, offset, &zebras);
+  OK();
+  tt_ptr_op(smartlist_get(sl, 0),OP_EQ, &apples);
+  apples.val = "yaks";
+  smartlist_pqueue_update(sl, cmp, offset, &apples);
+  OK();
+  tt_ptr_op(smartlist_get(sl, 0),OP_EQ, &cows);
+  zebras.val = "aardvarks";
+  smartlist_pqueue_update(sl, cmp, offset, &zebras);
+  OK();
+  tt_ptr_op(smartlist_get(sl, 0),OP_EQ, &zebras);
+  fish.val = "fishes";
+  smartlist_pqueue_update(sl, cmp, offset, &fish);
+  OK();
+  tt_ptr_op(smartlist_pqueue_pop(sl, cmp, offset),OP_EQ, &zebras);
+  tt_ptr_op(smartlist_pqueue_pop(sl, cmp, offset),OP_EQ, &cows);
+  tt_ptr_op(smartlist_pqueue_pop(sl, cmp, offset),OP_EQ, &fish);
+  tt_ptr_op(smartlist_pqueue_pop(sl, cmp, offset),OP_EQ, &frogs);
+  tt_ptr_op(smartlist_pqueue_pop(sl, cmp, offset),OP_EQ, &squid);
+  tt_ptr_op(smartlist_pqueue_pop(sl, cmp, offset),OP_EQ, &apples);
+  tt_int_op(smartlist_len(sl),OP_EQ, 0);
+  OK();
+
 #undef OK
 
  done:
@@ -214,6 +214,14 @@ test_cntev_format_cell_stats(void *arg)
   tt_str_op("InboundQueue=8 InboundConn=2 InboundAdded=relay:3 "
             "InboundRemoved=relay:7 InboundTime=relay:6 "
             "OutboundQueue=9 OutboundConn=1", OP_EQ, event_string);
+  tor_free(event_string);
+
+  /* The longest any of those cells waited was 4 msec. */
+  cell_stats->max_time_appward = 4;
+  format_cell_stats(&event_string, TO_CIRCUIT(or_circ), cell_stats);
+  tt_str_op("InboundQueue=8 InboundConn=2 InboundAdded=relay:3 "
+            "InboundRemoved=relay:7 InboundTime=relay:6 InboundMaxTime=4 "
+            "OutboundQueue=9 OutboundConn=1", OP_EQ, event_string);
 
  done:
   tor_free(cell_stats);
@@ -8,6 +8,7 @@
 
 #define BWAUTH_PRIVATE
 #define CONFIG_PRIVATE
+#define CONNECTION_PRIVATE
 #define CONTROL_PRIVATE
 #define DIRCACHE_PRIVATE
 #define DIRCLIENT_PRIVATE
@@ -50,6 +51,7 @@
 #include "feature/hibernate/hibernate.h"
 #include "feature/nodelist/authcert.h"
 #include "feature/nodelist/dirlist.h"
+#include "feature/nodelist/microdesc.h"
 #include "feature/nodelist/networkstatus.h"
 #include "feature/nodelist/nickname.h"
 #include "feature/nodelist/node_select.h"
@@ -64,6 +66,7 @@
 #include "feature/relay/routerkeys.h"
 #include "feature/relay/routermode.h"
 #include "lib/compress/compress.h"
+#include "lib/container/buffers.h"
 #include "lib/crypt_ops/crypto_ed25519.h"
 #include "lib/crypt_ops/crypto_format.h"
 #include "lib/crypt_ops/crypto_rand.h"
@@ -75,6 +78,7 @@
 #include "test/test_dir_common.h"
 
 #include "core/or/addr_policy_st.h"
+#include "feature/dircommon/dir_connection_st.h"
 #include "feature/nodelist/authority_cert_st.h"
 #include "feature/nodelist/document_signature_st.h"
 #include "feature/nodelist/extrainfo_st.h"
@@ -4591,6 +4595,214 @@ test_dir_authdir_type_to_string(void *data)
   tor_free(res);
 }
 
+static void
+test_dir_stream_consensus_body(void *data)
+{
+  const char headers[] =
+    "HTTP/1.0 200 OK\r\nContent-Encoding: deflate\r\n\r\n";
+  const size_t arrival = 4096;
+  dir_connection_t *conn = NULL;
+  smartlist_t *lines = smartlist_new();
+  char *doc = NULL, *compressed = NULL, *headers_out = NULL, *body = NULL;
+  size_t doc_len, compressed_len, body_len, off;
+  size_t peak = 0, base_alloc;
+  int i;
+  (void)data;
+
+  /* Something that looks a bit like a consensus. */
+  smartlist_add_strdup(lines, "network-status-version 3 microdesc\n");
+  for (i = 0; i < 10000; ++i) {
+    smartlist_add_asprintf(lines, "r relay%d AAAAAAAAAAAAAAAAAAAAAAAAAAA "
+                           "2038-01-01 00:00:00 10.%d.%d.1 9001 0\n"
+                           "m %08x\ns Fast Running Stable Valid\n",
+                           i, i >> 8, i & 0xff, crypto_rand_int(INT_MAX));
+  }
+  doc = smartlist_join_strings(lines, "", 0, &doc_len);
+  tt_int_op(0, OP_EQ, tor_compress(&compressed, &compressed_len,
+                                   doc, doc_len, ZLIB_METHOD));
+
+  conn = dir_connection_new(AF_INET);
+  conn->base_.purpose = DIR_PURPOSE_FETCH_CONSENSUS;
+  conn->base_.state = DIR_CONN_STATE_CLIENT_READING;
+  conn->requested_resource = tor_strdup("microdesc");
+
+  /* Let the body arrive a little at a time: we should decompress it as it
+   * comes in, and hold on to very little of the compressed data. */
+  base_alloc = buf_get_total_allocation();
+  buf_add(conn->base_.inbuf, headers, strlen(headers));
+  for (off = 0; off < compressed_len; off += arrival) {
+    size_t alloc;
+    buf_add(conn->base_.inbuf, compressed + off,
+            MIN(arrival, compressed_len - off));
+    tt_int_op(0, OP_EQ, connection_dir_client_process_body(conn));
+    alloc = buf_get_total_allocation() - base_alloc;
+    peak = MAX(peak, alloc);
+    if (conn->response_decompress)
+      tt_int_op(buf_datalen(conn->base_.inbuf), OP_EQ, 0);
+  }
+  tt_assert(conn->response_decompress);
+  tt_assert(! conn->response_not_streamed);
+  tt_int_op(buf_datalen(conn->response_body), OP_LE, doc_len);
+
+  /* Waiting for the whole body would need at least the compressed body,
+   * plus a copy of it, plus the decompressed body.  We should need little
+   * more than the decompressed body. */
+  tt_int_op(peak, OP_LT, doc_len + 65536);
+  tt_int_op(peak, OP_LT, doc_len + compressed_len);
+
+  tt_int_op(0, OP_EQ, dir_client_finish_body_stream(conn, 0, &headers_out,
+                                                    &body, &body_len));
+  tt_str_op(headers_out, OP_EQ, headers);
+  tt_int_op(body_len, OP_EQ, doc_len);
+  tt_str_op(body, OP_EQ, doc);
+  tt_int_op(buf_datalen(conn->response_body), OP_EQ, 0);
+  /* We still know how much arrived, for the log. */
+  tt_int_op(conn->response_bytes_streamed, OP_EQ,
+            strlen(headers) + compressed_len);
+  tor_free(headers_out);
+  tor_free(body);
+  connection_free_minimal(TO_CONN(conn));
+
+  /* If the body doesn't match the declared compression, wait for all of it,
+   * so that connection_dir_client_reached_eof() can sort it out. */
+  conn = dir_connection_new(AF_INET);
+  conn->base_.purpose = DIR_PURPOSE_FETCH_CONSENSUS;
+  conn->base_.state = DIR_CONN_STATE_CLIENT_READING;
+  conn->requested_resource = tor_strdup("microdesc");
+  buf_add(conn->base_.inbuf, headers, strlen(headers));
+  buf_add(conn->base_.inbuf, doc, 4096);
+  tt_int_op(0, OP_EQ, connection_dir_client_process_body(conn));
+  tt_assert(conn->response_not_streamed);
+  tt_ptr_op(conn->response_decompress, OP_EQ, NULL);
+  tt_int_op(buf_datalen(conn->base_.inbuf), OP_EQ, strlen(headers) + 4096);
+
+ done:
+  if (conn)
+    connection_free_minimal(TO_CONN(conn));
+  SMARTLIST_FOREACH(lines, char *, cp, tor_free(cp));
+  smartlist_free(lines);
+  tor_free(doc);
+  tor_free(compressed);
+  tor_free(headers_out);
+  tor_free(body);
+}
+
+static void
+test_dir_stream_microdesc_body(void *data)
+{
+  const char headers[] =
+    "HTTP/1.0 200 OK\r\nContent-Encoding: deflate\r\n\r\n";
+  const char md_fmt[] =
+    "onion-key\n"
+    "-----BEGIN RSA PUBLIC KEY-----\n"
+    "MIGJAoGBAMjlHH/daN43cSVRaHBwgUfnszzAhg98EvivJ9Qxfv51mvQUxPjQ07es\n"
+    "gV/3n8fyh3Kqr/ehi9jxkdgSRfSnmF7giaHL1SLZ29kA7KtST+pBvmTpDtHa3ykX\n"
+    "Xorc7hJvIyTZoc1HU+5XSynj3gsBE5IGK1ZRzrNS688LnuZMVp1tAgMBAAE=\n"
+    "-----END RSA PUBLIC KEY-----\n"
+    "family $%s\n"
+    "p accept %d\n";
+  const int n_mds = 300;
+  const size_t arrival = 256;
+  or_options_t *options = get_options_mutable();
+  dir_connection_t *conn = NULL;
+  smartlist_t *mds = smartlist_new(), *digests = smartlist_new();
+  smartlist_t *digests64 = smartlist_new();
+  char *doc = NULL, *compressed = NULL, *resource = NULL;
+  char *headers_out = NULL, *body = NULL;
+  size_t doc_len, compressed_len, body_len, off;
+  response_handler_args_t args;
+  int i, n_cached;
+  (void)data;
+
+  tor_free(options->CacheDirectory);
+  options->CacheDirectory = tor_strdup(get_fname("md_stream_test"));
+  tt_int_op(0, OP_EQ, check_private_dir(options->CacheDirectory,
+                                        CPD_CREATE, NULL));
+
+  /* A batch of microdescriptors that share an onion key. */
+  for (i = 0; i < n_mds; ++i) {
+    char *md, *d, d64[BASE64_DIGEST256_LEN+1];
+    char family[DIGEST_LEN], family_hex[HEX_DIGEST_LEN+1];
+    crypto_rand(family, sizeof(family));
+    base16_encode(family_hex, sizeof(family_hex), family, sizeof(family));
+    tor_asprintf(&md, md_fmt, family_hex, 1000 + i);
+    d = tor_malloc(DIGEST256_LEN);
+    crypto_digest256(d, md, strlen(md), DIGEST_SHA256);
+    digest256_to_base64(d64, d);
+    smartlist_add(mds, md);
+    smartlist_add(digests, d);
+    smartlist_add_strdup(digests64, d64);
+  }
+  doc = smartlist_join_strings(mds, "", 0, &doc_len);
+  tt_int_op(0, OP_EQ, tor_compress(&compressed, &compressed_len,
+                                   doc, doc_len, ZLIB_METHOD));
+  resource = smartlist_join_strings(digests64, "-", 0, NULL);
+
+  conn = dir_connection_new(AF_INET);
+  conn->base_.purpose = DIR_PURPOSE_FETCH_MICRODESC;
+  conn->base_.state = DIR_CONN_STATE_CLIENT_READING;
+  tor_asprintf(&conn->requested_resource, "d/%s", resource);
+  memset(conn->identity_digest, 'A', DIGEST_LEN);
+
+  /* Let the first half of the body arrive: we should have added the
+   * microdescriptors in it to the cache already. */
+  buf_add(conn->base_.inbuf, headers, strlen(headers));
+  for (off = 0; off < compressed_len / 2; off += arrival) {
+    buf_add(conn->base_.inbuf, compressed + off, arrival);
+    tt_int_op(0, OP_EQ, connection_dir_client_process_body(conn));
+  }
+  tt_assert(conn->response_decompress);
+  tt_int_op(conn->n_microdescs_arrived, OP_GT, 0);
+  tt_int_op(conn->n_microdescs_arrived, OP_LT, n_mds);
+  tt_int_op(smartlist_len(conn->microdescs_wanted), OP_EQ,
+            n_mds - conn->n_microdescs_arrived);
+  n_cached = 0;
+  SMARTLIST_FOREACH(digests, const char *, d,
+    n_cached += !! microdesc_cache_lookup_by_digest256(NULL, d));
+  tt_int_op(n_cached, OP_EQ, conn->n_microdescs_arrived);
+  tt_assert(microdesc_cache_lookup_by_digest256(NULL,
+                                                smartlist_get(digests, 0)));
+  tt_ptr_op(NULL, OP_EQ,
+            microdesc_cache_lookup_by_digest256(NULL,
+                                        smartlist_get(digests, n_mds-1)));
+
+  /* Now the rest of it, a byte short. */
+  buf_add(conn->base_.inbuf, compressed + off, compressed_len - off - 1);
+  tt_int_op(0, OP_EQ, connection_dir_client_process_body(conn));
+  tt_int_op(0, OP_EQ, dir_client_finish_body_stream(conn, 1, &headers_out,
+                                                    &body, &body_len));
+  tt_int_op(body_len, OP_LT, doc_len);
+  tt_str_op(body, OP_EQ, doc + doc_len - body_len);
+
+  memset(&args, 0, sizeof(args));
+  args.status_code = 200;
+  args.reason = "OK";
+  args.body = body;
+  args.body_len = body_len;
+  args.headers = headers_out;
+  tt_int_op(0, OP_EQ, handle_response_fetch_microdesc(conn, &args));
+  tt_ptr_op(conn->microdescs_wanted, OP_EQ, NULL);
+  tt_int_op(conn->n_microdescs_arrived, OP_EQ, n_mds);
+  SMARTLIST_FOREACH(digests, const char *, d,
+    tt_assert(microdesc_cache_lookup_by_digest256(NULL, d)));
+
+ done:
+  if (conn)
+    connection_free_minimal(TO_CONN(conn));
+  SMARTLIST_FOREACH(mds, char *, cp, tor_free(cp));
+  smartlist_free(mds);
+  SMARTLIST_FOREACH(digests, char *, cp, tor_free(cp));
+  smartlist_free(digests);
+  SMARTLIST_FOREACH(digests64, char *, cp, tor_free(cp));
+  smartlist_free(digests64);
+  tor_free(doc);
+  tor_free(compressed);
+  tor_free(resource);
+  tor_free(headers_out);
+  tor_free(body);
+  microdesc_free_all();
+}
+
 static void
 test_dir_conn_purpose_to_string(void *data)
 {
@@ -6336,6 +6548,8 @@ struct testcase_t dir_tests[] = {
   DIR(download_status_increment, TT_FORK),
   DIR(authdir_type_to_string, 0),
   DIR(conn_purpose_to_string, 0),
+  DIR(stream_consensus_body, TT_FORK),
+  DIR(stream_microdesc_body, TT_FORK),
   DIR(should_use_directory_guards, 0),
   DIR(should_not_init_request_to_ourselves, TT_FORK),
   DIR(should_not_init_request_to_dir_auths_without_v3_info, 0),
@@ -20,6 +20,7 @@
 #include "core/mainloop/connection.h"
 #include "core/proto/proto_http.h"
 #include "lib/crypt_ops/crypto_format.h"
+#include "lib/crypt_ops/crypto_rand.h"
 
 #include "feature/dircommon/dir_connection_st.h"
 #include "feature/nodelist/networkstatus_st.h"
@@ -46,6 +47,9 @@ init_test(void)
   hs_cache_init();
   /* We need the v2 cache since our OOM and cache cleanup does poke at it. */
   rend_cache_init();
+  /* The cache stamps new entries with approx_time(), and the tests clean it
+   * with time(NULL): keep the two in step. */
+  update_approx_time(time(NULL));
 }
 
 static void
@@ -122,9 +126,12 @@ test_directory(void *arg)
                                  helper_get_hsdir_query(desc_zero_lifetime),
                                  NULL);
     tt_int_op(ret, OP_EQ, 0);
-    /* Cleanup our entire cache. */
-    oom_size = hs_cache_handle_oom(time(NULL), 1);
+    /* Cleanup our entire cache. Asking for a single byte isn't enough for
+     * that: the OOM handler gets it back from the expired descriptor. */
+    oom_size = hs_cache_handle_oom(time(NULL),
+                                   rend_cache_get_total_allocation());
     tt_int_op(oom_size, OP_GE, 1);
+    tt_u64_op(rend_cache_get_total_allocation(), OP_EQ, 0);
     hs_descriptor_free(desc_zero_lifetime);
     tor_free(desc_zero_lifetime_str);
   }
@@ -220,6 +227,225 @@ test_clean_as_dir(void *arg)
   tor_free(desc1_str);
 }
 
+/* Test that descriptors stay reachable in the directory index as it grows,
+ * shrinks, and has entries removed from the middle of probe runs. */
+static void
+test_dir_index(void *arg)
+{
+  const int n_entries = 1000;
+  hs_cache_dir_descriptor_t *entries = NULL;
+  int i;
+
+  (void) arg;
+
+  init_test();
+
+  entries = tor_calloc(n_entries, sizeof(*entries));
+  for (i = 0; i < n_entries; ++i) {
+    crypto_rand((char *) entries[i].key, sizeof(entries[i].key));
+    dir_index_add(&entries[i]);
+  }
+  for (i = 0; i < n_entries; ++i) {
+    tt_ptr_op(lookup_v3_desc_as_dir(entries[i].key), OP_EQ, &entries[i]);
+  }
+
+  /* Remove every other entry: the rest must stay reachable. */
+  for (i = 0; i < n_entries; i += 2) {
+    dir_index_remove(&entries[i]);
+  }
+  for (i = 0; i < n_entries; ++i) {
+    tt_ptr_op(lookup_v3_desc_as_dir(entries[i].key), OP_EQ,
+              (i % 2) ? &entries[i] : NULL);
+  }
+
+  /* Then remove the rest, shrinking the index as we go. */
+  for (i = 1; i < n_entries; i += 2) {
+    dir_index_remove(&entries[i]);
+    tt_ptr_op(lookup_v3_desc_as_dir(entries[i].key), OP_EQ, NULL);
+    if (i + 2 < n_entries) {
+      tt_ptr_op(lookup_v3_desc_as_dir(entries[i + 2].key), OP_EQ,
+                &entries[i + 2]);
+    }
+  }
+
+ done:
+  hs_cache_free_all();
+  tor_free(entries);
+}
+
+/* Test that the directory cache frees a segment once nothing in it is
+ * cached, and stops serving descriptors once they expire. */
+static void
+test_dir_segments(void *arg)
+{
+  int ret;
+  const time_t now = 1000 * HS_CACHE_DIR_SEGMENT_LEN;
+  ed25519_keypair_t signing_kp1, signing_kp2;
+  hs_descriptor_t *desc1 = NULL, *desc2 = NULL;
+  char *desc1_str = NULL, *desc2_str = NULL;
+  const hs_cache_dir_descriptor_t *entry1, *entry2;
+
+  (void) arg;
+
+  init_test();
+
+  ret = ed25519_keypair_generate(&signing_kp1, 0);
+  tt_int_op(ret, OP_EQ, 0);
+  ret = ed25519_keypair_generate(&signing_kp2, 0);
+  tt_int_op(ret, OP_EQ, 0);
+  desc1 = hs_helper_build_hs_desc_with_ip(&signing_kp1);
+  tt_assert(desc1);
+  desc2 = hs_helper_build_hs_desc_with_ip(&signing_kp2);
+  tt_assert(desc2);
+
+  /* Both descriptors arrive at the same time, in the same segment. */
+  update_approx_time(now);
+  ret = hs_desc_encode_descriptor(desc1, &signing_kp1, NULL, &desc1_str);
+  tt_int_op(ret, OP_EQ, 0);
+  ret = hs_desc_encode_descriptor(desc2, &signing_kp2, NULL, &desc2_str);
+  tt_int_op(ret, OP_EQ, 0);
+  tt_int_op(hs_cache_store_as_dir(desc1_str), OP_EQ, 0);
+  tt_int_op(hs_cache_store_as_dir(desc2_str), OP_EQ, 0);
+  entry1 = lookup_v3_desc_as_dir(desc1->plaintext_data.blinded_pubkey.pubkey);
+  entry2 = lookup_v3_desc_as_dir(desc2->plaintext_data.blinded_pubkey.pubkey);
+  tt_assert(entry1);
+  tt_assert(entry2);
+  tt_ptr_op(entry1->segment, OP_EQ, entry2->segment);
+
+  /* A segment later, new revisions of both arrive. Once they have both
+   * been replaced, the first segment goes away, and only the new revisions
+   * still count towards our allocation. */
+  update_approx_time(now + HS_CACHE_DIR_SEGMENT_LEN);
+  tor_free(desc1_str);
+  tor_free(desc2_str);
+  desc1->plaintext_data.revision_counter++;
+  desc2->plaintext_data.revision_counter++;
+  ret = hs_desc_encode_descriptor(desc1, &signing_kp1, NULL, &desc1_str);
+  tt_int_op(ret, OP_EQ, 0);
+  ret = hs_desc_encode_descriptor(desc2, &signing_kp2, NULL, &desc2_str);
+  tt_int_op(ret, OP_EQ, 0);
+  tt_int_op(hs_cache_store_as_dir(desc1_str), OP_EQ, 0);
+  entry1 = lookup_v3_desc_as_dir(desc1->plaintext_data.blinded_pubkey.pubkey);
+  tt_ptr_op(entry1->segment, OP_NE, entry2->segment);
+  tt_int_op(hs_cache_store_as_dir(desc2_str), OP_EQ, 0);
+  entry2 = lookup_v3_desc_as_dir(desc2->plaintext_data.blinded_pubkey.pubkey);
+  tt_ptr_op(entry1->segment, OP_EQ, entry2->segment);
+  tt_u64_op(rend_cache_get_total_allocation(), OP_EQ,
+            2 * sizeof(hs_cache_dir_descriptor_t) +
+            strlen(desc1_str) + 1 + strlen(desc2_str) + 1);
+
+  /* Once they expire, we don't serve them, even before cleaning up. */
+  update_approx_time(now + HS_CACHE_DIR_SEGMENT_LEN +
+                     desc1->plaintext_data.lifetime_sec);
+  ret = hs_cache_lookup_as_dir(3, helper_get_hsdir_query(desc1), NULL);
+  tt_int_op(ret, OP_EQ, 0);
+  /* And cleaning up drops the whole segment. */
+  tt_u64_op(cache_clean_v3_as_dir(approx_time(), 0), OP_GT, 0);
+  tt_u64_op(rend_cache_get_total_allocation(), OP_EQ, 0);
+  tt_ptr_op(lookup_v3_desc_as_dir(
+                      desc2->plaintext_data.blinded_pubkey.pubkey), OP_EQ,
+            NULL);
+
+ done:
+  hs_descriptor_free(desc1);
+  hs_descriptor_free(desc2);
+  tor_free(desc1_str);
+  tor_free(desc2_str);
+  hs_cache_free_all();
+}
+
+/* Test that the directory cache gets back the memory of replaced and
+ * removed descriptors without waiting for their segment to go, and that
+ * cleaning only reports the bytes it actually freed. */
+static void
+test_dir_segment_compaction(void *arg)
+{
+  int ret;
+  const time_t now = 1000 * HS_CACHE_DIR_SEGMENT_LEN;
+  ed25519_keypair_t signing_kp1, signing_kp2;
+  hs_descriptor_t *desc1 = NULL, *desc2 = NULL;
+  char *desc1_str = NULL, *desc2_str = NULL;
+  const hs_cache_dir_descriptor_t *entry1, *entry2;
+  size_t entry1_size, entry2_size;
+
+  (void) arg;
+
+  init_test();
+
+  ret = ed25519_keypair_generate(&signing_kp1, 0);
+  tt_int_op(ret, OP_EQ, 0);
+  ret = ed25519_keypair_generate(&signing_kp2, 0);
+  tt_int_op(ret, OP_EQ, 0);
+  desc1 = hs_helper_build_hs_desc_with_ip(&signing_kp1);
+  tt_assert(desc1);
+  desc2 = hs_helper_build_hs_desc_with_ip(&signing_kp2);
+  tt_assert(desc2);
+
+  update_approx_time(now);
+  ret = hs_desc_encode_descriptor(desc1, &signing_kp1, NULL, &desc1_str);
+  tt_int_op(ret, OP_EQ, 0);
+  ret = hs_desc_encode_descriptor(desc2, &signing_kp2, NULL, &desc2_str);
+  tt_int_op(ret, OP_EQ, 0);
+  tt_int_op(hs_cache_store_as_dir(desc1_str), OP_EQ, 0);
+  tt_int_op(hs_cache_store_as_dir(desc2_str), OP_EQ, 0);
+  entry1_size = sizeof(hs_cache_dir_descriptor_t) + strlen(desc1_str) + 1;
+  entry2_size = sizeof(hs_cache_dir_descriptor_t) + strlen(desc2_str) + 1;
+
+  /* Replace the first descriptor within the same segment. Once the old one
+   * is out of the cache, half of the segment is dead, so we get that memory
+   * back right away rather than when the segment goes. */
+  desc1->plaintext_data.revision_counter++;
+  tor_free(desc1_str);
+  ret = hs_desc_encode_descriptor(desc1, &signing_kp1, NULL, &desc1_str);
+  tt_int_op(ret, OP_EQ, 0);
+  tt_int_op(hs_cache_store_as_dir(desc1_str), OP_EQ, 0);
+  tt_u64_op(rend_cache_get_total_allocation(), OP_EQ,
+            entry1_size + entry2_size);
+
+  /* Both descriptors are still there, in the new arena. */
+  entry1 = lookup_v3_desc_as_dir(desc1->plaintext_data.blinded_pubkey.pubkey);
+  entry2 = lookup_v3_desc_as_dir(desc2->plaintext_data.blinded_pubkey.pubkey);
+  tt_assert(entry1);
+  tt_assert(entry2);
+  tt_ptr_op(entry1->segment, OP_EQ, entry2->segment);
+  tt_str_op(entry1->encoded_desc, OP_EQ, desc1_str);
+  tt_str_op(entry2->encoded_desc, OP_EQ, desc2_str);
+  tt_u64_op(entry1->revision_counter, OP_EQ,
+            desc1->plaintext_data.revision_counter);
+
+  /* A newer revision of the second descriptor arrives later in the same
+   * segment. Cleaning as if short of memory, with a cutoff between the two
+   * arrivals, removes the first descriptor only, and what it reports is
+   * what it freed. */
+  update_approx_time(now + 60);
+  desc2->plaintext_data.revision_counter++;
+  tor_free(desc2_str);
+  ret = hs_desc_encode_descriptor(desc2, &signing_kp2, NULL, &desc2_str);
+  tt_int_op(ret, OP_EQ, 0);
+  tt_int_op(hs_cache_store_as_dir(desc2_str), OP_EQ, 0);
+  entry2_size = sizeof(hs_cache_dir_descriptor_t) + strlen(desc2_str) + 1;
+  tt_u64_op(rend_cache_get_total_allocation(), OP_EQ,
+            entry1_size + entry2_size);
+  tt_u64_op(cache_clean_v3_as_dir(approx_time(), now), OP_EQ, entry1_size);
+  tt_u64_op(rend_cache_get_total_allocation(), OP_EQ, entry2_size);
+  tt_ptr_op(lookup_v3_desc_as_dir(
+                      desc1->plaintext_data.blinded_pubkey.pubkey), OP_EQ,
+            NULL);
+  entry2 = lookup_v3_desc_as_dir(desc2->plaintext_data.blinded_pubkey.pubkey);
+  tt_assert(entry2);
+  tt_str_op(entry2->encoded_desc, OP_EQ, desc2_str);
+
+  /* Cleaning again frees nothing more, and says so. */
+  tt_u64_op(cache_clean_v3_as_dir(approx_time(), now), OP_EQ, 0);
+
+ done:
+  hs_descriptor_free(desc1);
+  hs_descriptor_free(desc2);
+  tor_free(desc1_str);
+  tor_free(desc2_str);
+  hs_cache_free_all();
+}
+
 /* Test helper: Fetch an HS descriptor from an HSDir (for the hidden service
    with <b>blinded_key</b>. Return the received descriptor string. */
 static char *
@@ -555,6 +781,12 @@ struct testcase_t hs_cache[] = {
     NULL, NULL },
   { "clean_as_dir", test_clean_as_dir, TT_FORK,
     NULL, NULL },
+  { "dir_index", test_dir_index, TT_FORK,
+    NULL, NULL },
+  { "dir_segments", test_dir_segments, TT_FORK,
+    NULL, NULL },
+  { "dir_segment_compaction", test_dir_segment_compaction, TT_FORK,
+    NULL, NULL },
   { "hsdir_revision_counter_check", test_hsdir_revision_counter_check, TT_FORK,
     NULL, NULL },
   { "upload_and_download_hs_desc", test_upload_and_download_hs_desc, TT_FORK,
@@ -426,6 +426,8 @@ mock_directory_initiate_request(directory_request_t *req)
   return;
 }
 
+static int n_desc_encodes = 0;
+
 static int
 mock_hs_desc_encode_descriptor(const hs_descriptor_t *desc,
                                const ed25519_keypair_t *signing_kp,
@@ -436,6 +438,7 @@ mock_hs_desc_encode_descriptor(const hs_descriptor_t *desc,
   (void)signing_kp;
   (void)descriptor_cookie;
 
+  ++n_desc_encodes;
   tor_asprintf(encoded_out, "lulu");
   return 0;
 }
@@ -525,9 +528,22 @@ test_desc_reupload_logic(void *arg)
   }
 
   /* Now let's upload our desc to all hsdirs */
+  n_desc_encodes = 0;
   upload_descriptor_to_all(service, desc);
   /* Check that previous hsdirs were populated */
   tt_int_op(smartlist_len(desc->previous_hsdirs), OP_EQ, 6);
+  /* Check that we encoded the descriptor once for all of them, and kept it
+   * along with how long that took. */
+  tt_int_op(n_desc_encodes, OP_EQ, 1);
+  tt_str_op(desc->encoded_desc, OP_EQ, "lulu");
+  tt_u64_op(service->state.n_desc_encodes, OP_EQ, 1);
+  {
+    char *encode_time = hs_service_lookup_encode_time(
+                                              &service->keys.identity_pk);
+    tt_assert(!strcmpstart(encode_time, "LAST="));
+    tt_assert(strstr(encode_time, " COUNT=1"));
+    tor_free(encode_time);
+  }
 
   /* Poison next upload time so that we can see if it was changed by
    * router_dir_info_changed(). No changes in hash ring so far, so the upload
@@ -598,6 +614,8 @@ test_desc_reupload_logic(void *arg)
   /* Now reupload again: see that the prev hsdir set got populated again. */
   upload_descriptor_to_all(service, desc);
   tt_int_op(smartlist_len(desc->previous_hsdirs), OP_EQ, 6);
+  tt_int_op(n_desc_encodes, OP_EQ, 3);
+  tt_u64_op(service->state.n_desc_encodes, OP_EQ, 3);
 
  done:
   SMARTLIST_FOREACH(ns->routerstatus_list,
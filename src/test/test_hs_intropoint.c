@@ -727,65 +727,140 @@ test_introduce1_validation(void *arg)
 {
   int ret;
   trn_cell_introduce1_t *cell = NULL;
+  uint8_t *request = NULL;
+  ssize_t request_len;
+  uint8_t legacy_key_id[DIGEST_LEN];
+  hs_intro_introduce1_view_t view;
 
   (void) arg;
 
-  /* Create our decoy cell that we'll modify as we go to test the validation
-   * function of that parsed cell. */
+  /* Create our decoy cell and parse it: we'll modify the parsed view as we
+   * go to test the validation function of that parsed cell. */
   cell = helper_create_introduce1_cell();
   tt_assert(cell);
+  request_len = trn_cell_introduce1_encoded_len(cell);
+  tt_int_op((int) request_len, OP_GT, 0);
+  request = tor_malloc_zero(request_len);
+  tt_int_op((int) trn_cell_introduce1_encode(request, request_len, cell),
+            OP_EQ, (int) request_len);
+  tt_int_op((int) hs_intro_parse_introduce1(&view, request, request_len),
+            OP_EQ, (int) request_len);
 
   /* It should NOT be a legacy cell which will trigger a BUG(). */
-  memset(cell->legacy_key_id, 'a', sizeof(cell->legacy_key_id));
+  memset(legacy_key_id, 'a', sizeof(legacy_key_id));
+  view.legacy_key_id = legacy_key_id;
   tor_capture_bugs_(1);
-  ret = validate_introduce1_parsed_cell(cell);
+  ret = validate_introduce1_parsed_cell(&view);
   tor_end_capture_bugs_();
   tt_int_op(ret, OP_EQ, -1);
   /* Reset legacy ID and make sure it's correct. */
-  memset(cell->legacy_key_id, 0, sizeof(cell->legacy_key_id));
-  ret = validate_introduce1_parsed_cell(cell);
+  memset(legacy_key_id, 0, sizeof(legacy_key_id));
+  ret = validate_introduce1_parsed_cell(&view);
   tt_int_op(ret, OP_EQ, 0);
 
   /* Non existing auth key type. */
-  cell->auth_key_type = 42;
-  ret = validate_introduce1_parsed_cell(cell);
+  view.auth_key_type = 42;
+  ret = validate_introduce1_parsed_cell(&view);
   tt_int_op(ret, OP_EQ, -1);
   /* Reset is to correct value and make sure it's correct. */
-  cell->auth_key_type = HS_INTRO_AUTH_KEY_TYPE_ED25519;
-  ret = validate_introduce1_parsed_cell(cell);
+  view.auth_key_type = HS_INTRO_AUTH_KEY_TYPE_ED25519;
+  ret = validate_introduce1_parsed_cell(&view);
   tt_int_op(ret, OP_EQ, 0);
 
   /* Really bad key length. */
-  cell->auth_key_len = 0;
-  ret = validate_introduce1_parsed_cell(cell);
+  view.auth_key_len = 0;
+  ret = validate_introduce1_parsed_cell(&view);
   tt_int_op(ret, OP_EQ, -1);
-  cell->auth_key_len = UINT16_MAX;
-  ret = validate_introduce1_parsed_cell(cell);
+  view.auth_key_len = UINT16_MAX;
+  ret = validate_introduce1_parsed_cell(&view);
   tt_int_op(ret, OP_EQ, -1);
   /* Correct size, let's try that. */
-  cell->auth_key_len = sizeof(ed25519_public_key_t);
-  ret = validate_introduce1_parsed_cell(cell);
-  tt_int_op(ret, OP_EQ, 0);
-  /* Set an invalid size of the auth key buffer. */
-  trn_cell_introduce1_setlen_auth_key(cell, 3);
-  ret = validate_introduce1_parsed_cell(cell);
-  tt_int_op(ret, OP_EQ, -1);
-  /* Reset auth key buffer and make sure it works. */
-  trn_cell_introduce1_setlen_auth_key(cell, sizeof(ed25519_public_key_t));
-  ret = validate_introduce1_parsed_cell(cell);
+  view.auth_key_len = sizeof(ed25519_public_key_t);
+  ret = validate_introduce1_parsed_cell(&view);
   tt_int_op(ret, OP_EQ, 0);
 
   /* Empty encrypted section. */
-  trn_cell_introduce1_setlen_encrypted(cell, 0);
-  ret = validate_introduce1_parsed_cell(cell);
+  view.encrypted_len = 0;
+  ret = validate_introduce1_parsed_cell(&view);
   tt_int_op(ret, OP_EQ, -1);
   /* Reset it to some non zero bytes and validate. */
-  trn_cell_introduce1_setlen_encrypted(cell, 1);
-  ret = validate_introduce1_parsed_cell(cell);
+  view.encrypted_len = 1;
+  ret = validate_introduce1_parsed_cell(&view);
   tt_int_op(ret, OP_EQ, 0);
 
  done:
   trn_cell_introduce1_free(cell);
+  tor_free(request);
+}
+
+/* Check that parsing an INTRODUCE1 cell in place agrees with trunnel on
+ * every truncation of a cell, and on a cell with a bad auth key type. */
+static void
+test_introduce1_parse_in_place(void *arg)
+{
+  trn_cell_introduce1_t *cell = NULL, *parsed = NULL;
+  uint8_t *request = NULL;
+  ssize_t request_len, len;
+  hs_intro_introduce1_view_t view;
+
+  (void) arg;
+
+  /* Give the cell an extension to step over. */
+  cell = helper_create_introduce1_cell();
+  tt_assert(cell);
+  {
+    trn_cell_extension_t *ext = trn_cell_introduce1_get_extensions(cell);
+    trn_cell_extension_fields_t *field = trn_cell_extension_fields_new();
+    trn_cell_extension_fields_set_field_type(field, 42);
+    trn_cell_extension_fields_set_field_len(field, 3);
+    trn_cell_extension_fields_setlen_field(field, 3);
+    trn_cell_extension_add_fields(ext, field);
+    trn_cell_extension_set_num(ext, 1);
+  }
+  request_len = trn_cell_introduce1_encoded_len(cell);
+  tt_int_op((int) request_len, OP_GT, 0);
+  request = tor_malloc_zero(request_len);
+  tt_int_op((int) trn_cell_introduce1_encode(request, request_len, cell),
+            OP_EQ, (int) request_len);
+
+  for (len = 0; len <= request_len; ++len) {
+    ssize_t expected = trn_cell_introduce1_parse(&parsed, request, len);
+    tt_int_op((int) hs_intro_parse_introduce1(&view, request, len),
+              OP_EQ, (int) expected);
+    if (expected < 0)
+      continue;
+    tt_mem_op(view.legacy_key_id, OP_EQ,
+              trn_cell_introduce1_getconstarray_legacy_key_id(parsed),
+              DIGEST_LEN);
+    tt_int_op(view.auth_key_type, OP_EQ,
+              trn_cell_introduce1_get_auth_key_type(parsed));
+    tt_int_op(view.auth_key_len, OP_EQ,
+              trn_cell_introduce1_get_auth_key_len(parsed));
+    tt_mem_op(view.auth_key, OP_EQ,
+              trn_cell_introduce1_getconstarray_auth_key(parsed),
+              view.auth_key_len);
+    tt_size_op(view.encrypted_len, OP_EQ,
+               trn_cell_introduce1_getlen_encrypted(parsed));
+    tt_mem_op(view.encrypted, OP_EQ,
+              trn_cell_introduce1_getconstarray_encrypted(parsed),
+              view.encrypted_len);
+    trn_cell_introduce1_free(parsed);
+  }
+  /* The whole cell parses, and nothing was copied. */
+  tt_ptr_op(view.encrypted + view.encrypted_len, OP_EQ,
+            request + request_len);
+
+  /* An auth key type we don't know is invalid, not truncated. */
+  request[DIGEST_LEN] = 7;
+  tt_int_op((int) trn_cell_introduce1_parse(&parsed, request, request_len),
+            OP_EQ, -1);
+  tt_int_op((int) hs_intro_parse_introduce1(&view, request, request_len),
+            OP_EQ, -1);
+
+ done:
+  trn_cell_introduce1_free(parsed);
+  trn_cell_introduce1_free(cell);
+  tor_free(request);
 }
 
 static void
@@ -922,6 +997,9 @@ struct testcase_t hs_intropoint_tests[] = {
   { "introduce1_validation",
     test_introduce1_validation, TT_FORK, NULL, NULL },
 
+  { "introduce1_parse_in_place",
+    test_introduce1_parse_in_place, TT_FORK, NULL, NULL },
+
   { "received_introduce1_handling",
     test_received_introduce1_handling, TT_FORK, NULL, NULL },
 
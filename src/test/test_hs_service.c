@@ -1618,6 +1618,63 @@ test_build_update_descriptors(void *arg)
   nodelist_free_all();
 }
 
+/** Test that building the descriptor intro points reuses the ones we built
+ *  before, until their certificates get old. */
+static void
+test_build_desc_intro_points(void *arg)
+{
+  hs_service_t *service;
+  hs_service_descriptor_t *desc;
+  hs_service_intro_point_t *ip1, *ip2;
+  hs_desc_intro_point_t *desc_ip;
+  smartlist_t *desc_ips;
+  time_t now = approx_time(), valid_until;
+
+  (void) arg;
+
+  hs_init();
+
+  service = helper_create_service();
+  desc = service->desc_current;
+  ed25519_keypair_generate(&desc->signing_kp, 0);
+  desc->desc->encrypted_data.intro_points = smartlist_new();
+  desc_ips = desc->desc->encrypted_data.intro_points;
+
+  ip1 = helper_create_service_ip();
+  service_intro_point_add(desc->intro_points.map, ip1);
+  build_desc_intro_points(service, desc, now);
+  tt_int_op(smartlist_len(desc_ips), OP_EQ, 1);
+  desc_ip = smartlist_get(desc_ips, 0);
+  tt_mem_op(&desc_ip->auth_key_cert->signed_key, OP_EQ,
+            &ip1->auth_key_kp.pubkey, sizeof(ed25519_public_key_t));
+
+  /* With a second intro point, we only build that one. */
+  ip2 = helper_create_service_ip();
+  service_intro_point_add(desc->intro_points.map, ip2);
+  build_desc_intro_points(service, desc, now + 3600);
+  tt_int_op(smartlist_len(desc_ips), OP_EQ, 2);
+  tt_assert(smartlist_contains(desc_ips, desc_ip));
+
+  /* An intro point we no longer have goes away. */
+  service_intro_point_remove(service, ip1);
+  service_intro_point_free(ip1);
+  build_desc_intro_points(service, desc, now + 3600);
+  tt_int_op(smartlist_len(desc_ips), OP_EQ, 1);
+  desc_ip = smartlist_get(desc_ips, 0);
+  tt_mem_op(&desc_ip->auth_key_cert->signed_key, OP_EQ,
+            &ip2->auth_key_kp.pubkey, sizeof(ed25519_public_key_t));
+
+  /* Once its certificates get close to expiring, we build it again. */
+  valid_until = desc_ip->auth_key_cert->valid_until;
+  build_desc_intro_points(service, desc, now + HS_DESC_CERT_LIFETIME);
+  tt_int_op(smartlist_len(desc_ips), OP_EQ, 1);
+  desc_ip = smartlist_get(desc_ips, 0);
+  tt_i64_op(desc_ip->auth_key_cert->valid_until, OP_GT, valid_until);
+
+ done:
+  hs_free_all();
+}
+
 /** Test building descriptors. We use this separate function instead of
  *  using test_build_update_descriptors because that function is too complex
  *  and also too interactive. */
@@ -2130,6 +2187,8 @@ struct testcase_t hs_service_tests[] = {
     NULL, NULL },
   { "build_update_descriptors", test_build_update_descriptors, TT_FORK,
     NULL, NULL },
+  { "build_desc_intro_points", test_build_desc_intro_points, TT_FORK,
+    NULL, NULL },
   { "build_descriptors", test_build_descriptors, TT_FORK,
     NULL, NULL },
   { "upload_descriptors", test_upload_descriptors, TT_FORK,
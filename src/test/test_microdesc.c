@@ -5,7 +5,9 @@
 #include "core/or/or.h"
 
 #define DIRVOTE_PRIVATE
+#define MICRODESC_PRIVATE
 #include "app/config/config.h"
+#include "core/or/policies.h"
 #include "feature/dirauth/dirvote.h"
 #include "feature/dirparse/microdesc_parse.h"
 #include "feature/dirparse/routerparse.h"
@@ -13,6 +15,8 @@
 #include "feature/nodelist/networkstatus.h"
 #include "feature/nodelist/routerlist.h"
 #include "feature/nodelist/torcert.h"
+#include "lib/crypt_ops/crypto_curve25519.h"
+#include "lib/crypt_ops/crypto_ed25519.h"
 
 #include "feature/nodelist/microdesc_st.h"
 #include "feature/nodelist/networkstatus_st.h"
@@ -811,6 +815,207 @@ test_md_corrupt_desc(void *arg)
   smartlist_free(sl);
 }
 
+static const char test_md_ed[] =
+  "onion-key\n"
+  "-----BEGIN RSA PUBLIC KEY-----\n"
+  "MIGJAoGBAMjlHH/daN43cSVRaHBwgUfnszzAhg98EvivJ9Qxfv51mvQUxPjQ07es\n"
+  "gV/3n8fyh3Kqr/ehi9jxkdgSRfSnmF7giaHL1SLZ29kA7KtST+pBvmTpDtHa3ykX\n"
+  "Xorc7hJvIyTZoc1HU+5XSynj3gsBE5IGK1ZRzrNS688LnuZMVp1tAgMBAAE=\n"
+  "-----END RSA PUBLIC KEY-----\n"
+  "ntor-onion-key 761Dmm27via7lXygNHM3l+oJLrYU2Nye0Uz4pkpipyY=\n"
+  "a [2001:db8::7]:9001\n"
+  "family nodeX $D8CFEA0D996F5D1473D2063C041B7910DB23981E\n"
+  "p reject 1-24,26-65535\n"
+  "p6 accept 80,443\n"
+  "id ed25519 AAECAwQFBgcICQoLDA0ODxAREhMUFRYXGBkaGxwdHh8\n";
+
+/** Helper: compare microdescriptors by their offset in the cache. */
+static int
+compare_md_off_(const void **a, const void **b)
+{
+  const microdesc_t *m1 = *a, *m2 = *b;
+  if (m1->off < m2->off)
+    return -1;
+  return m1->off > m2->off;
+}
+
+/** Helper: assert that <b>a</b> and <b>b</b> hold the same fields. */
+static void
+assert_md_eq(const microdesc_t *a, const microdesc_t *b)
+{
+  char *p1 = NULL, *p2 = NULL;
+
+  tt_int_op(a->off, OP_EQ, b->off);
+  tt_ptr_op(a->body, OP_EQ, b->body);
+  tt_uint_op(a->bodylen, OP_EQ, b->bodylen);
+  tt_int_op(a->saved_location, OP_EQ, b->saved_location);
+  tt_mem_op(a->digest, OP_EQ, b->digest, DIGEST256_LEN);
+  tt_int_op(a->last_listed, OP_EQ, b->last_listed);
+  tt_uint_op(a->onion_pkey_len, OP_EQ, b->onion_pkey_len);
+  tt_mem_op(a->onion_pkey, OP_EQ, b->onion_pkey, a->onion_pkey_len);
+  tt_int_op(!a->onion_curve25519_pkey, OP_EQ, !b->onion_curve25519_pkey);
+  if (a->onion_curve25519_pkey)
+    tt_mem_op(a->onion_curve25519_pkey, OP_EQ, b->onion_curve25519_pkey,
+              sizeof(curve25519_public_key_t));
+  tt_int_op(!a->ed25519_identity_pkey, OP_EQ, !b->ed25519_identity_pkey);
+  if (a->ed25519_identity_pkey)
+    tt_mem_op(a->ed25519_identity_pkey, OP_EQ, b->ed25519_identity_pkey,
+              sizeof(ed25519_public_key_t));
+  tt_assert(tor_addr_eq(&a->ipv6_addr, &b->ipv6_addr));
+  tt_int_op(a->ipv6_orport, OP_EQ, b->ipv6_orport);
+  tt_int_op(!a->family, OP_EQ, !b->family);
+  if (a->family) {
+    p1 = smartlist_join_strings(a->family, " ", 0, NULL);
+    p2 = smartlist_join_strings(b->family, " ", 0, NULL);
+    tt_str_op(p1, OP_EQ, p2);
+    tor_free(p1);
+    tor_free(p2);
+  }
+  tt_int_op(!a->exit_policy, OP_EQ, !b->exit_policy);
+  if (a->exit_policy) {
+    p1 = write_short_policy(a->exit_policy);
+    p2 = write_short_policy(b->exit_policy);
+    tt_str_op(p1, OP_EQ, p2);
+    tor_free(p1);
+    tor_free(p2);
+  }
+  tt_int_op(!a->ipv6_exit_policy, OP_EQ, !b->ipv6_exit_policy);
+  if (a->ipv6_exit_policy) {
+    p1 = write_short_policy(a->ipv6_exit_policy);
+    p2 = write_short_policy(b->ipv6_exit_policy);
+    tt_str_op(p1, OP_EQ, p2);
+  }
+
+ done:
+  tor_free(p1);
+  tor_free(p2);
+}
+
+static void
+test_md_snapshot(void *arg)
+{
+  or_options_t *options = get_options_mutable();
+  microdesc_cache_t *mc = NULL;
+  smartlist_t *added = NULL, *parsed = NULL, *loaded = NULL;
+  smartlist_t *digests = smartlist_new();
+  char *cache_fn = NULL, *snap_fn = NULL, *cache = NULL, *snap = NULL;
+  struct stat st;
+  size_t cache_len, snap_len;
+  const time_t now = time(NULL);
+  int i;
+  (void) arg;
+
+  tor_free(options->CacheDirectory);
+  options->CacheDirectory = tor_strdup(get_fname("md_datadir_snapshot"));
+  options->MicrodescCacheSnapshot = 1;
+#ifdef _WIN32
+  tt_int_op(0, OP_EQ, mkdir(options->CacheDirectory));
+#else
+  tt_int_op(0, OP_EQ, mkdir(options->CacheDirectory, 0700));
+#endif
+  tor_asprintf(&cache_fn, "%s"PATH_SEPARATOR"cached-microdescs",
+               options->CacheDirectory);
+  tor_asprintf(&snap_fn, "%s"PATH_SEPARATOR"cached-microdescs.snapshot",
+               options->CacheDirectory);
+
+  /* Nothing to snapshot yet. */
+  mc = get_microdesc_cache();
+  tt_int_op(microdesc_cache_save_snapshot(), OP_EQ, 0);
+  tt_int_op(file_status(snap_fn), OP_EQ, FN_NOENT);
+
+  added = microdescs_add_to_cache(mc, MD_PARSE_TEST_DATA, NULL,
+                                  SAVED_NOWHERE, 0, now - 3600, NULL);
+  tt_int_op(smartlist_len(added), OP_EQ, 11);
+  smartlist_free(added);
+  added = microdescs_add_to_cache(mc, test_md_ed, NULL,
+                                  SAVED_NOWHERE, 0, now, NULL);
+  tt_int_op(smartlist_len(added), OP_EQ, 1);
+  tt_assert(((microdesc_t *) smartlist_get(added, 0))->ed25519_identity_pkey);
+  smartlist_free(added);
+  added = NULL;
+  tt_int_op(microdesc_cache_rebuild(mc, 1), OP_EQ, 0);
+  tt_int_op(microdesc_cache_save_snapshot(), OP_EQ, 0);
+
+  /* The snapshot decodes to exactly what parsing the cache gives us. */
+  cache = read_file_to_str(cache_fn, RFTS_BIN, &st);
+  tt_assert(cache);
+  cache_len = (size_t) st.st_size;
+  snap = read_file_to_str(snap_fn, RFTS_BIN, &st);
+  tt_assert(snap);
+  snap_len = (size_t) st.st_size;
+
+  parsed = microdescs_parse_from_string(cache, cache + cache_len, 1,
+                                        SAVED_IN_CACHE, NULL);
+  loaded = microdesc_snapshot_decode(snap, snap_len, cache, cache_len);
+  tt_assert(loaded);
+  tt_int_op(smartlist_len(parsed), OP_EQ, 12);
+  tt_int_op(smartlist_len(loaded), OP_EQ, 12);
+  smartlist_sort(parsed, compare_md_off_);
+  smartlist_sort(loaded, compare_md_off_);
+  for (i = 0; i < 12; ++i) {
+    assert_md_eq(smartlist_get(parsed, i), smartlist_get(loaded, i));
+    const microdesc_t *md = smartlist_get(parsed, i);
+    smartlist_add(digests, tor_memdup(md->digest, DIGEST256_LEN));
+  }
+  SMARTLIST_FOREACH(loaded, microdesc_t *, md, microdesc_free(md));
+  smartlist_free(loaded);
+  loaded = NULL;
+
+  /* A snapshot for some other cache file, or a damaged one, is refused. */
+  cache[cache_len - 2] ^= 1;
+  tt_ptr_op(NULL, OP_EQ,
+            microdesc_snapshot_decode(snap, snap_len, cache, cache_len));
+  cache[cache_len - 2] ^= 1;
+  tt_ptr_op(NULL, OP_EQ,
+            microdesc_snapshot_decode(snap, snap_len, cache, cache_len - 1));
+  snap[snap_len / 2] ^= 1;
+  tt_ptr_op(NULL, OP_EQ,
+            microdesc_snapshot_decode(snap, snap_len, cache, cache_len));
+  snap[snap_len / 2] ^= 1;
+  tt_ptr_op(NULL, OP_EQ,
+            microdesc_snapshot_decode(snap, snap_len - 1, cache, cache_len));
+
+  /* Reloading uses the snapshot; the journal is still parsed. */
+  added = microdescs_add_to_cache(mc, test_md1, NULL,
+                                  SAVED_NOWHERE, 0, now, NULL);
+  tt_int_op(smartlist_len(added), OP_EQ, 1);
+  smartlist_add(digests, tor_memdup(((microdesc_t *)
+                                     smartlist_get(added, 0))->digest,
+                                    DIGEST256_LEN));
+  smartlist_free(added);
+  added = NULL;
+  microdesc_free_all();
+  mc = get_microdesc_cache();
+  SMARTLIST_FOREACH(digests, const char *, d,
+                    tt_assert(microdesc_cache_lookup_by_digest256(mc, d)));
+
+  /* If the snapshot is damaged, we fall back to parsing the cache. */
+  snap[snap_len / 2] ^= 1;
+  tt_int_op(0, OP_EQ, write_bytes_to_file(snap_fn, snap, snap_len, 1));
+  microdesc_free_all();
+  mc = get_microdesc_cache();
+  SMARTLIST_FOREACH(digests, const char *, d,
+                    tt_assert(microdesc_cache_lookup_by_digest256(mc, d)));
+
+ done:
+  tor_free(options->CacheDirectory);
+  options->MicrodescCacheSnapshot = 0;
+  microdesc_free_all();
+  smartlist_free(added);
+  if (parsed)
+    SMARTLIST_FOREACH(parsed, microdesc_t *, md, microdesc_free(md));
+  smartlist_free(parsed);
+  if (loaded)
+    SMARTLIST_FOREACH(loaded, microdesc_t *, md, microdesc_free(md));
+  smartlist_free(loaded);
+  SMARTLIST_FOREACH(digests, char *, cp, tor_free(cp));
+  smartlist_free(digests);
+  tor_free(cache_fn);
+  tor_free(snap_fn);
+  tor_free(cache);
+  tor_free(snap);
+}
+
 struct testcase_t microdesc_tests[] = {
   { "cache", test_md_cache, TT_FORK, NULL, NULL },
   { "broken_cache", test_md_cache_broken, TT_FORK, NULL, NULL },
@@ -818,5 +1023,6 @@ struct testcase_t microdesc_tests[] = {
   { "parse", test_md_parse, 0, NULL, NULL },
   { "reject_cache", test_md_reject_cache, TT_FORK, NULL, NULL },
   { "corrupt_desc", test_md_corrupt_desc, TT_FORK, NULL, NULL },
+  { "snapshot", test_md_snapshot, TT_FORK, NULL, NULL },
   END_OF_TESTCASES
 };
@@ -6,10 +6,15 @@
  * \brief Unit tests for nodelist related functions.
  **/
 
+#define NODELIST_PRIVATE
+
 #include "core/or/or.h"
+#include "app/config/config.h"
 #include "lib/crypt_ops/crypto_rand.h"
+#include "lib/encoding/binascii.h"
 #include "feature/nodelist/networkstatus.h"
 #include "feature/nodelist/nodelist.h"
+#include "feature/nodelist/routerlist.h"
 #include "feature/nodelist/torcert.h"
 
 #include "feature/nodelist/microdesc_st.h"
@@ -231,6 +236,165 @@ test_nodelist_ed_id(void *arg)
 #undef N_NODES
 }
 
+/** Make <b>ri</b> declare a family of the nodes <b>ri_members</b> whose
+ * indices are listed in <b>members</b> (terminated by -1), by hex ID.
+ * Replace any family it already had. */
+static void
+set_declared_family(routerinfo_t *ri, routerinfo_t **ri_members,
+                    const int *members)
+{
+  char hex[HEX_DIGEST_LEN+1];
+  if (ri->declared_family) {
+    SMARTLIST_FOREACH(ri->declared_family, char *, cp, tor_free(cp));
+    smartlist_free(ri->declared_family);
+  }
+  ri->declared_family = smartlist_new();
+  for ( ; *members >= 0; ++members) {
+    base16_encode(hex, sizeof(hex),
+                  ri_members[*members]->cache_info.identity_digest,
+                  DIGEST_LEN);
+    smartlist_add_asprintf(ri->declared_family, "$%s", hex);
+  }
+}
+
+/** Check that nodes_in_same_family() and nodelist_add_node_and_family()
+ * agree with nodes_declare_same_family() about every pair of nodes in
+ * <b>nodes</b>. */
+static void
+check_families_match_declarations(node_t **nodes, int n_nodes)
+{
+  smartlist_t *family = smartlist_new();
+  int i, j;
+
+  for (i = 0; i < n_nodes; ++i) {
+    smartlist_clear(family);
+    nodelist_add_node_and_family(family, nodes[i]);
+    tt_assert(smartlist_contains(family, nodes[i]));
+    for (j = 0; j < n_nodes; ++j) {
+      const int declared = nodes_declare_same_family(nodes[i], nodes[j]);
+      tt_int_op(nodes_in_same_family(nodes[i], nodes[j]), OP_EQ, declared);
+      if (i != j)
+        tt_int_op(smartlist_contains(family, nodes[j]), OP_EQ, declared);
+    }
+  }
+
+ done:
+  smartlist_free(family);
+}
+
+static void
+test_nodelist_declared_family(void *arg)
+{
+#define N_NODES 12
+  routerinfo_t *ri[N_NODES];
+  node_t *node[N_NODES];
+  routerinfo_t *ri_old = NULL;
+  char hex[HEX_DIGEST_LEN+1];
+  int i;
+  (void)arg;
+
+  get_options_mutable()->EnforceDistinctSubnets = 0;
+
+  for (i = 0; i < N_NODES; ++i) {
+    ri[i] = tor_malloc_zero(sizeof(routerinfo_t));
+    crypto_rand(ri[i]->cache_info.identity_digest, DIGEST_LEN);
+    tor_asprintf(&ri[i]->nickname, "node%d", i);
+  }
+
+  /* 0, 1 and 2 all list each other: a proper family. */
+  set_declared_family(ri[0], ri, (const int[]) { 1, 2, -1 });
+  set_declared_family(ri[1], ri, (const int[]) { 0, 1, 2, 2, -1 });
+  set_declared_family(ri[2], ri, (const int[]) { 0, 1, -1 });
+  /* 3 and 4 list each other, and so do 4 and 5, but 3 and 5 don't. */
+  set_declared_family(ri[3], ri, (const int[]) { 4, -1 });
+  set_declared_family(ri[4], ri, (const int[]) { 3, 5, -1 });
+  set_declared_family(ri[5], ri, (const int[]) { 4, -1 });
+  /* 6 lists 7 by ID, and 7 lists 6 by nickname. */
+  set_declared_family(ri[6], ri, (const int[]) { 7, -1 });
+  ri[7]->declared_family = smartlist_new();
+  smartlist_add_strdup(ri[7]->declared_family, "node6");
+  /* 8 and 9 list each other, and 8 lists 0 too. */
+  set_declared_family(ri[8], ri, (const int[]) { 0, 9, -1 });
+  set_declared_family(ri[9], ri, (const int[]) { 8, -1 });
+  /* 10 lists 11 with its nickname, and 11 lists 10. */
+  base16_encode(hex, sizeof(hex), ri[11]->cache_info.identity_digest,
+                DIGEST_LEN);
+  ri[10]->declared_family = smartlist_new();
+  smartlist_add_asprintf(ri[10]->declared_family, "$%s~node11", hex);
+  set_declared_family(ri[11], ri, (const int[]) { 10, -1 });
+
+  for (i = 0; i < N_NODES; ++i)
+    node[i] = nodelist_set_routerinfo(ri[i], &ri_old);
+
+  check_families_match_declarations(node, N_NODES);
+  tt_assert(nodes_in_same_family(node[0], node[2]));
+  tt_assert(nodes_in_same_family(node[3], node[4]));
+  tt_assert(! nodes_in_same_family(node[3], node[5]));
+  tt_assert(nodes_in_same_family(node[6], node[7]));
+  tt_assert(! nodes_in_same_family(node[0], node[8]));
+  tt_assert(nodes_in_same_family(node[10], node[11]));
+
+  /* Only the proper family can skip checking the declarations. */
+  tt_assert(node[0]->family_is_exact);
+  tt_int_op(node[0]->family_id, OP_NE, 0);
+  tt_int_op(node[0]->family_id, OP_EQ, node[1]->family_id);
+  tt_int_op(node[0]->family_id, OP_EQ, node[2]->family_id);
+  tt_assert(! node[3]->family_is_exact);
+  tt_assert(! node[6]->family_is_exact);
+  tt_assert(node[9]->family_is_exact);
+  tt_int_op(node[8]->family_id, OP_EQ, node[9]->family_id);
+  tt_int_op(node[8]->family_id, OP_NE, node[0]->family_id);
+
+  /* When a node's descriptor changes, we notice: 5 and 3 now list each
+   * other, so 3, 4, and 5 are a proper family. */
+  routerinfo_t *ri_new = tor_malloc_zero(sizeof(routerinfo_t));
+  memcpy(ri_new->cache_info.identity_digest, ri[5]->cache_info.identity_digest,
+         DIGEST_LEN);
+  ri_new->nickname = tor_strdup("node5");
+  set_declared_family(ri_new, ri, (const int[]) { 3, 4, -1 });
+  set_declared_family(ri[3], ri, (const int[]) { 4, 5, -1 });
+  tt_ptr_op(nodelist_set_routerinfo(ri_new, &ri_old), OP_EQ, node[5]);
+  tt_ptr_op(ri_old, OP_EQ, ri[5]);
+  routerinfo_free(ri[5]);
+  ri[5] = ri_new;
+
+  check_families_match_declarations(node, N_NODES);
+  tt_assert(nodes_in_same_family(node[3], node[5]));
+  tt_assert(node[3]->family_is_exact);
+  tt_int_op(node[3]->family_id, OP_EQ, node[5]->family_id);
+
+  /* A new descriptor that declares the same family doesn't make us
+   * recompute the families, but one that declares a different family
+   * does. */
+  tt_assert(! nodelist_families_are_stale());
+  ri_new = tor_malloc_zero(sizeof(routerinfo_t));
+  memcpy(ri_new->cache_info.identity_digest, ri[0]->cache_info.identity_digest,
+         DIGEST_LEN);
+  ri_new->nickname = tor_strdup("node0");
+  set_declared_family(ri_new, ri, (const int[]) { 1, 2, -1 });
+  tt_ptr_op(nodelist_set_routerinfo(ri_new, &ri_old), OP_EQ, node[0]);
+  routerinfo_free(ri[0]);
+  ri[0] = ri_new;
+  tt_assert(! nodelist_families_are_stale());
+  ri_new = tor_malloc_zero(sizeof(routerinfo_t));
+  memcpy(ri_new->cache_info.identity_digest, ri[0]->cache_info.identity_digest,
+         DIGEST_LEN);
+  ri_new->nickname = tor_strdup("node0");
+  set_declared_family(ri_new, ri, (const int[]) { 1, -1 });
+  tt_ptr_op(nodelist_set_routerinfo(ri_new, &ri_old), OP_EQ, node[0]);
+  routerinfo_free(ri[0]);
+  ri[0] = ri_new;
+  tt_assert(nodelist_families_are_stale());
+  check_families_match_declarations(node, N_NODES);
+  tt_assert(! node[1]->family_is_exact);
+
+ done:
+  nodelist_free_all();
+  for (i = 0; i < N_NODES; ++i)
+    routerinfo_free(ri[i]);
+#undef N_NODES
+}
+
 #define NODE(name, flags) \
   { #name, test_nodelist_##name, (flags), NULL, NULL }
 
@@ -239,6 +403,7 @@ struct testcase_t nodelist_tests[] = {
   NODE(node_get_verbose_nickname_not_named, TT_FORK),
   NODE(node_is_dir, TT_FORK),
   NODE(ed_id, TT_FORK),
+  NODE(declared_family, TT_FORK),
   END_OF_TESTCASES
 };
 
@@ -15,6 +15,7 @@
 #include "core/proto/proto_control0.h"
 #include "core/proto/proto_ext_or.h"
 
+#include "core/or/cell_st.h"
 #include "core/or/var_cell_st.h"
 
 static void
@@ -104,6 +105,45 @@ test_proto_var_cell(void *arg)
   tor_free(mem_op_hex_tmp);
 }
 
+static void
+test_proto_cell(void *arg)
+{
+  (void)arg;
+  char tmp[CELL_MAX_NETWORK_SIZE];
+  buf_t *buf = buf_new();
+  cell_t cell;
+  int i;
+
+  /* Not enough data. */
+  memset(tmp, 0, sizeof(tmp));
+  buf_add(buf, tmp, 513);
+  tt_int_op(0, OP_EQ, fetch_cell_from_buf(buf, &cell, 1));
+  tt_int_op(1, OP_EQ, fetch_cell_from_buf(buf, &cell, 0));
+  tt_int_op(buf_datalen(buf), OP_EQ, 1);
+  buf_clear(buf);
+
+  /* Enough cells that some of them straddle two chunks. */
+  for (i = 0; i < 20; ++i) {
+    set_uint32(tmp, htonl(0x80000000u + i));
+    set_uint8(tmp + 4, CELL_RELAY);
+    memset(tmp + 5, i, CELL_PAYLOAD_SIZE);
+    buf_add(buf, tmp, CELL_MAX_NETWORK_SIZE);
+  }
+  for (i = 0; i < 20; ++i) {
+    memset(tmp, i, CELL_PAYLOAD_SIZE);
+    memset(&cell, 0xff, sizeof(cell));
+    tt_int_op(1, OP_EQ, fetch_cell_from_buf(buf, &cell, 1));
+    tt_uint_op(cell.circ_id, OP_EQ, 0x80000000u + i);
+    tt_int_op(cell.command, OP_EQ, CELL_RELAY);
+    tt_mem_op(cell.payload, OP_EQ, tmp, CELL_PAYLOAD_SIZE);
+  }
+  tt_int_op(0, OP_EQ, fetch_cell_from_buf(buf, &cell, 1));
+  tt_int_op(buf_datalen(buf), OP_EQ, 0);
+
+ done:
+  buf_free(buf);
+}
+
 static void
 test_proto_control0(void *arg)
 {
@@ -256,6 +296,7 @@ test_proto_line(void *arg)
 
 struct testcase_t proto_misc_tests[] = {
   { "var_cell", test_proto_var_cell, 0, NULL, NULL },
+  { "cell", test_proto_cell, 0, NULL, NULL },
   { "control0", test_proto_control0, 0, NULL, NULL },
   { "ext_or_cmd", test_proto_ext_or_cmd, TT_FORK, NULL, NULL },
   { "line", test_proto_line, 0, NULL, NULL },
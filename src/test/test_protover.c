@@ -2,6 +2,7 @@
 /* See LICENSE for licensing information */
 
 #define PROTOVER_PRIVATE
+#define VERSIONS_PRIVATE
 
 #include "orconfig.h"
 #include "test/test.h"
@@ -10,6 +11,7 @@
 
 #include "core/or/or.h"
 #include "core/or/connection_or.h"
+#include "core/or/versions.h"
 #include "lib/tls/tortls.h"
 
 static void
@@ -299,6 +301,14 @@ test_protover_all_supported(void *arg)
   tt_str_op(msg, OP_EQ, "Link=6-12 Quokka=9000-9001");
   tor_free(msg);
 
+  /* Nor with a large range of a protocol we know. */
+  tt_assert(! protover_all_supported("Link=1-4294967294", &msg));
+  tt_str_op(msg, OP_EQ, "Link=6-4294967294");
+  tor_free(msg);
+  tt_assert(! protover_all_supported("Link=2,4-70,200", &msg));
+  tt_str_op(msg, OP_EQ, "Link=6-70,200");
+  tor_free(msg);
+
   /* We shouldn't be able to DoS ourselves parsing a large range. */
   tt_assert(! protover_all_supported("Sleen=1-2147483648", &msg));
   tt_str_op(msg, OP_EQ, "Sleen=1-2147483648");
@@ -634,6 +644,121 @@ test_protover_vote_roundtrip(void *args)
   tor_free(result);
 }
 
+static void
+test_protover_vote_bitsets(void *arg)
+{
+  smartlist_t *lst = smartlist_new();
+  char *result = NULL;
+  (void)arg;
+
+#ifndef HAVE_RUST
+  tt_u64_op(proto_range_to_bitset(0, 0), OP_EQ, 1);
+  tt_u64_op(proto_range_to_bitset(1, 3), OP_EQ, 0xe);
+  tt_u64_op(proto_range_to_bitset(60, 63), OP_EQ, UINT64_C(0xf) << 60);
+  tt_u64_op(proto_range_to_bitset(62, 500), OP_EQ, UINT64_C(0x3) << 62);
+  tt_u64_op(proto_range_to_bitset(0, UINT32_MAX-1), OP_EQ, UINT64_MAX);
+  tt_u64_op(proto_range_to_bitset(64, 70), OP_EQ, 0);
+
+  /* Listing a version twice in one vote only counts once. */
+  smartlist_add(lst, (void*) "Foo=1-3,2 Foo=3");
+  smartlist_add(lst, (void*) "Foo=3");
+  result = protover_compute_vote(lst, 2);
+  tt_str_op(result, OP_EQ, "Foo=3");
+  tor_free(result);
+  result = protover_compute_vote(lst, 3);
+  tt_str_op(result, OP_EQ, "");
+  tor_free(result);
+#endif /* !defined(HAVE_RUST) */
+
+  /* Versions on either side of the largest bitset version. */
+  smartlist_clear(lst);
+  smartlist_add(lst, (void*) "Bar=0,60-70 Foo=63-64,100");
+  smartlist_add(lst, (void*) "Bar=62-66 Foo=64,100-101");
+  smartlist_add(lst, (void*) "Bar=63-64,70 Foo=63,101");
+  result = protover_compute_vote(lst, 1);
+  tt_str_op(result, OP_EQ, "Bar=0,60-70 Foo=63-64,100-101");
+  tor_free(result);
+  result = protover_compute_vote(lst, 2);
+  tt_str_op(result, OP_EQ, "Bar=62-66,70 Foo=63-64,100-101");
+  tor_free(result);
+  result = protover_compute_vote(lst, 3);
+  tt_str_op(result, OP_EQ, "Bar=63-64");
+  tor_free(result);
+
+  /* What we support. */
+  tt_assert(protover_is_supported_here(PRT_LINK, 1));
+  tt_assert(protover_is_supported_here(PRT_RELAY, 2));
+  tt_assert(! protover_is_supported_here(PRT_LINK, 0));
+  tt_assert(! protover_is_supported_here(PRT_RELAY, 3));
+  tt_assert(! protover_is_supported_here(PRT_RELAY, 64));
+  tt_assert(! protover_is_supported_here(PRT_RELAY, UINT32_MAX));
+
+ done:
+  smartlist_free(lst);
+  tor_free(result);
+}
+
+static void
+test_protover_summarize_flags(void *arg)
+{
+  const char modern[] =
+    "Cons=1-2 Desc=1-2 DirCache=1-2 HSDir=1-2 HSIntro=3-4 HSRend=1-2 "
+    "Link=1-5 LinkAuth=1,3 Microdesc=1-2 Relay=1-2";
+  const char ancient[] = "Link=1-3 Relay=1";
+  protover_summary_flags_t flags;
+  int i;
+  (void)arg;
+
+  summarize_protover_flags(&flags, modern, "Tor 0.3.4.9");
+  tt_assert(flags.protocols_known);
+  tt_assert(flags.supports_extend2_cells);
+  tt_assert(flags.supports_ed25519_link_handshake_compat);
+  tt_assert(flags.supports_ed25519_link_handshake_any);
+  tt_assert(flags.supports_ed25519_hs_intro);
+  tt_assert(flags.supports_v3_hsdir);
+  tt_assert(flags.supports_v3_rendezvous_point);
+
+  /* The version correction applies to this relay only, not to everyone
+   * else who shares its protocol list. */
+  summarize_protover_flags(&flags, modern, "Tor 0.3.0.7");
+  tt_assert(flags.protocols_known);
+  tt_assert(! flags.supports_v3_hsdir);
+  summarize_protover_flags(&flags, modern, "Tor 0.3.4.9");
+  tt_assert(flags.supports_v3_hsdir);
+  summarize_protover_flags(&flags, modern, NULL);
+  tt_assert(flags.supports_v3_hsdir);
+
+  summarize_protover_flags(&flags, ancient, NULL);
+  tt_assert(flags.protocols_known);
+  tt_assert(! flags.supports_extend2_cells);
+  tt_assert(! flags.supports_ed25519_link_handshake_any);
+  tt_assert(! flags.supports_v3_hsdir);
+
+  /* Without a protocol list, fall back to the version. */
+  summarize_protover_flags(&flags, NULL, "Tor 0.2.4.8-alpha");
+  tt_assert(flags.protocols_known);
+  tt_assert(flags.supports_extend2_cells);
+  tt_assert(! flags.supports_ed25519_link_handshake_any);
+  summarize_protover_flags(&flags, NULL, NULL);
+  tt_assert(! flags.protocols_known);
+
+  /* Lots of different protocol lists: we should still get every one of
+   * them right once the cache fills up. */
+  for (i = 0; i < 3000; ++i) {
+    char *protocols = NULL;
+    tor_asprintf(&protocols, "Link=1-5 Relay=%d Sleen=%d", 1 + (i & 1), i);
+    memoize_protover_summary(&flags, protocols);
+    tt_assert(flags.protocols_known);
+    tt_int_op(flags.supports_extend2_cells, OP_EQ, i & 1);
+    tor_free(protocols);
+  }
+  summarize_protover_flags(&flags, modern, NULL);
+  tt_assert(flags.supports_ed25519_hs_intro);
+
+ done:
+  protover_summary_cache_free_all();
+}
+
 #define PV_TEST(name, flags)                       \
   { #name, test_protover_ ##name, (flags), NULL, NULL }
 
@@ -647,5 +772,7 @@ struct testcase_t protover_tests[] = {
   PV_TEST(supports_version, 0),
   PV_TEST(supported_protocols, 0),
   PV_TEST(vote_roundtrip, 0),
+  PV_TEST(vote_bitsets, 0),
+  PV_TEST(summarize_flags, 0),
   END_OF_TESTCASES
 };
@@ -7,6 +7,8 @@
 #include "core/or/or.h"
 #include "core/or/circuitbuild.h"
 #include "core/or/circuitlist.h"
+#include "core/or/circuitmux_ewma.h"
+#include "core/or/command.h"
 #include "core/or/channeltls.h"
 #include "feature/stats/rephist.h"
 #include "core/or/relay.h"
@@ -16,7 +18,9 @@
 #include "core/or/scheduler.h"
 
 #include "core/or/cell_st.h"
+#include "core/or/cell_queue_st.h"
 #include "core/or/or_circuit_st.h"
+#include "feature/nodelist/networkstatus_st.h"
 
 /* Test suite stuff */
 #include "test/test.h"
@@ -225,10 +229,264 @@ test_relay_append_cell_to_circuit_queue(void *arg)
   return;
 }
 
+static void
+test_relay_cell_queue_aqm(void *arg)
+{
+  cell_queue_t queue;
+  networkstatus_t *ns = tor_malloc_zero(sizeof(networkstatus_t));
+  uint32_t now = 1000;
+  (void)arg;
+
+  monotime_init();
+  cell_queue_init(&queue);
+  queue.n = 10;
+  ns->net_params = smartlist_new();
+
+  /* AQM is off by default. */
+  relay_consensus_has_changed(ns);
+  tt_int_op(CELL_QUEUE_AQM_OK, OP_EQ,
+            cell_queue_aqm_note_sojourn(&queue, now, 100000));
+  tt_assert(! queue.aqm_above_target);
+
+  smartlist_add(ns->net_params, (char *) "circ_aqm_target_ms=50");
+  smartlist_add(ns->net_params, (char *) "circ_aqm_interval_ms=500");
+  smartlist_add(ns->net_params, (char *) "circ_aqm_kill_sec=10");
+  relay_consensus_has_changed(ns);
+
+  /* A single slow cell isn't congestion. */
+  tt_int_op(CELL_QUEUE_AQM_OK, OP_EQ,
+            cell_queue_aqm_note_sojourn(&queue, now, 80));
+  tt_assert(queue.aqm_above_target);
+  tt_int_op(CELL_QUEUE_AQM_OK, OP_EQ,
+            cell_queue_aqm_note_sojourn(&queue, now + 1, 80));
+
+  /* One fast cell resets the interval. */
+  tt_int_op(CELL_QUEUE_AQM_OK, OP_EQ,
+            cell_queue_aqm_note_sojourn(&queue, now + 2, 20));
+  tt_assert(! queue.aqm_above_target);
+
+  /* Slow cells for a whole interval are. */
+  tt_int_op(CELL_QUEUE_AQM_OK, OP_EQ,
+            cell_queue_aqm_note_sojourn(&queue, now, 80));
+  now += (uint32_t) monotime_msec_to_approx_coarse_stamp_units(600);
+  tt_int_op(CELL_QUEUE_AQM_CONGESTED, OP_EQ,
+            cell_queue_aqm_note_sojourn(&queue, now, 80));
+  tt_assert(queue.aqm_congested);
+  /* We only report it once. */
+  tt_int_op(CELL_QUEUE_AQM_OK, OP_EQ,
+            cell_queue_aqm_note_sojourn(&queue, now, 80));
+  tt_assert(queue.aqm_congested);
+
+  /* Once cells are prompt again, we're no longer congested. */
+  tt_int_op(CELL_QUEUE_AQM_OK, OP_EQ,
+            cell_queue_aqm_note_sojourn(&queue, now, 10));
+  tt_assert(! queue.aqm_congested);
+
+  /* Nor is an empty queue. */
+  queue.n = 0;
+  tt_int_op(CELL_QUEUE_AQM_OK, OP_EQ,
+            cell_queue_aqm_note_sojourn(&queue, now, 80));
+  tt_assert(! queue.aqm_above_target);
+  queue.n = 10;
+
+  /* If cells stay slow for long enough, give up on the circuit. */
+  tt_int_op(CELL_QUEUE_AQM_OK, OP_EQ,
+            cell_queue_aqm_note_sojourn(&queue, now, 80));
+  now += (uint32_t) monotime_msec_to_approx_coarse_stamp_units(11000);
+  tt_int_op(CELL_QUEUE_AQM_RUNAWAY, OP_EQ,
+            cell_queue_aqm_note_sojourn(&queue, now, 80));
+
+ done:
+  smartlist_clear(ns->net_params);
+  relay_consensus_has_changed(ns);
+  smartlist_free(ns->net_params);
+  tor_free(ns);
+}
+
+static void
+test_relay_flush_batch(void *arg)
+{
+  channel_t *nchan = NULL, *pchan1 = NULL, *pchan2 = NULL;
+  or_circuit_t *circ1 = NULL, *circ2 = NULL;
+  cell_t *cell = NULL;
+  networkstatus_t *ns = tor_malloc_zero(sizeof(networkstatus_t));
+  int i;
+
+  (void)arg;
+
+  MOCK(scheduler_channel_has_waiting_cells,
+       scheduler_channel_has_waiting_cells_mock);
+  ns->net_params = smartlist_new();
+  cmux_ewma_set_options(NULL, NULL);
+
+  nchan = new_fake_channel();
+  pchan1 = new_fake_channel();
+  pchan2 = new_fake_channel();
+  circ1 = new_fake_orcirc(nchan, pchan1);
+  circ2 = new_fake_orcirc(nchan, pchan2);
+  circuitmux_attach_circuit(nchan->cmux, TO_CIRCUIT(circ1),
+                            CELL_DIRECTION_OUT);
+  circuitmux_attach_circuit(nchan->cmux, TO_CIRCUIT(circ2),
+                            CELL_DIRECTION_OUT);
+
+  cell = tor_malloc_zero(sizeof(cell_t));
+  make_fake_cell(cell);
+  for (i = 0; i < 10; ++i) {
+    append_cell_to_circuit_queue(TO_CIRCUIT(circ1), nchan, cell,
+                                 CELL_DIRECTION_OUT, 0);
+    append_cell_to_circuit_queue(TO_CIRCUIT(circ2), nchan, cell,
+                                 CELL_DIRECTION_OUT, 0);
+  }
+  tt_int_op(circuitmux_num_cells(nchan->cmux), OP_EQ, 20);
+
+  /* By default, we pick a circuit for every cell, so the two circuits
+   * take turns. */
+  relay_consensus_has_changed(ns);
+  tt_int_op(relay_get_circ_flush_batch(), OP_EQ, 1);
+  tt_int_op(channel_flush_from_first_active_circuit(nchan, 6), OP_EQ, 6);
+  tt_int_op(circ1->base_.n_chan_cells.n, OP_EQ, 7);
+  tt_int_op(circ2->base_.n_chan_cells.n, OP_EQ, 7);
+
+  /* With batches, a circuit sends several cells in a row, but never more
+   * than we asked for. */
+  smartlist_add(ns->net_params, (char *) "circ_flush_batch=4");
+  relay_consensus_has_changed(ns);
+  tt_int_op(relay_get_circ_flush_batch(), OP_EQ, 4);
+  tt_int_op(channel_flush_from_first_active_circuit(nchan, 3), OP_EQ, 3);
+  tt_int_op(circ1->base_.n_chan_cells.n + circ2->base_.n_chan_cells.n,
+            OP_EQ, 11);
+  tt_int_op(MIN(circ1->base_.n_chan_cells.n, circ2->base_.n_chan_cells.n),
+            OP_EQ, 4);
+
+  /* The cmux still sees the whole batch, so the other circuit goes next,
+   * and then the first one again. */
+  tt_int_op(channel_flush_from_first_active_circuit(nchan, 6), OP_EQ, 6);
+  tt_int_op(MIN(circ1->base_.n_chan_cells.n, circ2->base_.n_chan_cells.n),
+            OP_EQ, 2);
+  tt_int_op(MAX(circ1->base_.n_chan_cells.n, circ2->base_.n_chan_cells.n),
+            OP_EQ, 3);
+
+  /* A batch stops when the circuit runs out of cells. */
+  tt_int_op(channel_flush_from_first_active_circuit(nchan, 10), OP_EQ, 5);
+  tt_int_op(circuitmux_num_cells(nchan->cmux), OP_EQ, 0);
+
+ done:
+  UNMOCK(scheduler_channel_has_waiting_cells);
+  smartlist_clear(ns->net_params);
+  relay_consensus_has_changed(ns);
+  smartlist_free(ns->net_params);
+  tor_free(ns);
+  tor_free(cell);
+  if (circ1) {
+    circuitmux_detach_circuit(nchan->cmux, TO_CIRCUIT(circ1));
+    circuitmux_detach_circuit(pchan1->cmux, TO_CIRCUIT(circ1));
+    cell_queue_clear(&circ1->base_.n_chan_cells);
+  }
+  if (circ2) {
+    circuitmux_detach_circuit(nchan->cmux, TO_CIRCUIT(circ2));
+    circuitmux_detach_circuit(pchan2->cmux, TO_CIRCUIT(circ2));
+    cell_queue_clear(&circ2->base_.n_chan_cells);
+  }
+  tor_free(circ1);
+  tor_free(circ2);
+  free_fake_channel(nchan);
+  free_fake_channel(pchan1);
+  free_fake_channel(pchan2);
+}
+
+static void
+test_relay_cell_batch(void *arg)
+{
+  channel_t *nchan = NULL, *pchan = NULL;
+  or_circuit_t *orcirc = NULL;
+  cell_t cells[6];
+  int order[6];
+  int old_count, i;
+  const circid_t ids[6] = { 5, 9, 5, 7, 9, 5 };
+  const int expected_order[6] = { 0, 2, 5, 1, 4, 3 };
+
+  (void)arg;
+
+  /* Cells are grouped by circuit, in order of arrival. */
+  memset(cells, 0, sizeof(cells));
+  for (i = 0; i < 6; ++i)
+    cells[i].circ_id = ids[i];
+  command_order_cell_batch(cells, 6, order);
+  for (i = 0; i < 6; ++i)
+    tt_int_op(order[i], OP_EQ, expected_order[i]);
+
+  MOCK(scheduler_channel_has_waiting_cells,
+       scheduler_channel_has_waiting_cells_mock);
+  cmux_ewma_set_options(NULL, NULL);
+
+  nchan = new_fake_channel();
+  pchan = new_fake_channel();
+  orcirc = new_fake_orcirc(nchan, pchan);
+  make_fake_cell(&cells[0]);
+
+  /* During a batch, queueing cells doesn't touch the cmux or the
+   * scheduler... */
+  old_count = get_mock_scheduler_has_waiting_cells_count();
+  relay_cell_batch_begin();
+  for (i = 0; i < 3; ++i)
+    append_cell_to_circuit_queue(TO_CIRCUIT(orcirc), nchan, &cells[0],
+                                 CELL_DIRECTION_OUT, 0);
+  append_cell_to_circuit_queue(TO_CIRCUIT(orcirc), pchan, &cells[0],
+                               CELL_DIRECTION_IN, 0);
+  tt_int_op(orcirc->base_.n_chan_cells.n, OP_EQ, 3);
+  tt_int_op(circuitmux_num_cells(nchan->cmux), OP_EQ, 0);
+  tt_int_op(circuitmux_num_cells(pchan->cmux), OP_EQ, 0);
+  tt_int_op(get_mock_scheduler_has_waiting_cells_count(), OP_EQ, old_count);
+
+  /* ...until it ends, when each channel hears about its cells once. */
+  relay_cell_batch_end();
+  tt_int_op(circuitmux_num_cells(nchan->cmux), OP_EQ, 3);
+  tt_int_op(circuitmux_num_cells(pchan->cmux), OP_EQ, 1);
+  tt_int_op(get_mock_scheduler_has_waiting_cells_count(), OP_EQ,
+            old_count + 2);
+  tt_assert(! orcirc->base_.n_cmux_update_deferred);
+  tt_assert(! orcirc->base_.p_cmux_update_deferred);
+
+  /* Outside a batch, every cell does. */
+  append_cell_to_circuit_queue(TO_CIRCUIT(orcirc), nchan, &cells[0],
+                               CELL_DIRECTION_OUT, 0);
+  tt_int_op(circuitmux_num_cells(nchan->cmux), OP_EQ, 4);
+  tt_int_op(get_mock_scheduler_has_waiting_cells_count(), OP_EQ,
+            old_count + 3);
+
+  /* A circuit that goes away during a batch is forgotten. */
+  relay_cell_batch_begin();
+  append_cell_to_circuit_queue(TO_CIRCUIT(orcirc), nchan, &cells[0],
+                               CELL_DIRECTION_OUT, 0);
+  tt_assert(orcirc->base_.n_cmux_update_deferred);
+  relay_cell_batch_forget_circuit(TO_CIRCUIT(orcirc));
+  tt_assert(! orcirc->base_.n_cmux_update_deferred);
+  relay_cell_batch_end();
+  tt_int_op(circuitmux_num_cells(nchan->cmux), OP_EQ, 4);
+
+ done:
+  UNMOCK(scheduler_channel_has_waiting_cells);
+  if (orcirc) {
+    circuitmux_detach_circuit(nchan->cmux, TO_CIRCUIT(orcirc));
+    circuitmux_detach_circuit(pchan->cmux, TO_CIRCUIT(orcirc));
+    cell_queue_clear(&orcirc->base_.n_chan_cells);
+    cell_queue_clear(&orcirc->p_chan_cells);
+  }
+  tor_free(orcirc);
+  free_fake_channel(nchan);
+  free_fake_channel(pchan);
+}
+
 struct testcase_t relay_tests[] = {
   { "append_cell_to_circuit_queue", test_relay_append_cell_to_circuit_queue,
     TT_FORK, NULL, NULL },
   { "close_circ_rephist", test_relay_close_circuit,
     TT_FORK, NULL, NULL },
+  { "cell_queue_aqm", test_relay_cell_queue_aqm,
+    TT_FORK, NULL, NULL },
+  { "flush_batch", test_relay_flush_batch,
+    TT_FORK, NULL, NULL },
+  { "cell_batch", test_relay_cell_batch,
+    TT_FORK, NULL, NULL },
   END_OF_TESTCASES
 };
@@ -6,6 +6,7 @@
 #include "orconfig.h"
 #include "core/or/or.h"
 #include "feature/hs_common/replaycache.h"
+#include "lib/crypt_ops/crypto_rand.h"
 #include "test/test.h"
 
 static const char *test_buffer =
@@ -277,7 +278,7 @@ test_replaycache_scrub(void *arg)
   /* Make sure we hit the aging-out case too */
   replaycache_scrub_if_needed_internal(1500, r);
   /* Assert that we aged it */
-  tt_int_op(digest256map_size(r->digests_seen),OP_EQ, 0);
+  tt_int_op(smartlist_len(r->filters),OP_EQ, 0);
 
  done:
   if (r) replaycache_free(r);
@@ -371,6 +372,106 @@ test_replaycache_realtime(void *arg)
   return;
 }
 
+static void
+test_replaycache_false_positives(void *arg)
+{
+  replaycache_t *r = NULL;
+  const int n_added = 10000, n_probes = 100000;
+  const double fp_rate = 1e-3;
+  uint8_t *added = NULL;
+  uint8_t probe[DIGEST256_LEN];
+  int i, n_false = 0;
+
+  (void)arg;
+  r = replaycache_new_with_fp_rate(0, 0, fp_rate);
+  tt_ptr_op(r, OP_NE, NULL);
+
+  added = tor_malloc(n_added * DIGEST256_LEN);
+  crypto_rand((char *) added, n_added * DIGEST256_LEN);
+  for (i = 0; i < n_added; ++i) {
+    replaycache_add_and_test_internal(1200, r, added + i * DIGEST256_LEN,
+                                      DIGEST256_LEN, NULL);
+  }
+  /* That took a few filters as it grew. */
+  tt_int_op(smartlist_len(r->filters), OP_GT, 1);
+
+  /* Everything we added is still there... */
+  for (i = 0; i < n_added; ++i) {
+    tt_int_op(replaycache_add_and_test_internal(1300, r,
+                                                added + i * DIGEST256_LEN,
+                                                DIGEST256_LEN, NULL),
+              OP_EQ, 1);
+  }
+
+  /* ...and not too much that we didn't add. */
+  for (i = 0; i < n_probes; ++i) {
+    crypto_rand((char *) probe, sizeof(probe));
+    n_false += replaycache_add_and_test_internal(1300, r, probe,
+                                                 sizeof(probe), NULL);
+  }
+  tt_int_op(n_false, OP_LE, 3 * fp_rate * n_probes);
+
+ done:
+  tor_free(added);
+  if (r) replaycache_free(r);
+
+  return;
+}
+
+static void
+test_replaycache_rotate(void *arg)
+{
+  replaycache_t *r = NULL;
+  int result;
+  time_t elapsed = 0;
+
+  (void)arg;
+  r = replaycache_new(600, 300);
+  tt_ptr_op(r, OP_NE, NULL);
+
+  result =
+    replaycache_add_and_test_internal(1000, r, test_buffer,
+        strlen(test_buffer), NULL);
+  tt_int_op(result,OP_EQ, 0);
+  result =
+    replaycache_add_and_test_internal(1350, r, test_buffer_2,
+        strlen(test_buffer_2), NULL);
+  tt_int_op(result,OP_EQ, 0);
+  /* The second entry started a new filter. */
+  tt_int_op(smartlist_len(r->filters),OP_EQ, 2);
+
+  /* Both are seen from the filter they landed in. */
+  result =
+    replaycache_add_and_test_internal(1400, r, test_buffer,
+        strlen(test_buffer), &elapsed);
+  tt_int_op(result,OP_EQ, 1);
+  result =
+    replaycache_add_and_test_internal(1400, r, test_buffer_2,
+        strlen(test_buffer_2), &elapsed);
+  tt_int_op(result,OP_EQ, 1);
+  tt_int_op(elapsed,OP_EQ, 0);
+
+  /* Seeing the first one again moved it to the newest filter, so it outlives
+   * the oldest one. */
+  result =
+    replaycache_add_and_test_internal(1900, r, test_buffer,
+        strlen(test_buffer), NULL);
+  tt_int_op(result,OP_EQ, 1);
+  tt_int_op(smartlist_len(r->filters),OP_EQ, 2);
+
+  /* Once the horizon passes everything, it all goes. */
+  result =
+    replaycache_add_and_test_internal(3000, r, test_buffer_2,
+        strlen(test_buffer_2), NULL);
+  tt_int_op(result,OP_EQ, 0);
+  tt_int_op(smartlist_len(r->filters),OP_EQ, 1);
+
+ done:
+  if (r) replaycache_free(r);
+
+  return;
+}
+
 #define REPLAYCACHE_LEGACY(name) \
   { #name, test_replaycache_ ## name , 0, NULL, NULL }
 
@@ -386,6 +487,8 @@ struct testcase_t replaycache_tests[] = {
   REPLAYCACHE_LEGACY(scrub),
   REPLAYCACHE_LEGACY(future),
   REPLAYCACHE_LEGACY(realtime),
+  REPLAYCACHE_LEGACY(false_positives),
+  REPLAYCACHE_LEGACY(rotate),
   END_OF_TESTCASES
 };
 
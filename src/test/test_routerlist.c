@@ -150,6 +150,46 @@ test_routerlist_launch_descriptor_downloads(void *arg)
   smartlist_free(downloadable);
 }
 
+static void
+test_routerlist_microdesc_dl_batch_size(void *arg)
+{
+  (void)arg;
+
+  microdesc_download_timing_reset();
+
+  /* Without any measurements, split into three requests. */
+  tt_int_op(microdesc_dl_batch_size(7000, 500), OP_EQ, 500);
+  tt_int_op(microdesc_dl_batch_size(120, 90), OP_EQ, 40);
+  tt_int_op(microdesc_dl_batch_size(60, 90), OP_EQ, 32);
+  tt_int_op(microdesc_dl_batch_size(10, 90), OP_EQ, 10);
+
+  /* Tiny answers don't count. */
+  microdesc_download_note_timing(2, 50, 20000);
+  tt_int_op(microdesc_dl_batch_size(7000, 500), OP_EQ, 500);
+
+  /* A fast source with long latency: keep the batches big. */
+  microdesc_download_note_timing(100, 1000, 100);
+  tt_int_op(microdesc_dl_batch_size(7000, 500), OP_EQ, 500);
+  tt_int_op(microdesc_dl_batch_size(120, 90), OP_EQ, 40);
+
+  /* A slow source with short latency: split the work more finely. */
+  microdesc_download_timing_reset();
+  microdesc_download_note_timing(100, 50, 20000);
+  tt_int_op(microdesc_dl_batch_size(7000, 500), OP_EQ, 50);
+  /* ... but not below the minimum. */
+  microdesc_download_note_timing(100, 50, 100000);
+  tt_int_op(microdesc_dl_batch_size(7000, 500), OP_EQ, 32);
+
+  /* A slow source with long latency: the round trips matter more. */
+  microdesc_download_timing_reset();
+  microdesc_download_note_timing(100, 5000, 20000);
+  tt_int_op(microdesc_dl_batch_size(7000, 500), OP_EQ, 100);
+  tt_int_op(microdesc_dl_batch_size(120, 500), OP_EQ, 40);
+
+ done:
+  microdesc_download_timing_reset();
+}
+
 void
 construct_consensus(char **consensus_text_md, time_t now)
 {
@@ -778,6 +818,7 @@ test_warn_early_consensus(void *arg)
 struct testcase_t routerlist_tests[] = {
   NODE(initiate_descriptor_downloads, 0),
   NODE(launch_descriptor_downloads, 0),
+  NODE(microdesc_dl_batch_size, 0),
   NODE(router_is_already_dir_fetching, TT_FORK),
   ROUTER(pick_directory_server_impl, TT_FORK),
   { "directory_guard_fetch_with_no_dirinfo",
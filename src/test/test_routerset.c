@@ -7,7 +7,9 @@
 #include "core/or/policies.h"
 #include "feature/dirparse/policy_parse.h"
 #include "feature/nodelist/nodelist.h"
+#include "feature/nodelist/routerlist.h"
 #include "feature/nodelist/routerset.h"
+#include "lib/crypt_ops/crypto_rand.h"
 #include "lib/geoip/geoip.h"
 
 #include "core/or/addr_policy_st.h"
@@ -1573,6 +1575,98 @@ NS(test_main)(void *arg)
     routerset_free(set);
 }
 
+#undef NS_SUBMODULE
+#define NS_SUBMODULE ASPECT(routerset_contains_node, cached)
+
+/*
+ * Functional test for routerset_contains_node and routerset_get_all_nodes,
+ * checking that the cached membership bits always agree with a direct check
+ * as the routerset and the nodelist change.
+ */
+
+#define N_CACHED_TEST_NODES 100
+
+static void
+NS(check_cached)(const routerset_t *set, const routerset_t *exclude)
+{
+  smartlist_t *nodes = nodelist_get_list();
+  smartlist_t *out = smartlist_new();
+  int n_expected = 0;
+
+  SMARTLIST_FOREACH_BEGIN(nodes, const node_t *, node) {
+    int expected = routerset_contains_node_uncached(set, node) != 0;
+    tt_int_op(routerset_contains_node(set, node) != 0, OP_EQ, expected);
+    /* Ask again, so that we also check the cached answer. */
+    tt_int_op(routerset_contains_node(set, node) != 0, OP_EQ, expected);
+    if (expected && !routerset_contains_node_uncached(exclude, node))
+      ++n_expected;
+  } SMARTLIST_FOREACH_END(node);
+
+  routerset_get_all_nodes(out, set, exclude, 0);
+  tt_int_op(smartlist_len(out), OP_EQ, n_expected);
+  SMARTLIST_FOREACH_BEGIN(out, const node_t *, node) {
+    tt_assert(routerset_contains_node_uncached(set, node));
+    tt_assert(!routerset_contains_node_uncached(exclude, node));
+  } SMARTLIST_FOREACH_END(node);
+
+ done:
+  smartlist_free(out);
+}
+
+static void
+NS(test_main)(void *arg)
+{
+  routerset_t *set = routerset_new();
+  routerset_t *exclude = routerset_new();
+  routerinfo_t *ris[N_CACHED_TEST_NODES];
+  char *s = NULL;
+  char hex[HEX_DIGEST_LEN+1];
+  int i;
+  (void)arg;
+
+  for (i = 0; i < N_CACHED_TEST_NODES; ++i) {
+    ris[i] = tor_malloc_zero(sizeof(routerinfo_t));
+    tor_asprintf(&ris[i]->nickname, "relay%d", i);
+    ris[i]->addr = 0x0a000000 + (i << 8) + 1; /* 10.0.i.1 */
+    ris[i]->or_port = 9001;
+    crypto_rand(ris[i]->cache_info.identity_digest, DIGEST_LEN);
+    nodelist_set_routerinfo(ris[i], NULL);
+  }
+  tt_int_op(smartlist_len(nodelist_get_list()), OP_EQ, N_CACHED_TEST_NODES);
+
+  base16_encode(hex, sizeof(hex), ris[3]->cache_info.identity_digest,
+                DIGEST_LEN);
+  tor_asprintf(&s, "$%s,relay5,relay70,10.0.32.0/19", hex);
+  tt_int_op(routerset_parse(set, s, "test set"), OP_EQ, 0);
+  tt_int_op(routerset_parse(exclude, "relay40,10.0.50.0/24", "exclude"),
+            OP_EQ, 0);
+  NS(check_cached)(set, exclude);
+  NS(check_cached)(set, NULL);
+
+  /* Changing the routerset must invalidate what we learned about it. */
+  tt_assert(!routerset_contains_node(set, node_get_by_id(
+                                       ris[7]->cache_info.identity_digest)));
+  tt_int_op(routerset_parse(set, "relay7", "test set"), OP_EQ, 0);
+  tt_assert(routerset_contains_node(set, node_get_by_id(
+                                      ris[7]->cache_info.identity_digest)));
+  NS(check_cached)(set, exclude);
+
+  /* So must removing nodes, since that moves other nodes around. */
+  nodelist_remove_routerinfo(ris[0]);
+  nodelist_remove_routerinfo(ris[40]);
+  tt_int_op(smartlist_len(nodelist_get_list()), OP_EQ,
+            N_CACHED_TEST_NODES - 2);
+  NS(check_cached)(set, exclude);
+
+ done:
+  nodelist_free_all();
+  for (i = 0; i < N_CACHED_TEST_NODES; ++i)
+    routerinfo_free(ris[i]);
+  routerset_free(set);
+  routerset_free(exclude);
+  tor_free(s);
+}
+
 #undef NS_SUBMODULE
 #define NS_SUBMODULE ASPECT(routerset_get_all_nodes, no_routerset)
 
@@ -2200,6 +2294,7 @@ struct testcase_t routerset_tests[] = {
   TEST_CASE_ASPECT(routerset_contains_node, none),
   TEST_CASE_ASPECT(routerset_contains_node, routerinfo),
   TEST_CASE_ASPECT(routerset_contains_node, routerstatus),
+  TEST_CASE_ASPECT(routerset_contains_node, cached),
   TEST_CASE_ASPECT(routerset_get_all_nodes, no_routerset),
   TEST_CASE_ASPECT(routerset_get_all_nodes, list_with_no_nodes),
   TEST_CASE_ASPECT(routerset_get_all_nodes, list_flag_not_running),
@@ -4,6 +4,9 @@
 #include "orconfig.h"
 
 #include <math.h>
+#ifdef HAVE_SYS_STAT_H
+#include <sys/stat.h>
+#endif
 
 #define SCHEDULER_KIST_PRIVATE
 #define TOR_CHANNEL_INTERNAL_
@@ -17,6 +20,7 @@
 #include "feature/nodelist/networkstatus.h"
 #define SCHEDULER_PRIVATE_
 #include "core/or/scheduler.h"
+#include "lib/net/socketpair.h"
 
 /* Test suite stuff */
 #include "test/test.h"
@@ -348,6 +352,21 @@ update_socket_info_impl_mock(socket_table_ent_t *ent)
   ent->limit = INT_MAX;
 }
 
+/* Number of calls to update_socket_info_impl_count_mock(), and the limit it
+ * should give each socket. */
+static int update_socket_info_impl_n_calls = 0;
+static uint64_t update_socket_info_impl_limit = 0;
+
+static void
+update_socket_info_impl_count_mock(socket_table_ent_t *ent)
+{
+  ++update_socket_info_impl_n_calls;
+  ent->cwnd = 100;
+  ent->mss = 1000;
+  ent->unacked = ent->notsent = 0;
+  ent->limit = update_socket_info_impl_limit;
+}
+
 static void
 perform_channel_state_tests(int KISTSchedRunInterval, int sched_type)
 {
@@ -832,6 +851,170 @@ test_scheduler_loop_kist(void *arg)
   return;
 }
 
+static void
+test_scheduler_kist_reuse_socket_info(void *arg)
+{
+  (void) arg;
+  int i;
+
+#ifndef HAVE_KIST_SUPPORT
+  return;
+#endif
+
+  channel_t *ch1 = new_fake_channel();
+  const uint64_t cell_size = CELL_MAX_NETWORK_SIZE + TLS_PER_CELL_OVERHEAD;
+
+  MOCK(get_options, mock_get_options);
+  MOCK(channel_flush_some_cells, channel_flush_some_cells_mock);
+  MOCK(channel_more_to_flush, channel_more_to_flush_mock);
+  MOCK(channel_write_to_kernel, channel_write_to_kernel_mock);
+  MOCK(channel_should_write_to_kernel, channel_should_write_to_kernel_mock);
+  MOCK(update_socket_info_impl, update_socket_info_impl_count_mock);
+  clear_options();
+  mocked_options.KISTSchedRunInterval = 11;
+  set_scheduler_options(SCHEDULER_KIST);
+  scheduler_init();
+
+  tt_assert(ch1);
+  ch1->magic = TLS_CHAN_MAGIC;
+  ch1->state = CHANNEL_STATE_OPENING;
+  channel_register(ch1);
+  tt_assert(ch1->registered);
+  channel_change_state_open(ch1);
+  scheduler_channel_wants_writes(ch1);
+
+  /* A socket that stays far from its limit: we ask the kernel on the first
+   * run, and then reuse what it told us until that is too old. */
+  update_socket_info_impl_limit = 1000 * cell_size;
+  for (i = 0; i < 6; ++i) {
+    scheduler_channel_has_waiting_cells(ch1);
+    channel_flush_some_cells_mock_set(ch1, 5);
+    the_scheduler->run();
+  }
+  tt_int_op(update_socket_info_impl_n_calls, OP_EQ, 2);
+
+  /* If the channel misses a run, we don't know what it wrote in the
+   * meantime, so we ask again. */
+  the_scheduler->run();
+  update_socket_info_impl_n_calls = 0;
+  scheduler_channel_has_waiting_cells(ch1);
+  channel_flush_some_cells_mock_set(ch1, 5);
+  the_scheduler->run();
+  tt_int_op(update_socket_info_impl_n_calls, OP_EQ, 1);
+
+  /* A socket that uses most of its limit gets asked about on every run. */
+  update_socket_info_impl_limit = 6 * cell_size;
+  the_scheduler->run();
+  update_socket_info_impl_n_calls = 0;
+  for (i = 0; i < 3; ++i) {
+    scheduler_channel_has_waiting_cells(ch1);
+    channel_flush_some_cells_mock_set(ch1, 5);
+    the_scheduler->run();
+  }
+  tt_int_op(update_socket_info_impl_n_calls, OP_EQ, 3);
+
+ done:
+  channel_flush_some_cells_mock_free_all();
+  ch1->state = CHANNEL_STATE_CLOSED;
+  ch1->registered = 0;
+  channel_free(ch1);
+  UNMOCK(update_socket_info_impl);
+  UNMOCK(channel_should_write_to_kernel);
+  UNMOCK(channel_write_to_kernel);
+  UNMOCK(channel_more_to_flush);
+  UNMOCK(channel_flush_some_cells);
+  UNMOCK(get_options);
+  scheduler_free_all();
+}
+
+/* Test that KIST judges the cost of a netlink dump by how many sockets the
+ * host has, which the last dump told us, and not just by how many we
+ * have. */
+static void
+test_scheduler_kist_netlink_cost(void *arg)
+{
+  (void) arg;
+
+  /* Before any dump, all we know about is our own few sockets. */
+  kist_netlink_dump_n_sockets = 0;
+  kist_netlink_dump_run = 0;
+  tt_assert(! kist_netlink_dump_is_cheaper(15));
+  tt_assert(kist_netlink_dump_is_cheaper(100));
+
+  /* A host with many other connections makes a dump costlier. */
+  kist_netlink_dump_n_sockets = 100000;
+  tt_assert(! kist_netlink_dump_is_cheaper(100));
+  tt_assert(! kist_netlink_dump_is_cheaper(501));
+  tt_assert(kist_netlink_dump_is_cheaper(502));
+
+ done:
+  kist_netlink_dump_n_sockets = 0;
+}
+
+#ifdef HAVE_KIST_NETLINK_SUPPORT
+/* Callback for kist_netlink_dump() in test_scheduler_kist_netlink(): if
+ * <b>info</b> describes the socket whose inode is in arg->inode, copy it
+ * there. */
+static void
+kist_netlink_dump_test_cb(const kist_tcp_info_t *info, void *arg)
+{
+  kist_tcp_info_t *found = arg;
+  if (info->inode == found->inode)
+    memcpy(found, info, sizeof(*found));
+}
+#endif /* defined(HAVE_KIST_NETLINK_SUPPORT) */
+
+static void
+test_scheduler_kist_netlink(void *arg)
+{
+  (void) arg;
+#ifdef HAVE_KIST_NETLINK_SUPPORT
+  tor_socket_t fds[2] = { TOR_INVALID_SOCKET, TOR_INVALID_SOCKET };
+  tor_socket_t nl_sock = TOR_INVALID_SOCKET;
+  kist_tcp_info_t found;
+  uint64_t n_syscalls = 0;
+  struct stat st;
+
+  /* The ersatz socketpair is really a pair of TCP sockets over localhost,
+   * which is just what we want here. */
+  if (tor_ersatz_socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0) {
+    tt_skip();
+  }
+  nl_sock = kist_netlink_open();
+  if (!SOCKET_OK(nl_sock)) {
+    /* Some sandboxes and containers don't allow sock_diag. */
+    tt_skip();
+  }
+
+  tt_int_op(fstat(fds[0], &st), OP_EQ, 0);
+  memset(&found, 0, sizeof(found));
+  found.inode = (uint64_t) st.st_ino;
+  if (kist_netlink_dump(nl_sock, kist_netlink_dump_test_cb, &found,
+                        &n_syscalls) < 0) {
+    tt_skip();
+  }
+  /* One request and at least one reply for each of IPv4 and IPv6. */
+  tt_u64_op(n_syscalls, OP_GE, 4);
+  tt_u64_op(found.inode, OP_EQ, (uint64_t) st.st_ino);
+  tt_uint_op(found.mss, OP_GT, 0);
+  tt_uint_op(found.cwnd, OP_GT, 0);
+  tt_uint_op(found.unacked, OP_EQ, 0);
+  tt_uint_op(found.notsent, OP_EQ, 0);
+
+ done:
+  if (SOCKET_OK(fds[0]))
+    tor_close_socket_simple(fds[0]);
+  if (SOCKET_OK(fds[1]))
+    tor_close_socket_simple(fds[1]);
+  if (SOCKET_OK(nl_sock))
+    tor_close_socket(nl_sock);
+#else /* !(defined(HAVE_KIST_NETLINK_SUPPORT)) */
+  tt_skip();
+ done:
+  ;
+#endif /* defined(HAVE_KIST_NETLINK_SUPPORT) */
+}
+
 static void
 test_scheduler_channel_states(void *arg)
 {
@@ -1265,6 +1448,77 @@ test_scheduler_kist_pending_list(void *arg)
   UNMOCK(channel_should_write_to_kernel);
 }
 
+static void
+test_scheduler_kist_pending_null(void *arg)
+{
+  channel_t *chans[3] = { NULL, NULL, NULL };
+  smartlist_t *cp;
+  int i;
+  (void) arg;
+
+#ifndef HAVE_KIST_SUPPORT
+  return;
+#endif
+
+  MOCK(get_options, mock_get_options);
+  MOCK(channel_flush_some_cells, channel_flush_some_cells_mock_var);
+  MOCK(channel_more_to_flush, channel_more_to_flush_mock_var);
+  MOCK(update_socket_info_impl, update_socket_info_impl_mock_var);
+  MOCK(channel_write_to_kernel, channel_write_to_kernel_mock);
+  MOCK(channel_should_write_to_kernel, channel_should_write_to_kernel_mock);
+
+  mocked_options.KISTSchedRunInterval = 10;
+  set_scheduler_options(SCHEDULER_KIST);
+  scheduler_init();
+
+  for (i = 0; i < 3; ++i) {
+    chans[i] = new_fake_channel();
+    chans[i]->magic = TLS_CHAN_MAGIC;
+    channel_register(chans[i]);
+    scheduler_channel_wants_writes(chans[i]);
+    scheduler_channel_has_waiting_cells(chans[i]);
+  }
+  cp = get_channels_pending();
+  tt_int_op(smartlist_len(cp), OP_EQ, 3);
+
+  /* Somehow, a NULL has got to the top of the heap, with the channel that
+   * was there moved to the end. */
+  smartlist_add(cp, smartlist_get(cp, 0));
+  smartlist_set(cp, 0, NULL);
+  ((channel_t *) smartlist_get(cp, 3))->sched_heap_idx = 3;
+
+  /* The scheduler drops the NULL, and still serves every channel. */
+  mock_update_socket_info_limit = INT_MAX;
+  mock_more_to_flush = 0;
+  mock_flush_some_cells_num = 1;
+  tor_capture_bugs_(1);
+  the_scheduler->run();
+  tor_end_capture_bugs_();
+  tt_int_op(smartlist_len(cp), OP_EQ, 0);
+  for (i = 0; i < 3; ++i) {
+    tt_int_op(chans[i]->scheduler_state, OP_EQ,
+              SCHED_CHAN_WAITING_FOR_CELLS);
+    tt_int_op(chans[i]->sched_heap_idx, OP_EQ, -1);
+  }
+
+ done:
+  for (i = 0; i < 3; ++i) {
+    if (!chans[i])
+      continue;
+    chans[i]->state = CHANNEL_STATE_CLOSED;
+    chans[i]->registered = 0;
+    channel_free(chans[i]);
+  }
+  scheduler_free_all();
+
+  UNMOCK(get_options);
+  UNMOCK(channel_flush_some_cells);
+  UNMOCK(channel_more_to_flush);
+  UNMOCK(update_socket_info_impl);
+  UNMOCK(channel_write_to_kernel);
+  UNMOCK(channel_should_write_to_kernel);
+}
+
 struct testcase_t scheduler_tests[] = {
   { "compare_channels", test_scheduler_compare_channels,
     TT_FORK, NULL, NULL },
@@ -1272,10 +1526,17 @@ struct testcase_t scheduler_tests[] = {
   { "initfree", test_scheduler_initfree, TT_FORK, NULL, NULL },
   { "loop_vanilla", test_scheduler_loop_vanilla, TT_FORK, NULL, NULL },
   { "loop_kist", test_scheduler_loop_kist, TT_FORK, NULL, NULL },
+  { "kist_reuse_socket_info", test_scheduler_kist_reuse_socket_info,
+    TT_FORK, NULL, NULL },
+  { "kist_netlink", test_scheduler_kist_netlink, TT_FORK, NULL, NULL },
+  { "kist_netlink_cost", test_scheduler_kist_netlink_cost, TT_FORK,
+    NULL, NULL },
   { "ns_changed", test_scheduler_ns_changed, TT_FORK, NULL, NULL},
   { "should_use_kist", test_scheduler_can_use_kist, TT_FORK, NULL, NULL },
   { "kist_pending_list", test_scheduler_kist_pending_list, TT_FORK,
     NULL, NULL },
+  { "kist_pending_null", test_scheduler_kist_pending_null, TT_FORK,
+    NULL, NULL },
   END_OF_TESTCASES
 };
 
@@ -347,7 +347,7 @@ NS(test_main)(void *arg)
   actual = log_heartbeat(0);
 
   tt_int_op(actual, OP_EQ, expected);
-  tt_int_op(CALLED(logv), OP_EQ, 6);
+  tt_int_op(CALLED(logv), OP_EQ, 7);
 
   done:
     NS_UNMOCK(tls_get_write_overhead_ratio);
@@ -456,6 +456,12 @@ NS(logv)(int severity, log_domain_mask_t domain,
       tt_str_op(va_arg(ap, char *), OP_EQ, " [conn not enabled]");
       tt_str_op(va_arg(ap, char *), OP_EQ, "");
       break;
+    case 6:
+      tt_int_op(severity, OP_EQ, LOG_NOTICE);
+      tt_int_op(domain, OP_EQ, LD_HEARTBEAT);
+      tt_ptr_op(strstr(funcname, "onion_queue_log_heartbeat"), OP_NE, NULL);
+      tt_ptr_op(strstr(format, "Onion queue wait times"), OP_NE, NULL);
+      break;
     default:
       tt_abort_msg("unexpected call to logv()");  // TODO: prettyprint args
       break;
@@ -361,6 +361,73 @@ test_storagedir_read_labeled(void *arg)
   tor_free(as_read);
 }
 
+static void
+test_storagedir_index(void *arg)
+{
+  (void)arg;
+
+  char *dirname = tor_strdup(get_fname_rnd("store_dir"));
+  storage_dir_t *d = NULL;
+  char *fns[4];
+  char *fname = NULL, *fname2 = NULL, *listed = NULL;
+  const char str[] = "Tricky, tricky, tricky";
+  int r, i;
+
+  memset(fns, 0, sizeof(fns));
+  d = storage_dir_new(dirname, 4);
+  tt_assert(d);
+  tt_u64_op(0, OP_EQ, storage_dir_get_usage(d));
+
+  for (i = 0; i < 4; ++i) {
+    r = storage_dir_save_string_to_file(d, str+i, 1, &fns[i]);
+    tt_int_op(r, OP_EQ, 0);
+  }
+  tt_int_op(4, OP_EQ, smartlist_len(storage_dir_list(d)));
+  tt_u64_op(strlen(str)*4 - 6, OP_EQ, storage_dir_get_usage(d));
+
+  /* Removing a file makes its name available again, and the usage is
+   * reduced by the size we recorded when we wrote it. */
+  storage_dir_remove_file(d, fns[1]);
+  tt_int_op(3, OP_EQ, smartlist_len(storage_dir_list(d)));
+  tt_u64_op(strlen(str)*3 - 5, OP_EQ, storage_dir_get_usage(d));
+  r = storage_dir_save_string_to_file(d, str, 1, &fname);
+  tt_int_op(r, OP_EQ, 0);
+  tt_str_op(fname, OP_EQ, fns[1]);
+  tt_int_op(4, OP_EQ, smartlist_len(storage_dir_list(d)));
+  tt_u64_op(strlen(str)*4 - 5, OP_EQ, storage_dir_get_usage(d));
+
+  /* We can remove a file by the very name that the listing gives us. */
+  listed = tor_strdup(smartlist_get(storage_dir_list(d), 0));
+  storage_dir_remove_file(d, smartlist_get(storage_dir_list(d), 0));
+  tt_int_op(3, OP_EQ, smartlist_len(storage_dir_list(d)));
+  tt_assert(! smartlist_contains_string(storage_dir_list(d), listed));
+  r = storage_dir_save_string_to_file(d, str, 1, &fname2);
+  tt_int_op(r, OP_EQ, 0);
+  tt_str_op(fname2, OP_EQ, listed);
+  tt_int_op(4, OP_EQ, smartlist_len(storage_dir_list(d)));
+
+  /* Shrinking keeps the listing and the usage in sync. */
+  storage_dir_shrink(d, 1024, 3);
+  tt_int_op(1, OP_EQ, smartlist_len(storage_dir_list(d)));
+  storage_dir_free(d);
+  d = storage_dir_new(dirname, 4);
+  tt_int_op(1, OP_EQ, smartlist_len(storage_dir_list(d)));
+
+  storage_dir_remove_all(d);
+  tt_int_op(0, OP_EQ, smartlist_len(storage_dir_list(d)));
+  tt_u64_op(0, OP_EQ, storage_dir_get_usage(d));
+
+ done:
+  tor_free(dirname);
+  tor_free(fname);
+  tor_free(fname2);
+  tor_free(listed);
+  storage_dir_free(d);
+  for (i = 0; i < 4; ++i) {
+    tor_free(fns[i]);
+  }
+}
+
 #define ENT(name)                                               \
   { #name, test_storagedir_ ## name, TT_FORK, NULL, NULL }
 
@@ -370,6 +437,7 @@ struct testcase_t storagedir_tests[] = {
   ENT(deletion),
   ENT(full),
   ENT(cleaning),
+  ENT(index),
   ENT(save_labeled),
   ENT(read_labeled),
   END_OF_TESTCASES